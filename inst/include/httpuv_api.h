@@ -0,0 +1,144 @@
+#ifndef HTTPUV_API_H
+#define HTTPUV_API_H
+
+// C API for handling HTTP requests with compiled code, on httpuv's background
+// I/O thread, without calling into R.
+//
+// To use it from another package, add `LinkingTo: httpuv` to the DESCRIPTION
+// file, and `#include <httpuv_api.h>`. A handler is a function with the
+// signature of httpuv_handler_fn. Wrap it in an external pointer with
+// httpuv_make_handler(), and return that to R, where it can be attached to a
+// running server with `server$addNativeHandler("/prefix", handler)`.
+//
+// Handlers are called on the background thread, so they must not call any
+// functions from the R API, and they must be thread-safe with respect to any
+// data they share with code on the main thread. They are called when the
+// request headers have been received; the request body is not available to
+// them.
+
+#include <stddef.h>
+#include <Rinternals.h>
+#include <R_ext/Rdynload.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HTTPUV_API_VERSION 1
+
+typedef struct httpuv_request httpuv_request;
+typedef struct httpuv_response httpuv_response;
+
+// Functions for reading the request and filling in the response. A pointer to
+// this table is in every request and response object, so that handlers don't
+// need to look anything up with R_GetCCallable(), which is not safe to call
+// from the background thread. Strings returned by these functions are valid
+// until the handler returns.
+typedef struct httpuv_api {
+  int version;
+
+  // The request method, e.g. "GET".
+  const char* (*request_method)(const httpuv_request* req);
+  // The URL-decoded path of the request, without the query string.
+  const char* (*request_path)(const httpuv_request* req);
+  // The query string, including the leading '?', or "" if there is none.
+  const char* (*request_query)(const httpuv_request* req);
+  // The value of a request header (case-insensitive), or NULL if the request
+  // doesn't have that header.
+  const char* (*request_header)(const httpuv_request* req, const char* name);
+
+  // The status code of the response. Defaults to 200.
+  void (*response_set_status)(httpuv_response* res, int status);
+  void (*response_add_header)(httpuv_response* res, const char* name,
+                              const char* value);
+  // Sets the body of the response. The data is copied.
+  void (*response_set_body)(httpuv_response* res, const void* data,
+                            size_t len);
+} httpuv_api;
+
+// Only the first member of these structs is public; httpuv keeps more data
+// after it.
+struct httpuv_request {
+  const httpuv_api* api;
+};
+struct httpuv_response {
+  const httpuv_api* api;
+};
+
+// Return 1 after filling in `res` to send it as the response, or 0 to decline
+// the request, in which case it is handled by the application's R code as
+// usual. `data` is the pointer that was passed to httpuv_make_handler(), and
+// must remain valid for as long as the handler is attached to any server.
+typedef int (*httpuv_handler_fn)(const httpuv_request* req,
+                                 httpuv_response* res,
+                                 void* data);
+
+// Create an R external pointer for a handler, which can be passed to a
+// server's addNativeHandler() method. Must be called from the main R thread.
+static inline SEXP httpuv_make_handler(httpuv_handler_fn fn, void* data) {
+  static SEXP (*make_handler)(int, httpuv_handler_fn, void*) = NULL;
+  if (make_handler == NULL) {
+    make_handler = (SEXP (*)(int, httpuv_handler_fn, void*))
+      R_GetCCallable("httpuv", "httpuv_make_handler");
+  }
+  return make_handler(HTTPUV_API_VERSION, fn, data);
+}
+
+static inline const char* httpuv_request_method(const httpuv_request* req) {
+  return req->api->request_method(req);
+}
+
+static inline const char* httpuv_request_path(const httpuv_request* req) {
+  return req->api->request_path(req);
+}
+
+static inline const char* httpuv_request_query(const httpuv_request* req) {
+  return req->api->request_query(req);
+}
+
+static inline const char* httpuv_request_header(const httpuv_request* req,
+                                                const char* name)
+{
+  return req->api->request_header(req, name);
+}
+
+static inline void httpuv_response_set_status(httpuv_response* res, int status) {
+  res->api->response_set_status(res, status);
+}
+
+static inline void httpuv_response_add_header(httpuv_response* res,
+                                              const char* name,
+                                              const char* value)
+{
+  res->api->response_add_header(res, name, value);
+}
+
+static inline void httpuv_response_set_body(httpuv_response* res,
+                                            const void* data,
+                                            size_t len)
+{
+  res->api->response_set_body(res, data, len);
+}
+
+// Publishing to WebSocket channels from compiled code. A message published
+// to a channel is sent to every WebSocket connection that has subscribed to
+// it with `ws$subscribe()`, on any server in the R process. It is the same
+// as calling `publishWS()` from R.
+//
+// Look the function up with httpuv_get_publish() on the main R thread, for
+// example in the package's init function. The function that it returns can
+// then be called from any thread: it copies the message and queues it for
+// httpuv's background thread. `binary` is 1 for a binary message or 0 for a
+// text message, which must be UTF-8.
+typedef void (*httpuv_publish_fn)(const char* channel, const void* data,
+                                  size_t len, int binary);
+
+static inline httpuv_publish_fn httpuv_get_publish(void) {
+  return (httpuv_publish_fn) R_GetCCallable("httpuv", "httpuv_publish");
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // HTTPUV_API_H
@@ -34,9 +34,80 @@ BEGIN_RCPP
     return R_NilValue;
 END_RCPP
 }
+// wsBufferedAmount_
+double wsBufferedAmount_(SEXP conn);
+RcppExport SEXP _httpuv_wsBufferedAmount_(SEXP connSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type conn(connSEXP);
+    rcpp_result_gen = Rcpp::wrap(wsBufferedAmount_(conn));
+    return rcpp_result_gen;
+END_RCPP
+}
+// broadcastWS_
+void broadcastWS_(Rcpp::List conns, bool binary, Rcpp::RObject message, double maxBuffered, bool closeSlow);
+RcppExport SEXP _httpuv_broadcastWS_(SEXP connsSEXP, SEXP binarySEXP, SEXP messageSEXP, SEXP maxBufferedSEXP, SEXP closeSlowSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::List >::type conns(connsSEXP);
+    Rcpp::traits::input_parameter< bool >::type binary(binarySEXP);
+    Rcpp::traits::input_parameter< Rcpp::RObject >::type message(messageSEXP);
+    Rcpp::traits::input_parameter< double >::type maxBuffered(maxBufferedSEXP);
+    Rcpp::traits::input_parameter< bool >::type closeSlow(closeSlowSEXP);
+    broadcastWS_(conns, binary, message, maxBuffered, closeSlow);
+    return R_NilValue;
+END_RCPP
+}
+// subscribeWS_
+void subscribeWS_(SEXP conn, std::vector<std::string> channels);
+RcppExport SEXP _httpuv_subscribeWS_(SEXP connSEXP, SEXP channelsSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type conn(connSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type channels(channelsSEXP);
+    subscribeWS_(conn, channels);
+    return R_NilValue;
+END_RCPP
+}
+// unsubscribeWS_
+void unsubscribeWS_(SEXP conn, std::vector<std::string> channels);
+RcppExport SEXP _httpuv_unsubscribeWS_(SEXP connSEXP, SEXP channelsSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type conn(connSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type channels(channelsSEXP);
+    unsubscribeWS_(conn, channels);
+    return R_NilValue;
+END_RCPP
+}
+// publishWS_
+void publishWS_(std::string channel, bool binary, Rcpp::RObject message, double maxBuffered, bool closeSlow);
+RcppExport SEXP _httpuv_publishWS_(SEXP channelSEXP, SEXP binarySEXP, SEXP messageSEXP, SEXP maxBufferedSEXP, SEXP closeSlowSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type channel(channelSEXP);
+    Rcpp::traits::input_parameter< bool >::type binary(binarySEXP);
+    Rcpp::traits::input_parameter< Rcpp::RObject >::type message(messageSEXP);
+    Rcpp::traits::input_parameter< double >::type maxBuffered(maxBufferedSEXP);
+    Rcpp::traits::input_parameter< bool >::type closeSlow(closeSlowSEXP);
+    publishWS_(channel, binary, message, maxBuffered, closeSlow);
+    return R_NilValue;
+END_RCPP
+}
+// wsChannels_
+Rcpp::List wsChannels_();
+RcppExport SEXP _httpuv_wsChannels_() {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    rcpp_result_gen = Rcpp::wrap(wsChannels_());
+    return rcpp_result_gen;
+END_RCPP
+}
 // makeTcpServer
-Rcpp::RObject makeTcpServer(const std::string& host, int port, Rcpp::Function onHeaders, Rcpp::Function onBodyData, Rcpp::Function onRequest, Rcpp::Function onWSOpen, Rcpp::Function onWSMessage, Rcpp::Function onWSClose, Rcpp::List staticPaths, Rcpp::List staticPathOptions, bool quiet);
-RcppExport SEXP _httpuv_makeTcpServer(SEXP hostSEXP, SEXP portSEXP, SEXP onHeadersSEXP, SEXP onBodyDataSEXP, SEXP onRequestSEXP, SEXP onWSOpenSEXP, SEXP onWSMessageSEXP, SEXP onWSCloseSEXP, SEXP staticPathsSEXP, SEXP staticPathOptionsSEXP, SEXP quietSEXP) {
+Rcpp::RObject makeTcpServer(const std::string& host, int port, Rcpp::Function onHeaders, Rcpp::Function onBodyData, Rcpp::Function onRequest, Rcpp::Function onWSOpen, Rcpp::Function onWSMessage, Rcpp::Function onWSClose, Rcpp::Function onWSDrain, Rcpp::List staticPaths, Rcpp::List staticPathOptions, Rcpp::List routes, Rcpp::List serverOptions, bool quiet);
+RcppExport SEXP _httpuv_makeTcpServer(SEXP hostSEXP, SEXP portSEXP, SEXP onHeadersSEXP, SEXP onBodyDataSEXP, SEXP onRequestSEXP, SEXP onWSOpenSEXP, SEXP onWSMessageSEXP, SEXP onWSCloseSEXP, SEXP onWSDrainSEXP, SEXP staticPathsSEXP, SEXP staticPathOptionsSEXP, SEXP routesSEXP, SEXP serverOptionsSEXP, SEXP quietSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -48,16 +119,19 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< Rcpp::Function >::type onWSOpen(onWSOpenSEXP);
     Rcpp::traits::input_parameter< Rcpp::Function >::type onWSMessage(onWSMessageSEXP);
     Rcpp::traits::input_parameter< Rcpp::Function >::type onWSClose(onWSCloseSEXP);
+    Rcpp::traits::input_parameter< Rcpp::Function >::type onWSDrain(onWSDrainSEXP);
     Rcpp::traits::input_parameter< Rcpp::List >::type staticPaths(staticPathsSEXP);
     Rcpp::traits::input_parameter< Rcpp::List >::type staticPathOptions(staticPathOptionsSEXP);
+    Rcpp::traits::input_parameter< Rcpp::List >::type routes(routesSEXP);
+    Rcpp::traits::input_parameter< Rcpp::List >::type serverOptions(serverOptionsSEXP);
     Rcpp::traits::input_parameter< bool >::type quiet(quietSEXP);
-    rcpp_result_gen = Rcpp::wrap(makeTcpServer(host, port, onHeaders, onBodyData, onRequest, onWSOpen, onWSMessage, onWSClose, staticPaths, staticPathOptions, quiet));
+    rcpp_result_gen = Rcpp::wrap(makeTcpServer(host, port, onHeaders, onBodyData, onRequest, onWSOpen, onWSMessage, onWSClose, onWSDrain, staticPaths, staticPathOptions, routes, serverOptions, quiet));
     return rcpp_result_gen;
 END_RCPP
 }
 // makePipeServer
-Rcpp::RObject makePipeServer(const std::string& name, int mask, Rcpp::Function onHeaders, Rcpp::Function onBodyData, Rcpp::Function onRequest, Rcpp::Function onWSOpen, Rcpp::Function onWSMessage, Rcpp::Function onWSClose, Rcpp::List staticPaths, Rcpp::List staticPathOptions, bool quiet);
-RcppExport SEXP _httpuv_makePipeServer(SEXP nameSEXP, SEXP maskSEXP, SEXP onHeadersSEXP, SEXP onBodyDataSEXP, SEXP onRequestSEXP, SEXP onWSOpenSEXP, SEXP onWSMessageSEXP, SEXP onWSCloseSEXP, SEXP staticPathsSEXP, SEXP staticPathOptionsSEXP, SEXP quietSEXP) {
+Rcpp::RObject makePipeServer(const std::string& name, int mask, Rcpp::Function onHeaders, Rcpp::Function onBodyData, Rcpp::Function onRequest, Rcpp::Function onWSOpen, Rcpp::Function onWSMessage, Rcpp::Function onWSClose, Rcpp::Function onWSDrain, Rcpp::List staticPaths, Rcpp::List staticPathOptions, Rcpp::List routes, Rcpp::List serverOptions, bool quiet);
+RcppExport SEXP _httpuv_makePipeServer(SEXP nameSEXP, SEXP maskSEXP, SEXP onHeadersSEXP, SEXP onBodyDataSEXP, SEXP onRequestSEXP, SEXP onWSOpenSEXP, SEXP onWSMessageSEXP, SEXP onWSCloseSEXP, SEXP onWSDrainSEXP, SEXP staticPathsSEXP, SEXP staticPathOptionsSEXP, SEXP routesSEXP, SEXP serverOptionsSEXP, SEXP quietSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -69,10 +143,13 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< Rcpp::Function >::type onWSOpen(onWSOpenSEXP);
     Rcpp::traits::input_parameter< Rcpp::Function >::type onWSMessage(onWSMessageSEXP);
     Rcpp::traits::input_parameter< Rcpp::Function >::type onWSClose(onWSCloseSEXP);
+    Rcpp::traits::input_parameter< Rcpp::Function >::type onWSDrain(onWSDrainSEXP);
     Rcpp::traits::input_parameter< Rcpp::List >::type staticPaths(staticPathsSEXP);
     Rcpp::traits::input_parameter< Rcpp::List >::type staticPathOptions(staticPathOptionsSEXP);
+    Rcpp::traits::input_parameter< Rcpp::List >::type routes(routesSEXP);
+    Rcpp::traits::input_parameter< Rcpp::List >::type serverOptions(serverOptionsSEXP);
     Rcpp::traits::input_parameter< bool >::type quiet(quietSEXP);
-    rcpp_result_gen = Rcpp::wrap(makePipeServer(name, mask, onHeaders, onBodyData, onRequest, onWSOpen, onWSMessage, onWSClose, staticPaths, staticPathOptions, quiet));
+    rcpp_result_gen = Rcpp::wrap(makePipeServer(name, mask, onHeaders, onBodyData, onRequest, onWSOpen, onWSMessage, onWSClose, onWSDrain, staticPaths, staticPathOptions, routes, serverOptions, quiet));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -144,6 +221,294 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// getRoutes_
+Rcpp::List getRoutes_(std::string handle);
+RcppExport SEXP _httpuv_getRoutes_(SEXP handleSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type handle(handleSEXP);
+    rcpp_result_gen = Rcpp::wrap(getRoutes_(handle));
+    return rcpp_result_gen;
+END_RCPP
+}
+// setRoutes_
+Rcpp::List setRoutes_(std::string handle, Rcpp::List routes);
+RcppExport SEXP _httpuv_setRoutes_(SEXP handleSEXP, SEXP routesSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type handle(handleSEXP);
+    Rcpp::traits::input_parameter< Rcpp::List >::type routes(routesSEXP);
+    rcpp_result_gen = Rcpp::wrap(setRoutes_(handle, routes));
+    return rcpp_result_gen;
+END_RCPP
+}
+// removeRoutes_
+Rcpp::List removeRoutes_(std::string handle, Rcpp::CharacterVector paths);
+RcppExport SEXP _httpuv_removeRoutes_(SEXP handleSEXP, SEXP pathsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type handle(handleSEXP);
+    Rcpp::traits::input_parameter< Rcpp::CharacterVector >::type paths(pathsSEXP);
+    rcpp_result_gen = Rcpp::wrap(removeRoutes_(handle, paths));
+    return rcpp_result_gen;
+END_RCPP
+}
+// getNativeHandlers_
+Rcpp::CharacterVector getNativeHandlers_(std::string handle);
+RcppExport SEXP _httpuv_getNativeHandlers_(SEXP handleSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type handle(handleSEXP);
+    rcpp_result_gen = Rcpp::wrap(getNativeHandlers_(handle));
+    return rcpp_result_gen;
+END_RCPP
+}
+// addNativeHandler_
+Rcpp::CharacterVector addNativeHandler_(std::string handle, std::string prefix, SEXP handler);
+RcppExport SEXP _httpuv_addNativeHandler_(SEXP handleSEXP, SEXP prefixSEXP, SEXP handlerSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type handle(handleSEXP);
+    Rcpp::traits::input_parameter< std::string >::type prefix(prefixSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type handler(handlerSEXP);
+    rcpp_result_gen = Rcpp::wrap(addNativeHandler_(handle, prefix, handler));
+    return rcpp_result_gen;
+END_RCPP
+}
+// removeNativeHandler_
+Rcpp::CharacterVector removeNativeHandler_(std::string handle, std::string prefix);
+RcppExport SEXP _httpuv_removeNativeHandler_(SEXP handleSEXP, SEXP prefixSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type handle(handleSEXP);
+    Rcpp::traits::input_parameter< std::string >::type prefix(prefixSEXP);
+    rcpp_result_gen = Rcpp::wrap(removeNativeHandler_(handle, prefix));
+    return rcpp_result_gen;
+END_RCPP
+}
+// getServerOptions_
+Rcpp::List getServerOptions_(std::string handle);
+RcppExport SEXP _httpuv_getServerOptions_(SEXP handleSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type handle(handleSEXP);
+    rcpp_result_gen = Rcpp::wrap(getServerOptions_(handle));
+    return rcpp_result_gen;
+END_RCPP
+}
+// setServerOptions_
+Rcpp::List setServerOptions_(std::string handle, Rcpp::List opts);
+RcppExport SEXP _httpuv_setServerOptions_(SEXP handleSEXP, SEXP optsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type handle(handleSEXP);
+    Rcpp::traits::input_parameter< Rcpp::List >::type opts(optsSEXP);
+    rcpp_result_gen = Rcpp::wrap(setServerOptions_(handle, opts));
+    return rcpp_result_gen;
+END_RCPP
+}
+// clearResponseCache_
+void clearResponseCache_(std::string handle);
+RcppExport SEXP _httpuv_clearResponseCache_(SEXP handleSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type handle(handleSEXP);
+    clearResponseCache_(handle);
+    return R_NilValue;
+END_RCPP
+}
+// reopenAccessLog_
+void reopenAccessLog_(std::string handle);
+RcppExport SEXP _httpuv_reopenAccessLog_(SEXP handleSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type handle(handleSEXP);
+    reopenAccessLog_(handle);
+    return R_NilValue;
+END_RCPP
+}
+// startCapture_
+void startCapture_(std::string handle, std::string path);
+RcppExport SEXP _httpuv_startCapture_(SEXP handleSEXP, SEXP pathSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type handle(handleSEXP);
+    Rcpp::traits::input_parameter< std::string >::type path(pathSEXP);
+    startCapture_(handle, path);
+    return R_NilValue;
+END_RCPP
+}
+// stopCapture_
+Rcpp::List stopCapture_(std::string handle);
+RcppExport SEXP _httpuv_stopCapture_(SEXP handleSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type handle(handleSEXP);
+    rcpp_result_gen = Rcpp::wrap(stopCapture_(handle));
+    return rcpp_result_gen;
+END_RCPP
+}
+// startReplay_
+SEXP startReplay_(std::string path, std::string host, int port, double speed);
+RcppExport SEXP _httpuv_startReplay_(SEXP pathSEXP, SEXP hostSEXP, SEXP portSEXP, SEXP speedSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type path(pathSEXP);
+    Rcpp::traits::input_parameter< std::string >::type host(hostSEXP);
+    Rcpp::traits::input_parameter< int >::type port(portSEXP);
+    Rcpp::traits::input_parameter< double >::type speed(speedSEXP);
+    rcpp_result_gen = Rcpp::wrap(startReplay_(path, host, port, speed));
+    return rcpp_result_gen;
+END_RCPP
+}
+// replayFinished_
+bool replayFinished_(SEXP replay_xptr);
+RcppExport SEXP _httpuv_replayFinished_(SEXP replay_xptrSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type replay_xptr(replay_xptrSEXP);
+    rcpp_result_gen = Rcpp::wrap(replayFinished_(replay_xptr));
+    return rcpp_result_gen;
+END_RCPP
+}
+// stopReplay_
+void stopReplay_(SEXP replay_xptr);
+RcppExport SEXP _httpuv_stopReplay_(SEXP replay_xptrSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type replay_xptr(replay_xptrSEXP);
+    stopReplay_(replay_xptr);
+    return R_NilValue;
+END_RCPP
+}
+// replayResults_
+Rcpp::List replayResults_(SEXP replay_xptr);
+RcppExport SEXP _httpuv_replayResults_(SEXP replay_xptrSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type replay_xptr(replay_xptrSEXP);
+    rcpp_result_gen = Rcpp::wrap(replayResults_(replay_xptr));
+    return rcpp_result_gen;
+END_RCPP
+}
+// getMetrics_
+Rcpp::List getMetrics_(std::string handle);
+RcppExport SEXP _httpuv_getMetrics_(SEXP handleSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type handle(handleSEXP);
+    rcpp_result_gen = Rcpp::wrap(getMetrics_(handle));
+    return rcpp_result_gen;
+END_RCPP
+}
+// startLoopMonitor_
+void startLoopMonitor_(double interval, double lagThreshold, Rcpp::RObject onLag);
+RcppExport SEXP _httpuv_startLoopMonitor_(SEXP intervalSEXP, SEXP lagThresholdSEXP, SEXP onLagSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< double >::type interval(intervalSEXP);
+    Rcpp::traits::input_parameter< double >::type lagThreshold(lagThresholdSEXP);
+    Rcpp::traits::input_parameter< Rcpp::RObject >::type onLag(onLagSEXP);
+    startLoopMonitor_(interval, lagThreshold, onLag);
+    return R_NilValue;
+END_RCPP
+}
+// stopLoopMonitor_
+void stopLoopMonitor_();
+RcppExport SEXP _httpuv_stopLoopMonitor_() {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    stopLoopMonitor_();
+    return R_NilValue;
+END_RCPP
+}
+// getLoopMetrics_
+Rcpp::List getLoopMetrics_();
+RcppExport SEXP _httpuv_getLoopMetrics_() {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    rcpp_result_gen = Rcpp::wrap(getLoopMetrics_());
+    return rcpp_result_gen;
+END_RCPP
+}
+// startLoadGenerator_
+SEXP startLoadGenerator_(std::string host, int port, Rcpp::RawVector request, bool head, bool websocket, Rcpp::RawVector message, bool binary, int connections, int threads, double duration, double requests);
+RcppExport SEXP _httpuv_startLoadGenerator_(SEXP hostSEXP, SEXP portSEXP, SEXP requestSEXP, SEXP headSEXP, SEXP websocketSEXP, SEXP messageSEXP, SEXP binarySEXP, SEXP connectionsSEXP, SEXP threadsSEXP, SEXP durationSEXP, SEXP requestsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type host(hostSEXP);
+    Rcpp::traits::input_parameter< int >::type port(portSEXP);
+    Rcpp::traits::input_parameter< Rcpp::RawVector >::type request(requestSEXP);
+    Rcpp::traits::input_parameter< bool >::type head(headSEXP);
+    Rcpp::traits::input_parameter< bool >::type websocket(websocketSEXP);
+    Rcpp::traits::input_parameter< Rcpp::RawVector >::type message(messageSEXP);
+    Rcpp::traits::input_parameter< bool >::type binary(binarySEXP);
+    Rcpp::traits::input_parameter< int >::type connections(connectionsSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< double >::type duration(durationSEXP);
+    Rcpp::traits::input_parameter< double >::type requests(requestsSEXP);
+    rcpp_result_gen = Rcpp::wrap(startLoadGenerator_(host, port, request, head, websocket, message, binary, connections, threads, duration, requests));
+    return rcpp_result_gen;
+END_RCPP
+}
+// loadGeneratorFinished_
+bool loadGeneratorFinished_(SEXP gen_xptr);
+RcppExport SEXP _httpuv_loadGeneratorFinished_(SEXP gen_xptrSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type gen_xptr(gen_xptrSEXP);
+    rcpp_result_gen = Rcpp::wrap(loadGeneratorFinished_(gen_xptr));
+    return rcpp_result_gen;
+END_RCPP
+}
+// stopLoadGenerator_
+void stopLoadGenerator_(SEXP gen_xptr);
+RcppExport SEXP _httpuv_stopLoadGenerator_(SEXP gen_xptrSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type gen_xptr(gen_xptrSEXP);
+    stopLoadGenerator_(gen_xptr);
+    return R_NilValue;
+END_RCPP
+}
+// loadGeneratorResults_
+Rcpp::List loadGeneratorResults_(SEXP gen_xptr);
+RcppExport SEXP _httpuv_loadGeneratorResults_(SEXP gen_xptrSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type gen_xptr(gen_xptrSEXP);
+    rcpp_result_gen = Rcpp::wrap(loadGeneratorResults_(gen_xptr));
+    return rcpp_result_gen;
+END_RCPP
+}
+// isCancelled_
+bool isCancelled_(SEXP flag_xptr);
+RcppExport SEXP _httpuv_isCancelled_(SEXP flag_xptrSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type flag_xptr(flag_xptrSEXP);
+    rcpp_result_gen = Rcpp::wrap(isCancelled_(flag_xptr));
+    return rcpp_result_gen;
+END_RCPP
+}
 // base64encode
 std::string base64encode(const Rcpp::RawVector& x);
 RcppExport SEXP _httpuv_base64encode(SEXP xSEXP) {
@@ -253,17 +618,51 @@ BEGIN_RCPP
 END_RCPP
 }
 
+void registerCCallables(DllInfo* dll);
+void registerWSMessageClass(DllInfo* dll);
+
 static const R_CallMethodDef CallEntries[] = {
     {"_httpuv_sendWSMessage", (DL_FUNC) &_httpuv_sendWSMessage, 3},
     {"_httpuv_closeWS", (DL_FUNC) &_httpuv_closeWS, 3},
-    {"_httpuv_makeTcpServer", (DL_FUNC) &_httpuv_makeTcpServer, 11},
-    {"_httpuv_makePipeServer", (DL_FUNC) &_httpuv_makePipeServer, 11},
+    {"_httpuv_wsBufferedAmount_", (DL_FUNC) &_httpuv_wsBufferedAmount_, 1},
+    {"_httpuv_broadcastWS_", (DL_FUNC) &_httpuv_broadcastWS_, 5},
+    {"_httpuv_subscribeWS_", (DL_FUNC) &_httpuv_subscribeWS_, 2},
+    {"_httpuv_unsubscribeWS_", (DL_FUNC) &_httpuv_unsubscribeWS_, 2},
+    {"_httpuv_publishWS_", (DL_FUNC) &_httpuv_publishWS_, 5},
+    {"_httpuv_wsChannels_", (DL_FUNC) &_httpuv_wsChannels_, 0},
+    {"_httpuv_makeTcpServer", (DL_FUNC) &_httpuv_makeTcpServer, 14},
+    {"_httpuv_makePipeServer", (DL_FUNC) &_httpuv_makePipeServer, 14},
     {"_httpuv_stopServer_", (DL_FUNC) &_httpuv_stopServer_, 1},
     {"_httpuv_getStaticPaths_", (DL_FUNC) &_httpuv_getStaticPaths_, 1},
     {"_httpuv_setStaticPaths_", (DL_FUNC) &_httpuv_setStaticPaths_, 2},
     {"_httpuv_removeStaticPaths_", (DL_FUNC) &_httpuv_removeStaticPaths_, 2},
     {"_httpuv_getStaticPathOptions_", (DL_FUNC) &_httpuv_getStaticPathOptions_, 1},
     {"_httpuv_setStaticPathOptions_", (DL_FUNC) &_httpuv_setStaticPathOptions_, 2},
+    {"_httpuv_getRoutes_", (DL_FUNC) &_httpuv_getRoutes_, 1},
+    {"_httpuv_setRoutes_", (DL_FUNC) &_httpuv_setRoutes_, 2},
+    {"_httpuv_removeRoutes_", (DL_FUNC) &_httpuv_removeRoutes_, 2},
+    {"_httpuv_getNativeHandlers_", (DL_FUNC) &_httpuv_getNativeHandlers_, 1},
+    {"_httpuv_addNativeHandler_", (DL_FUNC) &_httpuv_addNativeHandler_, 3},
+    {"_httpuv_removeNativeHandler_", (DL_FUNC) &_httpuv_removeNativeHandler_, 2},
+    {"_httpuv_getServerOptions_", (DL_FUNC) &_httpuv_getServerOptions_, 1},
+    {"_httpuv_setServerOptions_", (DL_FUNC) &_httpuv_setServerOptions_, 2},
+    {"_httpuv_clearResponseCache_", (DL_FUNC) &_httpuv_clearResponseCache_, 1},
+    {"_httpuv_reopenAccessLog_", (DL_FUNC) &_httpuv_reopenAccessLog_, 1},
+    {"_httpuv_startCapture_", (DL_FUNC) &_httpuv_startCapture_, 2},
+    {"_httpuv_stopCapture_", (DL_FUNC) &_httpuv_stopCapture_, 1},
+    {"_httpuv_startReplay_", (DL_FUNC) &_httpuv_startReplay_, 4},
+    {"_httpuv_replayFinished_", (DL_FUNC) &_httpuv_replayFinished_, 1},
+    {"_httpuv_stopReplay_", (DL_FUNC) &_httpuv_stopReplay_, 1},
+    {"_httpuv_replayResults_", (DL_FUNC) &_httpuv_replayResults_, 1},
+    {"_httpuv_getMetrics_", (DL_FUNC) &_httpuv_getMetrics_, 1},
+    {"_httpuv_startLoopMonitor_", (DL_FUNC) &_httpuv_startLoopMonitor_, 3},
+    {"_httpuv_stopLoopMonitor_", (DL_FUNC) &_httpuv_stopLoopMonitor_, 0},
+    {"_httpuv_getLoopMetrics_", (DL_FUNC) &_httpuv_getLoopMetrics_, 0},
+    {"_httpuv_startLoadGenerator_", (DL_FUNC) &_httpuv_startLoadGenerator_, 11},
+    {"_httpuv_loadGeneratorFinished_", (DL_FUNC) &_httpuv_loadGeneratorFinished_, 1},
+    {"_httpuv_stopLoadGenerator_", (DL_FUNC) &_httpuv_stopLoadGenerator_, 1},
+    {"_httpuv_loadGeneratorResults_", (DL_FUNC) &_httpuv_loadGeneratorResults_, 1},
+    {"_httpuv_isCancelled_", (DL_FUNC) &_httpuv_isCancelled_, 1},
     {"_httpuv_base64encode", (DL_FUNC) &_httpuv_base64encode, 1},
     {"_httpuv_encodeURI", (DL_FUNC) &_httpuv_encodeURI, 1},
     {"_httpuv_encodeURIComponent", (DL_FUNC) &_httpuv_encodeURIComponent, 1},
@@ -280,4 +679,6 @@ static const R_CallMethodDef CallEntries[] = {
 RcppExport void R_init_httpuv(DllInfo *dll) {
     R_registerRoutines(dll, NULL, CallEntries, NULL, NULL);
     R_useDynamicSymbols(dll, FALSE);
+    registerCCallables(dll);
+    registerWSMessageClass(dll);
 }
@@ -0,0 +1,423 @@
+#include "accesslog.h"
+#include "httprequest.h"
+#include "utils.h"
+#include <cstdio>
+#include <ctime>
+#include <iomanip>
+#include <sstream>
+
+// Maximum number of bytes waiting to be written. Past this, lines are
+// dropped.
+static const size_t MAX_BUFFERED = 4 * 1024 * 1024;
+
+// Number of SIGHUPs received; each AccessLog compares this to the number it
+// has seen to know when to reopen.
+static std::atomic<uint64_t> signals_received(0);
+
+void AccessLog::signalReceived() {
+  signals_received.fetch_add(1);
+}
+
+// Open a file for appending, synchronously. Returns the file descriptor, or a
+// negative libuv error code. The loop is not used for synchronous requests.
+static uv_file open_log_file(const std::string& path) {
+  uv_fs_t req;
+  int fd = uv_fs_open(NULL, &req, path.c_str(),
+                      UV_FS_O_WRONLY | UV_FS_O_CREAT | UV_FS_O_APPEND, 0644, NULL);
+  uv_fs_req_cleanup(&req);
+  return fd;
+}
+
+static void close_log_file(uv_file fd) {
+  uv_fs_t req;
+  uv_fs_close(NULL, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+}
+
+struct AccessLogWrite {
+  uv_fs_t req;
+  std::shared_ptr<AccessLog> pLog;
+  std::string data;
+};
+
+static void on_access_log_written(uv_fs_t* req) {
+  AccessLogWrite* pWrite = reinterpret_cast<AccessLogWrite*>(req->data);
+  pWrite->pLog->onWriteComplete(req->result, pWrite->data);
+  uv_fs_req_cleanup(req);
+  delete pWrite;
+}
+
+
+// ============================================================================
+// Formatting
+// ============================================================================
+
+static struct tm utc_time(time_t t) {
+  struct tm timeptr;
+#ifdef _WIN32
+  gmtime_s(&timeptr, &t);
+#else
+  gmtime_r(&t, &timeptr);
+#endif
+  return timeptr;
+}
+
+// For example: "10/Oct/2000:13:55:36 +0000"
+static std::string clf_date(time_t t) {
+  struct tm timeptr = utc_time(t);
+  char buf[32];
+  strftime(buf, sizeof(buf), "%d/%b/%Y:%H:%M:%S +0000", &timeptr);
+  return buf;
+}
+
+// For example: "2000-10-10T13:55:36.123Z"
+static std::string iso_date(const uv_timeval64_t& tv) {
+  struct tm timeptr = utc_time((time_t)tv.tv_sec);
+  char buf[32];
+  strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &timeptr);
+  char ms[8];
+  snprintf(ms, sizeof(ms), ".%03dZ", (int)(tv.tv_usec / 1000));
+  return std::string(buf) + ms;
+}
+
+// Escape a value for a quoted field in the common log format, the same way
+// Apache does: quotes and backslashes are escaped with a backslash, and
+// control characters are written as \xhh.
+static std::string clf_escape(const std::string& s) {
+  std::string result;
+  for (size_t i = 0; i < s.size(); i++) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\') {
+      result += '\\';
+      result += c;
+    } else if (c < 0x20 || c == 0x7f) {
+      char buf[5];
+      snprintf(buf, sizeof(buf), "\\x%02x", c);
+      result += buf;
+    } else {
+      result += c;
+    }
+  }
+  return result;
+}
+
+static std::string json_string(const std::string& s) {
+  std::string result = "\"";
+  for (size_t i = 0; i < s.size(); i++) {
+    unsigned char c = s[i];
+    switch (c) {
+      case '"':  result += "\\\""; break;
+      case '\\': result += "\\\\"; break;
+      case '\n': result += "\\n"; break;
+      case '\r': result += "\\r"; break;
+      case '\t': result += "\\t"; break;
+      default:
+        if (c < 0x20) {
+          char buf[7];
+          snprintf(buf, sizeof(buf), "\\u%04x", c);
+          result += buf;
+        } else {
+          result += c;
+        }
+    }
+  }
+  result += "\"";
+  return result;
+}
+
+static std::string dash_if_empty(const std::string& s) {
+  return s.empty() ? "-" : s;
+}
+
+// Seconds between two uv_hrtime() values, or a negative number if either is
+// missing.
+static double interval(uint64_t start, uint64_t end) {
+  if (start == 0 || end == 0 || end < start) {
+    return -1;
+  }
+  return (end - start) / 1e9;
+}
+
+static void write_json_interval(std::ostream& os, const char* name, double secs) {
+  os << ",\"" << name << "\":";
+  if (secs < 0) {
+    os << "null";
+  } else {
+    os << secs;
+  }
+}
+
+std::string AccessLog::_formatLine(AccessLogFormat format, HttpRequest& request,
+                                   ResponseSource source,
+                                   const RequestTimings& timings,
+                                   const ResponseStats& stats)
+{
+  uv_timeval64_t now;
+  uv_gettimeofday(&now);
+
+  std::string host = request.clientAddress().host;
+  double total = interval(timings.begin, stats.lastByte);
+
+  std::ostringstream os;
+  os.precision(6);
+
+  if (format == ACCESS_LOG_JSON) {
+    os << "{\"time\":" << json_string(iso_date(now))
+       << ",\"remoteAddr\":" << json_string(host)
+       << ",\"method\":" << json_string(request.method())
+       << ",\"url\":" << json_string(request.url())
+       << ",\"protocol\":" << json_string("HTTP/" + request.httpVersion())
+       << ",\"status\":" << stats.status
+       << ",\"bytes\":" << stats.bodyBytes
+       << ",\"referer\":" << json_string(request.getHeader("Referer"))
+       << ",\"userAgent\":" << json_string(request.getHeader("User-Agent"))
+       << ",\"source\":" << json_string(response_source_name(source));
+    write_json_interval(os, "headersTime", interval(timings.begin, timings.headersComplete));
+    write_json_interval(os, "applicationTime", interval(timings.dispatched, timings.responded));
+    write_json_interval(os, "firstByteTime", interval(timings.headersComplete, stats.firstByte));
+    write_json_interval(os, "totalTime", total);
+    os << "}\n";
+    return os.str();
+  }
+
+  // Common log format, optionally followed by the referer and user agent
+  // (combined log format). In both cases, the total time in seconds is added
+  // as a last field.
+  os << dash_if_empty(host) << " - - [" << clf_date((time_t)now.tv_sec) << "] \""
+     << clf_escape(request.method() + " " + request.url() + " HTTP/" +
+                   request.httpVersion())
+     << "\" " << stats.status << " ";
+  if (stats.bodyBytes == 0) {
+    os << "-";
+  } else {
+    os << stats.bodyBytes;
+  }
+  if (format == ACCESS_LOG_COMBINED) {
+    os << " \"" << clf_escape(dash_if_empty(request.getHeader("Referer"))) << "\""
+       << " \"" << clf_escape(dash_if_empty(request.getHeader("User-Agent"))) << "\"";
+  }
+  os << " ";
+  if (total < 0) {
+    os << "-";
+  } else {
+    os << std::fixed << std::setprecision(6) << total;
+  }
+  os << "\n";
+  return os.str();
+}
+
+
+// ============================================================================
+// AccessLog
+// ============================================================================
+
+AccessLog::AccessLog() :
+  _format(ACCESS_LOG_COMMON),
+  _sample(1),
+  _reopenOnSignal(false),
+  _reopenRequested(false),
+  _loop(NULL),
+  _fd(-1),
+  _writing(false),
+  _sampleCredit(0),
+  _signalsSeen(0),
+  _lines(0),
+  _sampledOut(0),
+  _dropped(0),
+  _errors(0)
+{
+  uv_mutex_init(&_mutex);
+}
+
+AccessLog::~AccessLog() {
+  if (_fd >= 0) {
+    close_log_file(_fd);
+  }
+  uv_mutex_destroy(&_mutex);
+}
+
+void AccessLog::configure(const std::string& path, const std::string& format,
+                          double sample, bool reopenOnSignal)
+{
+  ASSERT_MAIN_THREAD()
+
+  AccessLogFormat logFormat;
+  if (format == "common") {
+    logFormat = ACCESS_LOG_COMMON;
+  } else if (format == "combined") {
+    logFormat = ACCESS_LOG_COMBINED;
+  } else if (format == "json") {
+    logFormat = ACCESS_LOG_JSON;
+  } else {
+    throw Rcpp::exception(("Unknown access log format: " + format).c_str());
+  }
+
+  // Check that the file can be opened now, so that the error is reported to
+  // the caller. The background thread opens it again for writing.
+  if (!path.empty()) {
+    uv_file fd = open_log_file(path);
+    if (fd < 0) {
+      throw Rcpp::exception(
+        ("Unable to open access log " + path + ": " + uv_strerror(fd)).c_str()
+      );
+    }
+    close_log_file(fd);
+  }
+
+  guard guard(_mutex);
+  bool changed = (path != _path);
+  _path = path;
+  _format = logFormat;
+  _sample = sample;
+  _reopenOnSignal = reopenOnSignal;
+  if (changed) {
+    _reopenRequested.store(true);
+  }
+}
+
+bool AccessLog::reopenOnSignal() const {
+  guard guard(_mutex);
+  return _reopenOnSignal && !_path.empty();
+}
+
+void AccessLog::reopen() {
+  _reopenRequested.store(true);
+}
+
+// Closes and reopens the file if that has been requested. This is only done
+// when no write is in progress, since the write uses the file descriptor.
+void AccessLog::_checkReopen() {
+  ASSERT_BACKGROUND_THREAD()
+  if (_writing) {
+    return;
+  }
+
+  std::string path;
+  bool reopenOnSignal;
+  {
+    guard guard(_mutex);
+    path = _path;
+    reopenOnSignal = _reopenOnSignal;
+  }
+
+  uint64_t signals = signals_received.load();
+  bool reopen = _reopenRequested.exchange(false);
+  if (reopenOnSignal && signals != _signalsSeen) {
+    reopen = true;
+  }
+  _signalsSeen = signals;
+
+  if (!reopen) {
+    return;
+  }
+
+  if (_fd >= 0) {
+    close_log_file(_fd);
+    _fd = -1;
+  }
+  if (path.empty()) {
+    _buffer.clear();
+    return;
+  }
+
+  _fd = open_log_file(path);
+  if (_fd < 0) {
+    _errors.fetch_add(1);
+    err_printf("Unable to open access log %s: %s\n", path.c_str(), uv_strerror(_fd));
+    // Don't try again until the next request to reopen.
+    _fd = -1;
+    _buffer.clear();
+  }
+}
+
+void AccessLog::log(uv_loop_t* loop, HttpRequest& request, ResponseSource source,
+                    const RequestTimings& timings, const ResponseStats& stats)
+{
+  ASSERT_BACKGROUND_THREAD()
+  _loop = loop;
+
+  AccessLogFormat format;
+  double sample;
+  {
+    guard guard(_mutex);
+    if (_path.empty() && _fd < 0) {
+      return;
+    }
+    format = _format;
+    sample = _sample;
+  }
+
+  _checkReopen();
+  if (_fd < 0) {
+    return;
+  }
+
+  // Sample deterministically, so that exactly the given fraction of
+  // responses is logged.
+  if (stats.status < 400 && sample < 1) {
+    _sampleCredit += sample;
+    if (_sampleCredit < 1) {
+      _sampledOut.fetch_add(1);
+      return;
+    }
+    _sampleCredit -= 1;
+  }
+
+  if (_buffer.size() > MAX_BUFFERED) {
+    _dropped.fetch_add(1);
+    return;
+  }
+
+  _buffer += _formatLine(format, request, source, timings, stats);
+  _lines.fetch_add(1);
+  _flush();
+}
+
+void AccessLog::_flush() {
+  ASSERT_BACKGROUND_THREAD()
+  if (_writing || _buffer.empty() || _fd < 0 || _loop == NULL) {
+    return;
+  }
+
+  AccessLogWrite* pWrite = new AccessLogWrite();
+  pWrite->pLog = shared_from_this();
+  pWrite->data.swap(_buffer);
+  pWrite->req.data = pWrite;
+
+  uv_buf_t buf = uv_buf_init(&pWrite->data[0], pWrite->data.size());
+  int r = uv_fs_write(_loop, &pWrite->req, _fd, &buf, 1, -1, on_access_log_written);
+  if (r < 0) {
+    _errors.fetch_add(1);
+    debug_log(std::string("AccessLog: write failed: ") + uv_strerror(r), LOG_INFO);
+    delete pWrite;
+    return;
+  }
+  _writing = true;
+}
+
+void AccessLog::onWriteComplete(ssize_t result, const std::string& data) {
+  ASSERT_BACKGROUND_THREAD()
+  _writing = false;
+
+  if (result < 0) {
+    _errors.fetch_add(1);
+    debug_log(std::string("AccessLog: write failed: ") + uv_strerror(result), LOG_INFO);
+  } else if ((size_t)result < data.size()) {
+    // Short write: put the rest back at the front of the buffer.
+    _buffer.insert(0, data, result, std::string::npos);
+  }
+
+  _checkReopen();
+  _flush();
+}
+
+Rcpp::List AccessLog::metricsAsRObject() const {
+  ASSERT_MAIN_THREAD()
+  using namespace Rcpp;
+  return List::create(
+    _["lines"]      = (double)_lines.load(),
+    _["sampledOut"] = (double)_sampledOut.load(),
+    _["dropped"]    = (double)_dropped.load(),
+    _["errors"]     = (double)_errors.load()
+  );
+}
@@ -0,0 +1,94 @@
+#ifndef ACCESSLOG_HPP
+#define ACCESSLOG_HPP
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <stdint.h>
+#include <uv.h>
+#include <Rcpp.h>
+#include "requestmetrics.h"
+#include "thread.h"
+
+class HttpRequest;
+
+enum AccessLogFormat {
+  ACCESS_LOG_COMMON,
+  ACCESS_LOG_COMBINED,
+  ACCESS_LOG_JSON
+};
+
+// An access log for a server, written entirely from the background thread so
+// that logging doesn't add any work for R.
+//
+// When a response has been written, a line for it is appended to a buffer.
+// If no write is in progress, the buffer is written to the file with an
+// asynchronous uv_fs_write(); lines that arrive while it is being written
+// accumulate, and are written together when it finishes. Since the buffer is
+// only touched on the background thread, no locking is needed for it. If the
+// disk can't keep up and the buffer grows too large, lines are dropped (and
+// counted) rather than using unbounded memory.
+//
+// The file is opened in append mode. It is reopened (for example, after it
+// has been moved by a log rotation tool) before the next line is written
+// after reopen() is called, or after SIGHUP if the accessLogReopenSignal
+// option is set.
+class AccessLog : public std::enable_shared_from_this<AccessLog> {
+  // Guarded by _mutex, since they are set from the main thread.
+  std::string _path;
+  AccessLogFormat _format;
+  // Fraction of successful responses to log; errors (4xx and 5xx) are always
+  // logged.
+  double _sample;
+  bool _reopenOnSignal;
+  mutable uv_mutex_t _mutex;
+
+  std::atomic<bool> _reopenRequested;
+
+  // Background thread only
+  uv_loop_t* _loop;
+  uv_file _fd;
+  std::string _buffer;
+  bool _writing;
+  double _sampleCredit;
+  uint64_t _signalsSeen;
+
+  std::atomic<uint64_t> _lines;
+  std::atomic<uint64_t> _sampledOut;
+  std::atomic<uint64_t> _dropped;
+  std::atomic<uint64_t> _errors;
+
+  void _checkReopen();
+  void _flush();
+  std::string _formatLine(AccessLogFormat format, HttpRequest& request,
+                          ResponseSource source, const RequestTimings& timings,
+                          const ResponseStats& stats);
+
+public:
+  AccessLog();
+  ~AccessLog();
+
+  // Called on the main thread. Throws an exception if the file can't be
+  // opened for writing. An empty path turns off logging.
+  void configure(const std::string& path, const std::string& format,
+                 double sample, bool reopenOnSignal);
+  bool reopenOnSignal() const;
+
+  // Safe to call from either thread.
+  void reopen();
+
+  // Records a response. Called on the background thread.
+  void log(uv_loop_t* loop, HttpRequest& request, ResponseSource source,
+           const RequestTimings& timings, const ResponseStats& stats);
+
+  // Called when an asynchronous write finishes.
+  void onWriteComplete(ssize_t result, const std::string& data);
+
+  Rcpp::List metricsAsRObject() const;
+
+  // Called from the SIGHUP handler; every access log with reopenOnSignal set
+  // is reopened.
+  static void signalReceived();
+};
+
+#endif
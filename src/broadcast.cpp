@@ -0,0 +1,32 @@
+#include "broadcast.h"
+#include "websockets.h"
+#include "thread.h"
+#include "utils.h"
+
+BroadcastResult broadcast_ws_message(
+  const std::vector<std::shared_ptr<WebSocketConnection> >& connections,
+  Opcode opcode,
+  std::shared_ptr<const std::vector<char> > payload,
+  const BroadcastOptions& options)
+{
+  ASSERT_BACKGROUND_THREAD()
+  debug_log("broadcast_ws_message", LOG_DEBUG);
+
+  BroadcastResult result;
+  std::vector<std::shared_ptr<WebSocketConnection> >::const_iterator it;
+  for (it = connections.begin(); it != connections.end(); it++) {
+    WebSocketConnection* pConn = it->get();
+    if (pConn->bufferedAmount() > options.maxBuffered) {
+      if (options.slowConsumer == SLOW_CONSUMER_CLOSE) {
+        pConn->disconnect();
+        result.closed++;
+      } else {
+        result.skipped++;
+      }
+      continue;
+    }
+    pConn->sendWSSharedMessage(opcode, payload);
+    result.sent++;
+  }
+  return result;
+}
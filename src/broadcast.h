@@ -0,0 +1,44 @@
+#ifndef BROADCAST_HPP
+#define BROADCAST_HPP
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include "constants.h"
+
+class WebSocketConnection;
+
+// What to do with a connection that already has more than maxBuffered bytes
+// waiting to be written when a broadcast message is sent to it.
+enum SlowConsumerPolicy {
+  // Don't send this message to it; it gets later ones once it has caught up.
+  SLOW_CONSUMER_SKIP,
+  // Close the connection.
+  SLOW_CONSUMER_CLOSE
+};
+
+struct BroadcastOptions {
+  size_t maxBuffered;
+  SlowConsumerPolicy slowConsumer;
+
+  BroadcastOptions() : maxBuffered(SIZE_MAX), slowConsumer(SLOW_CONSUMER_SKIP) {}
+};
+
+struct BroadcastResult {
+  uint64_t sent;
+  uint64_t skipped;
+  uint64_t closed;
+
+  BroadcastResult() : sent(0), skipped(0), closed(0) {}
+};
+
+// Sends one message to many WebSocket connections, on the background thread.
+// The payload is framed for each connection, but not copied: every write
+// refers to the same buffer, which is freed after the last one finishes.
+BroadcastResult broadcast_ws_message(
+  const std::vector<std::shared_ptr<WebSocketConnection> >& connections,
+  Opcode opcode,
+  std::shared_ptr<const std::vector<char> > payload,
+  const BroadcastOptions& options);
+
+#endif
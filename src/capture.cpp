@@ -0,0 +1,270 @@
+#include "capture.h"
+#include "utils.h"
+
+const char CAPTURE_MAGIC[8] = { 'H', 'U', 'V', 'C', 'A', 'P', '0', '1' };
+
+// Maximum number of bytes waiting to be written. Past this, records are
+// dropped.
+static const size_t MAX_BUFFERED = 16 * 1024 * 1024;
+
+static void put_u32(std::string& s, uint32_t x) {
+  for (int i = 0; i < 4; i++) {
+    s.push_back((char)((x >> (i * 8)) & 0xFF));
+  }
+}
+
+static void put_u64(std::string& s, uint64_t x) {
+  for (int i = 0; i < 8; i++) {
+    s.push_back((char)((x >> (i * 8)) & 0xFF));
+  }
+}
+
+// Opens a file for writing, synchronously, replacing its contents. Returns
+// the file descriptor, or a negative libuv error code.
+static uv_file open_capture_file(const std::string& path) {
+  uv_fs_t req;
+  int fd = uv_fs_open(NULL, &req, path.c_str(),
+                      UV_FS_O_WRONLY | UV_FS_O_CREAT | UV_FS_O_TRUNC, 0644, NULL);
+  uv_fs_req_cleanup(&req);
+  return fd;
+}
+
+static void close_capture_file(uv_file fd) {
+  uv_fs_t req;
+  uv_fs_close(NULL, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+}
+
+struct CaptureWrite {
+  uv_fs_t req;
+  std::shared_ptr<TrafficCapture> pCapture;
+  std::string data;
+};
+
+static void on_capture_written(uv_fs_t* req) {
+  CaptureWrite* pWrite = reinterpret_cast<CaptureWrite*>(req->data);
+  pWrite->pCapture->onWriteComplete(req->result, pWrite->data);
+  uv_fs_req_cleanup(req);
+  delete pWrite;
+}
+
+
+TrafficCapture::TrafficCapture() :
+  _generation(0),
+  _active(false),
+  _start(0),
+  _loop(NULL),
+  _fd(-1),
+  _openGeneration(0),
+  _writing(false),
+  _records(0),
+  _bytes(0),
+  _dropped(0),
+  _errors(0)
+{
+  uv_mutex_init(&_mutex);
+}
+
+TrafficCapture::~TrafficCapture() {
+  if (_fd >= 0) {
+    close_capture_file(_fd);
+  }
+  uv_mutex_destroy(&_mutex);
+}
+
+void TrafficCapture::start(const std::string& path) {
+  ASSERT_MAIN_THREAD()
+
+  // Check that the file can be created now, so that the error is reported to
+  // the caller. The background thread opens it again for writing.
+  uv_file fd = open_capture_file(path);
+  if (fd < 0) {
+    throw Rcpp::exception(
+      ("Unable to open capture file " + path + ": " + uv_strerror(fd)).c_str()
+    );
+  }
+  close_capture_file(fd);
+
+  // Recording starts when the background thread has opened the file.
+  _active.store(false);
+  _records.store(0);
+  _bytes.store(0);
+  _dropped.store(0);
+  _errors.store(0);
+
+  guard guard(_mutex);
+  _path = path;
+  _generation++;
+}
+
+void TrafficCapture::stop() {
+  ASSERT_MAIN_THREAD()
+  _active.store(false);
+
+  guard guard(_mutex);
+  _path.clear();
+  _generation++;
+}
+
+void TrafficCapture::sync() {
+  ASSERT_BACKGROUND_THREAD()
+  // The file is switched only when no write is in progress, since the write
+  // uses the file descriptor. When the write finishes, this is called again.
+  if (_writing) {
+    return;
+  }
+
+  std::string path;
+  uint64_t generation;
+  {
+    guard guard(_mutex);
+    path = _path;
+    generation = _generation;
+  }
+  if (generation == _openGeneration) {
+    return;
+  }
+  _openGeneration = generation;
+
+  if (_fd >= 0) {
+    close_capture_file(_fd);
+    _fd = -1;
+  }
+  _buffer.clear();
+  if (path.empty()) {
+    return;
+  }
+
+  _fd = open_capture_file(path);
+  if (_fd < 0) {
+    _errors.fetch_add(1);
+    err_printf("Unable to open capture file %s: %s\n", path.c_str(), uv_strerror(_fd));
+    _fd = -1;
+    return;
+  }
+
+  uv_timeval64_t now;
+  uv_gettimeofday(&now);
+  _buffer.append(CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+  put_u64(_buffer, (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000);
+
+  _start.store(uv_hrtime());
+  _active.store(true);
+}
+
+void TrafficCapture::_record(uv_loop_t* loop, CaptureRecordType type,
+                             uint64_t connId, uint64_t time,
+                             const char* data, size_t len)
+{
+  ASSERT_BACKGROUND_THREAD()
+  _loop = loop;
+  if (_fd < 0) {
+    return;
+  }
+
+  if (_buffer.size() > MAX_BUFFERED) {
+    _dropped.fetch_add(1);
+    return;
+  }
+
+  uint64_t start = _start.load();
+  _buffer.push_back((char)type);
+  put_u64(_buffer, connId);
+  put_u64(_buffer, time > start ? time - start : 0);
+  put_u32(_buffer, (uint32_t)len);
+  _buffer.append(data, len);
+
+  _records.fetch_add(1);
+  _bytes.fetch_add(CAPTURE_RECORD_HEADER_BYTES + len);
+  _flush();
+}
+
+void TrafficCapture::open(uv_loop_t* loop, uint64_t connId) {
+  if (!active()) {
+    return;
+  }
+  _record(loop, CAPTURE_OPEN, connId, uv_hrtime(), NULL, 0);
+}
+
+void TrafficCapture::data(uv_loop_t* loop, uint64_t connId,
+                          const char* data, size_t len)
+{
+  if (!active()) {
+    return;
+  }
+  _record(loop, CAPTURE_DATA, connId, uv_hrtime(), data, len);
+}
+
+void TrafficCapture::response(uv_loop_t* loop, uint64_t connId, int status,
+                              uint64_t firstByte)
+{
+  if (!active()) {
+    return;
+  }
+  std::string data;
+  put_u32(data, (uint32_t)status);
+  _record(loop, CAPTURE_RESPONSE, connId, firstByte != 0 ? firstByte : uv_hrtime(),
+          data.data(), data.size());
+}
+
+void TrafficCapture::close(uv_loop_t* loop, uint64_t connId) {
+  if (!active()) {
+    return;
+  }
+  _record(loop, CAPTURE_CLOSE, connId, uv_hrtime(), NULL, 0);
+}
+
+void TrafficCapture::_flush() {
+  ASSERT_BACKGROUND_THREAD()
+  if (_writing || _buffer.empty() || _fd < 0 || _loop == NULL) {
+    return;
+  }
+
+  CaptureWrite* pWrite = new CaptureWrite();
+  pWrite->pCapture = shared_from_this();
+  pWrite->data.swap(_buffer);
+  pWrite->req.data = pWrite;
+
+  uv_buf_t buf = uv_buf_init(&pWrite->data[0], pWrite->data.size());
+  int r = uv_fs_write(_loop, &pWrite->req, _fd, &buf, 1, -1, on_capture_written);
+  if (r < 0) {
+    _errors.fetch_add(1);
+    debug_log(std::string("TrafficCapture: write failed: ") + uv_strerror(r), LOG_INFO);
+    delete pWrite;
+    return;
+  }
+  _writing = true;
+}
+
+void TrafficCapture::onWriteComplete(ssize_t result, const std::string& data) {
+  ASSERT_BACKGROUND_THREAD()
+  _writing = false;
+
+  if (result < 0) {
+    _errors.fetch_add(1);
+    debug_log(std::string("TrafficCapture: write failed: ") + uv_strerror(result), LOG_INFO);
+  } else if ((size_t)result < data.size()) {
+    // Short write: put the rest back at the front of the buffer.
+    _buffer.insert(0, data, result, std::string::npos);
+  }
+
+  _flush();
+  sync();
+}
+
+Rcpp::List TrafficCapture::statusAsRObject() const {
+  ASSERT_MAIN_THREAD()
+  using namespace Rcpp;
+  std::string path;
+  {
+    guard guard(_mutex);
+    path = _path;
+  }
+  return List::create(
+    _["path"]    = path.empty() ? CharacterVector::create(NA_STRING) : CharacterVector::create(path),
+    _["records"] = (double)_records.load(),
+    _["bytes"]   = (double)_bytes.load(),
+    _["dropped"] = (double)_dropped.load(),
+    _["errors"]  = (double)_errors.load()
+  );
+}
@@ -0,0 +1,102 @@
+#ifndef CAPTURE_HPP
+#define CAPTURE_HPP
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <stdint.h>
+#include <uv.h>
+#include <Rcpp.h>
+#include "thread.h"
+
+// The format of a capture file. It starts with the 8 bytes of CAPTURE_MAGIC
+// and the wall-clock time the capture started, in milliseconds since the
+// epoch. Then there is a record for each event:
+//
+//   type        1 byte, a CaptureRecordType
+//   connection  8 bytes, the connection's ID
+//   time        8 bytes, nanoseconds since the capture started
+//   length      4 bytes, the number of bytes of data that follow
+//   data        `length` bytes
+//
+// Integers are little-endian. For CAPTURE_RESPONSE, the data is the 4-byte
+// status code, and the time is when the first byte of the response was
+// written.
+enum CaptureRecordType {
+  CAPTURE_OPEN = 1,
+  CAPTURE_DATA = 2,
+  CAPTURE_RESPONSE = 3,
+  CAPTURE_CLOSE = 4
+};
+
+extern const char CAPTURE_MAGIC[8];
+const size_t CAPTURE_FILE_HEADER_BYTES = 16;
+const size_t CAPTURE_RECORD_HEADER_BYTES = 21;
+
+// Records the raw bytes that a server receives on each connection, with
+// timestamps, so that the traffic can be replayed against a local server
+// with replayCapture().
+//
+// Like the access log, this is written entirely from the background thread:
+// records are appended to a buffer, which is written with uv_fs_write()
+// when no write is in progress. If the disk can't keep up, records are
+// dropped (and counted) rather than using unbounded memory. When it isn't
+// capturing, the only cost on the request path is checking a flag.
+class TrafficCapture : public std::enable_shared_from_this<TrafficCapture> {
+  // Guarded by _mutex, since they are set from the main thread.
+  std::string _path;
+  uint64_t _generation;
+  mutable uv_mutex_t _mutex;
+
+  std::atomic<bool> _active;
+  // uv_hrtime() when the capture started.
+  std::atomic<uint64_t> _start;
+
+  // Background thread only
+  uv_loop_t* _loop;
+  uv_file _fd;
+  uint64_t _openGeneration;
+  std::string _buffer;
+  bool _writing;
+
+  std::atomic<uint64_t> _records;
+  std::atomic<uint64_t> _bytes;
+  std::atomic<uint64_t> _dropped;
+  std::atomic<uint64_t> _errors;
+
+  void _record(uv_loop_t* loop, CaptureRecordType type, uint64_t connId,
+               uint64_t time, const char* data, size_t len);
+  void _flush();
+
+public:
+  TrafficCapture();
+  ~TrafficCapture();
+
+  // Called on the main thread. start() creates the file, replacing any
+  // existing one, and throws an exception if it can't. Both must be followed
+  // by a call to sync() on the background thread.
+  void start(const std::string& path);
+  void stop();
+
+  // Opens or closes the file to match the last call to start() or stop().
+  // Called on the background thread.
+  void sync();
+
+  bool active() const {
+    return _active.load(std::memory_order_relaxed);
+  }
+
+  // These record events on the background thread. They do nothing unless
+  // capturing.
+  void open(uv_loop_t* loop, uint64_t connId);
+  void data(uv_loop_t* loop, uint64_t connId, const char* data, size_t len);
+  void response(uv_loop_t* loop, uint64_t connId, int status, uint64_t firstByte);
+  void close(uv_loop_t* loop, uint64_t connId);
+
+  // Called when an asynchronous write finishes.
+  void onWriteComplete(ssize_t result, const std::string& data);
+
+  Rcpp::List statusAsRObject() const;
+};
+
+#endif
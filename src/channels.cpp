@@ -0,0 +1,175 @@
+#include "channels.h"
+#include "websockets.h"
+#include "callbackqueue.h"
+#include "utils.h"
+#include <functional>
+
+extern CallbackQueue* background_queue;
+
+ChannelManager::ChannelManager() {
+  uv_mutex_init(&_mutex);
+}
+
+void ChannelManager::subscribe(std::shared_ptr<WebSocketConnection> pConn,
+                               const std::vector<std::string>& channels) {
+  ASSERT_BACKGROUND_THREAD()
+  // The subscribe may have been queued before the connection closed; adding
+  // it now would keep it in the channels for good.
+  if (pConn->hasLeftChannels()) {
+    return;
+  }
+  guard guard(_mutex);
+  std::set<std::string>& memberships = _memberships[pConn.get()];
+  std::vector<std::string>::const_iterator it;
+  for (it = channels.begin(); it != channels.end(); it++) {
+    _channels[*it].subscribers.insert(pConn);
+    memberships.insert(*it);
+  }
+}
+
+void ChannelManager::unsubscribe(std::shared_ptr<WebSocketConnection> pConn,
+                                 const std::vector<std::string>& channels) {
+  ASSERT_BACKGROUND_THREAD()
+  guard guard(_mutex);
+  std::map<WebSocketConnection*, std::set<std::string> >::iterator m =
+    _memberships.find(pConn.get());
+  if (m == _memberships.end()) {
+    return;
+  }
+
+  std::vector<std::string>::const_iterator it;
+  for (it = channels.begin(); it != channels.end(); it++) {
+    if (m->second.erase(*it) == 0) {
+      continue;
+    }
+    std::map<std::string, Channel>::iterator c = _channels.find(*it);
+    if (c != _channels.end()) {
+      c->second.subscribers.erase(pConn);
+      if (c->second.subscribers.empty()) {
+        _channels.erase(c);
+      }
+    }
+  }
+  if (m->second.empty()) {
+    _memberships.erase(m);
+  }
+}
+
+void ChannelManager::removeConnection(WebSocketConnection* pConn) {
+  ASSERT_BACKGROUND_THREAD()
+  // Dropping the last reference to a connection destroys it, which must not
+  // happen while the mutex is held, so the references are released after
+  // the loop.
+  std::vector<std::shared_ptr<WebSocketConnection> > released;
+  {
+    guard guard(_mutex);
+    std::map<WebSocketConnection*, std::set<std::string> >::iterator m =
+      _memberships.find(pConn);
+    if (m == _memberships.end()) {
+      return;
+    }
+
+    std::set<std::string>::const_iterator it;
+    for (it = m->second.begin(); it != m->second.end(); it++) {
+      std::map<std::string, Channel>::iterator c = _channels.find(*it);
+      if (c == _channels.end()) {
+        continue;
+      }
+      std::set<std::shared_ptr<WebSocketConnection> >& subs = c->second.subscribers;
+      for (std::set<std::shared_ptr<WebSocketConnection> >::iterator s = subs.begin();
+           s != subs.end(); s++) {
+        if (s->get() == pConn) {
+          released.push_back(*s);
+          subs.erase(s);
+          break;
+        }
+      }
+      if (subs.empty()) {
+        _channels.erase(c);
+      }
+    }
+    _memberships.erase(m);
+  }
+}
+
+void ChannelManager::publish(const std::string& channel,
+                             Opcode opcode,
+                             std::shared_ptr<const std::vector<char> > payload,
+                             const BroadcastOptions& options) {
+  ASSERT_BACKGROUND_THREAD()
+  debug_log("ChannelManager::publish", LOG_DEBUG);
+
+  std::vector<std::shared_ptr<WebSocketConnection> > subscribers;
+  {
+    guard guard(_mutex);
+    std::map<std::string, Channel>::const_iterator c = _channels.find(channel);
+    if (c == _channels.end()) {
+      return;
+    }
+    subscribers.assign(c->second.subscribers.begin(), c->second.subscribers.end());
+  }
+
+  BroadcastResult result = broadcast_ws_message(subscribers, opcode, payload, options);
+
+  guard guard(_mutex);
+  std::map<std::string, Channel>::iterator c = _channels.find(channel);
+  if (c != _channels.end()) {
+    c->second.messages++;
+    c->second.bytes += result.sent * payload->size();
+    c->second.skipped += result.skipped;
+    c->second.closed += result.closed;
+  }
+}
+
+Rcpp::List ChannelManager::statsAsRObject() const {
+  guard guard(_mutex);
+  size_t n = _channels.size();
+  Rcpp::CharacterVector names(n);
+  Rcpp::IntegerVector subscribers(n);
+  Rcpp::NumericVector messages(n), bytes(n), skipped(n), closed(n);
+
+  size_t i = 0;
+  std::map<std::string, Channel>::const_iterator it;
+  for (it = _channels.begin(); it != _channels.end(); it++, i++) {
+    names[i] = it->first;
+    subscribers[i] = it->second.subscribers.size();
+    messages[i] = (double)it->second.messages;
+    bytes[i] = (double)it->second.bytes;
+    skipped[i] = (double)it->second.skipped;
+    closed[i] = (double)it->second.closed;
+  }
+
+  using namespace Rcpp;
+  return List::create(
+    _["channel"]     = names,
+    _["subscribers"] = subscribers,
+    _["messages"]    = messages,
+    _["bytes"]       = bytes,
+    _["skipped"]     = skipped,
+    _["closed"]      = closed
+  );
+}
+
+ChannelManager& ws_channels() {
+  // Never destroyed: it can hold connections, which must be destroyed on the
+  // background thread, and not during static destruction.
+  static ChannelManager* manager = new ChannelManager();
+  return *manager;
+}
+
+extern "C" void httpuv_publish(const char* channel, const void* data,
+                               size_t len, int binary) {
+  if (background_queue == NULL || channel == NULL) {
+    // No server has been started, so nothing can be subscribed.
+    return;
+  }
+  const char* bytes = static_cast<const char*>(data);
+  std::shared_ptr<const std::vector<char> > payload =
+    std::make_shared<std::vector<char> >(bytes, bytes + len);
+
+  background_queue->push(
+    std::bind(&ChannelManager::publish, &ws_channels(),
+              std::string(channel), binary ? Binary : Text, payload,
+              BroadcastOptions())
+  );
+}
@@ -0,0 +1,76 @@
+#ifndef CHANNELS_HPP
+#define CHANNELS_HPP
+
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include <uv.h>
+#include <Rcpp.h>
+#include "broadcast.h"
+#include "thread.h"
+
+class WebSocketConnection;
+
+// Named publish/subscribe channels for WebSocket connections, shared by all
+// servers in the process.
+//
+// Membership changes and publishes all happen on the background thread:
+// calls from R and from compiled code are queued there. Publishing fans the
+// message out with broadcast_ws_message(), so every subscriber's write shares
+// one copy of the payload. A connection is removed from its channels when it
+// closes, and a channel is removed when its last subscriber leaves.
+//
+// The mutex is held while the maps are read or changed, so that the channel
+// statistics can be read from the main thread. It is released before any
+// writes, since a slow consumer being closed removes itself from its
+// channels.
+class ChannelManager : NoCopy {
+  struct Channel {
+    std::set<std::shared_ptr<WebSocketConnection> > subscribers;
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t skipped;
+    uint64_t closed;
+
+    Channel() : messages(0), bytes(0), skipped(0), closed(0) {}
+  };
+
+  std::map<std::string, Channel> _channels;
+  // The channels that each connection belongs to, so that it can be removed
+  // from them when it closes.
+  std::map<WebSocketConnection*, std::set<std::string> > _memberships;
+  mutable uv_mutex_t _mutex;
+
+public:
+  ChannelManager();
+
+  void subscribe(std::shared_ptr<WebSocketConnection> pConn,
+                 const std::vector<std::string>& channels);
+  void unsubscribe(std::shared_ptr<WebSocketConnection> pConn,
+                   const std::vector<std::string>& channels);
+  // Called when a connection closes.
+  void removeConnection(WebSocketConnection* pConn);
+
+  void publish(const std::string& channel,
+               Opcode opcode,
+               std::shared_ptr<const std::vector<char> > payload,
+               const BroadcastOptions& options);
+
+  // A list of columns, with an element per channel. Can be called from any
+  // thread.
+  Rcpp::List statsAsRObject() const;
+};
+
+// The process-wide channel manager.
+ChannelManager& ws_channels();
+
+// Registered with R_RegisterCCallable() as "httpuv_publish". Copies the
+// message and queues the publish on the background thread, so it can be
+// called from any thread.
+extern "C" void httpuv_publish(const char* channel, const void* data,
+                               size_t len, int binary);
+
+#endif
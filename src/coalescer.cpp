@@ -0,0 +1,78 @@
+#include "coalescer.h"
+#include "httprequest.h"
+#include "responsecache.h"
+#include "thread.h"
+#include "utils.h"
+
+RequestCoalescer::RequestCoalescer() :
+  _enabled(false),
+  _coalesced(0)
+{
+  uv_mutex_init(&_mutex);
+}
+
+void RequestCoalescer::configure(bool enabled, const std::vector<std::string>& vary) {
+  guard guard(_mutex);
+  _enabled = enabled;
+  _vary.clear();
+  for (size_t i = 0; i < vary.size(); i++) {
+    _vary.push_back(to_lower(vary[i]));
+  }
+}
+
+bool RequestCoalescer::join(std::shared_ptr<HttpRequest> pRequest) {
+  ASSERT_BACKGROUND_THREAD()
+
+  guard guard(_mutex);
+  if (!_enabled || !cacheable_request(pRequest, _vary)) {
+    return false;
+  }
+
+  std::string key = request_cache_key(pRequest, _vary);
+
+  std::map<std::string, std::vector<std::shared_ptr<HttpRequest> > >::iterator it =
+    _waiters.find(key);
+  if (it != _waiters.end()) {
+    debug_log("RequestCoalescer::join: waiting on in-flight request", LOG_DEBUG);
+    it->second.push_back(pRequest);
+    return true;
+  }
+
+  _waiters[key] = std::vector<std::shared_ptr<HttpRequest> >();
+  _leaders[pRequest.get()] = key;
+  return false;
+}
+
+std::vector<std::shared_ptr<HttpRequest> > RequestCoalescer::finish(HttpRequest* pRequest) {
+  ASSERT_BACKGROUND_THREAD()
+
+  std::vector<std::shared_ptr<HttpRequest> > waiters;
+
+  guard guard(_mutex);
+  std::map<HttpRequest*, std::string>::iterator it = _leaders.find(pRequest);
+  if (it == _leaders.end()) {
+    return waiters;
+  }
+
+  waiters.swap(_waiters[it->second]);
+  _waiters.erase(it->second);
+  _leaders.erase(it);
+
+  return waiters;
+}
+
+void RequestCoalescer::recordCoalesced(size_t n) {
+  guard guard(_mutex);
+  _coalesced += n;
+}
+
+Rcpp::List RequestCoalescer::metricsAsRObject() const {
+  ASSERT_MAIN_THREAD()
+  using namespace Rcpp;
+  guard guard(_mutex);
+
+  return List::create(
+    _["coalesced"] = (double)_coalesced,
+    _["inFlight"]  = (double)_leaders.size()
+  );
+}
@@ -0,0 +1,57 @@
+#ifndef COALESCER_HPP
+#define COALESCER_HPP
+
+#include <string>
+#include <map>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+#include <Rcpp.h>
+#include "thread.h"
+
+class HttpRequest;
+
+// Keeps track of requests which have been passed to the application, so that
+// identical requests which arrive while one is in progress can wait for its
+// response, instead of each being passed to R. Requests are identical if
+// they have the same key (see request_cache_key()).
+//
+// join() and finish() are only called on the background thread; the mutex
+// is for configure() and metricsAsRObject(), which are called on the main
+// thread.
+class RequestCoalescer {
+  bool _enabled;
+  std::vector<std::string> _vary;
+
+  // Requests waiting on each in-flight request, by key.
+  std::map<std::string, std::vector<std::shared_ptr<HttpRequest> > > _waiters;
+  // The key for each in-flight request.
+  std::map<HttpRequest*, std::string> _leaders;
+
+  // Number of requests which got their response from another request.
+  uint64_t _coalesced;
+
+  mutable uv_mutex_t _mutex;
+
+public:
+  RequestCoalescer();
+
+  void configure(bool enabled, const std::vector<std::string>& vary);
+
+  // If an identical request is in flight, adds this request to its waiters
+  // and returns true. Otherwise, returns false; if the request can be
+  // coalesced, it becomes the in-flight request for its key.
+  bool join(std::shared_ptr<HttpRequest> pRequest);
+
+  // Called when a request is done with the application, successfully or not.
+  // If it was in flight, returns the requests that were waiting on it, and
+  // removes them. The caller is responsible for responding to them.
+  std::vector<std::shared_ptr<HttpRequest> > finish(HttpRequest* pRequest);
+
+  // Counts the requests which were sent a response from another request.
+  void recordCoalesced(size_t n);
+
+  Rcpp::List metricsAsRObject() const;
+};
+
+#endif
@@ -1,5 +1,6 @@
 #include "gzipdatasource.h"
 #include "utils.h"
+#include "probes.h"
 
 GZipDataSource::GZipDataSource(std::shared_ptr<DataSource> pData) :
   _pData(pData), _state(Streaming) {
@@ -33,6 +34,8 @@ uv_buf_t GZipDataSource::getData(size_t bytesDesired) {
     return {0};
   }
 
+  uLong totalIn = _zstrm.total_in;
+
   // Prepare the output area to be written to
   Bytef* outputBuf = (Bytef*)malloc(bytesDesired);
   _zstrm.next_out = outputBuf;
@@ -62,6 +65,7 @@ uv_buf_t GZipDataSource::getData(size_t bytesDesired) {
   uv_buf_t ret = {0};
   ret.base = (char*)outputBuf;
   ret.len = bytesDesired - _zstrm.avail_out;
+  HTTPUV_PROBE2(gzip__chunk, _zstrm.total_in - totalIn, ret.len);
   return ret;
 }
 
@@ -0,0 +1,116 @@
+#include "histogram.h"
+#include <cmath>
+
+Histogram::Histogram() : _count(0), _sum_ns(0), _max_ns(0) {
+  for (int i = 0; i < N_BUCKETS; i++) {
+    _buckets[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+void Histogram::record(uint64_t ns) {
+  uint64_t us = ns / 1000;
+  int bucket = 0;
+  while (us > 0 && bucket < N_BUCKETS - 1) {
+    us >>= 1;
+    bucket++;
+  }
+
+  _buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  _count.fetch_add(1, std::memory_order_relaxed);
+  _sum_ns.fetch_add(ns, std::memory_order_relaxed);
+
+  uint64_t prev_max = _max_ns.load(std::memory_order_relaxed);
+  while (ns > prev_max &&
+         !_max_ns.compare_exchange_weak(prev_max, ns, std::memory_order_relaxed)) {
+  }
+}
+
+uint64_t Histogram::count() const {
+  return _count.load(std::memory_order_relaxed);
+}
+
+double Histogram::bucketLimit(int i) {
+  if (i == N_BUCKETS - 1) {
+    return R_PosInf;
+  }
+  return std::ldexp(1.0, i) / 1e6;
+}
+
+// Estimate a quantile by linear interpolation within the bucket that contains
+// it. The result is accurate to within a factor of two.
+double Histogram::quantile(const std::vector<uint64_t>& counts, uint64_t total, double q) const {
+  if (total == 0) {
+    return R_NaN;
+  }
+
+  double target = q * total;
+  double cumulative = 0;
+  for (int i = 0; i < N_BUCKETS; i++) {
+    if (counts[i] == 0) {
+      continue;
+    }
+    if (cumulative + counts[i] >= target) {
+      double lower = (i == 0) ? 0 : bucketLimit(i - 1);
+      double upper = (i == N_BUCKETS - 1) ? _max_ns.load() / 1e9 : bucketLimit(i);
+      double frac = (target - cumulative) / counts[i];
+      return lower + frac * (upper - lower);
+    }
+    cumulative += counts[i];
+  }
+  return _max_ns.load() / 1e9;
+}
+
+Rcpp::List Histogram::asRObject() const {
+  using namespace Rcpp;
+
+  // The individual loads aren't synchronized with each other, so if values
+  // are being recorded at the same time, the total may not exactly match the
+  // sum of the buckets. Use the sum of the buckets for consistency.
+  std::vector<uint64_t> counts(N_BUCKETS);
+  uint64_t total = 0;
+  for (int i = 0; i < N_BUCKETS; i++) {
+    counts[i] = _buckets[i].load(std::memory_order_relaxed);
+    total += counts[i];
+  }
+
+  NumericVector le(N_BUCKETS);
+  NumericVector bucket_counts(N_BUCKETS);
+  for (int i = 0; i < N_BUCKETS; i++) {
+    le[i] = bucketLimit(i);
+    bucket_counts[i] = (double)counts[i];
+  }
+
+  return List::create(
+    _["count"]   = (double)total,
+    _["sum"]     = _sum_ns.load(std::memory_order_relaxed) / 1e9,
+    _["max"]     = _max_ns.load(std::memory_order_relaxed) / 1e9,
+    _["p50"]     = quantile(counts, total, 0.50),
+    _["p90"]     = quantile(counts, total, 0.90),
+    _["p99"]     = quantile(counts, total, 0.99),
+    _["buckets"] = List::create(
+      _["le"]    = le,
+      _["count"] = bucket_counts
+    )
+  );
+}
+
+void Histogram::writePrometheus(std::ostream& os, const std::string& name,
+                                const std::string& labels) const
+{
+  std::string sep = labels.empty() ? "" : ",";
+
+  // Prometheus buckets are cumulative. Every bucket is written, even when
+  // empty, so that the set of series is the same from one scrape to the
+  // next.
+  uint64_t cumulative = 0;
+  for (int i = 0; i < N_BUCKETS - 1; i++) {
+    cumulative += _buckets[i].load(std::memory_order_relaxed);
+    os << name << "_bucket{" << labels << sep << "le=\"" << bucketLimit(i) << "\"} "
+       << cumulative << "\n";
+  }
+  cumulative += _buckets[N_BUCKETS - 1].load(std::memory_order_relaxed);
+  os << name << "_bucket{" << labels << sep << "le=\"+Inf\"} " << cumulative << "\n";
+  os << name << "_sum{" << labels << "} "
+     << _sum_ns.load(std::memory_order_relaxed) / 1e9 << "\n";
+  os << name << "_count{" << labels << "} " << cumulative << "\n";
+}
@@ -0,0 +1,50 @@
+#ifndef HISTOGRAM_HPP
+#define HISTOGRAM_HPP
+
+#include <atomic>
+#include <ostream>
+#include <string>
+#include <stdint.h>
+#include <Rcpp.h>
+
+// A histogram of durations with logarithmic (power-of-two) buckets. Recording
+// a value is lock-free and wait-free (other than the running maximum), so it
+// can be done from either thread without blocking.
+//
+// Bucket 0 counts durations under 1 microsecond; bucket i (for i > 0) counts
+// durations in [2^(i-1), 2^i) microseconds. The last bucket also counts
+// anything larger.
+class Histogram {
+public:
+  static const int N_BUCKETS = 40;
+
+  Histogram();
+
+  // Record a duration, in nanoseconds (as returned by differences of
+  // uv_hrtime()).
+  void record(uint64_t ns);
+
+  uint64_t count() const;
+
+  // Returns a list with the total count, sum and max (in seconds), estimated
+  // quantiles, and the bucket upper bounds (in seconds) and counts.
+  Rcpp::List asRObject() const;
+
+  // Writes the histogram in the Prometheus text format, as the _bucket, _sum
+  // and _count series for `name`. `labels` is added to each series; it is
+  // either empty, or label pairs like `phase="total"`.
+  void writePrometheus(std::ostream& os, const std::string& name,
+                       const std::string& labels) const;
+
+private:
+  std::atomic<uint64_t> _buckets[N_BUCKETS];
+  std::atomic<uint64_t> _count;
+  std::atomic<uint64_t> _sum_ns;
+  std::atomic<uint64_t> _max_ns;
+
+  // Upper bound of a bucket, in seconds.
+  static double bucketLimit(int i);
+  double quantile(const std::vector<uint64_t>& counts, uint64_t total, double q) const;
+};
+
+#endif
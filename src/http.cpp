@@ -3,6 +3,7 @@
 #include "httpresponse.h"
 #include "callbackqueue.h"
 #include "socket.h"
+#include "serveroptions.h"
 #include "utils.h"
 #include "thread.h"
 #include <stdlib.h>
@@ -17,15 +18,163 @@
 // TODO: Streaming response body (with chunked transfer encoding)
 // TODO: Fast/easy use of files as response body
 
-void on_request(uv_stream_t* handle, int status) {
+// ============================================================================
+// Rejected connections
+// ============================================================================
+
+// When a server is at its connection limit and pauseAccept is false, new
+// connections are accepted, sent a canned 503 response, and closed, without
+// ever creating an HttpRequest object for them.
+struct RejectedConnection {
+  VariantHandle handle;
+  uv_write_t writeReq;
+  uv_shutdown_t shutdownReq;
+  uv_timer_t lingerTimer;
+  // Keeps the response data alive until the write completes.
+  std::shared_ptr<const std::string> pResponse;
+  // Number of handles (the stream and the timer) which have yet to be closed.
+  int openHandles;
+};
+
+// After the response is sent, give the client this long to close its end of
+// the connection before we close ours.
+static const uint64_t REJECTED_LINGER_MS = 1000;
+
+// Returns the full text of the 503 response sent to rejected connections. The
+// text is cached, and rebuilt at most once per second (for the Date header) or
+// when retryAfter changes.
+static std::shared_ptr<const std::string> rejection_response(int retryAfter) {
   ASSERT_BACKGROUND_THREAD()
-  if (status) {
-    err_printf("connection error: %s\n", uv_strerror(status));
+  static std::shared_ptr<const std::string> cached;
+  static time_t cached_time = 0;
+  static int cached_retry_after = -1;
+
+  time_t now = time(NULL);
+  if (!cached || now != cached_time || retryAfter != cached_retry_after) {
+    std::string body = "503 Service Unavailable\n";
+    std::ostringstream response;
+    response << "HTTP/1.1 503 Service Unavailable\r\n"
+             << "Date: " << http_date_string(now) << "\r\n"
+             << "Retry-After: " << retryAfter << "\r\n"
+             << "Connection: close\r\n"
+             << "Content-Type: text/plain; charset=UTF-8\r\n"
+             << "Content-Length: " << body.size() << "\r\n"
+             << "\r\n"
+             << body;
+
+    cached = std::make_shared<const std::string>(response.str());
+    cached_time = now;
+    cached_retry_after = retryAfter;
+  }
+
+  return cached;
+}
+
+static void on_rejected_closed(uv_handle_t* handle) {
+  ASSERT_BACKGROUND_THREAD()
+  RejectedConnection* pConn = (RejectedConnection*)handle->data;
+  if (--pConn->openHandles == 0) {
+    delete pConn;
+  }
+}
+
+static void close_rejected(RejectedConnection* pConn) {
+  ASSERT_BACKGROUND_THREAD()
+  uv_handle_t* pStream = toHandle(&pConn->handle.stream);
+  uv_handle_t* pTimer = (uv_handle_t*)&pConn->lingerTimer;
+  if (!uv_is_closing(pStream))
+    uv_close(pStream, on_rejected_closed);
+  if (!uv_is_closing(pTimer))
+    uv_close(pTimer, on_rejected_closed);
+}
+
+static void on_rejected_linger_timeout(uv_timer_t* handle) {
+  ASSERT_BACKGROUND_THREAD()
+  close_rejected((RejectedConnection*)handle->data);
+}
+
+static void on_rejected_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+  // Incoming data is discarded, so all rejected connections can share a
+  // buffer.
+  static char discard[4096];
+  *buf = uv_buf_init(discard, sizeof(discard));
+}
+
+static void on_rejected_read(uv_stream_t* handle, ssize_t nread, const uv_buf_t* buf) {
+  ASSERT_BACKGROUND_THREAD()
+  // Drain (and ignore) whatever the client sent until it closes the
+  // connection. Closing a socket while there is unread data in it causes a
+  // TCP reset, and the client might not see the response.
+  if (nread < 0) {
+    close_rejected((RejectedConnection*)handle->data);
+  }
+}
+
+static void on_rejected_shutdown(uv_shutdown_t* req, int status) {
+  ASSERT_BACKGROUND_THREAD()
+  RejectedConnection* pConn = (RejectedConnection*)req->data;
+  if (status || uv_read_start(&pConn->handle.stream, on_rejected_alloc, on_rejected_read)) {
+    close_rejected(pConn);
     return;
   }
+  uv_timer_start(&pConn->lingerTimer, on_rejected_linger_timeout, REJECTED_LINGER_MS, 0);
+}
 
-  // Copy the shared_ptr
-  std::shared_ptr<Socket> pSocket(*(std::shared_ptr<Socket>*)handle->data);
+static void on_rejected_written(uv_write_t* req, int status) {
+  ASSERT_BACKGROUND_THREAD()
+  RejectedConnection* pConn = (RejectedConnection*)req->data;
+  pConn->pResponse.reset();
+  if (status || uv_shutdown(&pConn->shutdownReq, &pConn->handle.stream, on_rejected_shutdown)) {
+    close_rejected(pConn);
+  }
+}
+
+// Accept a pending connection on the server `handle`, send it a 503, and
+// close it.
+static void reject_connection(uv_stream_t* handle, std::shared_ptr<Socket> pSocket, int retryAfter) {
+  ASSERT_BACKGROUND_THREAD()
+  debug_log("reject_connection", LOG_INFO);
+
+  // Freed in on_rejected_closed
+  RejectedConnection* pConn = new RejectedConnection();
+  pConn->openHandles = 2;
+  if (pSocket->handle.isTcp) {
+    uv_tcp_init(handle->loop, &pConn->handle.tcp);
+  } else {
+    uv_pipe_init(handle->loop, &pConn->handle.pipe, 0);
+  }
+  pConn->handle.isTcp = pSocket->handle.isTcp;
+  pConn->handle.stream.data = pConn;
+  uv_timer_init(handle->loop, &pConn->lingerTimer);
+  pConn->lingerTimer.data = pConn;
+  pConn->writeReq.data = pConn;
+  pConn->shutdownReq.data = pConn;
+
+  int r = uv_accept(handle, &pConn->handle.stream);
+  if (r) {
+    err_printf("accept: %s\n", uv_strerror(r));
+    close_rejected(pConn);
+    return;
+  }
+
+  pConn->pResponse = rejection_response(retryAfter);
+  uv_buf_t buf = uv_buf_init(
+    const_cast<char*>(pConn->pResponse->data()),
+    pConn->pResponse->size()
+  );
+  r = uv_write(&pConn->writeReq, &pConn->handle.stream, &buf, 1, on_rejected_written);
+  if (r) {
+    close_rejected(pConn);
+  }
+}
+
+
+// ============================================================================
+// Accepting connections
+// ============================================================================
+
+static void accept_connection(uv_stream_t* handle, std::shared_ptr<Socket> pSocket) {
+  ASSERT_BACKGROUND_THREAD()
   CallbackQueue* bg_queue = pSocket->background_queue;
 
   // Freed by HttpRequest itself when close() is called, which
@@ -41,7 +190,71 @@ void on_request(uv_stream_t* handle, int status) {
   }
 
   req->handleRequest();
+}
+
+// Is the server at its connection limit?
+static bool at_connection_limit(std::shared_ptr<Socket> pSocket, const ServerOptions& options) {
+  return options.maxConnections >= 0 &&
+    pSocket->connections.size() >= (size_t)options.maxConnections;
+}
+
+void on_request(uv_stream_t* handle, int status) {
+  ASSERT_BACKGROUND_THREAD()
+  if (status) {
+    err_printf("connection error: %s\n", uv_strerror(status));
+    return;
+  }
+
+  // Copy the shared_ptr
+  std::shared_ptr<Socket> pSocket(*(std::shared_ptr<Socket>*)handle->data);
+
+  std::shared_ptr<const ServerOptions> pOptions =
+    pSocket->pWebApplication->getServerOptions();
+  const ServerOptions& options = *pOptions;
+  if (at_connection_limit(pSocket, options)) {
+    if (options.pauseAccept) {
+      // Leave the connection in the listen backlog. libuv stops polling the
+      // server socket until uv_accept() is called, which happens in
+      // accept_pending_connections() when a slot frees up.
+      debug_log("on_request: connection limit reached, pausing accept", LOG_INFO);
+      pSocket->pendingAccepts++;
+    } else {
+      reject_connection(handle, pSocket, options.retryAfter);
+    }
+    return;
+  }
 
+  accept_connection(handle, pSocket);
+}
+
+// Accept connections which were deferred by on_request(), as long as the
+// server is under its connection limit. This is called when a connection
+// closes, and when the server options change.
+void accept_pending_connections(uv_stream_t* handle) {
+  ASSERT_BACKGROUND_THREAD()
+  if (uv_is_closing(toHandle(handle))) {
+    return;
+  }
+
+  std::shared_ptr<Socket> pSocket(*(std::shared_ptr<Socket>*)handle->data);
+
+  std::shared_ptr<const ServerOptions> pOptions =
+    pSocket->pWebApplication->getServerOptions();
+  const ServerOptions& options = *pOptions;
+  while (pSocket->pendingAccepts > 0) {
+    if (at_connection_limit(pSocket, options)) {
+      // If pauseAccept was turned off while connections were waiting, reject
+      // them rather than leaving them in the backlog.
+      if (options.pauseAccept) {
+        break;
+      }
+      pSocket->pendingAccepts--;
+      reject_connection(handle, pSocket, options.retryAfter);
+    } else {
+      pSocket->pendingAccepts--;
+      accept_connection(handle, pSocket);
+    }
+  }
 }
 
 uv_stream_t* createPipeServer(
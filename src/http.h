@@ -46,6 +46,7 @@ void createTcpServerSync(uv_loop_t* loop, const std::string& host, int port,
   uv_stream_t** pServer, std::shared_ptr<Barrier> blocker);
 
 void freeServer(uv_stream_t* pServer);
+void accept_pending_connections(uv_stream_t* pServer);
 bool runNonBlocking(uv_loop_t* loop);
 
 
@@ -1,11 +1,15 @@
 #include <functional>
 #include <memory>
+#include <sstream>
 #include "httprequest.h"
 #include <later_api.h>
 #include "callback.h"
 #include "utils.h"
 #include "thread.h"
 #include "auto_deleter.h"
+#include "responsecache.h"
+#include "probes.h"
+#include "channels.h"
 
 
 http_parser_settings& request_settings() {
@@ -22,6 +26,11 @@ http_parser_settings& request_settings() {
   return settings;
 }
 
+uint64_t next_connection_id() {
+  static std::atomic<uint64_t> next_id(1);
+  return next_id.fetch_add(1, std::memory_order_relaxed);
+}
+
 void on_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
   ASSERT_BACKGROUND_THREAD()
   // Freed in HttpRequest::_on_request_read
@@ -139,11 +148,10 @@ void HttpRequest::_newRequest() {
   _response_scheduled = false;
   _last_header_state = START;
 
-  // Schedule on main thread:
-  //   this->_initializeEnv();
-  invoke_later(
-    std::bind(&HttpRequest::_initializeEnv, shared_from_this())
-  );
+  _timings = RequestTimings();
+  _timings.begin = _accepted_at != 0 ? _accepted_at : uv_hrtime();
+  _accepted_at = 0;
+  _responseSource = SOURCE_R;
 }
 
 void HttpRequest::_initializeEnv() {
@@ -176,6 +184,12 @@ std::string HttpRequest::url() const {
   return _url;
 }
 
+std::string HttpRequest::httpVersion() const {
+  std::ostringstream os;
+  os << _parser.http_major << "." << _parser.http_minor;
+  return os.str();
+}
+
 const RequestHeaders& HttpRequest::headers() const {
   return _headers;
 }
@@ -191,12 +205,82 @@ bool HttpRequest::isResponseScheduled() {
   return _response_scheduled;
 }
 
+// Take one of the server's pending request slots. Returns false if the server
+// is already at its maxPendingRequests limit.
+bool HttpRequest::_acquireRequestSlot() {
+  ASSERT_BACKGROUND_THREAD()
+  if (_holds_request_slot)
+    return true;
+
+  int maxPendingRequests = _pWebApplication->getServerOptions()->maxPendingRequests;
+  if (maxPendingRequests >= 0 && _pSocket->activeRequests >= maxPendingRequests)
+    return false;
+
+  _pSocket->activeRequests++;
+  _holds_request_slot = true;
+  return true;
+}
+
+void HttpRequest::_releaseRequestSlot() {
+  ASSERT_BACKGROUND_THREAD()
+  if (!_holds_request_slot)
+    return;
+
+  _pSocket->activeRequests--;
+  _holds_request_slot = false;
+}
+
+void HttpRequest::_markQueued() {
+  ASSERT_BACKGROUND_THREAD()
+  _queued_at = uv_hrtime();
+}
+
+void HttpRequest::_startResponseTimer() {
+  ASSERT_BACKGROUND_THREAD()
+  double timeout = _pWebApplication->getServerOptions()->responseTimeout;
+  if (timeout < 0)
+    return;
+
+  uv_timer_start(_pResponseTimer, HttpRequest_on_response_timeout,
+                 (uint64_t)(timeout * 1000), 0);
+}
+
+void HttpRequest::_stopResponseTimer() {
+  ASSERT_BACKGROUND_THREAD()
+  uv_timer_stop(_pResponseTimer);
+}
+
+uint64_t HttpRequest::queueWait() const {
+  ASSERT_MAIN_THREAD()
+  return uv_hrtime() - _queued_at;
+}
+
+bool HttpRequest::isClosed() const {
+  return _closed->load();
+}
+
+std::shared_ptr<std::atomic<bool> > HttpRequest::cancelledFlag() const {
+  return _closed;
+}
+
 void HttpRequest::requestCompleted() {
   ASSERT_BACKGROUND_THREAD()
   debug_log("HttpRequest::requestCompleted", LOG_DEBUG);
   _handling_request = false;
 }
 
+void HttpRequest::responseWritten(const ResponseStats& stats) {
+  ASSERT_BACKGROUND_THREAD()
+  _pWebApplication->getTrafficCapture().response(_pLoop, _connId, stats.status,
+                                                 stats.firstByte);
+  // A 100 Continue is followed by the real response.
+  if (stats.status == 100) {
+    return;
+  }
+  _pWebApplication->getRequestMetrics().record(_responseSource, _timings, stats);
+  _pWebApplication->getAccessLog().log(_pLoop, *this, _responseSource, _timings, stats);
+}
+
 
 // ============================================================================
 // Miscellaneous callbacks for http parser
@@ -205,6 +289,7 @@ void HttpRequest::requestCompleted() {
 int HttpRequest::_on_message_begin(http_parser* pParser) {
   ASSERT_BACKGROUND_THREAD()
   debug_log("HttpRequest::_on_message_begin", LOG_DEBUG);
+  HTTPUV_PROBE1(request__begin, _connId);
   _newRequest();
   return 0;
 }
@@ -318,15 +403,35 @@ bool HttpRequest::isUpgrade() const {
 int HttpRequest::_on_headers_complete(http_parser* pParser) {
   ASSERT_BACKGROUND_THREAD()
   debug_log("HttpRequest::_on_headers_complete", LOG_DEBUG);
+  HTTPUV_PROBE3(request__headers, _connId, (int)_parser.method, _url.c_str());
   updateUpgradeStatus();
+  _timings.headersComplete = uv_hrtime();
 
   // Attempt static serving here. If the request is for a static path, this
   // will be a response object; if not, it will be an empty shared_ptr.
   std::shared_ptr<HttpResponse> pResponse =
     _pWebApplication->staticFileResponse(shared_from_this());
+  _responseSource = SOURCE_STATIC;
+
+  // If not, try handlers registered by compiled code.
+  if (!pResponse) {
+    pResponse = _pWebApplication->nativeHandlerResponse(shared_from_this());
+    _responseSource = SOURCE_NATIVE;
+  }
+
+  // If not, try responses from the application which were cached earlier.
+  if (!pResponse) {
+    pResponse = _pWebApplication->cachedResponse(shared_from_this());
+    _responseSource = SOURCE_CACHE;
+  }
+
+  if (!pResponse) {
+    _responseSource = SOURCE_R;
+  }
 
   if (pResponse) {
-    // The request was for a static path. Skip over the webapplication code
+    // The request was for a static path, native handler, or cached response.
+    // Skip over the webapplication code
     // (which calls back into R on the main thread). Just add a call to
     // _on_headers_complete_complete to the queue on the background thread.
     std::function<void (void)> cb(
@@ -336,14 +441,54 @@ int HttpRequest::_on_headers_complete(http_parser* pParser) {
     return 0;
   }
 
+  // If an identical request is already waiting on R, this one waits for its
+  // response instead of also being passed to R. _finishCoalesced(), called
+  // for the other request, takes it from there.
+  if (!isUpgrade() && _pWebApplication->getRequestCoalescer().join(shared_from_this())) {
+    return 0;
+  }
+
+  _handleWithApplication();
+  return 0;
+}
+
+void HttpRequest::_handleWithApplication() {
+  ASSERT_BACKGROUND_THREAD()
+
+  // If too many requests are already waiting on R, shed this one with a 503
+  // instead of adding to the backlog. WebSocket upgrades are exempt, since
+  // they don't hold on to a request slot after the handshake.
+  if (!isUpgrade() && !_acquireRequestSlot()) {
+    debug_log("HttpRequest::_handleWithApplication: too many pending requests", LOG_INFO);
+    _responseSource = SOURCE_REJECTED;
+    std::shared_ptr<HttpResponse> pResponse = overloaded_response(shared_from_this(),
+      _pWebApplication->getServerOptions()->retryAfter);
+
+    std::function<void (void)> cb(
+      std::bind(&HttpRequest::_on_headers_complete_complete, shared_from_this(), pResponse)
+    );
+    _background_queue->push(cb);
+    return;
+  }
 
   std::function<void(std::shared_ptr<HttpResponse>)> schedule_bg_callback(
     std::bind(&HttpRequest::_schedule_on_headers_complete_complete, shared_from_this(), std::placeholders::_1)
   );
 
+  _timings.dispatched = uv_hrtime();
+
+  // The R environment for the request is only needed when the request is
+  // handled by R, so it isn't created until here. Schedule on main thread:
+  //   this->_initializeEnv();
+  invoke_later(
+    std::bind(&HttpRequest::_initializeEnv, shared_from_this())
+  );
+
   // Use later to schedule _pWebApplication->onHeaders(this, schedule_bg_callback)
   // to run on the main thread. That function in turn calls
   // this->_schedule_on_headers_complete_complete.
+  _markQueued();
+  HTTPUV_PROBE1(r__dispatch, _connId);
   invoke_later(
     std::bind(
       &WebApplication::onHeaders,
@@ -352,8 +497,41 @@ int HttpRequest::_on_headers_complete(http_parser* pParser) {
       schedule_bg_callback
     )
   );
+}
 
-  return 0;
+void HttpRequest::_finishCoalesced(std::shared_ptr<HttpResponse> pResponse) {
+  ASSERT_BACKGROUND_THREAD()
+  RequestCoalescer& coalescer = _pWebApplication->getRequestCoalescer();
+
+  std::vector<std::shared_ptr<HttpRequest> > waiters = coalescer.finish(this);
+  if (waiters.empty()) {
+    return;
+  }
+
+  size_t shared = 0;
+  for (size_t i = 0; i < waiters.size(); i++) {
+    std::shared_ptr<HttpRequest> pWaiter = waiters[i];
+    if (pWaiter->isClosed()) {
+      continue;
+    }
+
+    std::shared_ptr<HttpResponse> pWaiterResponse;
+    if (pResponse) {
+      pWaiterResponse = share_response(pWaiter, pResponse);
+    }
+
+    if (pWaiterResponse) {
+      shared++;
+      pWaiter->_responseSource = SOURCE_COALESCED;
+      _background_queue->push(
+        std::bind(&HttpRequest::_on_headers_complete_complete, pWaiter, pWaiterResponse)
+      );
+    } else {
+      pWaiter->_handleWithApplication();
+    }
+  }
+
+  coalescer.recordCoalesced(shared);
 }
 
 // This is called at the end of WebApplication::onHeaders(). It puts an item
@@ -362,6 +540,7 @@ int HttpRequest::_on_headers_complete(http_parser* pParser) {
 void HttpRequest::_schedule_on_headers_complete_complete(std::shared_ptr<HttpResponse> pResponse) {
   ASSERT_MAIN_THREAD()
   debug_log("HttpRequest::_schedule_on_headers_complete_complete", LOG_DEBUG);
+  HTTPUV_PROBE2(r__return, _connId, pResponse ? pResponse->statusCode() : 0);
 
   if (pResponse)
     responseScheduled();
@@ -382,6 +561,14 @@ void HttpRequest::_on_headers_complete_complete(std::shared_ptr<HttpResponse> pR
   int result = 0;
 
   if (pResponse) {
+    _releaseRequestSlot();
+    if (_timings.dispatched != 0) {
+      _timings.responded = uv_hrtime();
+    }
+    // The application responded before the request body; identical requests
+    // waiting on this one are passed to the application themselves.
+    _finishCoalesced(std::shared_ptr<HttpResponse>());
+
     bool bodyExpected = hasHeader("Content-Length") || hasHeader("Transfer-Encoding");
     bool shouldKeepAlive = http_should_keep_alive(&_parser);
 
@@ -437,6 +624,7 @@ void HttpRequest::_on_headers_complete_complete(std::shared_ptr<HttpResponse> pR
 int HttpRequest::_on_body(http_parser* pParser, const char* pAt, size_t length) {
   ASSERT_BACKGROUND_THREAD()
   debug_log("HttpRequest::_on_body", LOG_DEBUG);
+  HTTPUV_PROBE2(request__body, _connId, length);
 
   // Copy pAt because the source data is deleted right after calling this
   // function.
@@ -480,6 +668,8 @@ void HttpRequest::_on_body_error(std::shared_ptr<HttpResponse> pResponse) {
 
   http_parser_pause(&_parser, 1);
 
+  _releaseRequestSlot();
+
   pResponse->closeAfterWritten();
   uv_read_stop((uv_stream_t*)handle());
   _ignoreNewData = true;
@@ -495,6 +685,7 @@ void HttpRequest::_on_body_error(std::shared_ptr<HttpResponse> pResponse) {
 int HttpRequest::_on_message_complete(http_parser* pParser) {
   ASSERT_BACKGROUND_THREAD()
   debug_log("HttpRequest::_on_message_complete", LOG_DEBUG);
+  HTTPUV_PROBE1(request__complete, _connId);
 
   if (isUpgrade())
     return 0;
@@ -506,6 +697,9 @@ int HttpRequest::_on_message_complete(http_parser* pParser) {
   // Use later to schedule _pWebApplication->getResponse(this, schedule_bg_callback)
   // to run on the main thread. That function in turn calls
   // this->_schedule_on_message_complete_complete.
+  _markQueued();
+  _startResponseTimer();
+  HTTPUV_PROBE1(r__dispatch, _connId);
   invoke_later(
     std::bind(
       &WebApplication::getResponse,
@@ -522,6 +716,7 @@ int HttpRequest::_on_message_complete(http_parser* pParser) {
 // WebApplication::getResponse(). It puts an item on the background queue.
 void HttpRequest::_schedule_on_message_complete_complete(std::shared_ptr<HttpResponse> pResponse) {
   ASSERT_MAIN_THREAD()
+  HTTPUV_PROBE2(r__return, _connId, pResponse ? pResponse->statusCode() : 0);
 
   responseScheduled();
 
@@ -535,6 +730,20 @@ void HttpRequest::_on_message_complete_complete(std::shared_ptr<HttpResponse> pR
   ASSERT_BACKGROUND_THREAD()
   debug_log("HttpRequest::_on_message_complete_complete", LOG_DEBUG);
 
+  _stopResponseTimer();
+  _releaseRequestSlot();
+  _timings.responded = uv_hrtime();
+
+  // This has to happen before the response is written, since writing it can
+  // replace the body with a gzip stream.
+  _finishCoalesced(_timed_out ? std::shared_ptr<HttpResponse>() : pResponse);
+
+  // A 504 was already sent for this request, and the connection is closing.
+  if (_timed_out) {
+    debug_log("HttpRequest::_on_message_complete_complete: dropping response for timed out request", LOG_INFO);
+    return;
+  }
+
   // This can happen if an error occured in WebApplication::onBodyData.
   if (pResponse == NULL) {
     return;
@@ -545,6 +754,8 @@ void HttpRequest::_on_message_complete_complete(std::shared_ptr<HttpResponse> pR
   if (_is_closing)
     return;
 
+  _pWebApplication->cacheResponse(shared_from_this(), pResponse);
+
   if (!http_should_keep_alive(&_parser)) {
     pResponse->closeAfterWritten();
 
@@ -556,20 +767,47 @@ void HttpRequest::_on_message_complete_complete(std::shared_ptr<HttpResponse> pR
   pResponse->writeResponse();
 }
 
+// Called when the application takes longer than the responseTimeout option to
+// produce a response. Sends a 504 and closes the connection, so that the
+// connection and request slot aren't held forever by a handler that never
+// finishes (for example, one that returns a promise which never resolves).
+void HttpRequest::_on_response_timeout(uv_timer_t* timer) {
+  ASSERT_BACKGROUND_THREAD()
+  debug_log("HttpRequest::_on_response_timeout", LOG_INFO);
+
+  if (_is_closing || !_handling_request)
+    return;
+
+  _timed_out = true;
+  _releaseRequestSlot();
+
+  // Let R code that checks req$httpuv.cancelled() know that its result is no
+  // longer wanted.
+  _closed->store(true);
+
+  // Schedule on main thread:
+  //   _pWebApplication->onResponseTimeout(this)
+  invoke_later(
+    std::bind(&WebApplication::onResponseTimeout, _pWebApplication, shared_from_this())
+  );
+
+  std::shared_ptr<HttpResponse> pResponse = error_response(shared_from_this(), 504);
+  pResponse->closeAfterWritten();
+  uv_read_stop((uv_stream_t*)handle());
+  _ignoreNewData = true;
+  pResponse->writeResponse();
+}
+
 
 // ============================================================================
 // Incoming websocket messages
 // ============================================================================
 
 // Called from WebSocketConnection::onFrameComplete
-void HttpRequest::onWSMessage(bool binary, const char* data, size_t len) {
+void HttpRequest::onWSMessage(bool binary, std::shared_ptr<std::vector<char> > data) {
   ASSERT_BACKGROUND_THREAD()
   debug_log("HttpRequest::onWSMessage", LOG_DEBUG);
 
-  // Copy data because the source data is deleted right after calling this
-  // function.
-  std::shared_ptr<std::vector<char> > buf = std::make_shared<std::vector<char> >(data, data + len);
-
   std::function<void (void)> error_callback(
     std::bind(&HttpRequest::schedule_close, shared_from_this())
   );
@@ -582,18 +820,109 @@ void HttpRequest::onWSMessage(bool binary, const char* data, size_t len) {
     return;
   }
 
+  size_t bytes = data->size();
+  _wsPendingMessages++;
+  _wsPendingBytes += bytes;
+  _pWebApplication->getWSFlowControl().messageQueued(bytes);
+
   // Schedule:
-  // _pWebApplication->onWSMessage(p_wsc, binary, data, len);
+  // this->_call_r_on_ws_message(p_wsc, binary, data);
   invoke_later(
     std::bind(
-      &WebApplication::onWSMessage,
-      _pWebApplication,
+      &HttpRequest::_call_r_on_ws_message,
+      shared_from_this(),
       p_wsc,
       binary,
-      buf,
-      error_callback
+      data
     )
   );
+
+  // The rest of the data from this read is still parsed, so the limits can
+  // be overshot by a little.
+  if (!_wsReadPaused && _wsPendingOverLimit(false)) {
+    _pauseWSRead();
+  }
+}
+
+void HttpRequest::_call_r_on_ws_message(std::shared_ptr<WebSocketConnection> p_wsc,
+                                        bool binary,
+                                        std::shared_ptr<std::vector<char> > data)
+{
+  ASSERT_MAIN_THREAD()
+  debug_log("HttpRequest::_call_r_on_ws_message", LOG_DEBUG);
+
+  std::function<void (void)> error_callback(
+    std::bind(&HttpRequest::schedule_close, shared_from_this())
+  );
+
+  // R may hold on to the buffer (see ws_message_to_r()), but the size
+  // doesn't change.
+  size_t bytes = data->size();
+  _pWebApplication->onWSMessage(p_wsc, binary, data, error_callback);
+
+  // Schedule on background thread:
+  // this->_on_ws_message_handled(bytes)
+  _background_queue->push(
+    std::bind(&HttpRequest::_on_ws_message_handled, shared_from_this(), bytes)
+  );
+}
+
+void HttpRequest::_on_ws_message_handled(size_t bytes) {
+  ASSERT_BACKGROUND_THREAD()
+  _wsPendingMessages--;
+  _wsPendingBytes -= bytes;
+
+  // Other connections may be waiting on the server's limits, not just this
+  // one on its own, but they only need to be checked when the server's
+  // totals have come down far enough.
+  WSFlowControl& flowControl = _pWebApplication->getWSFlowControl();
+  if (flowControl.messageDelivered(bytes)) {
+    flowControl.resumePaused();
+  } else if (_wsReadPaused) {
+    resumeWSRead();
+  }
+}
+
+bool HttpRequest::_wsPendingOverLimit(bool paused) {
+  ASSERT_BACKGROUND_THREAD()
+  return
+    ws_pending_over_limit(_wsPendingMessages, _wsMaxPendingMessages, paused) ||
+    ws_pending_over_limit(_wsPendingBytes, _wsMaxPendingBytes, paused) ||
+    _pWebApplication->getWSFlowControl().overLimit(paused);
+}
+
+void HttpRequest::_pauseWSRead() {
+  ASSERT_BACKGROUND_THREAD()
+  if (_wsReadPaused || _is_closing)
+    return;
+
+  debug_log("HttpRequest::_pauseWSRead", LOG_DEBUG);
+  uv_read_stop((uv_stream_t*)handle());
+  _wsReadPaused = true;
+  _pWebApplication->getWSFlowControl().addPaused(shared_from_this());
+}
+
+void HttpRequest::resumeWSRead() {
+  ASSERT_BACKGROUND_THREAD()
+  if (!_wsReadPaused || _wsPendingOverLimit(true))
+    return;
+
+  debug_log("HttpRequest::resumeWSRead", LOG_DEBUG);
+  _wsReadPaused = false;
+  _pWebApplication->getWSFlowControl().removePaused(this);
+
+  if (_is_closing || _ignoreNewData)
+    return;
+
+  int r = uv_read_start(handle(), &on_alloc, &HttpRequest_on_request_read);
+  if (r) {
+    debug_log(
+      std::string("HttpRequest::resumeWSRead error: [uv_read_start] ") +
+        uv_strerror(r),
+      LOG_INFO
+    );
+    close();
+  }
 }
 
 void HttpRequest::onWSClose(int code) {
@@ -605,43 +934,114 @@ void HttpRequest::onWSClose(int code) {
 // Outgoing websocket messages
 // ============================================================================
 
-typedef struct {
-  uv_write_t writeReq;
-  std::vector<char>* pHeader;
-  std::vector<char>* pData;
-  std::vector<char>* pFooter;
-} ws_send_t;
-
-void on_ws_message_sent(uv_write_t* handle, int status) {
+void on_ws_frame_sent(uv_write_t* handle, int status) {
   ASSERT_BACKGROUND_THREAD()
-  debug_log("on_ws_message_sent", LOG_DEBUG);
+  debug_log("on_ws_frame_sent", LOG_DEBUG);
   // TODO: Handle error if status != 0
-  ws_send_t* pSend = (ws_send_t*)handle;
-  delete pSend->pHeader;
-  delete pSend->pData;
-  delete pSend->pFooter;
-  free(pSend);
+  HttpRequest* pRequest = (HttpRequest*)handle->handle->data;
+  ws_frame_free((ws_frame_t*)handle);
+  pRequest->_on_ws_write(status);
 }
 
-void HttpRequest::sendWSFrame(const char* pHeader, size_t headerSize,
-                              const char* pData, size_t dataSize,
-                              const char* pFooter, size_t footerSize) {
+void HttpRequest::sendWSFrame(ws_frame_t* pFrame) {
   ASSERT_BACKGROUND_THREAD()
   debug_log("HttpRequest::sendWSFrame", LOG_DEBUG);
-  ws_send_t* pSend = (ws_send_t*)malloc(sizeof(ws_send_t));
-  memset(pSend, 0, sizeof(ws_send_t));
-  pSend->pHeader = new std::vector<char>(pHeader, pHeader + headerSize);
-  pSend->pData = new std::vector<char>(pData, pData + dataSize);
-  pSend->pFooter = new std::vector<char>(pFooter, pFooter + footerSize);
+
+  uv_buf_t buf = ws_frame_buf(pFrame);
+  int r = uv_write(&pFrame->writeReq, (uv_stream_t*)handle(), &buf, 1,
+                   &on_ws_frame_sent);
+  if (r) {
+    debug_log(
+      std::string("HttpRequest::sendWSFrame error: ") + uv_strerror(r),
+      LOG_INFO
+    );
+    ws_frame_free(pFrame);
+  }
+}
+
+// A write of a payload that's shared with other connections; only the
+// header and footer belong to this write.
+struct ws_shared_send_t {
+  uv_write_t writeReq;
+  char header[MAX_HEADER_BYTES];
+  char footer[MAX_FOOTER_BYTES];
+  std::shared_ptr<const std::vector<char> > payload;
+};
+
+void on_ws_shared_frame_sent(uv_write_t* handle, int status) {
+  ASSERT_BACKGROUND_THREAD()
+  debug_log("on_ws_shared_frame_sent", LOG_DEBUG);
+  HttpRequest* pRequest = (HttpRequest*)handle->handle->data;
+  delete (ws_shared_send_t*)handle->data;
+  pRequest->_on_ws_write(status);
+}
+
+void HttpRequest::sendWSSharedFrame(const char* pHeader, size_t headerSize,
+                                    std::shared_ptr<const std::vector<char> > payload,
+                                    const char* pFooter, size_t footerSize) {
+  ASSERT_BACKGROUND_THREAD()
+  debug_log("HttpRequest::sendWSSharedFrame", LOG_DEBUG);
+  ws_shared_send_t* pSend = new ws_shared_send_t();
+  pSend->writeReq.data = pSend;
+  memcpy(pSend->header, pHeader, headerSize);
+  memcpy(pSend->footer, pFooter, footerSize);
+  pSend->payload = payload;
 
   uv_buf_t buffers[3];
-  buffers[0] = uv_buf_init(safe_vec_addr(*pSend->pHeader), pSend->pHeader->size());
-  buffers[1] = uv_buf_init(safe_vec_addr(*pSend->pData), pSend->pData->size());
-  buffers[2] = uv_buf_init(safe_vec_addr(*pSend->pFooter), pSend->pFooter->size());
+  unsigned int nbufs = 0;
+  buffers[nbufs++] = uv_buf_init(pSend->header, headerSize);
+  if (!payload->empty()) {
+    buffers[nbufs++] = uv_buf_init(const_cast<char*>(&(*payload)[0]), payload->size());
+  }
+  if (footerSize > 0) {
+    buffers[nbufs++] = uv_buf_init(pSend->footer, footerSize);
+  }
 
-  // TODO: Handle return code
-  uv_write(&pSend->writeReq, (uv_stream_t*)handle(), buffers, 3,
-           &on_ws_message_sent);
+  int r = uv_write(&pSend->writeReq, (uv_stream_t*)handle(), buffers, nbufs,
+                   &on_ws_shared_frame_sent);
+  if (r) {
+    debug_log(
+      std::string("HttpRequest::sendWSSharedFrame error: ") + uv_strerror(r),
+      LOG_INFO
+    );
+    delete pSend;
+  }
+}
+
+size_t HttpRequest::wsBufferedAmount() {
+  ASSERT_BACKGROUND_THREAD()
+  return handle()->write_queue_size;
+}
+
+// Called after each WebSocket frame has been written, or the write has been
+// cancelled because the connection is closing. The connection may then send
+// messages it held back, or report that it has drained.
+void HttpRequest::_on_ws_write(int status) {
+  ASSERT_BACKGROUND_THREAD()
+  std::shared_ptr<WebSocketConnection> p_wsc = _pWebSocketConnection;
+  if (!p_wsc || _is_closing) {
+    return;
+  }
+  p_wsc->onWritten();
+}
+
+void HttpRequest::onWSDrain() {
+  ASSERT_BACKGROUND_THREAD()
+  debug_log("HttpRequest::onWSDrain", LOG_DEBUG);
+  std::shared_ptr<WebSocketConnection> p_wsc = _pWebSocketConnection;
+  if (!p_wsc) {
+    return;
+  }
+
+  // Schedule:
+  // _pWebApplication->onWSDrain(p_wsc)
+  invoke_later(
+    std::bind(
+      &WebApplication::onWSDrain,
+      _pWebApplication,
+      p_wsc
+    )
+  );
 }
 
 void HttpRequest::closeWSSocket() {
@@ -690,10 +1090,20 @@ void HttpRequest::close() {
     return;
   }
   _is_closing = true;
+  _closed->store(true);
+  HTTPUV_PROBE1(connection__close, _connId);
+  _pWebApplication->getTrafficCapture().close(_pLoop, _connId);
+
+  _stopResponseTimer();
+  _releaseRequestSlot();
+  _finishCoalesced(std::shared_ptr<HttpResponse>());
 
   std::shared_ptr<WebSocketConnection> p_wsc = _pWebSocketConnection;
 
   if (p_wsc && _protocol == WebSockets) {
+    p_wsc->markLeftChannels();
+    ws_channels().removeConnection(p_wsc.get());
+
     // Schedule:
     // _pWebApplication->onWSClose(p_wsc)
     invoke_later(
@@ -705,6 +1115,11 @@ void HttpRequest::close() {
     );
   }
 
+  if (_wsReadPaused) {
+    _wsReadPaused = false;
+    _pWebApplication->getWSFlowControl().removePaused(this);
+  }
+
   _pSocket->removeConnection(shared_from_this());
 
   uv_close(toHandle(&_handle.stream), HttpRequest_on_closed);
@@ -799,6 +1214,32 @@ void HttpRequest::_parse_http_data(char* buffer, const ssize_t n) {
         auto_deleter_background<HttpResponse>
       );
 
+      std::shared_ptr<const ServerOptions> pServerOptions =
+        _pWebApplication->getServerOptions();
+      const ServerOptions& serverOptions = *pServerOptions;
+      WSConnectionOptions wsOptions;
+      wsOptions.maxMessageSize = serverOptions.wsMaxMessageSize;
+      wsOptions.deflate.enabled = serverOptions.wsCompression;
+      wsOptions.deflate.level = serverOptions.wsCompressionLevel;
+      wsOptions.deflate.windowBits = serverOptions.wsCompressionWindowBits;
+      wsOptions.deflate.contextTakeover = serverOptions.wsCompressionContextTakeover;
+      wsOptions.highWaterMark = serverOptions.wsHighWaterMark;
+      if (serverOptions.wsBackpressure == "drop_newest") {
+        wsOptions.backpressure = WS_BACKPRESSURE_DROP_NEWEST;
+      } else if (serverOptions.wsBackpressure == "drop_oldest") {
+        wsOptions.backpressure = WS_BACKPRESSURE_DROP_OLDEST;
+      } else if (serverOptions.wsBackpressure == "close") {
+        wsOptions.backpressure = WS_BACKPRESSURE_CLOSE;
+      }
+      p_wsc->setOptions(wsOptions);
+
+      _wsMaxPendingMessages = serverOptions.wsMaxPendingMessages;
+      _wsMaxPendingBytes = serverOptions.wsMaxPendingBytes;
+      _pWebApplication->getWSFlowControl().setLimits(
+        serverOptions.wsMaxPendingMessagesTotal,
+        serverOptions.wsMaxPendingBytesTotal
+      );
+
       std::vector<uint8_t> body;
       p_wsc->handshake(_url, _headers, &pData, &pDataLen,
                        &pResp->headers(), &body);
@@ -851,6 +1292,8 @@ void HttpRequest::_on_request_read(uv_stream_t*, ssize_t nread, const uv_buf_t*
   ASSERT_BACKGROUND_THREAD()
   if (nread > 0) {
     //std::cerr << nread << " bytes read\n";
+    _pWebApplication->getRequestMetrics().recordBytesReceived(nread);
+    _pWebApplication->getTrafficCapture().data(_pLoop, _connId, buf->base, nread);
     if (_ignoreNewData) {
       // Do nothing
     } else if (_protocol == HTTP) {
@@ -885,6 +1328,8 @@ void HttpRequest::_on_request_read(uv_stream_t*, ssize_t nread, const uv_buf_t*
 
 void HttpRequest::handleRequest() {
   ASSERT_BACKGROUND_THREAD()
+  HTTPUV_PROBE1(connection__accept, _connId);
+  _pWebApplication->getTrafficCapture().open(_pLoop, _connId);
   int r = uv_read_start(handle(), &on_alloc, &HttpRequest_on_request_read);
   if (r) {
     debug_log(
@@ -920,3 +1365,4 @@ IMPLEMENT_CALLBACK_3(HttpRequest, on_body, int, http_parser*, const char*, size_
 IMPLEMENT_CALLBACK_1(HttpRequest, on_message_complete, int, http_parser*)
 IMPLEMENT_CALLBACK_1(HttpRequest, on_closed, void, uv_handle_t*)
 IMPLEMENT_CALLBACK_3(HttpRequest, on_request_read, void, uv_stream_t*, ssize_t, const uv_buf_t*)
+IMPLEMENT_CALLBACK_1(HttpRequest, on_response_timeout, void, uv_timer_t*)
@@ -4,6 +4,7 @@
 #include <map>
 #include <iostream>
 
+#include <atomic>
 #include <functional>
 #include <memory>
 #include <uv.h>
@@ -21,6 +22,9 @@ enum Protocol {
   WebSockets
 };
 
+// Returns a new ID for each connection, used to identify it in trace probes.
+uint64_t next_connection_id();
+
 // HttpRequest is a bit of a misnomer -- a HttpRequest object represents a
 // single connection, on which multiple actual HTTP requests can be made.
 class HttpRequest : public WebSocketConnectionCallbacks,
@@ -58,6 +62,12 @@ private:
 
   bool _is_closing;
 
+  // Set when the connection is closed. Unlike _is_closing, this can be read
+  // from the main thread, so that calls into R for a request whose client
+  // has gone away can be skipped. It is a shared_ptr so that R code can hold
+  // on to it (see cancelledFlag()) after this object is gone.
+  std::shared_ptr<std::atomic<bool> > _closed;
+
   // This starts false, and in the case of a connection upgrade, gets set to
   // true after the headers are complete.
   bool _is_upgrade;
@@ -67,6 +77,44 @@ private:
   void _parse_http_data_from_buffer();
 
   bool _response_scheduled;
+  // True while this request counts against the server's maxPendingRequests
+  // limit; that is, from when it is passed to R until it gets a response.
+  bool _holds_request_slot;
+  bool _acquireRequestSlot();
+  void _releaseRequestSlot();
+
+  // Time (from uv_hrtime()) at which the most recent call into R for this
+  // request was put on the main thread's queue.
+  uint64_t _queued_at;
+  void _markQueued();
+
+  // Enforces the server's responseTimeout option. The timer runs from when
+  // the request is passed to the application's call() function until the
+  // response is ready. If it fires first, a 504 is sent, and _timed_out is
+  // set so that the application's response, if it ever arrives, is dropped.
+  uv_timer_t* _pResponseTimer;
+  bool _timed_out;
+  void _startResponseTimer();
+  void _stopResponseTimer();
+
+  // Passes the request to the application, on the main thread, unless too
+  // many requests are already waiting on R.
+  void _handleWithApplication();
+  // Called when this request is done with the application. Identical
+  // requests that were waiting on it (see the coalesceRequests option) get a
+  // copy of pResponse, or are passed to the application themselves if it
+  // can't be shared.
+  void _finishCoalesced(std::shared_ptr<HttpResponse> pResponse);
+
+  // Identifies the connection in trace probes (see probes.h).
+  uint64_t _connId;
+
+  // For the server's request metrics. _accepted_at is when the connection was
+  // accepted, and is used as the start time of the first request on it.
+  uint64_t _accepted_at;
+  RequestTimings _timings;
+  ResponseSource _responseSource;
+
   // True when the HttpRequest object is handling an HTTP request; gets set to
   // false when the response is written.
   bool _handling_request;
@@ -92,6 +140,20 @@ private:
   };
   LastHeaderState _last_header_state;
 
+  // Incoming WebSocket messages on this connection which have been passed to
+  // R but not yet handled, and their total size. When these (or the totals
+  // for the server) reach the wsMaxPending* options, the connection stops
+  // reading until R catches up.
+  uint64_t _wsPendingMessages;
+  uint64_t _wsPendingBytes;
+  // The per-connection wsMaxPending* options, copied at the upgrade so that
+  // they don't have to be looked up for each message. Negative for no limit.
+  double _wsMaxPendingMessages;
+  double _wsMaxPendingBytes;
+  bool _wsReadPaused;
+  bool _wsPendingOverLimit(bool paused);
+  void _pauseWSRead();
+
 public:
   HttpRequest(uv_loop_t* pLoop,
               std::shared_ptr<WebApplication> pWebApplication,
@@ -103,10 +165,22 @@ public:
       _protocol(HTTP),
       _ignoreNewData(false),
       _is_closing(false),
+      _closed(std::make_shared<std::atomic<bool> >(false)),
       _is_upgrade(false),
       _response_scheduled(false),
+      _holds_request_slot(false),
+      _queued_at(0),
+      _timed_out(false),
+      _connId(next_connection_id()),
+      _accepted_at(uv_hrtime()),
+      _responseSource(SOURCE_R),
       _handling_request(false),
-      _background_queue(backgroundQueue)
+      _background_queue(backgroundQueue),
+      _wsPendingMessages(0),
+      _wsPendingBytes(0),
+      _wsMaxPendingMessages(-1),
+      _wsMaxPendingBytes(-1),
+      _wsReadPaused(false)
   {
     ASSERT_BACKGROUND_THREAD()
     uv_tcp_init(pLoop, &_handle.tcp);
@@ -119,15 +193,24 @@ public:
     _parser.data = this;
 
     _last_header_state = START;
+
+    _pResponseTimer = static_cast<uv_timer_t*>(malloc(sizeof(uv_timer_t)));
+    uv_timer_init(pLoop, _pResponseTimer);
+    _pResponseTimer->data = this;
   }
 
   virtual ~HttpRequest() {
     ASSERT_BACKGROUND_THREAD()
     debug_log("HttpRequest::~HttpRequest", LOG_DEBUG);
+    // calling uv_close() on a timer implicitly calls uv_timer_stop()
+    uv_close(toHandle(_pResponseTimer), freeAfterClose);
     _pWebSocketConnection.reset();
   }
 
   uv_stream_t* handle();
+  uint64_t connId() const {
+    return _connId;
+  }
   std::shared_ptr<WebSocketConnection> websocket() const {
     return _pWebSocketConnection;
   }
@@ -139,18 +222,27 @@ public:
 
   std::string method() const;
   std::string url() const;
+  // For example, "1.1".
+  std::string httpVersion() const;
   const RequestHeaders& headers() const;
 
   bool hasHeader(const std::string& name) const;
   bool hasHeader(const std::string& name, const std::string& value, bool ci = false) const;
   std::string getHeader(const std::string& name) const;
 
+  // Has the connection been closed? Safe to call from either thread.
+  bool isClosed() const;
+  std::shared_ptr<std::atomic<bool> > cancelledFlag() const;
+
   // Is the request an Upgrade (i.e. WebSocket connection)?
   bool isUpgrade() const;
 
-  void sendWSFrame(const char* pHeader, size_t headerSize,
-                   const char* pData, size_t dataSize,
-                   const char* pFooter, size_t footerSize);
+  void sendWSFrame(ws_frame_t* pFrame);
+  void sendWSSharedFrame(const char* pHeader, size_t headerSize,
+                         std::shared_ptr<const std::vector<char> > payload,
+                         const char* pFooter, size_t footerSize);
+  size_t wsBufferedAmount();
+  void onWSDrain();
   void closeWSSocket();
 
   // Call this function from the main thread to indicate that a response has
@@ -165,8 +257,22 @@ public:
   // (when the response has been sent). It is currently used to detect
   // pipelined HTTP requests.
   void requestCompleted();
+  // Called by HttpResponse when the whole response has been written.
+  void responseWritten(const ResponseStats& stats);
+
+  // How long (in nanoseconds) the most recent call into R for this request
+  // has been waiting in the main thread's queue. Meant to be called at the
+  // start of that call.
+  uint64_t queueWait() const;
 
   void _call_r_on_ws_open();
+  void _call_r_on_ws_message(std::shared_ptr<WebSocketConnection> p_wsc,
+                             bool binary,
+                             std::shared_ptr<std::vector<char> > data);
+  void _on_ws_message_handled(size_t bytes);
+  // Starts reading again after _pauseWSRead(), if the connection and server
+  // are back within their limits.
+  void resumeWSRead();
   void _schedule_on_headers_complete_complete(std::shared_ptr<HttpResponse> pResponse);
   void _on_headers_complete_complete(std::shared_ptr<HttpResponse> pResponse);
   void _schedule_on_body_error(std::shared_ptr<HttpResponse> pResponse);
@@ -185,7 +291,7 @@ public:
   virtual int _on_body(http_parser* pParser, const char* pAt, size_t length);
   virtual int _on_message_complete(http_parser* pParser);
 
-  virtual void onWSMessage(bool binary, const char* data, size_t len);
+  virtual void onWSMessage(bool binary, std::shared_ptr<std::vector<char> > data);
   virtual void onWSClose(int code);
 
   // Update whether or not this HttpRequest is to be upgraded. This is called
@@ -197,6 +303,8 @@ public:
   void schedule_close();
   void _on_request_read(uv_stream_t*, ssize_t nread, const uv_buf_t* buf);
   void _on_response_write(int status);
+  void _on_ws_write(int status);
+  void _on_response_timeout(uv_timer_t* timer);
 
   void _initializeSocket() {
     // Coerce to parent class
@@ -205,7 +313,7 @@ public:
     );
 
     _pWebSocketConnection = std::shared_ptr<WebSocketConnection>(
-      new WebSocketConnection(this->_pLoop, this_base),
+      new WebSocketConnection(this->_pLoop, this_base, _connId),
       auto_deleter_background<WebSocketConnection>
     );
 
@@ -256,6 +364,7 @@ DECLARE_CALLBACK_1(HttpRequest, on_message_complete, int, http_parser*)
 DECLARE_CALLBACK_1(HttpRequest, on_closed, void, uv_handle_t*)
 DECLARE_CALLBACK_3(HttpRequest, on_request_read, void, uv_stream_t*, ssize_t, const uv_buf_t*)
 DECLARE_CALLBACK_2(HttpRequest, on_response_write, void, uv_write_t*, int)
+DECLARE_CALLBACK_1(HttpRequest, on_response_timeout, void, uv_timer_t*)
 
 
 #endif // HTTPREQUEST_HPP
@@ -4,7 +4,10 @@
 #include "thread.h"
 #include "utils.h"
 #include "gzipdatasource.h"
+#include "probes.h"
 #include <uv.h>
+#include <iomanip>
+#include <sstream>
 
 
 void on_response_written(uv_write_t* handle, int status) {
@@ -19,14 +22,59 @@ void on_response_written(uv_write_t* handle, int status) {
 }
 
 
+// Writes headers other than Content-Length, whose value is returned in
+// `pContentLength` instead. Sets `pContentEncoding` if there is a
+// Content-Encoding header.
+static void write_headers(std::ostream& os, const ResponseHeaders& headers,
+                          bool* pContentEncoding, std::string* pContentLength)
+{
+  for (ResponseHeaders::const_iterator it = headers.begin();
+     it != headers.end();
+     it++) {
+    if (strcasecmp(it->first.c_str(), "Content-Length") == 0) {
+      *pContentLength = it->second;
+    } else {
+      os << it->first << ": " << it->second << "\r\n";
+      if (strcasecmp(it->first.c_str(), "Content-Encoding") == 0) {
+        *pContentEncoding = true;
+      }
+    }
+  }
+}
+
+ResponseHead::ResponseHead(int statusCode, const std::string& status,
+                           const ResponseHeaders& headers)
+  : statusCode(statusCode), contentEncoding(false)
+{
+  std::ostringstream head(std::ios_base::binary);
+  head << "HTTP/1.1 " << statusCode << " " << status << "\r\n";
+  write_headers(head, headers, &contentEncoding, &contentLength);
+  data = head.str();
+}
+
+
+int HttpResponse::statusCode() const {
+  return _statusCode;
+}
+
 ResponseHeaders& HttpResponse::headers() {
   return _headers;
 }
 
+std::shared_ptr<DataSource> HttpResponse::body() const {
+  return _pBody;
+}
+
 void HttpResponse::addHeader(const std::string& name, const std::string& value) {
   _headers.push_back(std::pair<std::string, std::string>(name, value));
 }
 
+void HttpResponse::addServerTiming(const std::string& name, uint64_t ns) {
+  std::ostringstream entry;
+  entry << name << ";dur=" << std::fixed << std::setprecision(3) << ns / 1e6;
+  _serverTiming.push_back(entry.str());
+}
+
 // Set a header to a particular value. If the header already exists, delete
 // it, and add the header with the new value. The new header will be the last
 // item.
@@ -54,6 +102,7 @@ public:
       ExtendedWrite(pHandle, pDataSource, chunked), _pParent(pParent) {}
 
   void onWriteComplete(int status) {
+    _pParent->onBodyWritten(status, bytesWritten());
     delete this;
   }
 };
@@ -63,20 +112,27 @@ void HttpResponse::writeResponse() {
   debug_log("HttpResponse::writeResponse", LOG_DEBUG);
   // TODO: Optimize
   std::ostringstream response(std::ios_base::binary);
-  response << "HTTP/1.1 " << _statusCode << " " << _status << "\r\n";
   bool contentEncoding = false;
   std::string contentLength;
-  for (ResponseHeaders::const_iterator it = _headers.begin();
-     it != _headers.end();
-     it++) {
-    if (strcasecmp(it->first.c_str(), "Content-Length") == 0) {
-      contentLength = it->second;
-    } else {
-      response << it->first << ": " << it->second << "\r\n";
-      if (strcasecmp(it->first.c_str(), "Content-Encoding") == 0) {
-        contentEncoding = true;
+  if (_pHead) {
+    // The status line and fixed headers are written from _pHead's buffer,
+    // ahead of this one.
+    contentEncoding = _pHead->contentEncoding;
+    contentLength = _pHead->contentLength;
+  } else {
+    response << "HTTP/1.1 " << _statusCode << " " << _status << "\r\n";
+  }
+  write_headers(response, _headers, &contentEncoding, &contentLength);
+
+  if (!_serverTiming.empty()) {
+    response << "Server-Timing: ";
+    for (size_t i = 0; i < _serverTiming.size(); i++) {
+      if (i > 0) {
+        response << ", ";
       }
+      response << _serverTiming[i];
     }
+    response << "\r\n";
   }
 
   // Determine if gzip compression should be used
@@ -104,6 +160,7 @@ void HttpResponse::writeResponse() {
   }
 
   if (gzip) {
+    _stats.gzipInputBytes = _pBody->size();
     response << "Content-Encoding: gzip\r\n";
     _chunked = true;
     _pBody = std::make_shared<GZipDataSource>(_pBody);
@@ -144,13 +201,26 @@ void HttpResponse::writeResponse() {
     }
   }
 
-  uv_buf_t headerBuf = uv_buf_init(safe_vec_addr(_responseHeader), _responseHeader.size());
+  uv_buf_t headerBufs[2];
+  unsigned int nHeaderBufs = 0;
+  if (_pHead) {
+    headerBufs[nHeaderBufs++] = uv_buf_init(const_cast<char*>(_pHead->data.data()),
+                                            _pHead->data.size());
+  }
+  headerBufs[nHeaderBufs++] = uv_buf_init(safe_vec_addr(_responseHeader),
+                                          _responseHeader.size());
+
+  _stats.status = _statusCode;
+  _stats.headerBytes = _responseHeader.size() + (_pHead ? _pHead->data.size() : 0);
+  HTTPUV_PROBE3(response__write__start, _pRequest->connId(), _statusCode,
+                _stats.headerBytes);
+
   uv_write_t* pWriteReq = (uv_write_t*)malloc(sizeof(uv_write_t));
   memset(pWriteReq, 0, sizeof(uv_write_t));
   // Pointer to shared_ptr
   pWriteReq->data = new std::shared_ptr<HttpResponse>(shared_from_this());
 
-  int r = uv_write(pWriteReq, _pRequest->handle(), &headerBuf, 1,
+  int r = uv_write(pWriteReq, _pRequest->handle(), headerBufs, nHeaderBufs,
       &on_response_written);
   if (r) {
     debug_log(std::string("uv_write() error:") + uv_strerror(r), LOG_INFO);
@@ -170,11 +240,27 @@ void HttpResponse::onResponseWritten(int status) {
     return;
   }
 
+  _stats.firstByte = uv_hrtime();
+
   if (_pBody != NULL) {
     HttpResponseExtendedWrite* pResponseWrite = new HttpResponseExtendedWrite(
       shared_from_this(), _pRequest->handle(), _pBody, this->_chunked);
     pResponseWrite->begin();
+  } else {
+    onBodyWritten(0, 0);
+  }
+}
+
+// Called when the whole response has been written.
+void HttpResponse::onBodyWritten(int status, uint64_t bytes) {
+  ASSERT_BACKGROUND_THREAD()
+  if (status != 0) {
+    return;
   }
+  _stats.bodyBytes = bytes;
+  _stats.lastByte = uv_hrtime();
+  HTTPUV_PROBE3(response__write__done, _pRequest->connId(), _statusCode, bytes);
+  _pRequest->responseWritten(_stats);
 }
 
 // This sets a flag so that the connection is closed after the response is
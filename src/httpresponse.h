@@ -6,19 +6,41 @@
 #include "uvutil.h"
 #include "utils.h"
 #include "constants.h"
+#include "requestmetrics.h"
 
 class HttpRequest;
 
+// A status line and headers which are the same for many responses, such as
+// those for a Route, serialized once and shared by all of them. Content-Length
+// is kept apart, since gzip replaces it with chunked encoding.
+struct ResponseHead {
+  int statusCode;
+  std::string data;
+  bool contentEncoding;
+  std::string contentLength;
+
+  ResponseHead(int statusCode, const std::string& status,
+               const ResponseHeaders& headers);
+};
+
 class HttpResponse : public std::enable_shared_from_this<HttpResponse>  {
 
   std::shared_ptr<HttpRequest> _pRequest;
   int _statusCode;
   std::string _status;
+  // If set, this is sent in place of the status line, followed by _headers.
+  std::shared_ptr<const ResponseHead> _pHead;
   ResponseHeaders _headers;
   std::vector<char> _responseHeader;
   std::shared_ptr<DataSource> _pBody;
   bool _closeAfterWritten;
   bool _chunked;
+  // Filled in as the response is written, and passed to the request when
+  // it's done.
+  ResponseStats _stats;
+  // Entries for the Server-Timing header, like "app;dur=12.3". The header is
+  // only sent if there are any.
+  std::vector<std::string> _serverTiming;
 
 public:
   HttpResponse(std::shared_ptr<HttpRequest> pRequest,
@@ -35,13 +57,32 @@ public:
     _headers.push_back(std::make_pair("Date", http_date_string(time(NULL))));
   }
 
+  HttpResponse(std::shared_ptr<HttpRequest> pRequest,
+               std::shared_ptr<const ResponseHead> pHead,
+               std::shared_ptr<DataSource> pBody)
+    : _pRequest(pRequest),
+      _statusCode(pHead->statusCode),
+      _pHead(pHead),
+      _pBody(pBody),
+      _closeAfterWritten(false),
+      _chunked(false)
+  {
+    _headers.push_back(std::make_pair("Date", http_date_string(time(NULL))));
+  }
+
   ~HttpResponse();
+  int statusCode() const;
   ResponseHeaders& headers();
+  std::shared_ptr<DataSource> body() const;
 
   void addHeader(const std::string& name, const std::string& value);
   void setHeader(const std::string& name, const std::string& value);
+  // Add an entry to the Server-Timing header. `ns` is a duration in
+  // nanoseconds.
+  void addServerTiming(const std::string& name, uint64_t ns);
   void writeResponse();
   void onResponseWritten(int status);
+  void onBodyWritten(int status, uint64_t bytes);
   void closeAfterWritten();
 };
 
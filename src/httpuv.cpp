@@ -5,6 +5,8 @@
 #include <iomanip>
 #include <signal.h>
 #include <errno.h>
+#include <atomic>
+#include <algorithm>
 #include <functional>
 #include <memory>
 #include <uv.h>
@@ -18,6 +20,11 @@
 #include "httpuv.h"
 #include "auto_deleter.h"
 #include "socket.h"
+#include "loopmonitor.h"
+#include "loadgen.h"
+#include "replay.h"
+#include "broadcast.h"
+#include "channels.h"
 #include <Rinternals.h>
 
 
@@ -124,6 +131,8 @@ void io_thread(void* data) {
   // Set up async communication channels
   uv_async_init(io_loop.get(), &async_stop_io_loop, stop_io_loop);
 
+  get_loop_monitor().attach(io_loop.get());
+
   // Tell other thread that it can continue.
   blocker->wait();
 
@@ -147,6 +156,37 @@ void io_thread(void* data) {
   delete background_queue;
 }
 
+// SIGHUP handler for the accessLogReopenSignal option. It is only started
+// once a server asks for it, because it replaces the default action for
+// SIGHUP, which is to terminate the process. Once started, it runs until the
+// I/O loop stops.
+uv_signal_t access_log_signal;
+
+void on_access_log_signal(uv_signal_t* handle, int signum) {
+  ASSERT_BACKGROUND_THREAD()
+  debug_log("on_access_log_signal", LOG_INFO);
+  AccessLog::signalReceived();
+}
+
+void watch_access_log_signal() {
+  ASSERT_BACKGROUND_THREAD()
+#ifndef _WIN32
+  if (uv_is_active((uv_handle_t*)&access_log_signal)) {
+    return;
+  }
+  uv_signal_init(io_loop.get(), &access_log_signal);
+  uv_signal_start(&access_log_signal, on_access_log_signal, SIGHUP);
+  uv_unref((uv_handle_t*)&access_log_signal);
+#endif
+}
+
+void update_access_log_signal(std::shared_ptr<WebApplication> pWebApplication) {
+  ASSERT_MAIN_THREAD()
+  if (pWebApplication->getAccessLog().reopenOnSignal()) {
+    background_queue->push(watch_access_log_signal);
+  }
+}
+
 void ensure_io_thread() {
   ASSERT_MAIN_THREAD()
   if (io_thread_running.get()) {
@@ -187,38 +227,31 @@ void sendWSMessage(SEXP conn,
              true> conn_xptr(conn);
   std::shared_ptr<WebSocketConnection> wsc = internalize_shared_ptr(conn_xptr);
 
+  // The message is copied once, into the frame that will be written to the
+  // socket; the background thread fills in the frame header and frees it
+  // after the write.
   Opcode mode;
-  SEXP msg_sexp;
-  std::vector<char>* str;
-
-  // Efficiently copy message into a new vector<char>. There's probably a
-  // cleaner way to do this.
-   if (binary) {
+  ws_frame_t* pFrame;
+  if (binary) {
     mode = Binary;
-    msg_sexp = PROTECT(Rcpp::as<SEXP>(message));
-    str = new std::vector<char>(RAW(msg_sexp), RAW(msg_sexp) + Rf_length(msg_sexp));
-    UNPROTECT(1);
-
+    SEXP msg_sexp = message;
+    pFrame = ws_frame_alloc(Rf_xlength(msg_sexp));
+    if (pFrame->payloadLength > 0) {
+      memcpy(ws_frame_payload(pFrame), RAW(msg_sexp), pFrame->payloadLength);
+    }
   } else {
     mode = Text;
-    msg_sexp = PROTECT(STRING_ELT(message, 0));
-    str = new std::vector<char>(CHAR(msg_sexp), CHAR(msg_sexp) + Rf_length(msg_sexp));
-    UNPROTECT(1);
+    SEXP msg_sexp = STRING_ELT(message, 0);
+    pFrame = ws_frame_alloc(Rf_length(msg_sexp));
+    if (pFrame->payloadLength > 0) {
+      memcpy(ws_frame_payload(pFrame), CHAR(msg_sexp), pFrame->payloadLength);
+    }
   }
 
-
-  std::function<void (void)> cb(
-    std::bind(&WebSocketConnection::sendWSMessage, wsc,
-      mode,
-      safe_vec_addr(*str),
-      str->size()
-    )
+  wsc->messageQueued(pFrame->payloadLength);
+  background_queue->push(
+    std::bind(&WebSocketConnection::sendQueuedWSFrame, wsc, mode, pFrame)
   );
-
-  background_queue->push(cb);
-  // Free str after data is written
-  // deleter_background<std::vector<char>>(str)
-  background_queue->push(std::bind(deleter_background<std::vector<char> >, str));
 }
 
 // [[Rcpp::export]]
@@ -241,6 +274,147 @@ void closeWS(SEXP conn,
   );
 }
 
+// The number of bytes of messages which are waiting to be sent. This is
+// updated by the background thread as writes finish, so it may be a little
+// out of date.
+// [[Rcpp::export]]
+double wsBufferedAmount_(SEXP conn) {
+  ASSERT_MAIN_THREAD()
+  Rcpp::XPtr<std::shared_ptr<WebSocketConnection>,
+             Rcpp::PreserveStorage,
+             auto_deleter_background<std::shared_ptr<WebSocketConnection> >,
+             true> conn_xptr(conn);
+  std::shared_ptr<WebSocketConnection> wsc = internalize_shared_ptr(conn_xptr);
+  return (double)wsc->bufferedAmountSnapshot();
+}
+
+// Sends one message to many connections. The message is copied once, and a
+// single callback fans it out on the background thread.
+// [[Rcpp::export]]
+void broadcastWS_(Rcpp::List conns,
+                  bool binary,
+                  Rcpp::RObject message,
+                  double maxBuffered,
+                  bool closeSlow)
+{
+  ASSERT_MAIN_THREAD()
+  debug_log("broadcastWS_", LOG_DEBUG);
+
+  std::vector<std::shared_ptr<WebSocketConnection> > wscs;
+  wscs.reserve(conns.size());
+  for (int i = 0; i < conns.size(); i++) {
+    SEXP conn = conns[i];
+    Rcpp::XPtr<std::shared_ptr<WebSocketConnection>,
+               Rcpp::PreserveStorage,
+               auto_deleter_background<std::shared_ptr<WebSocketConnection> >,
+               true> conn_xptr(conn);
+    wscs.push_back(internalize_shared_ptr(conn_xptr));
+  }
+
+  Opcode mode;
+  std::shared_ptr<std::vector<char> > payload;
+  if (binary) {
+    mode = Binary;
+    SEXP msg_sexp = message;
+    payload = std::make_shared<std::vector<char> >(
+      RAW(msg_sexp), RAW(msg_sexp) + Rf_xlength(msg_sexp));
+  } else {
+    mode = Text;
+    SEXP msg_sexp = STRING_ELT(message, 0);
+    payload = std::make_shared<std::vector<char> >(
+      CHAR(msg_sexp), CHAR(msg_sexp) + Rf_length(msg_sexp));
+  }
+
+  BroadcastOptions options;
+  if (maxBuffered >= 0) {
+    options.maxBuffered = (size_t)maxBuffered;
+  }
+  options.slowConsumer = closeSlow ? SLOW_CONSUMER_CLOSE : SLOW_CONSUMER_SKIP;
+
+  background_queue->push(
+    std::bind(broadcast_ws_message, wscs, mode,
+              std::shared_ptr<const std::vector<char> >(payload), options)
+  );
+}
+
+
+// ============================================================================
+// WebSocket channels
+// ============================================================================
+
+// [[Rcpp::export]]
+void subscribeWS_(SEXP conn, std::vector<std::string> channels) {
+  ASSERT_MAIN_THREAD()
+  Rcpp::XPtr<std::shared_ptr<WebSocketConnection>,
+             Rcpp::PreserveStorage,
+             auto_deleter_background<std::shared_ptr<WebSocketConnection> >,
+             true> conn_xptr(conn);
+  std::shared_ptr<WebSocketConnection> wsc = internalize_shared_ptr(conn_xptr);
+
+  background_queue->push(
+    std::bind(&ChannelManager::subscribe, &ws_channels(), wsc, channels)
+  );
+}
+
+// [[Rcpp::export]]
+void unsubscribeWS_(SEXP conn, std::vector<std::string> channels) {
+  ASSERT_MAIN_THREAD()
+  Rcpp::XPtr<std::shared_ptr<WebSocketConnection>,
+             Rcpp::PreserveStorage,
+             auto_deleter_background<std::shared_ptr<WebSocketConnection> >,
+             true> conn_xptr(conn);
+  std::shared_ptr<WebSocketConnection> wsc = internalize_shared_ptr(conn_xptr);
+
+  background_queue->push(
+    std::bind(&ChannelManager::unsubscribe, &ws_channels(), wsc, channels)
+  );
+}
+
+// [[Rcpp::export]]
+void publishWS_(std::string channel,
+                bool binary,
+                Rcpp::RObject message,
+                double maxBuffered,
+                bool closeSlow)
+{
+  ASSERT_MAIN_THREAD()
+  if (background_queue == NULL) {
+    // No server has been started, so there can't be any subscribers.
+    return;
+  }
+
+  Opcode mode;
+  std::shared_ptr<std::vector<char> > payload;
+  if (binary) {
+    mode = Binary;
+    SEXP msg_sexp = message;
+    payload = std::make_shared<std::vector<char> >(
+      RAW(msg_sexp), RAW(msg_sexp) + Rf_xlength(msg_sexp));
+  } else {
+    mode = Text;
+    SEXP msg_sexp = STRING_ELT(message, 0);
+    payload = std::make_shared<std::vector<char> >(
+      CHAR(msg_sexp), CHAR(msg_sexp) + Rf_length(msg_sexp));
+  }
+
+  BroadcastOptions options;
+  if (maxBuffered >= 0) {
+    options.maxBuffered = (size_t)maxBuffered;
+  }
+  options.slowConsumer = closeSlow ? SLOW_CONSUMER_CLOSE : SLOW_CONSUMER_SKIP;
+
+  background_queue->push(
+    std::bind(&ChannelManager::publish, &ws_channels(), channel, mode,
+              std::shared_ptr<const std::vector<char> >(payload), options)
+  );
+}
+
+// [[Rcpp::export]]
+Rcpp::List wsChannels_() {
+  ASSERT_MAIN_THREAD()
+  return ws_channels().statsAsRObject();
+}
+
 
 // ============================================================================
 // Create/stop servers
@@ -254,8 +428,11 @@ Rcpp::RObject makeTcpServer(const std::string& host, int port,
                             Rcpp::Function onWSOpen,
                             Rcpp::Function onWSMessage,
                             Rcpp::Function onWSClose,
+                            Rcpp::Function onWSDrain,
                             Rcpp::List     staticPaths,
                             Rcpp::List     staticPathOptions,
+                            Rcpp::List     routes,
+                            Rcpp::List     serverOptions,
                             bool           quiet
 ) {
 
@@ -266,8 +443,8 @@ Rcpp::RObject makeTcpServer(const std::string& host, int port,
   // this should be deleted when it goes out of scope.
   std::shared_ptr<RWebApplication> pHandler(
     new RWebApplication(onHeaders, onBodyData, onRequest,
-                        onWSOpen, onWSMessage, onWSClose,
-                        staticPaths, staticPathOptions),
+                        onWSOpen, onWSMessage, onWSClose, onWSDrain,
+                        staticPaths, staticPathOptions, routes, serverOptions),
     auto_deleter_main<RWebApplication>
   );
 
@@ -301,6 +478,7 @@ Rcpp::RObject makeTcpServer(const std::string& host, int port,
   }
 
   pServers.push_back(pServer);
+  update_access_log_signal(pHandler);
 
   return Rcpp::wrap(externalize_str<uv_stream_t>(pServer));
 }
@@ -314,8 +492,11 @@ Rcpp::RObject makePipeServer(const std::string& name,
                              Rcpp::Function onWSOpen,
                              Rcpp::Function onWSMessage,
                              Rcpp::Function onWSClose,
+                             Rcpp::Function onWSDrain,
                              Rcpp::List     staticPaths,
                              Rcpp::List     staticPathOptions,
+                             Rcpp::List     routes,
+                             Rcpp::List     serverOptions,
                              bool           quiet
 ) {
 
@@ -326,8 +507,8 @@ Rcpp::RObject makePipeServer(const std::string& name,
   // this should be deleted when it goes out of scope.
   std::shared_ptr<RWebApplication> pHandler(
     new RWebApplication(onHeaders, onBodyData, onRequest,
-                        onWSOpen, onWSMessage, onWSClose,
-                        staticPaths, staticPathOptions),
+                        onWSOpen, onWSMessage, onWSClose, onWSDrain,
+                        staticPaths, staticPathOptions, routes, serverOptions),
     auto_deleter_main<RWebApplication>
   );
 
@@ -359,6 +540,7 @@ Rcpp::RObject makePipeServer(const std::string& name,
   }
 
   pServers.push_back(pServer);
+  update_access_log_signal(pHandler);
 
   return Rcpp::wrap(externalize_str<uv_stream_t>(pServer));
 }
@@ -446,6 +628,277 @@ Rcpp::List setStaticPathOptions_(std::string handle, Rcpp::List opts) {
 }
 
 
+// ============================================================================
+// Routes
+// ============================================================================
+
+// [[Rcpp::export]]
+Rcpp::List getRoutes_(std::string handle) {
+  ASSERT_MAIN_THREAD()
+  return get_pWebApplication(handle)->getRouteManager().routesAsRObject();
+}
+
+// [[Rcpp::export]]
+Rcpp::List setRoutes_(std::string handle, Rcpp::List routes) {
+  ASSERT_MAIN_THREAD()
+  get_pWebApplication(handle)->getRouteManager().set(routes);
+  return getRoutes_(handle);
+}
+
+// [[Rcpp::export]]
+Rcpp::List removeRoutes_(std::string handle, Rcpp::CharacterVector paths) {
+  ASSERT_MAIN_THREAD()
+  get_pWebApplication(handle)->getRouteManager().remove(paths);
+  return getRoutes_(handle);
+}
+
+
+// ============================================================================
+// Native handlers
+// ============================================================================
+
+// [[Rcpp::export]]
+Rcpp::CharacterVector getNativeHandlers_(std::string handle) {
+  ASSERT_MAIN_THREAD()
+  return get_pWebApplication(handle)->getNativeHandlerManager().prefixes();
+}
+
+// [[Rcpp::export]]
+Rcpp::CharacterVector addNativeHandler_(std::string handle, std::string prefix, SEXP handler) {
+  ASSERT_MAIN_THREAD()
+  get_pWebApplication(handle)->getNativeHandlerManager().set(prefix, NativeHandler(handler));
+  return getNativeHandlers_(handle);
+}
+
+// [[Rcpp::export]]
+Rcpp::CharacterVector removeNativeHandler_(std::string handle, std::string prefix) {
+  ASSERT_MAIN_THREAD()
+  get_pWebApplication(handle)->getNativeHandlerManager().remove(prefix);
+  return getNativeHandlers_(handle);
+}
+
+// Make the C API in inst/include/httpuv_api.h available to other packages.
+// [[Rcpp::init]]
+void registerCCallables(DllInfo *dll) {
+  R_RegisterCCallable("httpuv", "httpuv_make_handler", (DL_FUNC)make_native_handler);
+  R_RegisterCCallable("httpuv", "httpuv_publish", (DL_FUNC)httpuv_publish);
+}
+
+
+// ============================================================================
+// Server options
+// ============================================================================
+
+// [[Rcpp::export]]
+Rcpp::List getServerOptions_(std::string handle) {
+  ASSERT_MAIN_THREAD()
+  return get_pWebApplication(handle)->getServerOptions()->asRObject();
+}
+
+// [[Rcpp::export]]
+Rcpp::List setServerOptions_(std::string handle, Rcpp::List opts) {
+  ASSERT_MAIN_THREAD()
+  get_pWebApplication(handle)->setServerOptions(opts);
+  update_access_log_signal(get_pWebApplication(handle));
+
+  // If the connection limit was raised, connections which are waiting in the
+  // backlog can now be accepted. Run on background thread:
+  // accept_pending_connections(pServer);
+  uv_stream_t* pServer = internalize_str<uv_stream_t>(handle);
+  background_queue->push(
+    std::bind(accept_pending_connections, pServer)
+  );
+
+  return getServerOptions_(handle);
+}
+
+
+// ============================================================================
+// Response cache
+// ============================================================================
+
+// [[Rcpp::export]]
+void clearResponseCache_(std::string handle) {
+  ASSERT_MAIN_THREAD()
+  get_pWebApplication(handle)->clearResponseCache();
+}
+
+
+// ============================================================================
+// Access log
+// ============================================================================
+
+// [[Rcpp::export]]
+void reopenAccessLog_(std::string handle) {
+  ASSERT_MAIN_THREAD()
+  get_pWebApplication(handle)->getAccessLog().reopen();
+}
+
+
+// ============================================================================
+// Traffic capture and replay
+// ============================================================================
+
+// [[Rcpp::export]]
+void startCapture_(std::string handle, std::string path) {
+  ASSERT_MAIN_THREAD()
+  TrafficCapture& capture = get_pWebApplication(handle)->getTrafficCapture();
+  capture.start(path);
+  background_queue->push(
+    std::bind(&TrafficCapture::sync, capture.shared_from_this())
+  );
+}
+
+// [[Rcpp::export]]
+Rcpp::List stopCapture_(std::string handle) {
+  ASSERT_MAIN_THREAD()
+  TrafficCapture& capture = get_pWebApplication(handle)->getTrafficCapture();
+  Rcpp::List status = capture.statusAsRObject();
+  capture.stop();
+  background_queue->push(
+    std::bind(&TrafficCapture::sync, capture.shared_from_this())
+  );
+  return status;
+}
+
+// [[Rcpp::export]]
+SEXP startReplay_(std::string path, std::string host, int port, double speed) {
+  ASSERT_MAIN_THREAD()
+  // As with the load generator, the finalizer stops the replay and waits for
+  // its thread.
+  Rcpp::XPtr<TrafficReplay> replay(new TrafficReplay(host, port, speed), true);
+  replay->start(path);
+  return replay;
+}
+
+// [[Rcpp::export]]
+bool replayFinished_(SEXP replay_xptr) {
+  ASSERT_MAIN_THREAD()
+  Rcpp::XPtr<TrafficReplay> replay(replay_xptr);
+  return replay->finished();
+}
+
+// [[Rcpp::export]]
+void stopReplay_(SEXP replay_xptr) {
+  ASSERT_MAIN_THREAD()
+  Rcpp::XPtr<TrafficReplay> replay(replay_xptr);
+  replay->stop();
+}
+
+// [[Rcpp::export]]
+Rcpp::List replayResults_(SEXP replay_xptr) {
+  ASSERT_MAIN_THREAD()
+  Rcpp::XPtr<TrafficReplay> replay(replay_xptr);
+  return replay->results();
+}
+
+
+// ============================================================================
+// Metrics
+// ============================================================================
+
+// [[Rcpp::export]]
+Rcpp::List getMetrics_(std::string handle) {
+  ASSERT_MAIN_THREAD()
+  return get_pWebApplication(handle)->getMetrics();
+}
+
+
+// [[Rcpp::export]]
+void startLoopMonitor_(double interval, double lagThreshold, Rcpp::RObject onLag) {
+  ASSERT_MAIN_THREAD()
+  ensure_io_thread();
+
+  LoopMonitor& monitor = get_loop_monitor();
+  monitor.setLagHook(lagThreshold, onLag);
+  uint64_t interval_ms = (uint64_t)std::max(1.0, interval * 1000);
+  background_queue->push(
+    std::bind(&LoopMonitor::startHeartbeat, &monitor, interval_ms)
+  );
+}
+
+// [[Rcpp::export]]
+void stopLoopMonitor_() {
+  ASSERT_MAIN_THREAD()
+  LoopMonitor& monitor = get_loop_monitor();
+  monitor.setLagHook(R_PosInf, R_NilValue);
+  if (io_thread_running.get()) {
+    background_queue->push(std::bind(&LoopMonitor::stopHeartbeat, &monitor));
+  }
+}
+
+// [[Rcpp::export]]
+Rcpp::List getLoopMetrics_() {
+  ASSERT_MAIN_THREAD()
+  return get_loop_monitor().asRObject();
+}
+
+
+// ============================================================================
+// Load generator
+// ============================================================================
+
+// [[Rcpp::export]]
+SEXP startLoadGenerator_(std::string host, int port, Rcpp::RawVector request,
+                         bool head, bool websocket, Rcpp::RawVector message,
+                         bool binary, int connections, int threads,
+                         double duration, double requests)
+{
+  ASSERT_MAIN_THREAD()
+  LoadGeneratorOptions options;
+  options.host = host;
+  options.port = port;
+  options.request.assign(request.begin(), request.end());
+  options.head = head;
+  options.websocket = websocket;
+  options.message.assign(message.begin(), message.end());
+  options.binary = binary;
+  options.connections = connections;
+  options.threads = threads;
+  options.duration = duration;
+  options.requests = requests;
+
+  // If the XPtr is garbage collected while the generator is running, the
+  // finalizer stops it and waits for its threads.
+  Rcpp::XPtr<LoadGenerator> gen(new LoadGenerator(options), true);
+  gen->start();
+  return gen;
+}
+
+// [[Rcpp::export]]
+bool loadGeneratorFinished_(SEXP gen_xptr) {
+  ASSERT_MAIN_THREAD()
+  Rcpp::XPtr<LoadGenerator> gen(gen_xptr);
+  return gen->finished();
+}
+
+// [[Rcpp::export]]
+void stopLoadGenerator_(SEXP gen_xptr) {
+  ASSERT_MAIN_THREAD()
+  Rcpp::XPtr<LoadGenerator> gen(gen_xptr);
+  gen->stop();
+}
+
+// [[Rcpp::export]]
+Rcpp::List loadGeneratorResults_(SEXP gen_xptr) {
+  ASSERT_MAIN_THREAD()
+  Rcpp::XPtr<LoadGenerator> gen(gen_xptr);
+  return gen->results();
+}
+
+
+// ============================================================================
+// Request cancellation
+// ============================================================================
+
+// [[Rcpp::export]]
+bool isCancelled_(SEXP flag_xptr) {
+  ASSERT_MAIN_THREAD()
+  Rcpp::XPtr<std::shared_ptr<std::atomic<bool> > > flag(flag_xptr);
+  return (*flag)->load();
+}
+
+
 // ============================================================================
 // Miscellaneous utility functions
 // ============================================================================
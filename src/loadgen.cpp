@@ -0,0 +1,783 @@
+#include "loadgen.h"
+#include "http-parser/http_parser.h"
+#include "websockets.h"
+#include "websockets-ietf.h"
+#include <algorithm>
+#include <set>
+#include <string.h>
+
+// ============================================================================
+// LatencyHistogram
+// ============================================================================
+
+// Enough buckets for latencies up to 2^40 microseconds (about 12 days).
+static const size_t N_LATENCY_BUCKETS = (40 - 6 + 2) << 6;
+
+LatencyHistogram::LatencyHistogram() :
+  _counts(N_LATENCY_BUCKETS, 0),
+  _count(0),
+  _min_ns(0),
+  _max_ns(0),
+  _sum_ns(0)
+{
+}
+
+// Values under 2 * SUB_COUNT have a bucket each. Above that, a value whose
+// highest bit is bit (SUB_BITS + e) goes in one of the SUB_COUNT buckets for
+// that power of two, according to its next SUB_BITS bits.
+size_t LatencyHistogram::index(uint64_t us) {
+  if (us < 2 * SUB_COUNT) {
+    return us;
+  }
+  int e = 0;
+  while ((us >> e) >= 2 * SUB_COUNT) {
+    e++;
+  }
+  size_t i = e * SUB_COUNT + (us >> e);
+  return std::min(i, N_LATENCY_BUCKETS - 1);
+}
+
+uint64_t LatencyHistogram::lowerBound(size_t i) {
+  if (i < 2 * SUB_COUNT) {
+    return i;
+  }
+  int e = i / SUB_COUNT - 1;
+  return (uint64_t)(i - e * SUB_COUNT) << e;
+}
+
+uint64_t LatencyHistogram::upperBound(size_t i) {
+  return lowerBound(i + 1);
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+  _counts[index(ns / 1000)]++;
+  if (_count == 0 || ns < _min_ns) {
+    _min_ns = ns;
+  }
+  if (ns > _max_ns) {
+    _max_ns = ns;
+  }
+  _count++;
+  _sum_ns += ns;
+}
+
+void LatencyHistogram::add(const LatencyHistogram& other) {
+  if (other._count == 0) {
+    return;
+  }
+  for (size_t i = 0; i < _counts.size(); i++) {
+    _counts[i] += other._counts[i];
+  }
+  if (_count == 0 || other._min_ns < _min_ns) {
+    _min_ns = other._min_ns;
+  }
+  _max_ns = std::max(_max_ns, other._max_ns);
+  _count += other._count;
+  _sum_ns += other._sum_ns;
+}
+
+// The midpoint of the bucket that holds the q-th quantile, clamped to the
+// observed range.
+double LatencyHistogram::quantile(double q) const {
+  if (_count == 0) {
+    return R_NaN;
+  }
+  uint64_t rank = (uint64_t)(q * _count);
+  if (rank >= _count) {
+    rank = _count - 1;
+  }
+  uint64_t seen = 0;
+  for (size_t i = 0; i < _counts.size(); i++) {
+    seen += _counts[i];
+    if (seen > rank) {
+      double mid = (lowerBound(i) + upperBound(i)) / 2.0 * 1000;
+      mid = std::max(mid, (double)_min_ns);
+      mid = std::min(mid, (double)_max_ns);
+      return mid / 1e9;
+    }
+  }
+  return _max_ns / 1e9;
+}
+
+Rcpp::List LatencyHistogram::asRObject() const {
+  using namespace Rcpp;
+  return List::create(
+    _["count"] = (double)_count,
+    _["mean"]  = _count > 0 ? _sum_ns / _count / 1e9 : R_NaN,
+    _["min"]   = _count > 0 ? _min_ns / 1e9 : R_NaN,
+    _["p50"]   = quantile(0.5),
+    _["p90"]   = quantile(0.9),
+    _["p99"]   = quantile(0.99),
+    _["p999"]  = quantile(0.999),
+    _["max"]   = _count > 0 ? _max_ns / 1e9 : R_NaN
+  );
+}
+
+
+// ============================================================================
+// Worker threads and connections
+// ============================================================================
+
+class LoadClient;
+
+struct LoadWorker {
+  LoadGenerator* pGenerator;
+  int nClients;
+  uv_thread_t thread;
+  uv_loop_t loop;
+  uv_timer_t tick;
+  std::set<LoadClient*> clients;
+  uint64_t deadline;
+  bool stopping;
+  // Shared by the connections for reading, since only one read callback
+  // runs at a time.
+  char readBuf[65536];
+
+  // Results, read on the main thread after the thread has finished.
+  LatencyHistogram latency;
+  uint64_t completed;
+  uint64_t bytesReceived;
+  uint64_t connectErrors;
+  uint64_t socketErrors;
+  uint64_t protocolErrors;
+  uint64_t statusClass[5];
+  uint64_t end;
+
+  LoadWorker(LoadGenerator* pGenerator, int nClients) :
+    pGenerator(pGenerator), nClients(nClients), deadline(0), stopping(false),
+    completed(0), bytesReceived(0), connectErrors(0), socketErrors(0),
+    protocolErrors(0), end(0)
+  {
+    memset(statusClass, 0, sizeof(statusClass));
+  }
+
+  void stop();
+  void clientClosed(LoadClient* pClient);
+};
+
+// One connection. For HTTP, a request is sent as soon as the previous
+// response has been received; if the server closes the connection, it is
+// reopened. For WebSockets, the handshake is sent when the connection opens,
+// and then a message is sent each time the previous one is echoed back.
+class LoadClient {
+public:
+  LoadClient(LoadWorker* pWorker) :
+    _pWorker(pWorker),
+    _state(CONNECTING),
+    _awaiting(false),
+    _writing(false),
+    _sendPending(false),
+    _reconnect(false),
+    _sentAt(0),
+    _wsPayloadLeft(0),
+    _wsInPayload(false),
+    _wsOpcode(Continuation)
+  {
+  }
+
+  void connect();
+  // Closes the connection. If `reconnect` is true and the worker isn't
+  // stopping, a new connection is opened; otherwise the client is deleted.
+  void close(bool reconnect);
+
+  void onConnect(int status);
+  void onWrite(int status);
+  void onRead(ssize_t nread, const uv_buf_t* buf);
+  void onClosed();
+  int onHeadersComplete();
+  int onMessageComplete();
+
+private:
+  enum State {
+    CONNECTING,
+    HANDSHAKE,
+    HTTP,
+    WEBSOCKET,
+    CLOSING
+  };
+
+  void _send();
+  void _readHttp(const char* data, size_t len);
+  void _readWebSocket(const char* data, size_t len);
+  void _onFrame(Opcode opcode);
+
+  LoadWorker* _pWorker;
+  uv_tcp_t _handle;
+  uv_connect_t _connectReq;
+  uv_write_t _writeReq;
+  http_parser _parser;
+  State _state;
+  // A request has been sent, and the response hasn't been received.
+  bool _awaiting;
+  // _writeReq is in use. If the response arrives before the write has
+  // finished (for example, an early error response), the next request is
+  // sent when it finishes.
+  bool _writing;
+  bool _sendPending;
+  bool _reconnect;
+  uint64_t _sentAt;
+
+  // Incoming WebSocket frames. The payloads are skipped, not stored.
+  std::vector<char> _wsHeader;
+  uint64_t _wsPayloadLeft;
+  bool _wsInPayload;
+  Opcode _wsOpcode;
+};
+
+static int LoadClient_on_headers_complete(http_parser* pParser) {
+  return reinterpret_cast<LoadClient*>(pParser->data)->onHeadersComplete();
+}
+
+static int LoadClient_on_message_complete(http_parser* pParser) {
+  return reinterpret_cast<LoadClient*>(pParser->data)->onMessageComplete();
+}
+
+static http_parser_settings& response_settings() {
+  static http_parser_settings settings;
+  settings.on_headers_complete = LoadClient_on_headers_complete;
+  settings.on_message_complete = LoadClient_on_message_complete;
+  return settings;
+}
+
+// The request buffers are shared by all connections and never written to, but
+// uv_buf_t needs a non-const pointer.
+static char* buffer_addr(const std::vector<char>& data) {
+  return data.empty() ? NULL : const_cast<char*>(&data[0]);
+}
+
+static void LoadClient_on_connect(uv_connect_t* req, int status) {
+  reinterpret_cast<LoadClient*>(req->data)->onConnect(status);
+}
+
+static void LoadClient_on_write(uv_write_t* req, int status) {
+  reinterpret_cast<LoadClient*>(req->data)->onWrite(status);
+}
+
+static void LoadClient_on_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+  LoadWorker* pWorker = reinterpret_cast<LoadWorker*>(handle->loop->data);
+  *buf = uv_buf_init(pWorker->readBuf, sizeof(pWorker->readBuf));
+}
+
+static void LoadClient_on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+  reinterpret_cast<LoadClient*>(stream->data)->onRead(nread, buf);
+}
+
+static void LoadClient_on_closed(uv_handle_t* handle) {
+  reinterpret_cast<LoadClient*>(handle->data)->onClosed();
+}
+
+void LoadClient::connect() {
+  _state = CONNECTING;
+  _awaiting = false;
+  _writing = false;
+  _sendPending = false;
+  _reconnect = false;
+  _wsHeader.clear();
+  _wsInPayload = false;
+
+  uv_tcp_init(&_pWorker->loop, &_handle);
+  _handle.data = this;
+  uv_tcp_nodelay(&_handle, 1);
+  http_parser_init(&_parser, HTTP_RESPONSE);
+  _parser.data = this;
+  _connectReq.data = this;
+  _writeReq.data = this;
+
+  int r = uv_tcp_connect(&_connectReq, &_handle,
+                         _pWorker->pGenerator->address(), LoadClient_on_connect);
+  if (r != 0) {
+    _pWorker->connectErrors++;
+    close(false);
+    return;
+  }
+}
+
+void LoadClient::close(bool reconnect) {
+  if (_state == CLOSING) {
+    return;
+  }
+  _state = CLOSING;
+  _reconnect = reconnect;
+  uv_read_stop((uv_stream_t*)&_handle);
+  uv_close((uv_handle_t*)&_handle, LoadClient_on_closed);
+}
+
+void LoadClient::onClosed() {
+  if (_reconnect && !_pWorker->stopping) {
+    connect();
+  } else {
+    _pWorker->clientClosed(this);
+  }
+}
+
+void LoadClient::onConnect(int status) {
+  if (_state == CLOSING) {
+    return;
+  }
+  if (status != 0) {
+    // Don't retry, since the server probably isn't there.
+    _pWorker->connectErrors++;
+    close(false);
+    return;
+  }
+
+  uv_read_start((uv_stream_t*)&_handle, LoadClient_on_alloc, LoadClient_on_read);
+
+  if (_pWorker->pGenerator->options().websocket) {
+    _state = HANDSHAKE;
+    const std::vector<char>& request = _pWorker->pGenerator->options().request;
+    uv_buf_t buf = uv_buf_init(buffer_addr(request), request.size());
+    _writing = true;
+    if (uv_write(&_writeReq, (uv_stream_t*)&_handle, &buf, 1, LoadClient_on_write) != 0) {
+      _pWorker->socketErrors++;
+      close(false);
+    }
+  } else {
+    _state = HTTP;
+    _send();
+  }
+}
+
+// Sends the next request or message, if there are any left.
+void LoadClient::_send() {
+  if (_writing) {
+    _sendPending = true;
+    return;
+  }
+  if (_pWorker->stopping || !_pWorker->pGenerator->claimRequest()) {
+    close(false);
+    return;
+  }
+
+  const std::vector<char>& data = (_state == WEBSOCKET) ?
+    _pWorker->pGenerator->frame() :
+    _pWorker->pGenerator->options().request;
+
+  // The buffer isn't copied; it lives as long as the generator.
+  uv_buf_t buf = uv_buf_init(buffer_addr(data), data.size());
+  _sentAt = uv_hrtime();
+  _awaiting = true;
+  _writing = true;
+  if (uv_write(&_writeReq, (uv_stream_t*)&_handle, &buf, 1, LoadClient_on_write) != 0) {
+    _pWorker->socketErrors++;
+    close(true);
+  }
+}
+
+void LoadClient::onWrite(int status) {
+  if (_state == CLOSING) {
+    return;
+  }
+  _writing = false;
+  if (status != 0) {
+    _pWorker->socketErrors++;
+    close(_state == HTTP);
+  } else if (_sendPending) {
+    _sendPending = false;
+    _send();
+  }
+}
+
+void LoadClient::onRead(ssize_t nread, const uv_buf_t* buf) {
+  if (_state == CLOSING) {
+    return;
+  }
+
+  if (nread > 0) {
+    _pWorker->bytesReceived += nread;
+    if (_state == WEBSOCKET) {
+      _readWebSocket(buf->base, nread);
+    } else {
+      _readHttp(buf->base, nread);
+    }
+
+  } else if (nread < 0) {
+    if (nread == UV_EOF && _state == HTTP) {
+      // A response without a length ends when the connection is closed.
+      http_parser_execute(&_parser, &response_settings(), NULL, 0);
+    }
+    if (_state == CLOSING) {
+      return;
+    }
+    if (nread != UV_EOF || _awaiting) {
+      _pWorker->socketErrors++;
+    }
+    close(_state == HTTP);
+  }
+}
+
+void LoadClient::_readHttp(const char* data, size_t len) {
+  size_t parsed = http_parser_execute(&_parser, &response_settings(), data, len);
+  if (_state == CLOSING) {
+    return;
+  }
+
+  if (_parser.upgrade) {
+    if (_state != HANDSHAKE || _parser.status_code != 101) {
+      _pWorker->protocolErrors++;
+      close(false);
+      return;
+    }
+    _state = WEBSOCKET;
+    _send();
+    if (parsed < len) {
+      _readWebSocket(data + parsed, len - parsed);
+    }
+  } else if (parsed < len) {
+    _pWorker->protocolErrors++;
+    close(true);
+  }
+}
+
+int LoadClient::onHeadersComplete() {
+  // A response to a HEAD request has no body, whatever its Content-Length.
+  return (_state == HTTP && _pWorker->pGenerator->options().head) ? 1 : 0;
+}
+
+int LoadClient::onMessageComplete() {
+  if (_state == HANDSHAKE) {
+    // The server didn't accept the WebSocket connection.
+    if (!_parser.upgrade) {
+      _pWorker->protocolErrors++;
+      close(false);
+    }
+    return 0;
+  }
+  if (_state != HTTP || !_awaiting) {
+    return 0;
+  }
+
+  _awaiting = false;
+  _pWorker->latency.record(uv_hrtime() - _sentAt);
+  _pWorker->completed++;
+  int status_class = _parser.status_code / 100 - 1;
+  if (status_class >= 0 && status_class < 5) {
+    _pWorker->statusClass[status_class]++;
+  }
+
+  if (http_should_keep_alive(&_parser)) {
+    _send();
+  } else {
+    close(true);
+  }
+  return 0;
+}
+
+void LoadClient::_readWebSocket(const char* data, size_t len) {
+  while (len > 0 || (_wsInPayload && _wsPayloadLeft == 0)) {
+    if (_state == CLOSING) {
+      return;
+    }
+
+    if (!_wsInPayload) {
+      size_t startingSize = _wsHeader.size();
+      size_t n = std::min(len, MAX_HEADER_BYTES - startingSize);
+      _wsHeader.insert(_wsHeader.end(), data, data + n);
+
+      WebSocketProto_IETF proto;
+      WSHyBiFrameHeader header(&proto, safe_vec_addr(_wsHeader), _wsHeader.size());
+      if (!header.isHeaderComplete()) {
+        return;
+      }
+      WSFrameHeaderInfo info = header.info();
+      size_t consumed = header.headerLength() - startingSize;
+      data += consumed;
+      len -= consumed;
+      _wsHeader.clear();
+      _wsOpcode = info.opcode;
+      _wsPayloadLeft = info.payloadLength;
+      _wsInPayload = true;
+      if (!info.fin) {
+        // Continuation frames are counted when the last one arrives.
+        _wsOpcode = Continuation;
+      }
+
+    } else {
+      size_t n = (size_t)std::min((uint64_t)len, _wsPayloadLeft);
+      data += n;
+      len -= n;
+      _wsPayloadLeft -= n;
+      if (_wsPayloadLeft == 0) {
+        _wsInPayload = false;
+        _onFrame(_wsOpcode);
+      }
+    }
+  }
+}
+
+void LoadClient::_onFrame(Opcode opcode) {
+  switch (opcode) {
+    case Text:
+    case Binary:
+    case Continuation:
+      if (!_awaiting) {
+        return;
+      }
+      _awaiting = false;
+      _pWorker->latency.record(uv_hrtime() - _sentAt);
+      _pWorker->completed++;
+      _send();
+      break;
+    case Close:
+      _pWorker->protocolErrors++;
+      close(false);
+      break;
+    default:
+      // Pings from the server are ignored.
+      break;
+  }
+}
+
+void LoadWorker::stop() {
+  stopping = true;
+  // Closing a client can delete it, so iterate over a copy.
+  std::vector<LoadClient*> toClose(clients.begin(), clients.end());
+  for (size_t i = 0; i < toClose.size(); i++) {
+    toClose[i]->close(false);
+  }
+}
+
+void LoadWorker::clientClosed(LoadClient* pClient) {
+  clients.erase(pClient);
+  delete pClient;
+  if (clients.empty()) {
+    // With the timer closed there's nothing left in the loop, so it exits.
+    uv_close((uv_handle_t*)&tick, NULL);
+  }
+}
+
+static void on_worker_tick(uv_timer_t* handle) {
+  LoadWorker* pWorker = reinterpret_cast<LoadWorker*>(handle->data);
+  if (pWorker->stopping) {
+    return;
+  }
+  if (pWorker->pGenerator->stopping() ||
+      (pWorker->deadline != 0 && uv_hrtime() >= pWorker->deadline))
+  {
+    pWorker->stop();
+  }
+}
+
+static void worker_thread(void* data) {
+  LoadWorker* pWorker = reinterpret_cast<LoadWorker*>(data);
+  const LoadGeneratorOptions& options = pWorker->pGenerator->options();
+
+  uv_loop_init(&pWorker->loop);
+  pWorker->loop.data = pWorker;
+
+  if (options.duration > 0) {
+    pWorker->deadline = uv_hrtime() + (uint64_t)(options.duration * 1e9);
+  }
+  // The stop flag and deadline are checked every 10ms, rather than using a
+  // uv_async_t, so that the main thread never touches this loop.
+  uv_timer_init(&pWorker->loop, &pWorker->tick);
+  pWorker->tick.data = pWorker;
+  uv_timer_start(&pWorker->tick, on_worker_tick, 10, 10);
+
+  for (int i = 0; i < pWorker->nClients; i++) {
+    LoadClient* pClient = new LoadClient(pWorker);
+    pWorker->clients.insert(pClient);
+  }
+  std::vector<LoadClient*> clients(pWorker->clients.begin(), pWorker->clients.end());
+  for (size_t i = 0; i < clients.size(); i++) {
+    clients[i]->connect();
+  }
+
+  uv_run(&pWorker->loop, UV_RUN_DEFAULT);
+  uv_loop_close(&pWorker->loop);
+
+  pWorker->end = uv_hrtime();
+  pWorker->pGenerator->workerFinished();
+}
+
+
+// ============================================================================
+// LoadGenerator
+// ============================================================================
+
+LoadGenerator::LoadGenerator(const LoadGeneratorOptions& options) :
+  _options(options),
+  _stop(false),
+  _running(0),
+  _remaining(options.requests < 0 ? 0 : (int64_t)options.requests),
+  _start(0),
+  _joined(true)
+{
+  memset(&_address, 0, sizeof(_address));
+}
+
+LoadGenerator::~LoadGenerator() {
+  stop();
+  _join();
+  for (size_t i = 0; i < _workers.size(); i++) {
+    delete _workers[i];
+  }
+}
+
+void resolve_address(const std::string& host, int port,
+                     struct sockaddr_storage* pAddress)
+{
+  // A NULL callback makes uv_getaddrinfo synchronous.
+  uv_loop_t loop;
+  uv_loop_init(&loop);
+  uv_getaddrinfo_t req;
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int r = uv_getaddrinfo(&loop, &req, NULL, host.c_str(), NULL, &hints);
+  if (r == 0) {
+    memcpy(pAddress, req.addrinfo->ai_addr, req.addrinfo->ai_addrlen);
+    uv_freeaddrinfo(req.addrinfo);
+  }
+  uv_loop_close(&loop);
+  if (r != 0) {
+    throw Rcpp::exception(
+      (std::string("Can't resolve ") + host + ": " + uv_strerror(r)).c_str()
+    );
+  }
+  if (pAddress->ss_family == AF_INET) {
+    ((struct sockaddr_in*)pAddress)->sin_port = htons(port);
+  } else {
+    ((struct sockaddr_in6*)pAddress)->sin6_port = htons(port);
+  }
+}
+
+void LoadGenerator::start() {
+  resolve_address(_options.host, _options.port, &_address);
+
+  if (_options.websocket) {
+    // Client frames must be masked. A fixed masking key is fine, since the
+    // frames only go to a server under test.
+    WebSocketProto_IETF proto;
+    char header[MAX_HEADER_BYTES];
+    size_t headerLen = 0;
+    proto.createFrameHeader(_options.binary ? Binary : Text, true,
+                            _options.message.size(), 0x1a2b3c4d,
+                            header, &headerLen);
+    WSHyBiFrameHeader frameHeader(&proto, header, headerLen);
+    std::vector<uint8_t> key = frameHeader.info().maskingKey;
+
+    _frame.assign(header, header + headerLen);
+    for (size_t i = 0; i < _options.message.size(); i++) {
+      _frame.push_back(_options.message[i] ^ key[i % 4]);
+    }
+  }
+
+  int nThreads = std::max(1, std::min(_options.threads, _options.connections));
+  for (int i = 0; i < nThreads; i++) {
+    int nClients = _options.connections / nThreads +
+      (i < _options.connections % nThreads ? 1 : 0);
+    _workers.push_back(new LoadWorker(this, nClients));
+  }
+
+  _start = uv_hrtime();
+  _joined = false;
+  for (size_t i = 0; i < _workers.size(); i++) {
+    _running++;
+    int r = uv_thread_create(&_workers[i]->thread, worker_thread, _workers[i]);
+    if (r != 0) {
+      _running--;
+      _workers.resize(i);
+      stop();
+      _join();
+      throw Rcpp::exception(
+        (std::string("Can't create load generator thread: ") + uv_strerror(r)).c_str()
+      );
+    }
+  }
+}
+
+void LoadGenerator::stop() {
+  _stop.store(true);
+}
+
+bool LoadGenerator::finished() const {
+  return _running.load() == 0;
+}
+
+void LoadGenerator::_join() {
+  if (_joined) {
+    return;
+  }
+  for (size_t i = 0; i < _workers.size(); i++) {
+    uv_thread_join(&_workers[i]->thread);
+  }
+  _joined = true;
+}
+
+Rcpp::List LoadGenerator::results() {
+  using namespace Rcpp;
+  _join();
+
+  LatencyHistogram latency;
+  uint64_t completed = 0, bytesReceived = 0;
+  uint64_t connectErrors = 0, socketErrors = 0, protocolErrors = 0;
+  uint64_t statusClass[5] = {0, 0, 0, 0, 0};
+  uint64_t end = _start;
+  for (size_t i = 0; i < _workers.size(); i++) {
+    LoadWorker* pWorker = _workers[i];
+    latency.add(pWorker->latency);
+    completed += pWorker->completed;
+    bytesReceived += pWorker->bytesReceived;
+    connectErrors += pWorker->connectErrors;
+    socketErrors += pWorker->socketErrors;
+    protocolErrors += pWorker->protocolErrors;
+    for (int j = 0; j < 5; j++) {
+      statusClass[j] += pWorker->statusClass[j];
+    }
+    end = std::max(end, pWorker->end);
+  }
+
+  double elapsed = (end - _start) / 1e9;
+
+  NumericVector status = NumericVector::create(
+    _["1xx"] = (double)statusClass[0],
+    _["2xx"] = (double)statusClass[1],
+    _["3xx"] = (double)statusClass[2],
+    _["4xx"] = (double)statusClass[3],
+    _["5xx"] = (double)statusClass[4]
+  );
+  NumericVector errors = NumericVector::create(
+    _["connect"]  = (double)connectErrors,
+    _["socket"]   = (double)socketErrors,
+    _["protocol"] = (double)protocolErrors
+  );
+
+  return List::create(
+    _["requests"]      = (double)completed,
+    _["duration"]      = elapsed,
+    _["rate"]          = elapsed > 0 ? completed / elapsed : R_NaN,
+    _["bytesReceived"] = (double)bytesReceived,
+    _["errors"]        = errors,
+    _["status"]        = status,
+    _["latency"]       = latency.asRObject()
+  );
+}
+
+const LoadGeneratorOptions& LoadGenerator::options() const {
+  return _options;
+}
+
+const struct sockaddr* LoadGenerator::address() const {
+  return (const struct sockaddr*)&_address;
+}
+
+const std::vector<char>& LoadGenerator::frame() const {
+  return _frame;
+}
+
+bool LoadGenerator::stopping() const {
+  return _stop.load();
+}
+
+bool LoadGenerator::claimRequest() {
+  if (_options.requests < 0) {
+    return true;
+  }
+  return _remaining.fetch_sub(1) > 0;
+}
+
+void LoadGenerator::workerFinished() {
+  _running--;
+}
@@ -0,0 +1,122 @@
+#ifndef LOADGEN_HPP
+#define LOADGEN_HPP
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <uv.h>
+#include <Rcpp.h>
+
+// A histogram of latencies with log-linear buckets, in the style of
+// HdrHistogram: each power-of-two range of microseconds is split into 64
+// linear sub-buckets, so quantiles are accurate to within about 1.5%. It
+// isn't thread-safe; each load generator thread has its own, and they are
+// added together at the end.
+class LatencyHistogram {
+public:
+  LatencyHistogram();
+
+  // Record a latency, in nanoseconds.
+  void record(uint64_t ns);
+  void add(const LatencyHistogram& other);
+
+  // Returns a list with the count, and the mean, min, max and quantiles in
+  // seconds.
+  Rcpp::List asRObject() const;
+
+private:
+  static const int SUB_BITS = 6;
+  static const uint64_t SUB_COUNT = 1 << SUB_BITS;
+
+  static size_t index(uint64_t us);
+  // Lower and upper bounds of a bucket, in microseconds.
+  static uint64_t lowerBound(size_t i);
+  static uint64_t upperBound(size_t i);
+  double quantile(double q) const;
+
+  std::vector<uint64_t> _counts;
+  uint64_t _count;
+  uint64_t _min_ns;
+  uint64_t _max_ns;
+  double _sum_ns;
+};
+
+// Resolves a host name, synchronously. Throws an exception on failure.
+void resolve_address(const std::string& host, int port,
+                     struct sockaddr_storage* pAddress);
+
+struct LoadGeneratorOptions {
+  std::string host;
+  int port;
+  // The bytes sent for each HTTP request, or for WebSockets, the handshake
+  // request sent when each connection opens.
+  std::vector<char> request;
+  // If true, responses don't have a body even if they have a Content-Length.
+  bool head;
+  bool websocket;
+  // For WebSockets, the message sent each time the previous one is echoed.
+  std::vector<char> message;
+  bool binary;
+  int connections;
+  int threads;
+  // In seconds; 0 for no limit.
+  double duration;
+  // Total number of requests (or messages); -1 for no limit.
+  double requests;
+};
+
+struct LoadWorker;
+
+// A load generator for benchmarking HTTP and WebSocket servers. Each of its
+// threads runs its own libuv loop, separate from the server's I/O thread,
+// with a share of the connections. Each connection sends a request (or a
+// WebSocket message), waits for the response (or the echoed message), and
+// immediately sends the next one, so the request rate is limited only by
+// how fast the server responds.
+//
+// The generator is created and controlled from the main thread; it doesn't
+// call into R from its own threads, so it can be used to benchmark a server
+// running in the same R process as long as the main thread keeps running
+// later callbacks.
+class LoadGenerator {
+public:
+  LoadGenerator(const LoadGeneratorOptions& options);
+  // Stops the generator and waits for its threads.
+  ~LoadGenerator();
+
+  // Resolves the host and starts the threads. Throws an exception on
+  // failure.
+  void start();
+  void stop();
+  bool finished() const;
+  // Waits for the threads to finish, and returns the results.
+  Rcpp::List results();
+
+  // These are used by the worker threads.
+  const LoadGeneratorOptions& options() const;
+  const struct sockaddr* address() const;
+  const std::vector<char>& frame() const;
+  bool stopping() const;
+  // Claims one request from the total; returns false if there are none
+  // left.
+  bool claimRequest();
+  void workerFinished();
+
+private:
+  void _join();
+
+  LoadGeneratorOptions _options;
+  struct sockaddr_storage _address;
+  // The complete, masked frame for the WebSocket message.
+  std::vector<char> _frame;
+  std::vector<LoadWorker*> _workers;
+
+  std::atomic<bool> _stop;
+  std::atomic<int> _running;
+  std::atomic<int64_t> _remaining;
+  uint64_t _start;
+  bool _joined;
+};
+
+#endif
@@ -0,0 +1,138 @@
+#include "logring.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+
+LogRing& get_log_ring() {
+  static LogRing ring;
+  return ring;
+}
+
+static void flusher_thread(void* data) {
+  reinterpret_cast<LogRing*>(data)->flushLoop();
+}
+
+static void write_stderr(const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(STDERR_FILENO, data, len);
+    if (n <= 0) {
+      return;
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+LogRing::LogRing() :
+  _head(0),
+  _tail(0),
+  _dropped(0),
+  _droppedReported(0),
+  _flusherState(FLUSHER_NONE)
+{
+  for (size_t i = 0; i < N_SLOTS; i++) {
+    _slots[i].seq.store(i, std::memory_order_relaxed);
+    _slots[i].len = 0;
+  }
+  uv_sem_init(&_wakeup, 0);
+}
+
+bool LogRing::_ensureFlusher() {
+  int state = _flusherState.load(std::memory_order_acquire);
+  if (state == FLUSHER_NONE &&
+      _flusherState.compare_exchange_strong(state, FLUSHER_STARTING))
+  {
+    // The thread is never stopped, like the I/O thread.
+    if (uv_thread_create(&_flusherThread, flusher_thread, this) == 0) {
+      state = FLUSHER_RUNNING;
+    } else {
+      state = FLUSHER_FAILED;
+    }
+    _flusherState.store(state, std::memory_order_release);
+  }
+  return state != FLUSHER_FAILED;
+}
+
+bool LogRing::push(const char* msg, size_t len) {
+  if (!_ensureFlusher()) {
+    // No flusher thread, so write directly.
+    std::string line(msg, len);
+    line.push_back('\n');
+    write_stderr(line.data(), line.size());
+    return true;
+  }
+
+  if (len > MAX_MESSAGE - 1) {
+    len = MAX_MESSAGE - 1;
+  }
+
+  // Claim a position. The slot for it is free when its sequence number equals
+  // the position; if it's behind, the ring is full.
+  Slot* slot;
+  size_t pos = _head.load(std::memory_order_relaxed);
+  for (;;) {
+    slot = &_slots[pos % N_SLOTS];
+    size_t seq = slot->seq.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      _dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    } else {
+      pos = _head.load(std::memory_order_relaxed);
+    }
+  }
+
+  memcpy(slot->text, msg, len);
+  slot->text[len] = '\n';
+  slot->len = len + 1;
+  // Publish the message to the flusher.
+  slot->seq.store(pos + 1, std::memory_order_release);
+
+  uv_sem_post(&_wakeup);
+  return true;
+}
+
+size_t LogRing::_drain() {
+  std::string buf;
+  size_t count = 0;
+
+  for (;;) {
+    Slot& slot = _slots[_tail % N_SLOTS];
+    if (slot.seq.load(std::memory_order_acquire) != _tail + 1) {
+      break;
+    }
+    buf.append(slot.text, slot.len);
+    // Free the slot for the producer that will claim it on the next lap.
+    slot.seq.store(_tail + N_SLOTS, std::memory_order_release);
+    _tail++;
+    count++;
+  }
+
+  uint64_t dropped = _dropped.load(std::memory_order_relaxed);
+  if (dropped != _droppedReported) {
+    char notice[100];
+    snprintf(notice, sizeof(notice), "httpuv: %llu log messages dropped\n",
+             (unsigned long long)(dropped - _droppedReported));
+    buf.append(notice);
+    _droppedReported = dropped;
+  }
+
+  if (!buf.empty()) {
+    write_stderr(buf.data(), buf.size());
+  }
+  return count;
+}
+
+void LogRing::flushLoop() {
+  for (;;) {
+    // Each message posts once, so after a drain that wrote several messages,
+    // the next few waits return immediately and find nothing to do.
+    uv_sem_wait(&_wakeup);
+    _drain();
+  }
+}
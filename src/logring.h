@@ -0,0 +1,67 @@
+#ifndef LOGRING_HPP
+#define LOGRING_HPP
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <uv.h>
+
+// A bounded queue of log messages, so that logging doesn't block the thread
+// that logs. Messages are copied into a fixed ring of slots by any thread
+// without taking a lock, and a flusher thread (started the first time a
+// message is logged) writes them to stderr. If the ring is full because
+// stderr can't keep up, the message is dropped and counted, and the flusher
+// reports how many were dropped the next time it writes.
+//
+// The ring is a bounded multi-producer queue in the style of Dmitry Vyukov's:
+// each slot has a sequence number which tells producers whether the slot is
+// free for the position they claimed, and tells the (single) consumer whether
+// the message in it has been completely written.
+class LogRing {
+public:
+  static const size_t N_SLOTS = 1024;
+  // Longer messages are truncated.
+  static const size_t MAX_MESSAGE = 512;
+
+  LogRing();
+
+  // Adds a message to the ring; a newline is appended. Safe to call from any
+  // thread. Returns false if the message was dropped.
+  bool push(const char* msg, size_t len);
+
+  // Called on the flusher thread.
+  void flushLoop();
+
+private:
+  struct Slot {
+    std::atomic<size_t> seq;
+    size_t len;
+    char text[MAX_MESSAGE];
+  };
+
+  bool _ensureFlusher();
+  // Writes out all complete messages. Returns the number written.
+  size_t _drain();
+
+  Slot _slots[N_SLOTS];
+  std::atomic<size_t> _head;
+  // Consumer only
+  size_t _tail;
+
+  std::atomic<uint64_t> _dropped;
+  uint64_t _droppedReported;
+
+  enum FlusherState {
+    FLUSHER_NONE,
+    FLUSHER_STARTING,
+    FLUSHER_RUNNING,
+    FLUSHER_FAILED
+  };
+  std::atomic<int> _flusherState;
+  uv_sem_t _wakeup;
+  uv_thread_t _flusherThread;
+};
+
+LogRing& get_log_ring();
+
+#endif
@@ -0,0 +1,252 @@
+#include "loopmonitor.h"
+#include "callback.h"
+#include "utils.h"
+#include <algorithm>
+#include <cmath>
+
+LoopMonitor& get_loop_monitor() {
+  static LoopMonitor monitor;
+  return monitor;
+}
+
+static void on_prepare(uv_prepare_t* handle) {
+  reinterpret_cast<LoopMonitor*>(handle->data)->onPrepare();
+}
+
+static void on_heartbeat_timer(uv_timer_t* handle) {
+  reinterpret_cast<LoopMonitor*>(handle->data)->onHeartbeatTimer();
+}
+
+static double wall_time() {
+  uv_timeval64_t tv;
+  if (uv_gettimeofday(&tv) != 0) {
+    return R_NaN;
+  }
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+LoopMonitor::LoopMonitor() :
+  _loop(NULL),
+  _lastPrepare(0),
+  _lastPrepareIdle(0),
+  _lastTick(0),
+  _lastTickIdle(0),
+  _seq(0),
+  _start(0),
+  _busy(0),
+  _iterations(0),
+  _heartbeatInterval(0),
+  _heartbeatInFlight(false),
+  _nextSample(0),
+  _lagThreshold(R_PosInf),
+  _onLag(NULL),
+  _lagWarnings(0)
+{
+  uv_mutex_init(&_mutex);
+}
+
+void LoopMonitor::attach(uv_loop_t* loop) {
+  ASSERT_BACKGROUND_THREAD()
+
+  _loop = loop;
+  int r = uv_loop_configure(loop, UV_METRICS_IDLE_TIME);
+  if (r != 0) {
+    debug_log(std::string("LoopMonitor: idle time metrics unavailable: ") +
+              uv_strerror(r), LOG_INFO);
+  }
+
+  uint64_t now = uv_hrtime();
+  _lastPrepare = now;
+  _lastPrepareIdle = uv_metrics_idle_time(loop);
+  _start.store(now);
+  _busy.store(0);
+
+  // The handles are unreferenced so that they don't keep the loop alive, and
+  // are closed with everything else when the loop stops.
+  uv_prepare_init(loop, &_prepare);
+  _prepare.data = this;
+  uv_prepare_start(&_prepare, on_prepare);
+  uv_unref((uv_handle_t*)&_prepare);
+
+  uv_timer_init(loop, &_timer);
+  _timer.data = this;
+  uv_unref((uv_handle_t*)&_timer);
+
+  _heartbeatInFlight.store(false);
+  uint64_t interval = _heartbeatInterval.load();
+  if (interval > 0) {
+    startHeartbeat(interval);
+  }
+}
+
+void LoopMonitor::startHeartbeat(uint64_t interval) {
+  ASSERT_BACKGROUND_THREAD()
+  _heartbeatInterval.store(interval);
+  if (_loop == NULL) {
+    return;
+  }
+  _lastTick = uv_hrtime();
+  _lastTickIdle = uv_metrics_idle_time(_loop);
+  uv_timer_start(&_timer, on_heartbeat_timer, interval, interval);
+}
+
+void LoopMonitor::stopHeartbeat() {
+  ASSERT_BACKGROUND_THREAD()
+  _heartbeatInterval.store(0);
+  if (_loop != NULL) {
+    uv_timer_stop(&_timer);
+  }
+}
+
+void LoopMonitor::setLagHook(double threshold, Rcpp::RObject onLag) {
+  ASSERT_MAIN_THREAD()
+  _lagThreshold = threshold;
+  if (_onLag != NULL) {
+    delete _onLag;
+    _onLag = NULL;
+  }
+  if (!onLag.isNULL()) {
+    _onLag = new Rcpp::RObject(onLag);
+  }
+}
+
+void LoopMonitor::onPrepare() {
+  ASSERT_BACKGROUND_THREAD()
+  uint64_t now = uv_hrtime();
+  uint64_t idle = uv_metrics_idle_time(_loop);
+
+  uint64_t elapsed = now - _lastPrepare;
+  uint64_t idleDelta = idle - _lastPrepareIdle;
+  uint64_t busy = elapsed > idleDelta ? elapsed - idleDelta : 0;
+
+  _ioBusy.record(busy);
+  _busy.fetch_add(busy, std::memory_order_relaxed);
+  _iterations.fetch_add(1, std::memory_order_relaxed);
+
+  _lastPrepare = now;
+  _lastPrepareIdle = idle;
+}
+
+void LoopMonitor::onHeartbeatTimer() {
+  ASSERT_BACKGROUND_THREAD()
+  uint64_t now = uv_hrtime();
+  uint64_t idle = uv_metrics_idle_time(_loop);
+
+  Sample sample;
+  sample.seq = ++_seq;
+  sample.time = wall_time();
+  sample.ioUtilization = R_NaN;
+  sample.mainLag = R_NaN;
+  if (now > _lastTick) {
+    double utilization = 1.0 - (double)(idle - _lastTickIdle) / (now - _lastTick);
+    sample.ioUtilization = std::max(0.0, std::min(1.0, utilization));
+  }
+  _lastTick = now;
+  _lastTickIdle = idle;
+
+  {
+    guard guard(_mutex);
+    if (_samples.size() < (size_t)N_SAMPLES) {
+      _samples.push_back(sample);
+    } else {
+      _samples[_nextSample] = sample;
+    }
+    _nextSample = (_nextSample + 1) % N_SAMPLES;
+  }
+
+  // If the previous heartbeat hasn't arrived yet, the main thread is still
+  // busy; its lag will be recorded when it does.
+  bool expected = false;
+  if (_heartbeatInFlight.compare_exchange_strong(expected, true)) {
+    invoke_later(
+      std::bind(&LoopMonitor::onHeartbeatReceived, this, sample.seq, now)
+    );
+  }
+}
+
+void LoopMonitor::onHeartbeatReceived(uint64_t seq, uint64_t sent) {
+  ASSERT_MAIN_THREAD()
+  uint64_t lag_ns = uv_hrtime() - sent;
+  double lag = lag_ns / 1e9;
+  _heartbeatInFlight.store(false);
+  _mainLag.record(lag_ns);
+
+  {
+    guard guard(_mutex);
+    for (size_t i = 0; i < _samples.size(); i++) {
+      if (_samples[i].seq == seq) {
+        _samples[i].mainLag = lag;
+        break;
+      }
+    }
+  }
+
+  if (lag > _lagThreshold) {
+    _lagWarnings++;
+    if (_onLag != NULL) {
+      Rcpp::Function onLag(*_onLag);
+      onLag(lag);
+    }
+  }
+}
+
+Rcpp::List LoopMonitor::asRObject() const {
+  ASSERT_MAIN_THREAD()
+  using namespace Rcpp;
+
+  uint64_t start = _start.load();
+  double utilization = R_NaN;
+  if (start != 0) {
+    uint64_t elapsed = uv_hrtime() - start;
+    if (elapsed > 0) {
+      utilization = std::min(1.0, (double)_busy.load() / elapsed);
+    }
+  }
+
+  std::vector<double> time, ioUtilization, mainLag;
+  {
+    guard guard(_mutex);
+    // Oldest first
+    size_t n = _samples.size();
+    size_t first = (n < (size_t)N_SAMPLES) ? 0 : _nextSample;
+    for (size_t i = 0; i < n; i++) {
+      const Sample& sample = _samples[(first + i) % n];
+      time.push_back(sample.time);
+      ioUtilization.push_back(sample.ioUtilization);
+      mainLag.push_back(sample.mainLag);
+    }
+  }
+
+  List samples = List::create(
+    _["time"]          = wrap(time),
+    _["ioUtilization"] = wrap(ioUtilization),
+    _["mainLag"]       = wrap(mainLag)
+  );
+
+  uint64_t interval = _heartbeatInterval.load();
+  return List::create(
+    _["heartbeatInterval"] = interval > 0 ? interval / 1e3 : R_NaN,
+    _["io"] = List::create(
+      _["utilization"] = utilization,
+      _["iterations"]  = (double)_iterations.load(),
+      _["busy"]        = _ioBusy.asRObject()
+    ),
+    _["main"] = List::create(
+      _["lag"]         = _mainLag.asRObject(),
+      _["lagWarnings"] = (double)_lagWarnings
+    ),
+    _["samples"] = samples
+  );
+}
+
+void LoopMonitor::writePrometheus(std::ostream& os) const {
+  os << "# HELP httpuv_io_loop_busy_seconds_total Time the I/O loop spent not waiting for I/O.\n"
+     << "# TYPE httpuv_io_loop_busy_seconds_total counter\n"
+     << "httpuv_io_loop_busy_seconds_total " << _busy.load() / 1e9 << "\n";
+  os << "# HELP httpuv_io_loop_iteration_seconds Busy time per I/O loop iteration.\n"
+     << "# TYPE httpuv_io_loop_iteration_seconds histogram\n";
+  _ioBusy.writePrometheus(os, "httpuv_io_loop_iteration_seconds", "");
+  os << "# HELP httpuv_main_thread_lag_seconds Time a heartbeat took to run on the R main thread.\n"
+     << "# TYPE httpuv_main_thread_lag_seconds histogram\n";
+  _mainLag.writePrometheus(os, "httpuv_main_thread_lag_seconds", "");
+}
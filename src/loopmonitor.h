@@ -0,0 +1,101 @@
+#ifndef LOOPMONITOR_HPP
+#define LOOPMONITOR_HPP
+
+#include <atomic>
+#include <ostream>
+#include <vector>
+#include <stdint.h>
+#include <uv.h>
+#include <Rcpp.h>
+#include "histogram.h"
+#include "thread.h"
+
+// Measures how busy the background I/O loop and the R main thread are, so
+// that slow responses can be attributed to one or the other. There is one
+// LoopMonitor, since all servers share the same I/O loop.
+//
+// For the I/O loop, a prepare handle runs just before the loop blocks waiting
+// for I/O. Each time, the time since the previous prepare callback, minus the
+// time that libuv spent idle (waiting in poll), is how long the loop was busy
+// for that iteration. Total busy time over elapsed time is the utilization.
+//
+// For the main thread, a heartbeat timer on the I/O thread periodically sends
+// a no-op callback to the main thread with invoke_later(). The time it takes
+// to run is the main thread lag: how long a request would have waited for R
+// at that moment. Only one heartbeat is in flight at a time, so a blocked
+// main thread doesn't build up a backlog of them.
+class LoopMonitor {
+public:
+  static const int N_SAMPLES = 120;
+
+  LoopMonitor();
+
+  // Called on the background thread when the I/O loop is created, before it
+  // runs. The heartbeat is restarted if it was enabled.
+  void attach(uv_loop_t* loop);
+
+  // Start or stop the heartbeat. These are called on the background thread.
+  // `interval` is in milliseconds.
+  void startHeartbeat(uint64_t interval);
+  void stopHeartbeat();
+
+  // Set the lag, in seconds, above which `onLag` is called on the main thread
+  // with the lag. `onLag` may be NULL.
+  void setLagHook(double threshold, Rcpp::RObject onLag);
+
+  Rcpp::List asRObject() const;
+  void writePrometheus(std::ostream& os) const;
+
+  // Callbacks from libuv and the main thread. These are public so that they
+  // can be called from the C callback functions.
+  void onPrepare();
+  void onHeartbeatTimer();
+  void onHeartbeatReceived(uint64_t seq, uint64_t sent);
+
+private:
+  // One heartbeat interval. `mainLag` is NaN until the heartbeat sent at the
+  // start of the interval arrives, and stays NaN if it was skipped.
+  struct Sample {
+    uint64_t seq;
+    double time;            // Seconds since the epoch
+    double ioUtilization;   // Over the interval, between 0 and 1
+    double mainLag;         // Seconds
+  };
+
+  uv_loop_t* _loop;
+  uv_prepare_t _prepare;
+  uv_timer_t _timer;
+
+  // Background thread only
+  uint64_t _lastPrepare;
+  uint64_t _lastPrepareIdle;
+  uint64_t _lastTick;
+  uint64_t _lastTickIdle;
+  uint64_t _seq;
+
+  // Start of monitoring, and total busy time since then, for the overall
+  // utilization.
+  std::atomic<uint64_t> _start;
+  std::atomic<uint64_t> _busy;
+  std::atomic<uint64_t> _iterations;
+  std::atomic<uint64_t> _heartbeatInterval;
+  std::atomic<bool> _heartbeatInFlight;
+
+  // Busy time per loop iteration, and main thread lag.
+  Histogram _ioBusy;
+  Histogram _mainLag;
+
+  // Recent samples, in a ring. Guarded by _mutex.
+  std::vector<Sample> _samples;
+  size_t _nextSample;
+  mutable uv_mutex_t _mutex;
+
+  // Main thread only
+  double _lagThreshold;
+  Rcpp::RObject* _onLag;
+  uint64_t _lagWarnings;
+};
+
+LoopMonitor& get_loop_monitor();
+
+#endif
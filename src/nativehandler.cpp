@@ -0,0 +1,257 @@
+#include "nativehandler.h"
+#include "httprequest.h"
+#include "httpresponse.h"
+#include "webapplication.h"
+#include "httpuv.h"
+#include "thread.h"
+#include "utils.h"
+
+// ============================================================================
+// Request and response objects passed to handlers
+// ============================================================================
+
+// These extend the public httpuv_request/httpuv_response structs, whose only
+// member is a pointer to the function table below.
+struct NativeRequest : public httpuv_request {
+  std::shared_ptr<HttpRequest> pRequest;
+  std::string method;
+  std::string path;
+  std::string query;
+};
+
+struct NativeResponse : public httpuv_response {
+  int status;
+  ResponseHeaders headers;
+  std::vector<uint8_t> body;
+};
+
+static const char* native_request_method(const httpuv_request* req) {
+  return static_cast<const NativeRequest*>(req)->method.c_str();
+}
+
+static const char* native_request_path(const httpuv_request* req) {
+  return static_cast<const NativeRequest*>(req)->path.c_str();
+}
+
+static const char* native_request_query(const httpuv_request* req) {
+  return static_cast<const NativeRequest*>(req)->query.c_str();
+}
+
+static const char* native_request_header(const httpuv_request* req, const char* name) {
+  const RequestHeaders& headers = static_cast<const NativeRequest*>(req)->pRequest->headers();
+  RequestHeaders::const_iterator it = headers.find(name);
+  if (it == headers.end()) {
+    return NULL;
+  }
+  return it->second.c_str();
+}
+
+static void native_response_set_status(httpuv_response* res, int status) {
+  static_cast<NativeResponse*>(res)->status = status;
+}
+
+static void native_response_add_header(httpuv_response* res, const char* name, const char* value) {
+  static_cast<NativeResponse*>(res)->headers.push_back(
+    std::pair<std::string, std::string>(name, value)
+  );
+}
+
+static void native_response_set_body(httpuv_response* res, const void* data, size_t len) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  static_cast<NativeResponse*>(res)->body.assign(p, p + len);
+}
+
+static const httpuv_api native_api = {
+  HTTPUV_API_VERSION,
+  native_request_method,
+  native_request_path,
+  native_request_query,
+  native_request_header,
+  native_response_set_status,
+  native_response_add_header,
+  native_response_set_body
+};
+
+
+// ============================================================================
+// NativeHandler
+// ============================================================================
+
+static void native_handler_finalizer(SEXP handler_xptr) {
+  NativeHandler* pHandler = static_cast<NativeHandler*>(R_ExternalPtrAddr(handler_xptr));
+  if (pHandler) {
+    delete pHandler;
+    R_ClearExternalPtr(handler_xptr);
+  }
+}
+
+SEXP make_native_handler(int version, httpuv_handler_fn fn, void* data) {
+  ASSERT_MAIN_THREAD()
+  if (version > HTTPUV_API_VERSION) {
+    Rf_error("Native handler was compiled against a newer version of httpuv.");
+  }
+  if (fn == NULL) {
+    Rf_error("Native handler function must not be NULL.");
+  }
+
+  SEXP handler_xptr = PROTECT(R_MakeExternalPtr(
+    new NativeHandler(fn, data),
+    Rf_install("httpuv_handler"),
+    R_NilValue
+  ));
+  R_RegisterCFinalizerEx(handler_xptr, native_handler_finalizer, TRUE);
+  UNPROTECT(1);
+  return handler_xptr;
+}
+
+NativeHandler::NativeHandler(SEXP handler_xptr) {
+  ASSERT_MAIN_THREAD()
+  if (TYPEOF(handler_xptr) != EXTPTRSXP ||
+      R_ExternalPtrTag(handler_xptr) != Rf_install("httpuv_handler"))
+  {
+    throw Rcpp::exception("Native handler must be an external pointer created by httpuv_make_handler().");
+  }
+
+  NativeHandler* pHandler = static_cast<NativeHandler*>(R_ExternalPtrAddr(handler_xptr));
+  if (!pHandler) {
+    throw Rcpp::exception("Native handler external pointer is NULL.");
+  }
+
+  fn   = pHandler->fn;
+  data = pHandler->data;
+}
+
+
+// ============================================================================
+// NativeHandlerManager
+// ============================================================================
+
+NativeHandlerManager::NativeHandlerManager() {
+  uv_mutex_init(&mutex);
+}
+
+void NativeHandlerManager::set(const std::string& prefix, const NativeHandler& handler) {
+  guard guard(mutex);
+  std::map<std::string, NativeHandler>::iterator it = handler_map.find(prefix);
+  if (it != handler_map.end()) {
+    it->second = handler;
+  } else {
+    handler_map.insert(std::pair<std::string, NativeHandler>(prefix, handler));
+  }
+}
+
+void NativeHandlerManager::remove(const std::string& prefix) {
+  guard guard(mutex);
+  handler_map.erase(prefix);
+}
+
+// Finds the handler with the longest prefix that matches url_path. A prefix
+// matches if it is equal to the path, or if it is followed by a '/' in the
+// path; so "/foo" matches "/foo" and "/foo/bar", but not "/foobar". The
+// prefix "/" matches every path.
+std::experimental::optional<NativeHandler> NativeHandlerManager::match(
+  const std::string& url_path) const
+{
+  guard guard(mutex);
+  if (handler_map.empty()) {
+    return std::experimental::nullopt;
+  }
+
+  std::string path = url_path;
+  while (true) {
+    std::map<std::string, NativeHandler>::const_iterator it = handler_map.find(path);
+    if (it != handler_map.end()) {
+      return it->second;
+    }
+
+    if (path == "/" || path.empty()) {
+      return std::experimental::nullopt;
+    }
+
+    size_t idx = path.find_last_of('/');
+    if (idx == std::string::npos) {
+      return std::experimental::nullopt;
+    }
+    path = (idx == 0) ? "/" : path.substr(0, idx);
+  }
+}
+
+std::shared_ptr<HttpResponse> NativeHandlerManager::handle(
+  std::shared_ptr<HttpRequest> pRequest) const
+{
+  ASSERT_BACKGROUND_THREAD()
+
+  // WebSocket upgrades always go to the application.
+  if (pRequest->hasHeader("Upgrade")) {
+    return std::shared_ptr<HttpResponse>();
+  }
+
+  std::pair<std::string, std::string> url_query = splitQueryString(pRequest->url());
+  std::string url_path = doDecodeURI(url_query.first, true);
+
+  std::experimental::optional<NativeHandler> handler = match(url_path);
+  if (!handler) {
+    return std::shared_ptr<HttpResponse>();
+  }
+
+  NativeRequest req;
+  req.api      = &native_api;
+  req.pRequest = pRequest;
+  req.method   = pRequest->method();
+  req.path     = url_path;
+  req.query    = url_query.second;
+
+  NativeResponse res;
+  res.api    = &native_api;
+  res.status = 200;
+
+  int handled;
+  try {
+    handled = handler->fn(&req, &res, handler->data);
+  } catch (...) {
+    debug_log("Exception occurred in native handler", LOG_INFO);
+    return error_response(pRequest, 500);
+  }
+
+  if (!handled) {
+    return std::shared_ptr<HttpResponse>();
+  }
+
+  // Responses to HEAD, and with statuses that can't have a body, are sent
+  // without the body that the handler set. A HEAD response still gets the
+  // length that the body would have had.
+  bool isHead = req.method == "HEAD";
+  bool bodyAllowed = !(res.status >= 100 && res.status < 200) &&
+    res.status != 204 && res.status != 304;
+
+  std::shared_ptr<DataSource> pDataSource;
+  if (!isHead && bodyAllowed) {
+    pDataSource = std::make_shared<InMemoryDataSource>(res.body);
+  }
+
+  std::shared_ptr<HttpResponse> pResponse(
+    new HttpResponse(pRequest, res.status, getStatusDescription(res.status), pDataSource),
+    auto_deleter_background<HttpResponse>
+  );
+
+  ResponseHeaders::const_iterator it;
+  for (it = res.headers.begin(); it != res.headers.end(); it++) {
+    pResponse->addHeader(it->first, it->second);
+  }
+  if (isHead && bodyAllowed) {
+    pResponse->addHeader("Content-Length", toString(res.body.size()));
+  }
+
+  return pResponse;
+}
+
+Rcpp::CharacterVector NativeHandlerManager::prefixes() const {
+  ASSERT_MAIN_THREAD()
+  guard guard(mutex);
+  std::vector<std::string> result;
+  std::map<std::string, NativeHandler>::const_iterator it;
+  for (it = handler_map.begin(); it != handler_map.end(); it++) {
+    result.push_back(it->first);
+  }
+  return Rcpp::wrap(result);
+}
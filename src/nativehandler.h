@@ -0,0 +1,57 @@
+#ifndef NATIVEHANDLER_HPP
+#define NATIVEHANDLER_HPP
+
+#include <string>
+#include <map>
+#include <memory>
+#include <Rcpp.h>
+#include <httpuv_api.h>
+#include "optional.h"
+#include "thread.h"
+
+class HttpRequest;
+class HttpResponse;
+
+// A request handler written in compiled code, from another package. See
+// inst/include/httpuv_api.h for the public side of this API.
+class NativeHandler {
+public:
+  httpuv_handler_fn fn;
+  void* data;
+
+  NativeHandler(httpuv_handler_fn fn, void* data) : fn(fn), data(data) {}
+  // Extracts the handler from an external pointer created by
+  // httpuv_make_handler().
+  NativeHandler(SEXP handler_xptr);
+};
+
+
+// Keeps track of the native handlers for a server, by URL prefix. Handlers
+// are added and removed on the main thread, and matched against requests on
+// the background thread.
+class NativeHandlerManager {
+  std::map<std::string, NativeHandler> handler_map;
+  // Mutex is used whenever handler_map is accessed.
+  mutable uv_mutex_t mutex;
+
+public:
+  NativeHandlerManager();
+
+  void set(const std::string& prefix, const NativeHandler& handler);
+  void remove(const std::string& prefix);
+
+  std::experimental::optional<NativeHandler> match(const std::string& url_path) const;
+
+  // Runs the handler for the request's path, if there is one. Returns an
+  // empty shared_ptr if no handler matched, or if the handler declined the
+  // request.
+  std::shared_ptr<HttpResponse> handle(std::shared_ptr<HttpRequest> pRequest) const;
+
+  Rcpp::CharacterVector prefixes() const;
+};
+
+
+// Registered with R_RegisterCCallable() as "httpuv_make_handler".
+SEXP make_native_handler(int version, httpuv_handler_fn fn, void* data);
+
+#endif
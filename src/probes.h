@@ -0,0 +1,66 @@
+#ifndef PROBES_HPP
+#define PROBES_HPP
+
+// Statically-defined tracepoints (USDT probes) for tools like bpftrace and
+// perf. On Linux, when <sys/sdt.h> is available (for example, from the
+// systemtap-sdt-dev or systemtap-sdt-devel package), each probe compiles to a
+// single nop instruction plus a note in the ELF file that tells the tracer
+// where the probe and its arguments are. When no tracer is attached, that
+// nop is the only cost. Elsewhere, or when compiled with -DHTTPUV_NO_PROBES,
+// the probes compile to nothing.
+//
+// The arguments are evaluated even when no tracer is attached, so they must
+// be cheap: integers, or pointers to strings that already exist.
+//
+// The probes, all in the "httpuv" provider, are:
+//
+//   connection__accept(conn_id)
+//   connection__close(conn_id)
+//   request__begin(conn_id)
+//   request__headers(conn_id, method, url)  method is http_parser's enum
+//   request__body(conn_id, bytes)
+//   request__complete(conn_id)
+//   r__dispatch(conn_id)                    Request is sent to R
+//   r__return(conn_id, status)              R returned; status 0 means none
+//   response__write__start(conn_id, status, header_bytes)
+//   response__write__done(conn_id, status, body_bytes)
+//   ws__frame__receive(conn_id, opcode, bytes)
+//   ws__frame__send(conn_id, opcode, bytes)
+//   gzip__chunk(in_bytes, out_bytes)
+//
+// conn_id is unique for each connection accepted by the process. For example:
+//
+//   bpftrace -e 'usdt:/path/to/httpuv.so:httpuv:r__dispatch { @s[arg0] = nsecs; }
+//                usdt:/path/to/httpuv.so:httpuv:r__return /@s[arg0]/ {
+//                  @r = hist(nsecs - @s[arg0]); delete(@s[arg0]); }'
+
+#if defined(__linux__) && !defined(HTTPUV_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HTTPUV_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef HTTPUV_HAVE_PROBES
+
+#define HTTPUV_PROBE1(name, a1) \
+  DTRACE_PROBE1(httpuv, name, a1)
+#define HTTPUV_PROBE2(name, a1, a2) \
+  DTRACE_PROBE2(httpuv, name, a1, a2)
+#define HTTPUV_PROBE3(name, a1, a2, a3) \
+  DTRACE_PROBE3(httpuv, name, a1, a2, a3)
+
+#else
+
+// The arguments are not evaluated, but are still referenced so that
+// variables used only by probes don't cause unused variable warnings.
+#define HTTPUV_PROBE1(name, a1) \
+  do { (void)sizeof(a1); } while (0)
+#define HTTPUV_PROBE2(name, a1, a2) \
+  do { (void)sizeof(a1); (void)sizeof(a2); } while (0)
+#define HTTPUV_PROBE3(name, a1, a2, a3) \
+  do { (void)sizeof(a1); (void)sizeof(a2); (void)sizeof(a3); } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,555 @@
+#include "replay.h"
+#include "http-parser/http_parser.h"
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <string.h>
+
+static uint64_t get_u32(const unsigned char* p) {
+  uint64_t x = 0;
+  for (int i = 3; i >= 0; i--) {
+    x = (x << 8) | p[i];
+  }
+  return x;
+}
+
+static uint64_t get_u64(const unsigned char* p) {
+  uint64_t x = 0;
+  for (int i = 7; i >= 0; i--) {
+    x = (x << 8) | p[i];
+  }
+  return x;
+}
+
+
+// ============================================================================
+// ReplayConnection
+// ============================================================================
+
+// One captured connection. It is opened at the time of its first record, and
+// then works through the records in order: data is sent when it is due, and
+// a response record waits until a response has started to arrive.
+class ReplayConnection {
+public:
+  ReplayConnection(TrafficReplay* pReplay) :
+    _pReplay(pReplay),
+    _state(WAITING),
+    _next(0),
+    _handlesOpen(0),
+    _requestStart(true),
+    _head(false),
+    _upgraded(false),
+    _responsesSeen(0),
+    _responsesPassed(0),
+    _lastSentAt(0),
+    _lastDataTime(0)
+  {
+  }
+
+  std::vector<ReplayEvent> events;
+
+  void begin();
+  void close();
+
+  void onTimer();
+  void onConnect(int status);
+  void onRead(ssize_t nread, const uv_buf_t* buf);
+  void onClosed();
+  int onMessageBegin();
+  int onHeadersComplete();
+
+private:
+  enum State {
+    WAITING,
+    CONNECTING,
+    OPEN,
+    CLOSING
+  };
+
+  void _advance();
+  void _send(const ReplayEvent& event);
+  bool _expectingMore() const;
+
+  TrafficReplay* _pReplay;
+  State _state;
+  size_t _next;
+  int _handlesOpen;
+
+  uv_tcp_t _handle;
+  uv_connect_t _connectReq;
+  uv_timer_t _timer;
+  http_parser _parser;
+
+  // The next chunk sent starts a request; this is used to tell whether it's
+  // a HEAD request.
+  bool _requestStart;
+  bool _head;
+  // After a 101 response, the rest of the connection isn't HTTP.
+  bool _upgraded;
+  std::vector<int> _statuses;
+  size_t _responsesSeen;
+  size_t _responsesPassed;
+  // When the last chunk of data was sent, and when it was originally
+  // received.
+  uint64_t _lastSentAt;
+  uint64_t _lastDataTime;
+};
+
+static void ReplayConnection_on_timer(uv_timer_t* handle) {
+  reinterpret_cast<ReplayConnection*>(handle->data)->onTimer();
+}
+
+static void ReplayConnection_on_connect(uv_connect_t* req, int status) {
+  reinterpret_cast<ReplayConnection*>(req->data)->onConnect(status);
+}
+
+static void ReplayConnection_on_write(uv_write_t* req, int status) {
+  // The data belongs to the events, so only the request is freed.
+  free(req);
+}
+
+static void ReplayConnection_on_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
+  TrafficReplay* pReplay = reinterpret_cast<TrafficReplay*>(handle->loop->data);
+  *buf = uv_buf_init(pReplay->readBuf, sizeof(pReplay->readBuf));
+}
+
+static void ReplayConnection_on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+  reinterpret_cast<ReplayConnection*>(stream->data)->onRead(nread, buf);
+}
+
+static void ReplayConnection_on_closed(uv_handle_t* handle) {
+  reinterpret_cast<ReplayConnection*>(handle->data)->onClosed();
+}
+
+static int ReplayConnection_on_message_begin(http_parser* pParser) {
+  return reinterpret_cast<ReplayConnection*>(pParser->data)->onMessageBegin();
+}
+
+static int ReplayConnection_on_headers_complete(http_parser* pParser) {
+  return reinterpret_cast<ReplayConnection*>(pParser->data)->onHeadersComplete();
+}
+
+static http_parser_settings& replay_settings() {
+  static http_parser_settings settings;
+  settings.on_message_begin = ReplayConnection_on_message_begin;
+  settings.on_headers_complete = ReplayConnection_on_headers_complete;
+  return settings;
+}
+
+void ReplayConnection::begin() {
+  for (size_t i = 0; i < events.size(); i++) {
+    if (events[i].type == CAPTURE_RESPONSE) {
+      _statuses.push_back(events[i].status);
+    }
+  }
+
+  uv_timer_init(_pReplay->loop(), &_timer);
+  _timer.data = this;
+  _handlesOpen++;
+
+  uint64_t due = _pReplay->dueTime(events[0].time);
+  uint64_t now = uv_hrtime();
+  uv_timer_start(&_timer, ReplayConnection_on_timer,
+                 due > now ? (due - now) / 1000000 : 0, 0);
+}
+
+void ReplayConnection::onTimer() {
+  if (_state == WAITING) {
+    _state = CONNECTING;
+    uv_tcp_init(_pReplay->loop(), &_handle);
+    _handle.data = this;
+    _handlesOpen++;
+    uv_tcp_nodelay(&_handle, 1);
+    http_parser_init(&_parser, HTTP_RESPONSE);
+    _parser.data = this;
+    _connectReq.data = this;
+
+    int r = uv_tcp_connect(&_connectReq, &_handle, _pReplay->address(),
+                           ReplayConnection_on_connect);
+    if (r != 0) {
+      _pReplay->connectErrors++;
+      close();
+    }
+    return;
+  }
+  _advance();
+}
+
+void ReplayConnection::onConnect(int status) {
+  if (_state == CLOSING) {
+    return;
+  }
+  if (status != 0) {
+    _pReplay->connectErrors++;
+    close();
+    return;
+  }
+  _state = OPEN;
+  uv_read_start((uv_stream_t*)&_handle, ReplayConnection_on_alloc,
+                ReplayConnection_on_read);
+  _advance();
+}
+
+void ReplayConnection::_advance() {
+  while (_state == OPEN && _next < events.size()) {
+    const ReplayEvent& event = events[_next];
+
+    if (event.type == CAPTURE_RESPONSE) {
+      // Wait for the response to start arriving, unless the connection has
+      // switched protocols and no more HTTP responses will come.
+      if (!_upgraded) {
+        if (_responsesSeen <= _responsesPassed) {
+          return;
+        }
+        if (_lastSentAt != 0 && event.time >= _lastDataTime) {
+          _pReplay->original.record(event.time - _lastDataTime);
+        }
+      }
+      _responsesPassed++;
+      _requestStart = true;
+      _next++;
+      continue;
+    }
+
+    uint64_t due = _pReplay->dueTime(event.time);
+    uint64_t now = uv_hrtime();
+    if (due > now) {
+      // Round up, so the timer doesn't fire just before the data is due.
+      uv_timer_start(&_timer, ReplayConnection_on_timer,
+                     (due - now + 999999) / 1000000, 0);
+      return;
+    }
+
+    _next++;
+    if (event.type == CAPTURE_DATA) {
+      _send(event);
+    } else if (event.type == CAPTURE_CLOSE) {
+      close();
+      return;
+    }
+  }
+
+  if (_state == OPEN && _next >= events.size()) {
+    // The capture stopped while the connection was still open.
+    close();
+  }
+}
+
+void ReplayConnection::_send(const ReplayEvent& event) {
+  if (event.data.empty()) {
+    return;
+  }
+  if (_requestStart && !_upgraded) {
+    _head = event.data.size() >= 5 && memcmp(&event.data[0], "HEAD ", 5) == 0;
+    _requestStart = false;
+  }
+
+  uv_write_t* pReq = (uv_write_t*)malloc(sizeof(uv_write_t));
+  uv_buf_t buf = uv_buf_init(const_cast<char*>(&event.data[0]), event.data.size());
+  int r = uv_write(pReq, (uv_stream_t*)&_handle, &buf, 1, ReplayConnection_on_write);
+  if (r != 0) {
+    free(pReq);
+    _pReplay->socketErrors++;
+    close();
+    return;
+  }
+  _pReplay->bytesSent += event.data.size();
+  _lastSentAt = uv_hrtime();
+  _lastDataTime = event.time;
+}
+
+// Whether there is more data to send or responses to receive.
+bool ReplayConnection::_expectingMore() const {
+  for (size_t i = _next; i < events.size(); i++) {
+    if (events[i].type == CAPTURE_DATA ||
+        (events[i].type == CAPTURE_RESPONSE && !_upgraded))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+void ReplayConnection::onRead(ssize_t nread, const uv_buf_t* buf) {
+  if (_state == CLOSING) {
+    return;
+  }
+
+  if (nread > 0) {
+    _pReplay->bytesReceived += nread;
+    if (_upgraded) {
+      return;
+    }
+    size_t parsed = http_parser_execute(&_parser, &replay_settings(), buf->base, nread);
+    if (_parser.upgrade) {
+      _upgraded = true;
+      _advance();
+    } else if (parsed < (size_t)nread) {
+      _pReplay->protocolErrors++;
+      close();
+    }
+
+  } else if (nread < 0) {
+    if (nread == UV_EOF && !_upgraded) {
+      // A response without a length ends when the connection is closed.
+      http_parser_execute(&_parser, &replay_settings(), NULL, 0);
+    }
+    if (_state == CLOSING) {
+      return;
+    }
+    if (_expectingMore()) {
+      // The server closed the connection when the capture says it didn't.
+      _pReplay->socketErrors++;
+    }
+    close();
+  }
+}
+
+int ReplayConnection::onMessageBegin() {
+  _responsesSeen++;
+  if (_lastSentAt != 0) {
+    _pReplay->replayed.record(uv_hrtime() - _lastSentAt);
+  }
+  _pReplay->responses++;
+  return 0;
+}
+
+int ReplayConnection::onHeadersComplete() {
+  size_t i = _responsesSeen - 1;
+  if (i >= _statuses.size() || _statuses[i] != (int)_parser.status_code) {
+    _pReplay->statusMismatches++;
+  }
+  // The response to a HEAD request has no body, whatever its Content-Length.
+  int result = _head ? 1 : 0;
+  // The next data may have been waiting for this response. It's sent from
+  // here rather than when the response is complete, since that's when it
+  // was originally received too.
+  _advance();
+  return result;
+}
+
+void ReplayConnection::close() {
+  if (_state == CLOSING) {
+    return;
+  }
+  bool connected = _state != WAITING;
+  _state = CLOSING;
+  uv_close((uv_handle_t*)&_timer, ReplayConnection_on_closed);
+  if (connected) {
+    uv_close((uv_handle_t*)&_handle, ReplayConnection_on_closed);
+  }
+}
+
+void ReplayConnection::onClosed() {
+  if (--_handlesOpen == 0) {
+    _pReplay->connectionDone(this);
+  }
+}
+
+
+// ============================================================================
+// TrafficReplay
+// ============================================================================
+
+static void replay_thread(void* data) {
+  reinterpret_cast<TrafficReplay*>(data)->run();
+}
+
+static void on_replay_tick(uv_timer_t* handle) {
+  reinterpret_cast<TrafficReplay*>(handle->data)->tick();
+}
+
+TrafficReplay::TrafficReplay(const std::string& host, int port, double speed) :
+  responses(0),
+  statusMismatches(0),
+  bytesSent(0),
+  bytesReceived(0),
+  connectErrors(0),
+  socketErrors(0),
+  protocolErrors(0),
+  _host(host),
+  _port(port),
+  _speed(speed),
+  _remaining(0),
+  _stop(false),
+  _running(false),
+  _stopping(false),
+  _joined(true),
+  _start(0),
+  _end(0)
+{
+  memset(&_address, 0, sizeof(_address));
+}
+
+TrafficReplay::~TrafficReplay() {
+  stop();
+  _join();
+  for (size_t i = 0; i < _connections.size(); i++) {
+    delete _connections[i];
+  }
+}
+
+// Reads the records and groups them by connection. A truncated last record
+// is ignored, since the file may have been copied while a capture was still
+// running.
+void TrafficReplay::_read(const std::string& path) {
+  std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+  if (!file) {
+    throw Rcpp::exception(("Can't open capture file " + path).c_str());
+  }
+  std::vector<char> contents((std::istreambuf_iterator<char>(file)),
+                             std::istreambuf_iterator<char>());
+
+  if (contents.size() < CAPTURE_FILE_HEADER_BYTES ||
+      memcmp(&contents[0], CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0)
+  {
+    throw Rcpp::exception((path + " is not an httpuv capture file").c_str());
+  }
+
+  std::map<uint64_t, ReplayConnection*> byId;
+  size_t pos = CAPTURE_FILE_HEADER_BYTES;
+  while (contents.size() - pos >= CAPTURE_RECORD_HEADER_BYTES) {
+    const unsigned char* p = (const unsigned char*)&contents[pos];
+    uint64_t len = get_u32(p + 17);
+    if (contents.size() - pos - CAPTURE_RECORD_HEADER_BYTES < len) {
+      break;
+    }
+
+    ReplayEvent event;
+    event.type = (CaptureRecordType)p[0];
+    event.time = get_u64(p + 9);
+    event.status = 0;
+    const char* data = &contents[pos + CAPTURE_RECORD_HEADER_BYTES];
+    if (event.type == CAPTURE_RESPONSE && len >= 4) {
+      event.status = (int)get_u32((const unsigned char*)data);
+    } else if (event.type == CAPTURE_DATA) {
+      event.data.assign(data, data + len);
+    }
+    pos += CAPTURE_RECORD_HEADER_BYTES + len;
+
+    if (event.type < CAPTURE_OPEN || event.type > CAPTURE_CLOSE) {
+      continue;
+    }
+
+    uint64_t connId = get_u64(p + 1);
+    ReplayConnection*& pConn = byId[connId];
+    if (pConn == NULL) {
+      pConn = new ReplayConnection(this);
+      _connections.push_back(pConn);
+    }
+    pConn->events.push_back(event);
+  }
+}
+
+void TrafficReplay::start(const std::string& path) {
+  _read(path);
+  resolve_address(_host, _port, &_address);
+
+  _remaining = _connections.size();
+  _running.store(true);
+  _joined = false;
+  int r = uv_thread_create(&_thread, replay_thread, this);
+  if (r != 0) {
+    _running.store(false);
+    _joined = true;
+    throw Rcpp::exception(
+      (std::string("Can't create replay thread: ") + uv_strerror(r)).c_str()
+    );
+  }
+}
+
+void TrafficReplay::run() {
+  uv_loop_init(&_loop);
+  _loop.data = this;
+
+  // The stop flag is checked every 10ms, rather than using a uv_async_t, so
+  // that the main thread never touches this loop.
+  uv_timer_init(&_loop, &_tick);
+  _tick.data = this;
+  uv_timer_start(&_tick, on_replay_tick, 10, 10);
+
+  _start = uv_hrtime();
+  if (_connections.empty()) {
+    uv_close((uv_handle_t*)&_tick, NULL);
+  }
+  for (size_t i = 0; i < _connections.size(); i++) {
+    _connections[i]->begin();
+  }
+
+  uv_run(&_loop, UV_RUN_DEFAULT);
+  uv_loop_close(&_loop);
+
+  _end = uv_hrtime();
+  _running.store(false);
+}
+
+void TrafficReplay::tick() {
+  if (_stopping || !_stop.load()) {
+    return;
+  }
+  _stopping = true;
+  for (size_t i = 0; i < _connections.size(); i++) {
+    _connections[i]->close();
+  }
+}
+
+void TrafficReplay::connectionDone(ReplayConnection* pConn) {
+  if (--_remaining == 0) {
+    // With the timer closed there's nothing left in the loop, so it exits.
+    uv_close((uv_handle_t*)&_tick, NULL);
+  }
+}
+
+void TrafficReplay::stop() {
+  _stop.store(true);
+}
+
+bool TrafficReplay::finished() const {
+  return !_running.load();
+}
+
+void TrafficReplay::_join() {
+  if (_joined) {
+    return;
+  }
+  uv_thread_join(&_thread);
+  _joined = true;
+}
+
+uv_loop_t* TrafficReplay::loop() {
+  return &_loop;
+}
+
+const struct sockaddr* TrafficReplay::address() const {
+  return (const struct sockaddr*)&_address;
+}
+
+uint64_t TrafficReplay::dueTime(uint64_t captured) const {
+  if (_speed <= 0) {
+    return 0;
+  }
+  return _start + (uint64_t)(captured / _speed);
+}
+
+Rcpp::List TrafficReplay::results() {
+  using namespace Rcpp;
+  _join();
+
+  NumericVector errors = NumericVector::create(
+    _["connect"]  = (double)connectErrors,
+    _["socket"]   = (double)socketErrors,
+    _["protocol"] = (double)protocolErrors
+  );
+
+  return List::create(
+    _["connections"]      = (double)_connections.size(),
+    _["responses"]        = (double)responses,
+    _["duration"]         = _end > _start ? (_end - _start) / 1e9 : 0.0,
+    _["bytesSent"]        = (double)bytesSent,
+    _["bytesReceived"]    = (double)bytesReceived,
+    _["statusMismatches"] = (double)statusMismatches,
+    _["errors"]           = errors,
+    _["original"]         = original.asRObject(),
+    _["replay"]           = replayed.asRObject()
+  );
+}
@@ -0,0 +1,97 @@
+#ifndef REPLAY_HPP
+#define REPLAY_HPP
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <uv.h>
+#include <Rcpp.h>
+#include "capture.h"
+#include "loadgen.h"
+
+struct ReplayEvent {
+  CaptureRecordType type;
+  // Nanoseconds since the capture started.
+  uint64_t time;
+  std::vector<char> data;
+  // For CAPTURE_RESPONSE, the status code that was sent.
+  int status;
+};
+
+class ReplayConnection;
+
+// Replays a file written by TrafficCapture against a server. Each captured
+// connection is opened again, and the bytes it received are sent in the same
+// order, with the same timing scaled by `speed`. A chunk of data that
+// originally arrived after a response is not sent until the corresponding
+// response has arrived, so requests are never pipelined when they weren't
+// originally.
+//
+// For each response, the time from sending the last chunk before it to
+// receiving its first byte is compared to the same interval in the capture.
+//
+// Like LoadGenerator, it runs on its own thread and libuv loop, and doesn't
+// call into R from there.
+class TrafficReplay {
+public:
+  // `speed` is a multiplier for the original pacing; 0 sends everything as
+  // fast as the server responds.
+  TrafficReplay(const std::string& host, int port, double speed);
+  ~TrafficReplay();
+
+  // Reads the capture file, resolves the host and starts the thread. Throws
+  // an exception on failure.
+  void start(const std::string& path);
+  void stop();
+  bool finished() const;
+  // Waits for the thread to finish, and returns the results.
+  Rcpp::List results();
+
+  // These are used by the replay thread.
+  uv_loop_t* loop();
+  const struct sockaddr* address() const;
+  // The uv_hrtime() at which a captured time should be replayed.
+  uint64_t dueTime(uint64_t captured) const;
+  void connectionDone(ReplayConnection* pConn);
+  void run();
+  void tick();
+
+  // Results, updated on the replay thread.
+  LatencyHistogram original;
+  LatencyHistogram replayed;
+  uint64_t responses;
+  uint64_t statusMismatches;
+  uint64_t bytesSent;
+  uint64_t bytesReceived;
+  uint64_t connectErrors;
+  uint64_t socketErrors;
+  uint64_t protocolErrors;
+
+  // Shared by the connections for reading, since only one read callback
+  // runs at a time.
+  char readBuf[65536];
+
+private:
+  void _read(const std::string& path);
+  void _join();
+
+  std::string _host;
+  int _port;
+  double _speed;
+  struct sockaddr_storage _address;
+  std::vector<ReplayConnection*> _connections;
+  size_t _remaining;
+
+  uv_thread_t _thread;
+  uv_loop_t _loop;
+  uv_timer_t _tick;
+  std::atomic<bool> _stop;
+  std::atomic<bool> _running;
+  bool _stopping;
+  bool _joined;
+  uint64_t _start;
+  uint64_t _end;
+};
+
+#endif
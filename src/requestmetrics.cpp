@@ -0,0 +1,146 @@
+#include "requestmetrics.h"
+#include "thread.h"
+
+static const char* source_names[N_SOURCES] = {
+  "r", "static", "native", "cache", "coalesced", "rejected"
+};
+
+static const char* status_class_names[5] = {
+  "1xx", "2xx", "3xx", "4xx", "5xx"
+};
+
+const char* response_source_name(ResponseSource source) {
+  return source_names[source];
+}
+
+static void record_interval(Histogram& hist, uint64_t start, uint64_t end) {
+  if (start != 0 && end != 0 && end >= start) {
+    hist.record(end - start);
+  }
+}
+
+RequestMetrics::RequestMetrics() :
+  _bytesReceived(0),
+  _bytesSent(0),
+  _gzipInputBytes(0),
+  _gzipOutputBytes(0)
+{
+  for (int i = 0; i < 5; i++) {
+    _statusClass[i].store(0, std::memory_order_relaxed);
+  }
+  for (int i = 0; i < N_SOURCES; i++) {
+    _source[i].store(0, std::memory_order_relaxed);
+  }
+  uv_mutex_init(&_mutex);
+}
+
+void RequestMetrics::recordBytesReceived(size_t n) {
+  _bytesReceived.fetch_add(n, std::memory_order_relaxed);
+}
+
+void RequestMetrics::record(ResponseSource source, const RequestTimings& timings,
+                            const ResponseStats& stats)
+{
+  ASSERT_BACKGROUND_THREAD()
+
+  _bytesSent.fetch_add(stats.headerBytes + stats.bodyBytes, std::memory_order_relaxed);
+  if (stats.gzipInputBytes > 0) {
+    _gzipInputBytes.fetch_add(stats.gzipInputBytes, std::memory_order_relaxed);
+    _gzipOutputBytes.fetch_add(stats.bodyBytes, std::memory_order_relaxed);
+  }
+
+  int status_class = stats.status / 100 - 1;
+  if (status_class >= 0 && status_class < 5) {
+    _statusClass[status_class].fetch_add(1, std::memory_order_relaxed);
+  }
+  _source[source].fetch_add(1, std::memory_order_relaxed);
+
+  record_interval(_headers, timings.begin, timings.headersComplete);
+  record_interval(_application, timings.dispatched, timings.responded);
+  record_interval(_firstByte, timings.headersComplete, stats.firstByte);
+  record_interval(_write, stats.firstByte, stats.lastByte);
+  record_interval(_total, timings.begin, stats.lastByte);
+}
+
+void RequestMetrics::setPath(const std::string& path) {
+  guard guard(_mutex);
+  _path = path;
+}
+
+bool RequestMetrics::isMetricsPath(const std::string& url_path) const {
+  guard guard(_mutex);
+  return !_path.empty() && url_path == _path;
+}
+
+Rcpp::List RequestMetrics::asRObject() const {
+  using namespace Rcpp;
+
+  NumericVector status(5);
+  CharacterVector status_names(5);
+  for (int i = 0; i < 5; i++) {
+    status[i] = (double)_statusClass[i].load(std::memory_order_relaxed);
+    status_names[i] = status_class_names[i];
+  }
+  status.attr("names") = status_names;
+
+  NumericVector source(N_SOURCES);
+  CharacterVector source_names_r(N_SOURCES);
+  for (int i = 0; i < N_SOURCES; i++) {
+    source[i] = (double)_source[i].load(std::memory_order_relaxed);
+    source_names_r[i] = source_names[i];
+  }
+  source.attr("names") = source_names_r;
+
+  return List::create(
+    _["bytesReceived"]   = (double)_bytesReceived.load(std::memory_order_relaxed),
+    _["bytesSent"]       = (double)_bytesSent.load(std::memory_order_relaxed),
+    _["gzipInputBytes"]  = (double)_gzipInputBytes.load(std::memory_order_relaxed),
+    _["gzipOutputBytes"] = (double)_gzipOutputBytes.load(std::memory_order_relaxed),
+    _["status"]          = status,
+    _["source"]          = source,
+    _["phases"]          = List::create(
+      _["headers"]     = _headers.asRObject(),
+      _["application"] = _application.asRObject(),
+      _["firstByte"]   = _firstByte.asRObject(),
+      _["write"]       = _write.asRObject(),
+      _["total"]       = _total.asRObject()
+    )
+  );
+}
+
+void RequestMetrics::writePrometheus(std::ostream& os) const {
+  os << "# HELP httpuv_bytes_received_total Bytes read from client connections.\n"
+     << "# TYPE httpuv_bytes_received_total counter\n"
+     << "httpuv_bytes_received_total " << _bytesReceived.load(std::memory_order_relaxed) << "\n";
+  os << "# HELP httpuv_bytes_sent_total Bytes of HTTP responses written to clients.\n"
+     << "# TYPE httpuv_bytes_sent_total counter\n"
+     << "httpuv_bytes_sent_total " << _bytesSent.load(std::memory_order_relaxed) << "\n";
+  os << "# HELP httpuv_gzip_input_bytes_total Response body bytes before gzip compression.\n"
+     << "# TYPE httpuv_gzip_input_bytes_total counter\n"
+     << "httpuv_gzip_input_bytes_total " << _gzipInputBytes.load(std::memory_order_relaxed) << "\n";
+  os << "# HELP httpuv_gzip_output_bytes_total Response body bytes after gzip compression.\n"
+     << "# TYPE httpuv_gzip_output_bytes_total counter\n"
+     << "httpuv_gzip_output_bytes_total " << _gzipOutputBytes.load(std::memory_order_relaxed) << "\n";
+
+  os << "# HELP httpuv_responses_total HTTP responses, by status class.\n"
+     << "# TYPE httpuv_responses_total counter\n";
+  for (int i = 0; i < 5; i++) {
+    os << "httpuv_responses_total{class=\"" << status_class_names[i] << "\"} "
+       << _statusClass[i].load(std::memory_order_relaxed) << "\n";
+  }
+
+  os << "# HELP httpuv_responses_by_source_total HTTP responses, by what produced them.\n"
+     << "# TYPE httpuv_responses_by_source_total counter\n";
+  for (int i = 0; i < N_SOURCES; i++) {
+    os << "httpuv_responses_by_source_total{source=\"" << source_names[i] << "\"} "
+       << _source[i].load(std::memory_order_relaxed) << "\n";
+  }
+
+  os << "# HELP httpuv_request_phase_seconds Time spent in each phase of a request.\n"
+     << "# TYPE httpuv_request_phase_seconds histogram\n";
+  _headers.writePrometheus(os, "httpuv_request_phase_seconds", "phase=\"headers\"");
+  _application.writePrometheus(os, "httpuv_request_phase_seconds", "phase=\"application\"");
+  _firstByte.writePrometheus(os, "httpuv_request_phase_seconds", "phase=\"first_byte\"");
+  _write.writePrometheus(os, "httpuv_request_phase_seconds", "phase=\"write\"");
+  _total.writePrometheus(os, "httpuv_request_phase_seconds", "phase=\"total\"");
+}
@@ -0,0 +1,100 @@
+#ifndef REQUESTMETRICS_HPP
+#define REQUESTMETRICS_HPP
+
+#include <atomic>
+#include <ostream>
+#include <string>
+#include <stdint.h>
+#include <Rcpp.h>
+#include "histogram.h"
+#include "thread.h"
+
+// What produced the response for a request.
+enum ResponseSource {
+  SOURCE_R,          // The application's R code
+  SOURCE_STATIC,     // Static paths and routes
+  SOURCE_NATIVE,     // Native handlers
+  SOURCE_CACHE,      // The response cache
+  SOURCE_COALESCED,  // A copy of another request's response
+  SOURCE_REJECTED,   // A 503 because too many requests were pending
+  N_SOURCES
+};
+
+// Name of a response source, as used in metrics and logs: "r", "static", etc.
+const char* response_source_name(ResponseSource source);
+
+// Times (from uv_hrtime()) at which a request reached each stage on the
+// background thread. A value of 0 means that the request didn't go through
+// that stage; for example, `dispatched` is 0 for static files.
+struct RequestTimings {
+  // When the request started: when the connection was accepted for the first
+  // request on a connection, and when the request line arrived for later
+  // ones.
+  uint64_t begin;
+  uint64_t headersComplete;
+  // When the request was passed to R, and when the response was ready.
+  uint64_t dispatched;
+  uint64_t responded;
+
+  RequestTimings() : begin(0), headersComplete(0), dispatched(0), responded(0) {}
+};
+
+// Measurements that an HttpResponse makes as it is written.
+struct ResponseStats {
+  int status;
+  uint64_t headerBytes;
+  // Body bytes written to the socket, after compression and chunking.
+  uint64_t bodyBytes;
+  // Size of the body before gzip compression, if it was compressed.
+  uint64_t gzipInputBytes;
+  // When the headers were written, and when the whole response was written.
+  uint64_t firstByte;
+  uint64_t lastByte;
+
+  ResponseStats() : status(0), headerBytes(0), bodyBytes(0), gzipInputBytes(0),
+                    firstByte(0), lastByte(0) {}
+};
+
+// Counters and latency histograms for the HTTP requests handled by a server.
+// Everything is recorded on the background thread with relaxed atomics, so
+// recording never blocks, and can be read from either thread.
+class RequestMetrics {
+  std::atomic<uint64_t> _bytesReceived;
+  std::atomic<uint64_t> _bytesSent;
+  std::atomic<uint64_t> _gzipInputBytes;
+  std::atomic<uint64_t> _gzipOutputBytes;
+  // Responses by status class (1xx through 5xx), and by source.
+  std::atomic<uint64_t> _statusClass[5];
+  std::atomic<uint64_t> _source[N_SOURCES];
+
+  // Request start to headers parsed.
+  Histogram _headers;
+  // Passed to R until the response was ready.
+  Histogram _application;
+  // Headers parsed until the first byte of the response was written.
+  Histogram _firstByte;
+  // First byte until last byte of the response was written.
+  Histogram _write;
+  // Request start until last byte of the response was written.
+  Histogram _total;
+
+  // Path at which the metrics are served in the Prometheus text format, or
+  // empty if they aren't. Guarded by _mutex.
+  std::string _path;
+  mutable uv_mutex_t _mutex;
+
+public:
+  RequestMetrics();
+
+  void recordBytesReceived(size_t n);
+  void record(ResponseSource source, const RequestTimings& timings,
+              const ResponseStats& stats);
+
+  void setPath(const std::string& path);
+  bool isMetricsPath(const std::string& url_path) const;
+
+  Rcpp::List asRObject() const;
+  void writePrometheus(std::ostream& os) const;
+};
+
+#endif
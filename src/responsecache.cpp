@@ -0,0 +1,359 @@
+#include "responsecache.h"
+#include "httprequest.h"
+#include "httpresponse.h"
+#include "webapplication.h"
+#include "uvutil.h"
+#include "thread.h"
+#include "utils.h"
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+// Statuses which may be cached, from RFC 7231 section 6.1 (minus 206, since
+// range requests aren't cached).
+static bool cacheable_status(int status) {
+  switch (status) {
+    case 200: case 203: case 204: case 300: case 301: case 308:
+    case 404: case 405: case 410: case 414: case 501:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static std::vector<std::string> split_list(const std::string& value) {
+  std::vector<std::string> result;
+  size_t start = 0;
+  while (start <= value.length()) {
+    size_t end = value.find(',', start);
+    if (end == std::string::npos) {
+      end = value.length();
+    }
+    std::string item = trim(value.substr(start, end - start));
+    if (!item.empty()) {
+      result.push_back(item);
+    }
+    start = end + 1;
+  }
+  return result;
+}
+
+// Returns the number of seconds that a response may be cached for, according
+// to its Cache-Control header, or -1 if it may not be cached. s-maxage takes
+// precedence over max-age, since this is a shared cache.
+static int cache_lifetime(const std::string& cache_control) {
+  int max_age = -1;
+  int s_maxage = -1;
+
+  std::vector<std::string> directives = split_list(cache_control);
+  for (size_t i = 0; i < directives.size(); i++) {
+    std::string directive = to_lower(directives[i]);
+    if (directive == "no-store" || directive == "no-cache" || directive == "private") {
+      return -1;
+    }
+
+    size_t eq = directive.find('=');
+    if (eq == std::string::npos) {
+      continue;
+    }
+    std::string name = trim(directive.substr(0, eq));
+    std::string value = trim(directive.substr(eq + 1));
+    if (value.length() >= 2 && value[0] == '"' && value[value.length() - 1] == '"') {
+      value = value.substr(1, value.length() - 2);
+    }
+    if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos) {
+      continue;
+    }
+
+    int seconds = atoi(value.c_str());
+    if (name == "max-age") {
+      max_age = seconds;
+    } else if (name == "s-maxage") {
+      s_maxage = seconds;
+    }
+  }
+
+  return s_maxage >= 0 ? s_maxage : max_age;
+}
+
+
+bool cacheable_request(std::shared_ptr<HttpRequest> pRequest,
+                       const std::vector<std::string>& vary)
+{
+  std::string method = pRequest->method();
+  if (method != "GET" && method != "HEAD") {
+    return false;
+  }
+  if (pRequest->hasHeader("Authorization") || pRequest->hasHeader("Upgrade")) {
+    return false;
+  }
+  // Responses often depend on cookies, for example for a login session.
+  if (pRequest->hasHeader("Cookie") &&
+      std::find(vary.begin(), vary.end(), "cookie") == vary.end())
+  {
+    return false;
+  }
+  return true;
+}
+
+// A header which is missing is different from one which is empty.
+std::string request_cache_key(std::shared_ptr<HttpRequest> pRequest,
+                              const std::vector<std::string>& vary)
+{
+  std::string key = pRequest->method() + " " + pRequest->url();
+  for (size_t i = 0; i < vary.size(); i++) {
+    key += "\n";
+    if (pRequest->hasHeader(vary[i])) {
+      key += ":" + pRequest->getHeader(vary[i]);
+    }
+  }
+  return key;
+}
+
+std::shared_ptr<HttpResponse> share_response(std::shared_ptr<HttpRequest> pRequest,
+                                             std::shared_ptr<HttpResponse> pResponse)
+{
+  ASSERT_BACKGROUND_THREAD()
+
+  std::shared_ptr<DataSource> pDataSource;
+  std::shared_ptr<DataSource> pBody = pResponse->body();
+  if (pBody) {
+    SharedBufferDataSource* pSharedBody = dynamic_cast<SharedBufferDataSource*>(pBody.get());
+    if (pSharedBody == NULL) {
+      return std::shared_ptr<HttpResponse>();
+    }
+    pDataSource = std::make_shared<SharedBufferDataSource>(pSharedBody->buffer());
+  }
+
+  int status = pResponse->statusCode();
+  std::shared_ptr<HttpResponse> pShared(
+    new HttpResponse(pRequest, status, getStatusDescription(status), pDataSource),
+    auto_deleter_background<HttpResponse>
+  );
+
+  const ResponseHeaders& respHeaders = pResponse->headers();
+  for (ResponseHeaders::const_iterator it = respHeaders.begin(); it != respHeaders.end(); it++) {
+    const char* name = it->first.c_str();
+    if (strcasecmp(name, "Set-Cookie") == 0) {
+      return std::shared_ptr<HttpResponse>();
+    }
+    if (strcasecmp(name, "Cache-Control") == 0) {
+      std::vector<std::string> directives = split_list(to_lower(it->second));
+      if (std::find(directives.begin(), directives.end(), "private") != directives.end() ||
+          std::find(directives.begin(), directives.end(), "no-store") != directives.end())
+      {
+        return std::shared_ptr<HttpResponse>();
+      }
+    }
+    // The new response already has its own Date header.
+    if (strcasecmp(name, "Date") == 0) {
+      continue;
+    }
+    pShared->addHeader(it->first, it->second);
+  }
+
+  return pShared;
+}
+
+
+ResponseCache::ResponseCache() :
+  _maxBytes(0),
+  _bytes(0),
+  _hits(0),
+  _misses(0),
+  _stores(0),
+  _evictions(0)
+{
+  uv_mutex_init(&_mutex);
+}
+
+void ResponseCache::configure(size_t maxBytes, const std::vector<std::string>& vary) {
+  guard guard(_mutex);
+
+  std::vector<std::string> vary_lower;
+  for (size_t i = 0; i < vary.size(); i++) {
+    vary_lower.push_back(to_lower(vary[i]));
+  }
+
+  if (vary_lower != _vary) {
+    _vary = vary_lower;
+    _evict(0);
+  }
+
+  _maxBytes = maxBytes;
+  _evict(_maxBytes);
+}
+
+void ResponseCache::_erase(std::list<Entry>::iterator it) {
+  _bytes -= it->size;
+  _index.erase(it->key);
+  _entries.erase(it);
+}
+
+// Removes least recently used entries until the total size is at most
+// maxBytes.
+void ResponseCache::_evict(size_t maxBytes) {
+  while (_bytes > maxBytes && !_entries.empty()) {
+    _erase(--_entries.end());
+    _evictions++;
+  }
+}
+
+std::shared_ptr<HttpResponse> ResponseCache::lookup(std::shared_ptr<HttpRequest> pRequest) {
+  ASSERT_BACKGROUND_THREAD()
+
+  guard guard(_mutex);
+  if (_maxBytes == 0 || !cacheable_request(pRequest, _vary)) {
+    return std::shared_ptr<HttpResponse>();
+  }
+
+  std::map<std::string, std::list<Entry>::iterator>::iterator index_it =
+    _index.find(request_cache_key(pRequest, _vary));
+  if (index_it == _index.end()) {
+    _misses++;
+    return std::shared_ptr<HttpResponse>();
+  }
+
+  std::list<Entry>::iterator it = index_it->second;
+  uint64_t now = uv_hrtime();
+  if (now >= it->expires) {
+    _erase(it);
+    _misses++;
+    return std::shared_ptr<HttpResponse>();
+  }
+
+  // Move to the front, as the most recently used entry.
+  _entries.splice(_entries.begin(), _entries, it);
+  _hits++;
+
+  std::shared_ptr<DataSource> pDataSource;
+  if (it->body) {
+    pDataSource = std::make_shared<SharedBufferDataSource>(it->body);
+  }
+
+  std::shared_ptr<HttpResponse> pResponse(
+    new HttpResponse(pRequest, it->status, getStatusDescription(it->status), pDataSource),
+    auto_deleter_background<HttpResponse>
+  );
+
+  ResponseHeaders& headers = pResponse->headers();
+  headers.insert(headers.end(), it->headers.begin(), it->headers.end());
+  headers.push_back(std::make_pair("Age", toString((now - it->created) / 1000000000)));
+
+  return pResponse;
+}
+
+void ResponseCache::store(std::shared_ptr<HttpRequest> pRequest,
+                          std::shared_ptr<HttpResponse> pResponse)
+{
+  ASSERT_BACKGROUND_THREAD()
+
+  guard guard(_mutex);
+  if (_maxBytes == 0 || !cacheable_request(pRequest, _vary) ||
+      !cacheable_status(pResponse->statusCode()))
+  {
+    return;
+  }
+
+  // Bodies from files aren't cached; only those that are already in memory.
+  std::shared_ptr<const std::vector<uint8_t> > body;
+  std::shared_ptr<DataSource> pBody = pResponse->body();
+  if (pBody) {
+    SharedBufferDataSource* pSharedBody = dynamic_cast<SharedBufferDataSource*>(pBody.get());
+    if (pSharedBody == NULL) {
+      return;
+    }
+    body = pSharedBody->buffer();
+  }
+
+  int lifetime = -1;
+  ResponseHeaders headers;
+  const ResponseHeaders& respHeaders = pResponse->headers();
+  for (ResponseHeaders::const_iterator it = respHeaders.begin(); it != respHeaders.end(); it++) {
+    const char* name = it->first.c_str();
+
+    if (strcasecmp(name, "Set-Cookie") == 0) {
+      return;
+    }
+    if (strcasecmp(name, "Cache-Control") == 0) {
+      lifetime = cache_lifetime(it->second);
+      if (lifetime < 0) {
+        return;
+      }
+    }
+    // The response can only be reused for requests which match on the
+    // headers it varies by, so they all must be part of the key.
+    if (strcasecmp(name, "Vary") == 0) {
+      std::vector<std::string> vary = split_list(it->second);
+      for (size_t i = 0; i < vary.size(); i++) {
+        if (std::find(_vary.begin(), _vary.end(), to_lower(vary[i])) == _vary.end()) {
+          return;
+        }
+      }
+    }
+    // These are added for each response that is sent.
+    if (strcasecmp(name, "Date") == 0 || strcasecmp(name, "Age") == 0) {
+      continue;
+    }
+
+    headers.push_back(*it);
+  }
+
+  if (lifetime <= 0) {
+    return;
+  }
+
+  std::string key = request_cache_key(pRequest, _vary);
+
+  size_t size = sizeof(Entry) + 2 * key.size() + (body ? body->size() : 0);
+  for (ResponseHeaders::const_iterator it = headers.begin(); it != headers.end(); it++) {
+    size += it->first.size() + it->second.size();
+  }
+  if (size > _maxBytes) {
+    return;
+  }
+
+  std::map<std::string, std::list<Entry>::iterator>::iterator index_it = _index.find(key);
+  if (index_it != _index.end()) {
+    _erase(index_it->second);
+  }
+
+  uint64_t now = uv_hrtime();
+  Entry entry;
+  entry.key     = key;
+  entry.status  = pResponse->statusCode();
+  entry.headers = headers;
+  entry.body    = body;
+  entry.created = now;
+  entry.expires = now + (uint64_t)lifetime * 1000000000;
+  entry.size    = size;
+
+  _entries.push_front(entry);
+  _index[key] = _entries.begin();
+  _bytes += size;
+  _stores++;
+
+  _evict(_maxBytes);
+}
+
+void ResponseCache::clear() {
+  guard guard(_mutex);
+  _entries.clear();
+  _index.clear();
+  _bytes = 0;
+}
+
+Rcpp::List ResponseCache::metricsAsRObject() const {
+  ASSERT_MAIN_THREAD()
+  using namespace Rcpp;
+  guard guard(_mutex);
+
+  return List::create(
+    _["hits"]      = (double)_hits,
+    _["misses"]    = (double)_misses,
+    _["stores"]    = (double)_stores,
+    _["evictions"] = (double)_evictions,
+    _["entries"]   = (double)_entries.size(),
+    _["bytes"]     = (double)_bytes
+  );
+}
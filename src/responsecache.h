@@ -0,0 +1,100 @@
+#ifndef RESPONSECACHE_HPP
+#define RESPONSECACHE_HPP
+
+#include <string>
+#include <map>
+#include <list>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+#include <Rcpp.h>
+#include "thread.h"
+#include "constants.h"
+
+class HttpRequest;
+class HttpResponse;
+
+// Whether responses to a request could be reused for other requests. Only
+// GET and HEAD requests are, and not those with credentials or WebSocket
+// upgrades. Requests with cookies are only reused if "cookie" is in `vary`
+// (which must be lowercase), so that the key includes them.
+bool cacheable_request(std::shared_ptr<HttpRequest> pRequest,
+                       const std::vector<std::string>& vary);
+
+// The key for a request is the method and URL, followed by the value of each
+// header in `vary` (which must be lowercase).
+std::string request_cache_key(std::shared_ptr<HttpRequest> pRequest,
+                              const std::vector<std::string>& vary);
+
+// Makes a copy of a response from the application to send for another,
+// identical request. Returns an empty shared_ptr if the response can't be
+// shared: if it sets cookies, is marked private or no-store, or has a body
+// that is streamed from a file.
+std::shared_ptr<HttpResponse> share_response(std::shared_ptr<HttpRequest> pRequest,
+                                             std::shared_ptr<HttpResponse> pResponse);
+
+// A small in-memory cache of responses from the application, so that
+// identical requests which arrive within a short time of each other can be
+// answered from the background thread instead of calling into R each time.
+//
+// Only responses which opt in with a Cache-Control max-age (or s-maxage)
+// directive are stored, and only for that many seconds. Entries are keyed by
+// the request method, URL, and the values of the request headers in the
+// responseCacheVary server option. When the total size goes over the byte
+// budget, the least recently used entries are evicted.
+class ResponseCache {
+  struct Entry {
+    std::string key;
+    int status;
+    ResponseHeaders headers;
+    // NULL if the response has no body.
+    std::shared_ptr<const std::vector<uint8_t> > body;
+    // Times (from uv_hrtime()) at which the entry was stored and expires.
+    uint64_t created;
+    uint64_t expires;
+    // Approximate memory used by the entry, in bytes.
+    size_t size;
+  };
+
+  // Most recently used entries are at the front.
+  std::list<Entry> _entries;
+  std::map<std::string, std::list<Entry>::iterator> _index;
+
+  size_t _maxBytes;
+  size_t _bytes;
+  std::vector<std::string> _vary;
+
+  uint64_t _hits;
+  uint64_t _misses;
+  uint64_t _stores;
+  uint64_t _evictions;
+
+  // Mutex is used whenever any of the above is accessed.
+  mutable uv_mutex_t _mutex;
+
+  void _erase(std::list<Entry>::iterator it);
+  void _evict(size_t maxBytes);
+
+public:
+  ResponseCache();
+
+  // Sets the byte budget (0 disables the cache) and the request headers that
+  // are part of the cache key. Changing the headers clears the cache, since
+  // existing keys would no longer match.
+  void configure(size_t maxBytes, const std::vector<std::string>& vary);
+
+  // Returns a response for the request if there is a fresh entry for it, or
+  // an empty shared_ptr if not.
+  std::shared_ptr<HttpResponse> lookup(std::shared_ptr<HttpRequest> pRequest);
+
+  // Stores a response from the application, if both the request and the
+  // response are cacheable.
+  void store(std::shared_ptr<HttpRequest> pRequest,
+             std::shared_ptr<HttpResponse> pResponse);
+
+  void clear();
+
+  Rcpp::List metricsAsRObject() const;
+};
+
+#endif
@@ -0,0 +1,259 @@
+#include "routes.h"
+#include "httprequest.h"
+#include "httpresponse.h"
+#include "webapplication.h"
+#include "thread.h"
+#include "utils.h"
+#include "httpuv.h"
+
+// ============================================================================
+// Route
+// ============================================================================
+
+Route::Route(const Rcpp::List& route) {
+  ASSERT_MAIN_THREAD()
+
+  std::string obj_class = route.attr("class");
+  if (obj_class != "route") {
+    throw Rcpp::exception("Route object must have class 'route'.");
+  }
+
+  std::string type_str = Rcpp::as<std::string>(route["type"]);
+  if (type_str == "response") {
+    type = RESPONSE;
+  } else if (type_str == "redirect") {
+    type = REDIRECT;
+  } else {
+    throw Rcpp::exception("Unknown route type: " + type_str);
+  }
+
+  prefix = Rcpp::as<bool>(route["prefix"]);
+  status = Rcpp::as<int>(route["status"]);
+
+  Rcpp::RObject temp;
+  temp = route["headers"];
+  if (!temp.isNULL()) {
+    headers = Rcpp::as<ResponseHeaders>(temp);
+  }
+
+  if (type == RESPONSE) {
+    Rcpp::RawVector body_raw = route["body"];
+    std::shared_ptr<std::vector<uint8_t> > pBody =
+      std::make_shared<std::vector<uint8_t> >(body_raw.size());
+    std::copy(body_raw.begin(), body_raw.end(), pBody->begin());
+    body = pBody;
+
+    ResponseHeaders headHeaders;
+    for (ResponseHeaders::const_iterator it = headers.begin(); it != headers.end(); it++) {
+      if (strcasecmp(it->first.c_str(), "Connection") == 0) {
+        connectionHeaders.push_back(*it);
+      } else {
+        headHeaders.push_back(*it);
+      }
+    }
+    // Content-Length is the same for every response, and adding it here means
+    // that HEAD requests get it too. Responses with status 1xx and 204 must
+    // not have it.
+    if (status >= 200 && status != 204) {
+      headHeaders.push_back(std::make_pair("Content-Length", toString(body->size())));
+    }
+    head = std::make_shared<const ResponseHead>(
+      status, getStatusDescription(status), headHeaders
+    );
+
+  } else {
+    location = Rcpp::as<std::string>(route["location"]);
+  }
+}
+
+static void replace_all(std::string& str, const std::string& from, const std::string& to) {
+  size_t pos = 0;
+  while ((pos = str.find(from, pos)) != std::string::npos) {
+    str.replace(pos, from.length(), to);
+    pos += to.length();
+  }
+}
+
+std::shared_ptr<HttpResponse> Route::response(std::shared_ptr<HttpRequest> pRequest,
+                                              const std::string& subpath,
+                                              const std::string& query) const
+{
+  ASSERT_BACKGROUND_THREAD()
+
+  if (type == RESPONSE) {
+    std::string method = pRequest->method();
+    if (method != "GET" && method != "HEAD") {
+      return std::shared_ptr<HttpResponse>();
+    }
+    std::shared_ptr<DataSource> pDataSource;
+    // Responses with status 204 and 304 can't have a body.
+    if (method == "GET" && status != 204 && status != 304) {
+      pDataSource = std::make_shared<SharedBufferDataSource>(body);
+    }
+
+    // Only the Date header, and any Connection header, are added per request.
+    std::shared_ptr<HttpResponse> pResponse(
+      new HttpResponse(pRequest, head, pDataSource),
+      auto_deleter_background<HttpResponse>
+    );
+    ResponseHeaders& respHeaders = pResponse->headers();
+    respHeaders.insert(respHeaders.end(), connectionHeaders.begin(), connectionHeaders.end());
+    return pResponse;
+  }
+
+  std::shared_ptr<HttpResponse> pResponse(
+    new HttpResponse(pRequest, status, getStatusDescription(status),
+                     std::shared_ptr<DataSource>()),
+    auto_deleter_background<HttpResponse>
+  );
+
+  std::string url = location;
+  replace_all(url, "{path}", doEncodeURI(subpath, false));
+  replace_all(url, "{query}", query);
+  ResponseHeaders& respHeaders = pResponse->headers();
+  respHeaders.push_back(std::make_pair("Location", url));
+  respHeaders.push_back(std::make_pair("Content-Length", "0"));
+
+  return pResponse;
+}
+
+Rcpp::List Route::asRObject() const {
+  ASSERT_MAIN_THREAD()
+  using namespace Rcpp;
+
+  List obj;
+  if (type == RESPONSE) {
+    RawVector body_raw(body->begin(), body->end());
+
+    obj = List::create(
+      _["type"]     = "response",
+      _["prefix"]   = prefix,
+      _["status"]   = status,
+      _["headers"]  = headers.size() == 0 ? R_NilValue : wrap(headers),
+      _["body"]     = body_raw,
+      _["location"] = R_NilValue
+    );
+  } else {
+    obj = List::create(
+      _["type"]     = "redirect",
+      _["prefix"]   = prefix,
+      _["status"]   = status,
+      _["headers"]  = R_NilValue,
+      _["body"]     = R_NilValue,
+      _["location"] = location
+    );
+  }
+
+  obj.attr("class") = "route";
+  return obj;
+}
+
+
+// ============================================================================
+// RouteManager
+// ============================================================================
+
+RouteManager::RouteManager() {
+  uv_mutex_init(&mutex);
+}
+
+RouteManager::RouteManager(const Rcpp::List& routes) {
+  ASSERT_MAIN_THREAD()
+  uv_mutex_init(&mutex);
+  set(routes);
+}
+
+void RouteManager::set(const Rcpp::List& routes) {
+  ASSERT_MAIN_THREAD()
+  if (routes.size() == 0) {
+    return;
+  }
+
+  Rcpp::CharacterVector names = routes.names();
+  if (names.isNULL()) {
+    throw Rcpp::exception("Error processing routes: all routes must be named.");
+  }
+
+  // Convert everything before taking the lock, so that an invalid route
+  // doesn't leave the map partially updated.
+  std::vector<std::pair<std::string, std::shared_ptr<const Route> > > new_routes;
+  for (int i=0; i<routes.size(); i++) {
+    std::string path = Rcpp::as<std::string>(names[i]);
+    if (path == "") {
+      throw Rcpp::exception("Error processing routes: all routes must be named.");
+    }
+    Rcpp::List route_obj(routes[i]);
+    new_routes.push_back(std::make_pair(path, std::make_shared<const Route>(route_obj)));
+  }
+
+  guard guard(mutex);
+  for (size_t i=0; i<new_routes.size(); i++) {
+    route_map[new_routes[i].first] = new_routes[i].second;
+  }
+}
+
+void RouteManager::remove(const Rcpp::CharacterVector& paths) {
+  ASSERT_MAIN_THREAD()
+  std::vector<std::string> paths_vec = Rcpp::as<std::vector<std::string> >(paths);
+  guard guard(mutex);
+  for (size_t i=0; i<paths_vec.size(); i++) {
+    route_map.erase(paths_vec[i]);
+  }
+}
+
+// Like StaticPathManager::matchStaticPath(), this tries the whole path first,
+// then removes one path segment at a time from the end. Exact routes can only
+// match the whole path; prefix routes can match at any step. The longest
+// matching path wins.
+std::experimental::optional<std::pair<std::shared_ptr<const Route>, std::string> >
+RouteManager::matchRoute(const std::string& url_path) const {
+  guard guard(mutex);
+  if (route_map.empty() || url_path.empty()) {
+    return std::experimental::nullopt;
+  }
+
+  std::string path = url_path;
+  // Strip off a trailing slash, except when the path is just "/".
+  if (path.length() > 1 && path.at(path.length() - 1) == '/') {
+    path = path.substr(0, path.length() - 1);
+  }
+  const std::string full_path = path;
+
+  while (true) {
+    std::map<std::string, std::shared_ptr<const Route> >::const_iterator it =
+      route_map.find(path);
+
+    if (it != route_map.end() && (path == full_path || it->second->prefix)) {
+      std::string subpath;
+      if (path != "/") {
+        subpath = full_path.substr(path.length());
+      } else if (full_path != "/") {
+        subpath = full_path;
+      }
+      return std::make_pair(it->second, subpath);
+    }
+
+    if (path == "/") {
+      return std::experimental::nullopt;
+    }
+
+    size_t idx = path.find_last_of('/');
+    if (idx == std::string::npos) {
+      return std::experimental::nullopt;
+    }
+    path = (idx == 0) ? "/" : path.substr(0, idx);
+  }
+}
+
+Rcpp::List RouteManager::routesAsRObject() const {
+  ASSERT_MAIN_THREAD()
+  guard guard(mutex);
+  Rcpp::List obj;
+
+  std::map<std::string, std::shared_ptr<const Route> >::const_iterator it;
+  for (it = route_map.begin(); it != route_map.end(); it++) {
+    obj[it->first] = it->second->asRObject();
+  }
+
+  return obj;
+}
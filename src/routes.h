@@ -0,0 +1,76 @@
+#ifndef ROUTES_HPP
+#define ROUTES_HPP
+
+#include <string>
+#include <map>
+#include <memory>
+#include <vector>
+#include <Rcpp.h>
+#include "optional.h"
+#include "thread.h"
+#include "constants.h"
+
+class HttpRequest;
+class HttpResponse;
+struct ResponseHead;
+
+// A fixed response or redirect which is sent from the background thread,
+// without calling into R. Created from an R object made by routeResponse()
+// or routeRedirect().
+class Route {
+public:
+  enum Type {
+    RESPONSE,
+    REDIRECT
+  };
+
+  Type type;
+  // If true, the route also matches paths under its path.
+  bool prefix;
+  int status;
+  ResponseHeaders headers;
+  // For RESPONSE routes. This is shared by all responses for the route, so
+  // the bytes are never copied per request.
+  std::shared_ptr<const std::vector<uint8_t> > body;
+  // For RESPONSE routes, the status line and headers, serialized once. A
+  // Connection header is left out of it and added to each response instead,
+  // since HttpResponse may need to replace it.
+  std::shared_ptr<const ResponseHead> head;
+  ResponseHeaders connectionHeaders;
+  // For REDIRECT routes. May contain "{path}" and "{query}".
+  std::string location;
+
+  Route(const Rcpp::List& route);
+
+  // `subpath` is the part of the request path after the route's path, and
+  // `query` is the query string. Returns an empty shared_ptr if the route
+  // doesn't respond to this request (so it should go to the application).
+  std::shared_ptr<HttpResponse> response(std::shared_ptr<HttpRequest> pRequest,
+                                         const std::string& subpath,
+                                         const std::string& query) const;
+
+  Rcpp::List asRObject() const;
+};
+
+
+class RouteManager {
+  std::map<std::string, std::shared_ptr<const Route> > route_map;
+  // Mutex is used whenever route_map is accessed.
+  mutable uv_mutex_t mutex;
+
+public:
+  RouteManager();
+  RouteManager(const Rcpp::List& routes);
+
+  void set(const Rcpp::List& routes);
+  void remove(const Rcpp::CharacterVector& paths);
+
+  // Finds the route for a URL path. Returns the route, and the part of
+  // url_path after the route's path (which is empty for exact matches).
+  std::experimental::optional<std::pair<std::shared_ptr<const Route>, std::string> >
+    matchRoute(const std::string& url_path) const;
+
+  Rcpp::List routesAsRObject() const;
+};
+
+#endif
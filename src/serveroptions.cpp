@@ -0,0 +1,243 @@
+#include "serveroptions.h"
+#include "thread.h"
+#include "utils.h"
+
+// R represents "no limit" as Inf, but on the C++ side it is a negative
+// number. normalizeServerOptions() converts Inf to -1 before the options get
+// here.
+static Rcpp::RObject wrap_limit(int value) {
+  if (value < 0) {
+    return Rcpp::wrap(R_PosInf);
+  }
+  return Rcpp::wrap(value);
+}
+
+static Rcpp::RObject wrap_limit(double value) {
+  if (value < 0) {
+    return Rcpp::wrap(R_PosInf);
+  }
+  return Rcpp::wrap(value);
+}
+
+// The defaults are set by the default constructor.
+ServerOptions::ServerOptions(const Rcpp::List& options) : ServerOptions()
+{
+  ASSERT_MAIN_THREAD()
+
+  std::string obj_class = options.attr("class");
+  if (obj_class != "serverOptions") {
+    throw Rcpp::exception("Server options object must have class 'serverOptions'.");
+  }
+
+  setOptions(options);
+}
+
+// Set the values of the options which are present and non-NULL in `options`.
+// Other values are left unchanged.
+void ServerOptions::setOptions(const Rcpp::List& options) {
+  ASSERT_MAIN_THREAD()
+  Rcpp::RObject temp;
+  if (options.containsElementNamed("maxConnections")) {
+    temp = options["maxConnections"];
+    if (!temp.isNULL()) {
+      maxConnections = Rcpp::as<int>(temp);
+    }
+  }
+  if (options.containsElementNamed("maxPendingRequests")) {
+    temp = options["maxPendingRequests"];
+    if (!temp.isNULL()) {
+      maxPendingRequests = Rcpp::as<int>(temp);
+    }
+  }
+  if (options.containsElementNamed("pauseAccept")) {
+    temp = options["pauseAccept"];
+    if (!temp.isNULL()) {
+      pauseAccept = Rcpp::as<bool>(temp);
+    }
+  }
+  if (options.containsElementNamed("retryAfter")) {
+    temp = options["retryAfter"];
+    if (!temp.isNULL()) {
+      retryAfter = Rcpp::as<int>(temp);
+    }
+  }
+  if (options.containsElementNamed("queueDeadline")) {
+    temp = options["queueDeadline"];
+    if (!temp.isNULL()) {
+      queueDeadline = Rcpp::as<double>(temp);
+    }
+  }
+  if (options.containsElementNamed("responseTimeout")) {
+    temp = options["responseTimeout"];
+    if (!temp.isNULL()) {
+      responseTimeout = Rcpp::as<double>(temp);
+    }
+  }
+  if (options.containsElementNamed("responseCacheSize")) {
+    temp = options["responseCacheSize"];
+    if (!temp.isNULL()) {
+      responseCacheSize = Rcpp::as<double>(temp);
+    }
+  }
+  if (options.containsElementNamed("responseCacheVary")) {
+    temp = options["responseCacheVary"];
+    if (!temp.isNULL()) {
+      responseCacheVary = Rcpp::as<std::vector<std::string> >(temp);
+    }
+  }
+  if (options.containsElementNamed("coalesceRequests")) {
+    temp = options["coalesceRequests"];
+    if (!temp.isNULL()) {
+      coalesceRequests = Rcpp::as<bool>(temp);
+    }
+  }
+  if (options.containsElementNamed("metricsPath")) {
+    temp = options["metricsPath"];
+    if (!temp.isNULL()) {
+      metricsPath = Rcpp::as<std::string>(temp);
+    }
+  }
+  if (options.containsElementNamed("accessLog")) {
+    temp = options["accessLog"];
+    if (!temp.isNULL()) {
+      accessLog = Rcpp::as<std::string>(temp);
+    }
+  }
+  if (options.containsElementNamed("accessLogFormat")) {
+    temp = options["accessLogFormat"];
+    if (!temp.isNULL()) {
+      accessLogFormat = Rcpp::as<std::string>(temp);
+    }
+  }
+  if (options.containsElementNamed("accessLogSample")) {
+    temp = options["accessLogSample"];
+    if (!temp.isNULL()) {
+      accessLogSample = Rcpp::as<double>(temp);
+    }
+  }
+  if (options.containsElementNamed("accessLogReopenSignal")) {
+    temp = options["accessLogReopenSignal"];
+    if (!temp.isNULL()) {
+      accessLogReopenSignal = Rcpp::as<bool>(temp);
+    }
+  }
+  if (options.containsElementNamed("serverTiming")) {
+    temp = options["serverTiming"];
+    if (!temp.isNULL()) {
+      serverTiming = Rcpp::as<bool>(temp);
+    }
+  }
+  if (options.containsElementNamed("wsCompression")) {
+    temp = options["wsCompression"];
+    if (!temp.isNULL()) {
+      wsCompression = Rcpp::as<bool>(temp);
+    }
+  }
+  if (options.containsElementNamed("wsCompressionLevel")) {
+    temp = options["wsCompressionLevel"];
+    if (!temp.isNULL()) {
+      wsCompressionLevel = Rcpp::as<int>(temp);
+    }
+  }
+  if (options.containsElementNamed("wsCompressionWindowBits")) {
+    temp = options["wsCompressionWindowBits"];
+    if (!temp.isNULL()) {
+      wsCompressionWindowBits = Rcpp::as<int>(temp);
+    }
+  }
+  if (options.containsElementNamed("wsCompressionContextTakeover")) {
+    temp = options["wsCompressionContextTakeover"];
+    if (!temp.isNULL()) {
+      wsCompressionContextTakeover = Rcpp::as<bool>(temp);
+    }
+  }
+  if (options.containsElementNamed("wsMaxMessageSize")) {
+    temp = options["wsMaxMessageSize"];
+    if (!temp.isNULL()) {
+      wsMaxMessageSize = Rcpp::as<double>(temp);
+    }
+  }
+  if (options.containsElementNamed("wsMaxPendingMessages")) {
+    temp = options["wsMaxPendingMessages"];
+    if (!temp.isNULL()) {
+      wsMaxPendingMessages = Rcpp::as<int>(temp);
+    }
+  }
+  if (options.containsElementNamed("wsMaxPendingBytes")) {
+    temp = options["wsMaxPendingBytes"];
+    if (!temp.isNULL()) {
+      wsMaxPendingBytes = Rcpp::as<double>(temp);
+    }
+  }
+  if (options.containsElementNamed("wsMaxPendingMessagesTotal")) {
+    temp = options["wsMaxPendingMessagesTotal"];
+    if (!temp.isNULL()) {
+      wsMaxPendingMessagesTotal = Rcpp::as<int>(temp);
+    }
+  }
+  if (options.containsElementNamed("wsMaxPendingBytesTotal")) {
+    temp = options["wsMaxPendingBytesTotal"];
+    if (!temp.isNULL()) {
+      wsMaxPendingBytesTotal = Rcpp::as<double>(temp);
+    }
+  }
+  if (options.containsElementNamed("wsHighWaterMark")) {
+    temp = options["wsHighWaterMark"];
+    if (!temp.isNULL()) {
+      wsHighWaterMark = Rcpp::as<double>(temp);
+    }
+  }
+  if (options.containsElementNamed("wsBackpressure")) {
+    temp = options["wsBackpressure"];
+    if (!temp.isNULL()) {
+      wsBackpressure = Rcpp::as<std::string>(temp);
+    }
+  }
+}
+
+Rcpp::List ServerOptions::asRObject() const {
+  ASSERT_MAIN_THREAD()
+  using namespace Rcpp;
+
+  List obj = List::create(
+    _["maxConnections"]     = wrap_limit(maxConnections),
+    _["maxPendingRequests"] = wrap_limit(maxPendingRequests),
+    _["pauseAccept"]        = pauseAccept,
+    _["retryAfter"]         = retryAfter,
+    _["queueDeadline"]      = wrap_limit(queueDeadline),
+    _["responseTimeout"]    = wrap_limit(responseTimeout),
+    _["responseCacheSize"]  = responseCacheSize,
+    _["responseCacheVary"]  = responseCacheVary,
+    _["coalesceRequests"]   = coalesceRequests,
+    _["metricsPath"]        = metricsPath.empty() ? R_NilValue : Rcpp::wrap(metricsPath),
+    _["accessLog"]          = accessLog.empty() ? R_NilValue : Rcpp::wrap(accessLog),
+    _["accessLogFormat"]    = accessLogFormat,
+    _["accessLogSample"]    = accessLogSample,
+    _["accessLogReopenSignal"] = accessLogReopenSignal,
+    _["serverTiming"]       = serverTiming
+  );
+
+  // List::create() takes at most 20 arguments, so the WebSocket options are
+  // added separately.
+  List ws = List::create(
+    _["wsCompression"]      = wsCompression,
+    _["wsCompressionLevel"] = wsCompressionLevel,
+    _["wsCompressionWindowBits"] = wsCompressionWindowBits,
+    _["wsCompressionContextTakeover"] = wsCompressionContextTakeover,
+    _["wsMaxMessageSize"]   = wrap_limit(wsMaxMessageSize),
+    _["wsMaxPendingMessages"] = wrap_limit(wsMaxPendingMessages),
+    _["wsMaxPendingBytes"]  = wrap_limit(wsMaxPendingBytes),
+    _["wsMaxPendingMessagesTotal"] = wrap_limit(wsMaxPendingMessagesTotal),
+    _["wsMaxPendingBytesTotal"] = wrap_limit(wsMaxPendingBytesTotal),
+    _["wsHighWaterMark"]    = wrap_limit(wsHighWaterMark),
+    _["wsBackpressure"]     = wsBackpressure
+  );
+  CharacterVector wsNames = ws.names();
+  for (int i = 0; i < ws.size(); i++) {
+    obj.push_back(ws[i], as<std::string>(wsNames[i]));
+  }
+
+  obj.attr("class") = "serverOptions";
+
+  return obj;
+}
@@ -0,0 +1,114 @@
+#ifndef SERVEROPTIONS_HPP
+#define SERVEROPTIONS_HPP
+
+#include <string>
+#include <vector>
+#include <Rcpp.h>
+#include "thread.h"
+
+// Per-server settings which control how the background thread handles
+// connections and requests. Unlike StaticPathOptions, there is no inheritance
+// between levels, so every field always has a value. For the limits, a
+// negative value means that there is no limit.
+class ServerOptions {
+public:
+  // Maximum number of open connections. When this is reached, new
+  // connections are either rejected with a 503, or left in the listen
+  // backlog until an existing connection closes (if pauseAccept is true).
+  int maxConnections;
+  // Maximum number of requests that have been handed off to R and are
+  // waiting for a response. Requests over the limit get a 503 response from
+  // the background thread.
+  int maxPendingRequests;
+  bool pauseAccept;
+  // Value of the Retry-After header (in seconds) sent with 503 responses.
+  int retryAfter;
+  // Maximum time (in seconds) that a request can wait in the queue for the R
+  // main thread. When the main thread gets to a request that has waited
+  // longer, it sends a 503 without calling the R handler.
+  double queueDeadline;
+  // Maximum time (in seconds) that the application's call() function, or the
+  // promise it returns, can take to produce a response. When this elapses,
+  // the background thread sends a 504 and closes the connection.
+  double responseTimeout;
+  // Size (in bytes) of the cache for responses from the application, or 0 if
+  // responses should not be cached.
+  double responseCacheSize;
+  // Request headers whose values are part of the response cache key.
+  std::vector<std::string> responseCacheVary;
+  // If true, identical GET and HEAD requests (with the same cache key) which
+  // arrive while one is waiting on the application get a copy of its
+  // response, instead of also being passed to the application.
+  bool coalesceRequests;
+  // URL path at which the server's metrics are served in the Prometheus text
+  // format, from the background thread. Empty if they aren't served.
+  std::string metricsPath;
+  // File that the background thread writes an access log to, or empty if
+  // there is no access log. The format is "common", "combined", or "json".
+  std::string accessLog;
+  std::string accessLogFormat;
+  // Fraction of successful responses which are logged.
+  double accessLogSample;
+  // If true, the access log is reopened when the process receives SIGHUP.
+  bool accessLogReopenSignal;
+  // If true, responses get a Server-Timing header with the time spent in
+  // each phase of the request.
+  bool serverTiming;
+  // If true, WebSocket messages are compressed with the permessage-deflate
+  // extension, for clients that support it. The window bits (9-15) bound the
+  // memory used for compression on each connection. If context takeover is
+  // off, each message is compressed on its own.
+  bool wsCompression;
+  int wsCompressionLevel;
+  int wsCompressionWindowBits;
+  bool wsCompressionContextTakeover;
+  // Largest WebSocket message (in bytes, after decompression) that will be
+  // accepted from a client. Connections that send larger messages are closed.
+  double wsMaxMessageSize;
+  // Limits on incoming WebSocket messages which have been passed to R but
+  // not yet handled, for each connection and for the whole server. When one
+  // is reached, the connection stops reading until R catches up.
+  int wsMaxPendingMessages;
+  double wsMaxPendingBytes;
+  int wsMaxPendingMessagesTotal;
+  double wsMaxPendingBytesTotal;
+  // When more than this many bytes (or negative for no limit) are waiting to
+  // be sent on a WebSocket connection, new outgoing messages are handled
+  // according to wsBackpressure: "queue", "drop_newest", "drop_oldest", or
+  // "close".
+  double wsHighWaterMark;
+  std::string wsBackpressure;
+
+  ServerOptions() :
+    maxConnections(-1),
+    maxPendingRequests(-1),
+    pauseAccept(false),
+    retryAfter(1),
+    queueDeadline(-1),
+    responseTimeout(-1),
+    responseCacheSize(0),
+    coalesceRequests(false),
+    accessLogFormat("common"),
+    accessLogSample(1),
+    accessLogReopenSignal(false),
+    serverTiming(false),
+    wsCompression(false),
+    wsCompressionLevel(6),
+    wsCompressionWindowBits(15),
+    wsCompressionContextTakeover(true),
+    wsMaxMessageSize(-1),
+    wsMaxPendingMessages(-1),
+    wsMaxPendingBytes(-1),
+    wsMaxPendingMessagesTotal(-1),
+    wsMaxPendingBytesTotal(-1),
+    wsHighWaterMark(-1),
+    wsBackpressure("queue")
+  { };
+  ServerOptions(const Rcpp::List& options);
+
+  void setOptions(const Rcpp::List& options);
+
+  Rcpp::List asRObject() const;
+};
+
+#endif
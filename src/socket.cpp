@@ -13,6 +13,12 @@ void Socket::removeConnection(std::shared_ptr<HttpRequest> request) {
   connections.erase(
     std::remove(connections.begin(), connections.end(), request),
     connections.end());
+
+  // Now that there's a free slot, accept connections that were deferred
+  // because of the connection limit.
+  if (!closing && pendingAccepts > 0) {
+    accept_pending_connections(&handle.stream);
+  }
 }
 
 Socket::~Socket() {
@@ -34,6 +40,7 @@ void delete_ppsocket(uv_handle_t* pHandle) {
 void Socket::close() {
   ASSERT_BACKGROUND_THREAD()
   debug_log("Socket::close", LOG_DEBUG);
+  closing = true;
   for (std::vector<std::shared_ptr<HttpRequest> >::reverse_iterator it = connections.rbegin();
     it != connections.rend();
     it++) {
@@ -14,10 +14,18 @@ public:
   std::shared_ptr<WebApplication> pWebApplication;
   CallbackQueue* background_queue;
   std::vector<std::shared_ptr<HttpRequest> > connections;
+  // Number of connections which are waiting to be accepted because the
+  // server was at its connection limit.
+  int pendingAccepts;
+  // Number of HTTP requests which have been passed to R and haven't yet
+  // gotten a response.
+  int activeRequests;
+  bool closing;
 
   Socket(std::shared_ptr<WebApplication> pWebApplication,
          CallbackQueue* background_queue)
-    : pWebApplication(pWebApplication), background_queue(background_queue)
+    : pWebApplication(pWebApplication), background_queue(background_queue),
+      pendingAccepts(0), activeRequests(0), closing(false)
   {
   }
 
@@ -1,32 +1,36 @@
 #include "utils.h"
+#include "logring.h"
+#include <string.h>
 
 // Set the default log level
-LogLevel log_level_ = LOG_ERROR;
+std::atomic<int> log_level_(LOG_ERROR);
 
-void debug_log(const std::string& msg, LogLevel level) {
-  if (log_level_ >= level) {
-    err_printf("%s\n", msg.c_str());
-  };
+void log_write(const std::string& msg) {
+  get_log_ring().push(msg.data(), msg.size());
+}
+
+void log_write(const char* msg) {
+  get_log_ring().push(msg, strlen(msg));
 }
 
 
 // Sets the current log level and returns previous value.
 // [[Rcpp::export]]
 std::string log_level(const std::string& level) {
-  LogLevel old_level = log_level_;
+  LogLevel old_level = (LogLevel)log_level_.load();
 
   if (level == "") {
     // Do nothing
   } else if (level == "OFF") {
-    log_level_ = LOG_OFF;
+    log_level_.store(LOG_OFF);
   } else if (level == "ERROR") {
-    log_level_ = LOG_ERROR;
+    log_level_.store(LOG_ERROR);
   } else if (level == "WARN") {
-    log_level_ = LOG_WARN;
+    log_level_.store(LOG_WARN);
   } else if (level == "INFO") {
-    log_level_ = LOG_INFO;
+    log_level_.store(LOG_INFO);
   } else if (level == "DEBUG") {
-    log_level_ = LOG_DEBUG;
+    log_level_.store(LOG_DEBUG);
   } else {
     Rcpp::stop("Unknown value for `level`");
   }
@@ -2,6 +2,7 @@
 #define UTILS_H
 
 #include <algorithm>
+#include <atomic>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdarg.h>
@@ -75,7 +76,25 @@ enum LogLevel {
   LOG_DEBUG
 };
 
-void debug_log(const std::string& msg, LogLevel level);
+extern std::atomic<int> log_level_;
+
+inline bool log_enabled(LogLevel level) {
+  return log_level_.load(std::memory_order_relaxed) >= level;
+}
+
+// Queues a message to be written to stderr; see logring.h. Callers should
+// use debug_log(), which checks the level first.
+void log_write(const std::string& msg);
+void log_write(const char* msg);
+
+// debug_log() is a macro so that when the level is disabled, the message
+// isn't evaluated: building a std::string from a literal, or concatenating
+// strings, would otherwise cost an allocation on every call.
+#define debug_log(msg, level)          \
+  do {                                 \
+    if (log_enabled(level))            \
+      log_write(msg);                  \
+  } while (0)
 
 // ============================================================================
 
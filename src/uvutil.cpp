@@ -90,6 +90,31 @@ void InMemoryDataSource::add(const std::vector<uint8_t>& moreData) {
   _buffer.insert(_buffer.end(), moreData.begin(), moreData.end());
 }
 
+std::shared_ptr<const std::vector<uint8_t> > SharedBufferDataSource::buffer() const {
+  return _pBuffer;
+}
+uint64_t SharedBufferDataSource::size() const {
+  return _pBuffer->size();
+}
+uv_buf_t SharedBufferDataSource::getData(size_t bytesDesired) {
+  ASSERT_BACKGROUND_THREAD()
+  size_t bytes = _pBuffer->size() - _pos;
+  if (bytesDesired < bytes)
+    bytes = bytesDesired;
+
+  uv_buf_t mem;
+  // uv_buf_t isn't const, but the data is only read by uv_write().
+  mem.base = bytes > 0 ? reinterpret_cast<char*>(const_cast<uint8_t*>(&(*_pBuffer)[_pos])) : 0;
+  mem.len = bytes;
+
+  _pos += bytes;
+  return mem;
+}
+void SharedBufferDataSource::freeData(uv_buf_t buffer) {
+}
+void SharedBufferDataSource::close() {
+}
+
 static void writecb(uv_write_t* handle, int status) {
   ASSERT_BACKGROUND_THREAD()
   WriteOp* pWriteOp = (WriteOp*)handle->data;
@@ -169,6 +194,7 @@ void ExtendedWrite::next() {
 
   WriteOp* pWriteOp = new WriteOp(this, prefix, buf, suffix);
   _activeWrites++;
+  _bytesWritten += prefix.size() + buf.len + suffix.size();
   auto op_bufs = pWriteOp->bufs();
   uv_write(&pWriteOp->handle, _pHandle, &op_bufs[0], op_bufs.size(), &writecb);
 }
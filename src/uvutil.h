@@ -65,6 +65,26 @@ public:
   void add(const std::vector<uint8_t>& moreData);
 };
 
+// Like InMemoryDataSource, but it reads from an immutable buffer which can be
+// shared by many responses, instead of holding its own copy of the data.
+class SharedBufferDataSource : public DataSource {
+private:
+  std::shared_ptr<const std::vector<uint8_t> > _pBuffer;
+  size_t _pos;
+public:
+  explicit SharedBufferDataSource(std::shared_ptr<const std::vector<uint8_t> > pBuffer)
+    : _pBuffer(pBuffer), _pos(0) {}
+
+  virtual ~SharedBufferDataSource() {}
+
+  std::shared_ptr<const std::vector<uint8_t> > buffer() const;
+
+  uint64_t size() const;
+  uv_buf_t getData(size_t bytesDesired);
+  void freeData(uv_buf_t buffer);
+  void close();
+};
+
 // Class for writing a DataSource to a uv_stream_t. Takes care
 // not to buffer too much data in memory (happens when you try
 // to write too much data to a slow uv_stream_t).
@@ -75,16 +95,19 @@ class ExtendedWrite {
   bool _completed;
   uv_stream_t* _pHandle;
   std::shared_ptr<DataSource> _pDataSource;
+  // Total bytes passed to uv_write(), including chunk framing.
+  uint64_t _bytesWritten;
 
 public:
   ExtendedWrite(uv_stream_t* pHandle, std::shared_ptr<DataSource> pDataSource, bool chunked)
       : _chunked(chunked), _activeWrites(0), _errored(false), _completed(false), _pHandle(pHandle),
-        _pDataSource(pDataSource) {}
+        _pDataSource(pDataSource), _bytesWritten(0) {}
   virtual ~ExtendedWrite() {}
 
   virtual void onWriteComplete(int status) = 0;
 
   void begin();
+  uint64_t bytesWritten() const { return _bytesWritten; }
   friend class WriteOp;
 
 protected:
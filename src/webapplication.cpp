@@ -1,8 +1,10 @@
+#include <cstring>
 #include <functional>
 #include <memory>
 #include "httpuv.h"
 #include "filedatasource.h"
 #include "webapplication.h"
+#include "loopmonitor.h"
 #include "httprequest.h"
 #include "http.h"
 #include "thread.h"
@@ -10,7 +12,9 @@
 #include "mime.h"
 #include "staticpath.h"
 #include "fs.h"
+#include "wsmessage.h"
 #include <Rinternals.h>
+#include <Rversion.h>
 
 // ============================================================================
 // Utility functions
@@ -113,6 +117,14 @@ std::shared_ptr<HttpResponse> error_response(std::shared_ptr<HttpRequest> pReque
   );
 }
 
+// A 503 response with a Retry-After header, for when the server is too busy
+// to handle a request. Like error_response(), this doesn't involve R.
+std::shared_ptr<HttpResponse> overloaded_response(std::shared_ptr<HttpRequest> pRequest, int retryAfter) {
+  std::shared_ptr<HttpResponse> pResponse = error_response(pRequest, 503);
+  pResponse->addHeader("Retry-After", toString(retryAfter));
+  return pResponse;
+}
+
 // Given a URL path like "/foo?abc=123", removes the '?' and everything after.
 std::pair<std::string, std::string> splitQueryString(const std::string& url) {
   size_t qsIndex = url.find('?');
@@ -128,6 +140,31 @@ std::pair<std::string, std::string> splitQueryString(const std::string& url) {
 }
 
 
+// Returns an R function which takes no arguments and returns TRUE if the
+// connection for the request has been closed. It reads the flag that
+// requestToEnv() stores in the request's environment as
+// .httpuv_cancelled_flag. The body of the function is built once and shared;
+// only the closure, whose environment is the request's, is made per request.
+// The request environment's parent is the empty environment, so the body
+// holds isCancelled_() itself rather than its name.
+static SEXP cancelledFunction(SEXP env) {
+  ASSERT_MAIN_THREAD()
+  static SEXP body = R_NilValue;
+  if (body == R_NilValue) {
+    Rcpp::Function isCancelled(
+      Rcpp::Environment::namespace_env("httpuv")["isCancelled_"]
+    );
+    body = PROTECT(Rf_lang2(isCancelled, Rf_install(".httpuv_cancelled_flag")));
+    R_PreserveObject(body);
+    UNPROTECT(1);
+  }
+#if defined(R_VERSION) && R_VERSION >= R_Version(4, 5, 0)
+  return R_mkClosure(R_NilValue, body, env);
+#else
+  return Rf_mkCLOSXP(R_NilValue, body, env);
+#endif
+}
+
 void requestToEnv(std::shared_ptr<HttpRequest> pRequest, Rcpp::Environment* pEnv) {
   ASSERT_MAIN_THREAD()
   using namespace Rcpp;
@@ -178,6 +215,13 @@ void requestToEnv(std::shared_ptr<HttpRequest> pRequest, Rcpp::Environment* pEnv
 
   env["HEADERS"] = raw_headers;
 
+  // req$httpuv.cancelled() lets R code (especially async handlers) check
+  // whether the client has disconnected, so it can stop working early.
+  env[".httpuv_cancelled_flag"] = Rcpp::XPtr<std::shared_ptr<std::atomic<bool> > >(
+    new std::shared_ptr<std::atomic<bool> >(pRequest->cancelledFlag()),
+    true
+  );
+  env["httpuv.cancelled"] = Rcpp::RObject(cancelledFunction(env));
 }
 
 
@@ -225,13 +269,18 @@ std::shared_ptr<HttpResponse> listToResponse(
     }
     pDataSource = pFDS;
   }
-  else if (hasBody && Rf_isString(response["body"])) {
-    RawVector responseBytes = Function("charToRaw")(response["body"]);
-    pDataSource = std::make_shared<InMemoryDataSource>(responseBytes);
-  }
   else if (hasBody) {
-    RawVector responseBytes = response["body"];
-    pDataSource = std::make_shared<InMemoryDataSource>(responseBytes);
+    RawVector responseBytes;
+    if (Rf_isString(response["body"])) {
+      responseBytes = Function("charToRaw")(response["body"]);
+    } else {
+      responseBytes = response["body"];
+    }
+    // The bytes are held in a shared buffer, so that the response cache can
+    // keep them without making another copy.
+    std::shared_ptr<std::vector<uint8_t> > pBuffer =
+      std::make_shared<std::vector<uint8_t> >(responseBytes.begin(), responseBytes.end());
+    pDataSource = std::make_shared<SharedBufferDataSource>(pBuffer);
   }
 
   std::shared_ptr<HttpResponse> pResp(
@@ -248,14 +297,104 @@ std::shared_ptr<HttpResponse> listToResponse(
   return pResp;
 }
 
+// If the request had a body, the R onBodyData function wrote it to a file
+// connection, which the R call function normally closes. When the request is
+// answered without calling into R, close it here.
+void closeBodyData(std::shared_ptr<HttpRequest> pRequest) {
+  ASSERT_MAIN_THREAD()
+  Rcpp::Environment& env = pRequest->env();
+  if (env.exists(".bodyData")) {
+    Rcpp::Function close_con("close");
+    try {
+      close_con(env[".bodyData"]);
+    } catch (...) {
+      debug_log("Exception occurred closing request body data", LOG_INFO);
+    }
+    env.remove(".bodyData");
+  }
+}
+
+// Times (from uv_hrtime()) for a call into the application's call()
+// function, for the Server-Timing header.
+struct RequestPhaseTimes {
+  // How long (in nanoseconds) the request waited for the main thread.
+  uint64_t queueWait;
+  // When call() was called, when it produced a response (which may be later
+  // than when it returned, if it returned a promise), and when the response
+  // was converted to an HttpResponse.
+  uint64_t called;
+  uint64_t responded;
+  uint64_t converted;
+
+  RequestPhaseTimes() : queueWait(0), called(0), responded(0), converted(0) {}
+};
+
+// Whether a string can be used as a metric name in a Server-Timing header
+// (an HTTP token).
+static bool is_server_timing_name(const std::string& name) {
+  if (name.empty()) {
+    return false;
+  }
+  for (size_t i = 0; i < name.size(); i++) {
+    char c = name[i];
+    if (!(isalnum((unsigned char)c) || strchr("!#$%&'*+-.^_`|~", c))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Adds Server-Timing entries for a response from the application: how long
+// the request waited for the main thread, how long the application took to
+// produce the response (including any promise), and how long it took to
+// convert the response from an R list. Entries added by the application in
+// req$httpuv.serverTiming (a named numeric vector of durations in
+// milliseconds) follow them.
+static void addServerTiming(std::shared_ptr<HttpRequest> pRequest,
+                            std::shared_ptr<HttpResponse> pResponse,
+                            const RequestPhaseTimes& times)
+{
+  ASSERT_MAIN_THREAD()
+  using namespace Rcpp;
+
+  pResponse->addServerTiming("queue", times.queueWait);
+  pResponse->addServerTiming("app", times.responded - times.called);
+  pResponse->addServerTiming("convert", times.converted - times.responded);
+
+  RObject entries = pRequest->env().get("httpuv.serverTiming");
+  if (TYPEOF(entries) != REALSXP && TYPEOF(entries) != INTSXP) {
+    return;
+  }
+  RObject names_obj = entries.attr("names");
+  if (names_obj.isNULL()) {
+    return;
+  }
+  std::vector<double> values = as<std::vector<double> >(entries);
+  std::vector<std::string> names = as<std::vector<std::string> >(names_obj);
+  for (size_t i = 0; i < values.size(); i++) {
+    if (!is_server_timing_name(names[i]) || !(values[i] >= 0)) {
+      continue;
+    }
+    pResponse->addServerTiming(names[i], (uint64_t)(values[i] * 1e6));
+  }
+}
+
 void invokeResponseFun(std::function<void(std::shared_ptr<HttpResponse>)> fun,
                        std::shared_ptr<HttpRequest> pRequest,
+                       RequestPhaseTimes times,
+                       bool serverTiming,
                        Rcpp::List response)
 {
   ASSERT_MAIN_THREAD()
+  times.responded = uv_hrtime();
   // new HttpResponse object. The callback will invoke
   // HttpResponse->writeResponse().
   std::shared_ptr<HttpResponse> pResponse = listToResponse(pRequest, response);
+  times.converted = uv_hrtime();
+
+  if (serverTiming && pResponse) {
+    addServerTiming(pRequest, pResponse, times);
+  }
   fun(pResponse);
 }
 
@@ -271,21 +410,80 @@ RWebApplication::RWebApplication(
     Rcpp::Function onWSOpen,
     Rcpp::Function onWSMessage,
     Rcpp::Function onWSClose,
+    Rcpp::Function onWSDrain,
     Rcpp::List     staticPaths,
-    Rcpp::List     staticPathOptions) :
+    Rcpp::List     staticPathOptions,
+    Rcpp::List     routes,
+    Rcpp::List     serverOptions) :
     _onHeaders(onHeaders), _onBodyData(onBodyData), _onRequest(onRequest),
-    _onWSOpen(onWSOpen), _onWSMessage(onWSMessage), _onWSClose(onWSClose)
+    _onWSOpen(onWSOpen), _onWSMessage(onWSMessage), _onWSClose(onWSClose),
+    _onWSDrain(onWSDrain),
+    _routeManager(routes),
+    _serverOptions(std::make_shared<const ServerOptions>(serverOptions)),
+    _pAccessLog(std::make_shared<AccessLog>()),
+    _pTrafficCapture(std::make_shared<TrafficCapture>()),
+    _queueExpired(0),
+    _cancelled(0),
+    _timedOut(0)
 {
   ASSERT_MAIN_THREAD()
 
   _staticPathManager = StaticPathManager(staticPaths, staticPathOptions);
+
+  const ServerOptions& options = *_serverOptions.get();
+  _responseCache.configure(options.responseCacheSize, options.responseCacheVary);
+  _requestCoalescer.configure(options.coalesceRequests, options.responseCacheVary);
+  _requestMetrics.setPath(options.metricsPath);
+  _pAccessLog->configure(options.accessLog, options.accessLogFormat,
+                         options.accessLogSample, options.accessLogReopenSignal);
+}
+
+
+// Checks whether the client for a request has disconnected. Requests like
+// this are skipped rather than being passed to R.
+bool RWebApplication::_skipClosed(std::shared_ptr<HttpRequest> pRequest) {
+  ASSERT_MAIN_THREAD()
+  if (pRequest->isClosed()) {
+    debug_log("Skipping request for closed connection", LOG_DEBUG);
+    _cancelled++;
+    return true;
+  }
+  return false;
 }
 
+// Records how long the request waited for the main thread, and checks whether
+// that exceeded the queueDeadline option. If so, the client has likely given
+// up already, so the caller should send a 503 instead of calling into R.
+bool RWebApplication::_queueDeadlineExpired(std::shared_ptr<HttpRequest> pRequest) {
+  ASSERT_MAIN_THREAD()
+  uint64_t wait = pRequest->queueWait();
+  _queueWait.record(wait);
+
+  double deadline = getServerOptions()->queueDeadline;
+  if (deadline >= 0 && wait > deadline * 1e9) {
+    debug_log("Request exceeded queue deadline", LOG_INFO);
+    _queueExpired++;
+    return true;
+  }
+  return false;
+}
 
 void RWebApplication::onHeaders(std::shared_ptr<HttpRequest> pRequest,
                                 std::function<void(std::shared_ptr<HttpResponse>)> callback)
 {
   ASSERT_MAIN_THREAD()
+
+  // The client disconnected while this was waiting in the queue. Don't call
+  // into R for it, and don't call the callback, since there's no longer a
+  // connection to respond on.
+  if (_skipClosed(pRequest)) {
+    return;
+  }
+
+  if (_queueDeadlineExpired(pRequest)) {
+    callback(overloaded_response(pRequest, getServerOptions()->retryAfter));
+    return;
+  }
   if (_onHeaders.isNULL()) {
     std::shared_ptr<HttpResponse> null_ptr;
     callback(null_ptr);
@@ -325,6 +523,9 @@ void RWebApplication::onBodyData(std::shared_ptr<HttpRequest> pRequest,
   if (pRequest->isResponseScheduled())
     return;
 
+  if (pRequest->isClosed())
+    return;
+
   Rcpp::RawVector rawVector(data->size());
   std::copy(data->begin(), data->end(), rawVector.begin());
   try {
@@ -348,10 +549,28 @@ void RWebApplication::getResponse(std::shared_ptr<HttpRequest> pRequest,
   debug_log("RWebApplication::getResponse", LOG_DEBUG);
   using namespace Rcpp;
 
+  if (_skipClosed(pRequest)) {
+    closeBodyData(pRequest);
+    return;
+  }
+
+  // If there was an error processing the body, a response has already been
+  // sent, so there's no need to check the deadline.
+  if (!pRequest->isResponseScheduled() && _queueDeadlineExpired(pRequest)) {
+    closeBodyData(pRequest);
+    callback(overloaded_response(pRequest, getServerOptions()->retryAfter));
+    return;
+  }
+
+  RequestPhaseTimes times;
+  times.queueWait = pRequest->queueWait();
+  times.called = uv_hrtime();
+
   // Pass callback to R:
-  // invokeResponseFun(callback, pRequest, _1)
+  // invokeResponseFun(callback, pRequest, times, serverTiming, _1)
   std::function<void(List)>* callback_wrapper = new std::function<void(List)>(
-    std::bind(invokeResponseFun, callback, pRequest, std::placeholders::_1)
+    std::bind(invokeResponseFun, callback, pRequest, times,
+              getServerOptions()->serverTiming, std::placeholders::_1)
   );
 
   SEXP callback_xptr = PROTECT(R_MakeExternalPtr(callback_wrapper, R_NilValue, R_NilValue));
@@ -413,18 +632,12 @@ void RWebApplication::onWSMessage(std::shared_ptr<WebSocketConnection> pConn,
 {
   ASSERT_MAIN_THREAD()
   try {
-    if (binary)
-      _onWSMessage(
-        externalize_shared_ptr(pConn),
-        binary,
-        std::vector<uint8_t>(data->begin(), data->end())
-      );
-    else
-      _onWSMessage(
-        externalize_shared_ptr(pConn),
-        binary,
-        std::string(data->begin(), data->end())
-      );
+    Rcpp::RObject message(ws_message_to_r(binary, data));
+    _onWSMessage(
+      externalize_shared_ptr(pConn),
+      binary,
+      message
+    );
   } catch(...) {
     error_callback();
   }
@@ -435,6 +648,20 @@ void RWebApplication::onWSClose(std::shared_ptr<WebSocketConnection> pConn) {
   _onWSClose(externalize_shared_ptr(pConn));
 }
 
+void RWebApplication::onWSDrain(std::shared_ptr<WebSocketConnection> pConn) {
+  ASSERT_MAIN_THREAD()
+  _onWSDrain(externalize_shared_ptr(pConn));
+}
+
+// The 504 has already been sent by the background thread. The application's
+// call() may never finish, so release the request body file here instead of
+// waiting for it to clean up.
+void RWebApplication::onResponseTimeout(std::shared_ptr<HttpRequest> pRequest) {
+  ASSERT_MAIN_THREAD()
+  _timedOut++;
+  closeBodyData(pRequest);
+}
+
 
 // ============================================================================
 // Static file serving
@@ -443,6 +670,8 @@ void RWebApplication::onWSClose(std::shared_ptr<WebSocketConnection> pConn) {
 // Unlike most of the methods for an RWebApplication, these ones are called on
 // the background thread.
 
+// Returns a response for requests which can be answered without R: routes
+// (fixed responses and redirects) are checked first, then static paths.
 std::shared_ptr<HttpResponse> RWebApplication::staticFileResponse(
   std::shared_ptr<HttpRequest> pRequest
 ) {
@@ -458,6 +687,21 @@ std::shared_ptr<HttpResponse> RWebApplication::staticFileResponse(
   std::pair<std::string, std::string> url_query = splitQueryString(pRequest->url());
   std::string url_path = doDecodeURI(url_query.first, true);
 
+  if (_requestMetrics.isMetricsPath(url_path)) {
+    return _metricsResponse(pRequest);
+  }
+
+  std::experimental::optional<std::pair<std::shared_ptr<const Route>, std::string> > route_pair =
+    _routeManager.matchRoute(url_path);
+
+  if (route_pair) {
+    std::shared_ptr<HttpResponse> pResponse =
+      route_pair->first->response(pRequest, route_pair->second, url_query.second);
+    if (pResponse) {
+      return pResponse;
+    }
+  }
+
   std::experimental::optional<std::pair<StaticPath, std::string>> sp_pair =
     _staticPathManager.matchStaticPath(url_path);
 
@@ -516,6 +760,9 @@ std::shared_ptr<HttpResponse> RWebApplication::staticFileResponse(
     local_path += "/" + subpath;
   }
 
+  // Time taken to find, open, and stat the file, for the Server-Timing header.
+  uint64_t file_start = uv_hrtime();
+
   if (is_directory(local_path)) {
     if (*sp.options.indexhtml) {
       local_path = local_path + "/" + "index.html";
@@ -524,6 +771,7 @@ std::shared_ptr<HttpResponse> RWebApplication::staticFileResponse(
 
   std::shared_ptr<FileDataSource> pDataSource = std::make_shared<FileDataSource>();
   FileDataSourceResult ret = pDataSource->initialize(local_path, false);
+  uint64_t file_time = uv_hrtime() - file_start;
 
   if (ret != FDS_OK) {
     if (ret == FDS_NOT_EXIST || ret == FDS_ISDIR) {
@@ -623,9 +871,168 @@ std::shared_ptr<HttpResponse> RWebApplication::staticFileResponse(
     respHeaders.push_back(std::make_pair("Last-Modified", http_date_string(pDataSource->getMtime())));
   }
 
+  if (getServerOptions()->serverTiming) {
+    pResponse->addServerTiming("file", file_time);
+  }
+
   return pResponse;
 }
 
 StaticPathManager& RWebApplication::getStaticPathManager() {
   return _staticPathManager;
 }
+
+RouteManager& RWebApplication::getRouteManager() {
+  return _routeManager;
+}
+
+std::shared_ptr<HttpResponse> RWebApplication::nativeHandlerResponse(
+  std::shared_ptr<HttpRequest> pRequest
+) {
+  ASSERT_BACKGROUND_THREAD()
+  return _nativeHandlerManager.handle(pRequest);
+}
+
+NativeHandlerManager& RWebApplication::getNativeHandlerManager() {
+  return _nativeHandlerManager;
+}
+
+
+// ============================================================================
+// Response cache
+// ============================================================================
+
+std::shared_ptr<HttpResponse> RWebApplication::cachedResponse(
+  std::shared_ptr<HttpRequest> pRequest
+) {
+  ASSERT_BACKGROUND_THREAD()
+  return _responseCache.lookup(pRequest);
+}
+
+void RWebApplication::cacheResponse(std::shared_ptr<HttpRequest> pRequest,
+                                    std::shared_ptr<HttpResponse> pResponse)
+{
+  ASSERT_BACKGROUND_THREAD()
+  _responseCache.store(pRequest, pResponse);
+}
+
+void RWebApplication::clearResponseCache() {
+  ASSERT_MAIN_THREAD()
+  _responseCache.clear();
+}
+
+RequestCoalescer& RWebApplication::getRequestCoalescer() {
+  return _requestCoalescer;
+}
+
+
+// ============================================================================
+// Server options
+// ============================================================================
+
+std::shared_ptr<const ServerOptions> RWebApplication::getServerOptions() {
+  return _serverOptions.get();
+}
+
+void RWebApplication::setServerOptions(const Rcpp::List& options) {
+  ASSERT_MAIN_THREAD()
+  ServerOptions newOptions = *_serverOptions.get();
+  newOptions.setOptions(options);
+  // This throws if the log file can't be opened, so do it before anything is
+  // changed.
+  _pAccessLog->configure(newOptions.accessLog, newOptions.accessLogFormat,
+                         newOptions.accessLogSample, newOptions.accessLogReopenSignal);
+  _serverOptions.set(std::make_shared<const ServerOptions>(newOptions));
+
+  _responseCache.configure(newOptions.responseCacheSize, newOptions.responseCacheVary);
+  _requestCoalescer.configure(newOptions.coalesceRequests, newOptions.responseCacheVary);
+  _requestMetrics.setPath(newOptions.metricsPath);
+}
+
+
+// ============================================================================
+// Metrics
+// ============================================================================
+
+Rcpp::List RWebApplication::getMetrics() {
+  ASSERT_MAIN_THREAD()
+  using namespace Rcpp;
+  return List::create(
+    _["requests"]      = _requestMetrics.asRObject(),
+    _["queueWait"]     = _queueWait.asRObject(),
+    _["queueExpired"]  = (double)_queueExpired,
+    _["cancelled"]     = (double)_cancelled,
+    _["timedOut"]      = (double)_timedOut,
+    _["responseCache"] = _responseCache.metricsAsRObject(),
+    _["coalescing"]    = _requestCoalescer.metricsAsRObject(),
+    _["accessLog"]     = _pAccessLog->metricsAsRObject(),
+    _["websocket"]     = _wsFlowControl.metricsAsRObject()
+  );
+}
+
+RequestMetrics& RWebApplication::getRequestMetrics() {
+  return _requestMetrics;
+}
+
+AccessLog& RWebApplication::getAccessLog() {
+  return *_pAccessLog;
+}
+
+TrafficCapture& RWebApplication::getTrafficCapture() {
+  return *_pTrafficCapture;
+}
+
+WSFlowControl& RWebApplication::getWSFlowControl() {
+  return _wsFlowControl;
+}
+
+// The metrics in the Prometheus text exposition format, for the metricsPath
+// server option. This is served from the background thread, so it only
+// includes values which are safe to read from there.
+std::shared_ptr<HttpResponse> RWebApplication::_metricsResponse(
+  std::shared_ptr<HttpRequest> pRequest
+) {
+  ASSERT_BACKGROUND_THREAD()
+
+  std::string method = pRequest->method();
+  if (method != "GET" && method != "HEAD") {
+    return error_response(pRequest, 405);
+  }
+
+  std::ostringstream os;
+  _requestMetrics.writePrometheus(os);
+
+  os << "# HELP httpuv_queue_wait_seconds Time requests waited for the R main thread.\n"
+     << "# TYPE httpuv_queue_wait_seconds histogram\n";
+  _queueWait.writePrometheus(os, "httpuv_queue_wait_seconds", "");
+  os << "# HELP httpuv_queue_expired_total Requests dropped for exceeding the queue deadline.\n"
+     << "# TYPE httpuv_queue_expired_total counter\n"
+     << "httpuv_queue_expired_total " << _queueExpired.load() << "\n";
+  os << "# HELP httpuv_cancelled_total Requests skipped because the client disconnected.\n"
+     << "# TYPE httpuv_cancelled_total counter\n"
+     << "httpuv_cancelled_total " << _cancelled.load() << "\n";
+  os << "# HELP httpuv_timed_out_total Requests that exceeded the response timeout.\n"
+     << "# TYPE httpuv_timed_out_total counter\n"
+     << "httpuv_timed_out_total " << _timedOut.load() << "\n";
+  _wsFlowControl.writePrometheus(os);
+
+  // The I/O loop is shared by all servers, so these are the same for each.
+  get_loop_monitor().writePrometheus(os);
+
+  std::string text = os.str();
+  std::shared_ptr<DataSource> pDataSource;
+  if (method == "GET") {
+    pDataSource = std::make_shared<InMemoryDataSource>(
+      std::vector<uint8_t>(text.begin(), text.end())
+    );
+  }
+
+  std::shared_ptr<HttpResponse> pResponse(
+    new HttpResponse(pRequest, 200, getStatusDescription(200), pDataSource),
+    auto_deleter_background<HttpResponse>
+  );
+  pResponse->addHeader("Content-Type", "text/plain; version=0.0.4; charset=utf-8");
+  pResponse->addHeader("Content-Length", toString(text.size()));
+  pResponse->addHeader("Cache-Control", "no-store");
+  return pResponse;
+}
@@ -1,16 +1,32 @@
 #ifndef WEBAPPLICATION_HPP
 #define WEBAPPLICATION_HPP
 
+#include <atomic>
 #include <functional>
 #include <uv.h>
 #include <Rcpp.h>
 #include "websockets.h"
 #include "thread.h"
 #include "staticpath.h"
+#include "serveroptions.h"
+#include "histogram.h"
+#include "nativehandler.h"
+#include "routes.h"
+#include "responsecache.h"
+#include "coalescer.h"
+#include "requestmetrics.h"
+#include "accesslog.h"
+#include "capture.h"
+#include "wsflowcontrol.h"
 
 class HttpRequest;
 class HttpResponse;
 
+const std::string& getStatusDescription(int code);
+std::shared_ptr<HttpResponse> error_response(std::shared_ptr<HttpRequest> pRequest, int code);
+std::shared_ptr<HttpResponse> overloaded_response(std::shared_ptr<HttpRequest> pRequest, int retryAfter);
+std::pair<std::string, std::string> splitQueryString(const std::string& url);
+
 class WebApplication {
 public:
   virtual ~WebApplication() {}
@@ -28,10 +44,44 @@ public:
                            std::shared_ptr<std::vector<char> > data,
                            std::function<void(void)> error_callback) = 0;
   virtual void onWSClose(std::shared_ptr<WebSocketConnection>) = 0;
+  // Called when a connection's outgoing data, after going over the
+  // wsHighWaterMark option, is down to half of it.
+  virtual void onWSDrain(std::shared_ptr<WebSocketConnection>) = 0;
+  // Called after the background thread has sent a 504 because the
+  // application didn't respond within the responseTimeout option.
+  virtual void onResponseTimeout(std::shared_ptr<HttpRequest> pRequest) = 0;
 
   virtual std::shared_ptr<HttpResponse> staticFileResponse(
     std::shared_ptr<HttpRequest> pRequest) = 0;
   virtual StaticPathManager& getStaticPathManager() = 0;
+  virtual RouteManager& getRouteManager() = 0;
+
+  // Handlers from compiled code, which run on the background thread.
+  virtual std::shared_ptr<HttpResponse> nativeHandlerResponse(
+    std::shared_ptr<HttpRequest> pRequest) = 0;
+  virtual NativeHandlerManager& getNativeHandlerManager() = 0;
+
+  // Cache of responses from the application. cachedResponse() returns an
+  // empty shared_ptr if there is no fresh entry for the request.
+  virtual std::shared_ptr<HttpResponse> cachedResponse(
+    std::shared_ptr<HttpRequest> pRequest) = 0;
+  virtual void cacheResponse(std::shared_ptr<HttpRequest> pRequest,
+                             std::shared_ptr<HttpResponse> pResponse) = 0;
+  virtual void clearResponseCache() = 0;
+
+  virtual RequestCoalescer& getRequestCoalescer() = 0;
+  virtual RequestMetrics& getRequestMetrics() = 0;
+  virtual AccessLog& getAccessLog() = 0;
+  virtual TrafficCapture& getTrafficCapture() = 0;
+  virtual WSFlowControl& getWSFlowControl() = 0;
+
+  // Returns the current server options; safe to call from either thread.
+  // The object is never modified: setServerOptions() replaces it, so callers
+  // can hold on to it without copying.
+  virtual std::shared_ptr<const ServerOptions> getServerOptions() = 0;
+  virtual void setServerOptions(const Rcpp::List& options) = 0;
+
+  virtual Rcpp::List getMetrics() = 0;
 };
 
 
@@ -43,8 +93,43 @@ private:
   Rcpp::Function _onWSOpen;
   Rcpp::Function _onWSMessage;
   Rcpp::Function _onWSClose;
+  Rcpp::Function _onWSDrain;
 
   StaticPathManager _staticPathManager;
+  RouteManager _routeManager;
+  NativeHandlerManager _nativeHandlerManager;
+  ResponseCache _responseCache;
+  RequestCoalescer _requestCoalescer;
+  ThreadSafe<std::shared_ptr<const ServerOptions> > _serverOptions;
+
+  // Counters and histograms for requests, recorded on the background thread.
+  RequestMetrics _requestMetrics;
+  std::shared_ptr<HttpResponse> _metricsResponse(std::shared_ptr<HttpRequest> pRequest);
+
+  // A shared_ptr because writes in progress keep it alive.
+  std::shared_ptr<AccessLog> _pAccessLog;
+  // Likewise for the traffic capture.
+  std::shared_ptr<TrafficCapture> _pTrafficCapture;
+
+  // Incoming WebSocket messages waiting for R, for the wsMaxPending* options.
+  WSFlowControl _wsFlowControl;
+
+  // How long requests waited for the main thread, and how many were dropped
+  // because they waited longer than the queueDeadline option. Both are only
+  // updated on the main thread. These counters are atomic because the
+  // metricsPath endpoint reads them on the background thread.
+  Histogram _queueWait;
+  std::atomic<uint64_t> _queueExpired;
+  bool _queueDeadlineExpired(std::shared_ptr<HttpRequest> pRequest);
+
+  // Number of calls into R which were skipped because the client had already
+  // disconnected. Only updated on the main thread.
+  std::atomic<uint64_t> _cancelled;
+  bool _skipClosed(std::shared_ptr<HttpRequest> pRequest);
+
+  // Number of requests which got a 504 because of the responseTimeout option.
+  // Only updated on the main thread.
+  std::atomic<uint64_t> _timedOut;
 
 public:
   RWebApplication(Rcpp::Function onHeaders,
@@ -53,8 +138,11 @@ public:
                   Rcpp::Function onWSOpen,
                   Rcpp::Function onWSMessage,
                   Rcpp::Function onWSClose,
+                  Rcpp::Function onWSDrain,
                   Rcpp::List     staticPaths,
-                  Rcpp::List     staticPathOptions);
+                  Rcpp::List     staticPathOptions,
+                  Rcpp::List     routes,
+                  Rcpp::List     serverOptions);
 
   virtual ~RWebApplication() {
     ASSERT_MAIN_THREAD()
@@ -74,10 +162,34 @@ public:
                            std::shared_ptr<std::vector<char> > data,
                            std::function<void(void)> error_callback);
   virtual void onWSClose(std::shared_ptr<WebSocketConnection> conn);
+  virtual void onWSDrain(std::shared_ptr<WebSocketConnection> conn);
+  virtual void onResponseTimeout(std::shared_ptr<HttpRequest> pRequest);
 
   virtual std::shared_ptr<HttpResponse> staticFileResponse(
     std::shared_ptr<HttpRequest> pRequest);
   virtual StaticPathManager& getStaticPathManager();
+  virtual RouteManager& getRouteManager();
+
+  virtual std::shared_ptr<HttpResponse> nativeHandlerResponse(
+    std::shared_ptr<HttpRequest> pRequest);
+  virtual NativeHandlerManager& getNativeHandlerManager();
+
+  virtual std::shared_ptr<HttpResponse> cachedResponse(
+    std::shared_ptr<HttpRequest> pRequest);
+  virtual void cacheResponse(std::shared_ptr<HttpRequest> pRequest,
+                             std::shared_ptr<HttpResponse> pResponse);
+  virtual void clearResponseCache();
+
+  virtual RequestCoalescer& getRequestCoalescer();
+  virtual RequestMetrics& getRequestMetrics();
+  virtual AccessLog& getAccessLog();
+  virtual TrafficCapture& getTrafficCapture();
+  virtual WSFlowControl& getWSFlowControl();
+
+  virtual std::shared_ptr<const ServerOptions> getServerOptions();
+  virtual void setServerOptions(const Rcpp::List& options);
+
+  virtual Rcpp::List getMetrics();
 };
 
 
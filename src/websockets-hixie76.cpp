@@ -39,6 +39,7 @@ void WSHixie76Parser::read(const char* data, size_t len) {
 
         WSFrameHeaderInfo info;
         info.fin = true;
+        info.rsv1 = false;
         info.opcode = Text;
         info.masked = false;
         info.hasLength = false;
@@ -83,6 +84,7 @@ void WSHixie76Parser::read(const char* data, size_t len) {
         // Close up shop
         WSFrameHeaderInfo info;
         info.fin = true;
+        info.rsv1 = false;
         info.opcode = Close;
         info.masked = false;
         info.hasLength = true;
@@ -111,6 +113,7 @@ void WSHixie76Parser::read(const char* data, size_t len) {
 
         WSFrameHeaderInfo info;
         info.fin = true;
+        info.rsv1 = false;
         info.opcode = Binary;
         info.masked = false;
         info.hasLength = true;
@@ -1,12 +1,17 @@
 #include "websockets.h"
 #include "utils.h"
 #include "thread.h"
+#include "probes.h"
+#include "wsmask.h"
 #include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
 
 #include <algorithm>
 #include <iostream>
 #include <iomanip>
 #include <memory>
+#include <new>
 
 #include "sha1/sha1.h"
 #include "base64/base64.hpp"
@@ -15,6 +20,13 @@
 #include "websockets-hybi03.h"
 #include "websockets-hixie76.h"
 
+// The most memory reserved for an incoming frame's payload before any of it
+// has arrived.
+static const size_t MAX_PAYLOAD_RESERVE = 16 * 1024 * 1024;
+
+// Messages smaller than this aren't worth compressing.
+static const size_t MIN_DEFLATE_SIZE = 64;
+
 template <typename T>
 T min(T a, T b) {
   return (a > b) ? b : a;
@@ -45,6 +57,7 @@ bool WSHyBiFrameHeader::isHeaderComplete() const {
 WSFrameHeaderInfo WSHyBiFrameHeader::info() const {
   WSFrameHeaderInfo inf;
   inf.fin = fin();
+  inf.rsv1 = rsv1();
   inf.opcode = opcode();
   inf.hasLength = true;
   inf.masked = masked();
@@ -59,6 +72,9 @@ WSFrameHeaderInfo WSHyBiFrameHeader::info() const {
 bool WSHyBiFrameHeader::fin() const {
   return _pProto->isFin(read(0, 1));
 }
+bool WSHyBiFrameHeader::rsv1() const {
+  return read(1, 1) != 0;
+}
 Opcode WSHyBiFrameHeader::opcode() const {
   uint8_t oc = read(4, 4);
   return _pProto->decodeOpcode(oc);
@@ -235,6 +251,7 @@ bool WebSocketConnection::accept(const RequestHeaders& requestHeaders,
   WebSocketProto_IETF ietf;
   if (ietf.canHandle(requestHeaders, pData, len)) {
     _pParser = new WSHyBiParser(this, new WebSocketProto_IETF());
+    _ietf = true;
     this->startPingTimer();
     return true;
   }
@@ -259,27 +276,265 @@ void WebSocketConnection::handshake(const std::string& url,
 
   _pParser->handshake(url, requestHeaders, ppData, pLen, pResponseHeaders,
                       pResponse);
+
+  RequestHeaders::const_iterator extensions =
+    requestHeaders.find("sec-websocket-extensions");
+  if (_ietf && extensions != requestHeaders.end()) {
+    std::string response;
+    _pDeflate = WSDeflate::negotiate(extensions->second, _options.deflate,
+                                     &response);
+    if (_pDeflate) {
+      pResponseHeaders->push_back(
+        std::pair<std::string, std::string>("Sec-WebSocket-Extensions", response));
+    }
+  }
+}
+
+void WebSocketConnection::setOptions(const WSConnectionOptions& options) {
+  ASSERT_BACKGROUND_THREAD()
+  _options = options;
+}
+
+ws_frame_t* ws_frame_alloc(size_t payloadLength) {
+  ws_frame_t* pFrame = (ws_frame_t*)malloc(
+    offsetof(ws_frame_t, data) + MAX_HEADER_BYTES + payloadLength + MAX_FOOTER_BYTES
+  );
+  if (pFrame == NULL) {
+    throw std::bad_alloc();
+  }
+  memset(&pFrame->writeReq, 0, sizeof(uv_write_t));
+  pFrame->headerLength = 0;
+  pFrame->payloadLength = payloadLength;
+  pFrame->footerLength = 0;
+  return pFrame;
+}
+
+char* ws_frame_payload(ws_frame_t* pFrame) {
+  return pFrame->data + MAX_HEADER_BYTES;
+}
+
+uv_buf_t ws_frame_buf(ws_frame_t* pFrame) {
+  return uv_buf_init(
+    ws_frame_payload(pFrame) - pFrame->headerLength,
+    pFrame->headerLength + pFrame->payloadLength + pFrame->footerLength
+  );
+}
+
+void ws_frame_free(ws_frame_t* pFrame) {
+  free(pFrame);
 }
 
 void WebSocketConnection::sendWSMessage(Opcode opcode, const char* pData, size_t length) {
   ASSERT_BACKGROUND_THREAD()
   if (_connState == WS_CLOSED) return;
 
-  std::vector<char> header(MAX_HEADER_BYTES);
-  std::vector<char> footer(MAX_FOOTER_BYTES);
+  ws_frame_t* pFrame = ws_frame_alloc(length);
+  if (length > 0) {
+    memcpy(ws_frame_payload(pFrame), pData, length);
+  }
+  sendWSFrame(opcode, pFrame);
+}
+
+void WebSocketConnection::sendWSFrame(Opcode opcode, ws_frame_t* pFrame) {
+  ASSERT_BACKGROUND_THREAD()
+  if (_connState == WS_CLOSED) {
+    ws_frame_free(pFrame);
+    return;
+  }
+
+  // Control frames are small, and are never held back or dropped.
+  if ((opcode == Text || opcode == Binary) &&
+      !admitMessage(WSHeldMessage(opcode, pFrame)))
+  {
+    return;
+  }
+  writeWSFrame(opcode, pFrame);
+  updateBufferedAmount();
+}
+
+void WebSocketConnection::writeWSFrame(Opcode opcode, ws_frame_t* pFrame) {
+  // Data messages are compressed if the client agreed to it. Control frames
+  // never are.
+  bool compressed = false;
+  if (_pDeflate && (opcode == Text || opcode == Binary) &&
+      pFrame->payloadLength >= MIN_DEFLATE_SIZE)
+  {
+    ws_frame_t* pDeflated = ws_frame_alloc(
+      _pDeflate->compressBound(pFrame->payloadLength));
+    compressed = _pDeflate->compress(
+      ws_frame_payload(pFrame), pFrame->payloadLength,
+      ws_frame_payload(pDeflated), &pDeflated->payloadLength);
+    if (compressed) {
+      ws_frame_free(pFrame);
+      pFrame = pDeflated;
+    } else {
+      ws_frame_free(pDeflated);
+    }
+  }
+
+  char header[MAX_HEADER_BYTES];
+  char* payload = ws_frame_payload(pFrame);
+
+  // The footer goes directly after the payload. The header's length depends
+  // on the payload length, so it's built separately and then copied into
+  // place in front of the payload.
+  _pParser->createFrameHeaderFooter(opcode, false, pFrame->payloadLength, 0,
+    header, &pFrame->headerLength,
+    payload + pFrame->payloadLength, &pFrame->footerLength);
+  if (compressed) {
+    header[0] |= 0x40; // RSV1
+  }
+  memcpy(payload - pFrame->headerLength, header, pFrame->headerLength);
+
+  HTTPUV_PROBE3(ws__frame__send, _connId, (int)opcode, pFrame->payloadLength);
+  _pCallbacks->sendWSFrame(pFrame);
+}
 
+void WebSocketConnection::sendWSSharedMessage(
+  Opcode opcode, std::shared_ptr<const std::vector<char> > payload)
+{
+  ASSERT_BACKGROUND_THREAD()
+  if (_connState == WS_CLOSED) return;
+
+  // A compressed payload depends on the connection's compression state, so
+  // it can't be shared.
+  if (_pDeflate) {
+    sendWSMessage(opcode, payload->empty() ? NULL : &(*payload)[0],
+                  payload->size());
+    return;
+  }
+
+  if (!admitMessage(WSHeldMessage(opcode, payload))) {
+    return;
+  }
+  writeWSSharedMessage(opcode, payload);
+  updateBufferedAmount();
+}
+
+void WebSocketConnection::writeWSSharedMessage(
+  Opcode opcode, std::shared_ptr<const std::vector<char> > payload)
+{
+  char header[MAX_HEADER_BYTES];
+  char footer[MAX_FOOTER_BYTES];
   size_t headerLength = 0;
   size_t footerLength = 0;
+  _pParser->createFrameHeaderFooter(opcode, false, payload->size(), 0,
+    header, &headerLength, footer, &footerLength);
+
+  HTTPUV_PROBE3(ws__frame__send, _connId, (int)opcode, payload->size());
+  _pCallbacks->sendWSSharedFrame(header, headerLength, payload,
+                                 footer, footerLength);
+}
+
+void WebSocketConnection::messageQueued(size_t length) {
+  ASSERT_MAIN_THREAD()
+  _queuedBytes += length;
+}
+
+void WebSocketConnection::sendQueuedWSFrame(Opcode opcode, ws_frame_t* pFrame) {
+  ASSERT_BACKGROUND_THREAD()
+  _queuedBytes -= pFrame->payloadLength;
+  sendWSFrame(opcode, pFrame);
+}
+
+bool WebSocketConnection::admitMessage(const WSHeldMessage& message) {
+  if (_options.highWaterMark < 0 ||
+      (_held.empty() && _pCallbacks->wsBufferedAmount() <= _options.highWaterMark))
+  {
+    return true;
+  }
+
+  switch (_options.backpressure) {
+  case WS_BACKPRESSURE_QUEUE:
+    return true;
+
+  case WS_BACKPRESSURE_DROP_OLDEST:
+    _held.push_back(message);
+    _heldBytes += message.length;
+    // The newest message is always kept, even if it's over the limit on its
+    // own.
+    while (_held.size() > 1 && _heldBytes > _options.highWaterMark) {
+      if (_held.front().pFrame) {
+        ws_frame_free(_held.front().pFrame);
+      }
+      _heldBytes -= _held.front().length;
+      _held.pop_front();
+    }
+    updateBufferedAmount();
+    return false;
+
+  case WS_BACKPRESSURE_DROP_NEWEST:
+    if (message.pFrame) {
+      ws_frame_free(message.pFrame);
+    }
+    return false;
+
+  case WS_BACKPRESSURE_CLOSE:
+    if (message.pFrame) {
+      ws_frame_free(message.pFrame);
+    }
+    failWS(1008, "Too much data waiting to be sent");
+    return false;
+  }
+  return true;
+}
 
-  _pParser->createFrameHeaderFooter(opcode, false, length, 0,
-    safe_vec_addr(header), &headerLength,
-    safe_vec_addr(footer), &footerLength);
-  header.resize(headerLength);
-  footer.resize(footerLength);
+void WebSocketConnection::releaseHeld(bool all) {
+  // Once a Close frame has been sent, the rest are discarded with the
+  // connection.
+  while (!_held.empty() &&
+         (_connState == WS_OPEN || _connState == WS_CLOSE_RECEIVED) &&
+         (all || _pCallbacks->wsBufferedAmount() <= _options.highWaterMark))
+  {
+    WSHeldMessage message = _held.front();
+    _held.pop_front();
+    _heldBytes -= message.length;
+    if (message.pFrame) {
+      writeWSFrame(message.opcode, message.pFrame);
+    } else {
+      writeWSSharedMessage(message.opcode, message.payload);
+    }
+  }
+}
+
+void WebSocketConnection::updateBufferedAmount() {
+  size_t amount = bufferedAmount();
+  _bufferedSnapshot = amount;
+  if (_options.highWaterMark >= 0 && amount > _options.highWaterMark) {
+    _overHighWaterMark = true;
+  }
+}
+
+size_t WebSocketConnection::bufferedAmount() {
+  ASSERT_BACKGROUND_THREAD()
+  if (_connState == WS_CLOSED) return 0;
+  return _pCallbacks->wsBufferedAmount() + _heldBytes;
+}
 
-  _pCallbacks->sendWSFrame(safe_vec_addr(header), header.size(),
-                           pData, length,
-                           safe_vec_addr(footer), footer.size());
+size_t WebSocketConnection::bufferedAmountSnapshot() const {
+  return _bufferedSnapshot + _queuedBytes;
+}
+
+void WebSocketConnection::onWritten() {
+  ASSERT_BACKGROUND_THREAD()
+  if (_connState == WS_CLOSED) return;
+
+  releaseHeld(false);
+  updateBufferedAmount();
+
+  // Wait until there's a good amount of room, so that an application which
+  // waits for this doesn't stop and start on every message.
+  if (_overHighWaterMark && bufferedAmount() <= _options.highWaterMark / 2) {
+    _overHighWaterMark = false;
+    _pCallbacks->onWSDrain();
+  }
+}
+
+void WebSocketConnection::disconnect() {
+  ASSERT_BACKGROUND_THREAD()
+  if (_connState == WS_CLOSED) return;
+  _connState = WS_CLOSED;
+  _pCallbacks->closeWSSocket();
 }
 
 void WebSocketConnection::sendPing() {
@@ -293,6 +548,9 @@ void WebSocketConnection::closeWS(uint16_t code, std::string reason) {
   ASSERT_BACKGROUND_THREAD()
   debug_log("WebSocketConnection::closeWS", LOG_DEBUG);
 
+  // Nothing can be sent after the Close frame, so held messages go first.
+  releaseHeld(true);
+
   switch (_connState) {
   // If we have already sent a close message, do nothing.
   case WS_CLOSE_SENT:
@@ -320,6 +578,15 @@ void WebSocketConnection::closeWS(uint16_t code, std::string reason) {
     _pCallbacks->closeWSSocket();
 }
 
+void WebSocketConnection::failWS(uint16_t code, const std::string& reason) {
+  ASSERT_BACKGROUND_THREAD()
+  debug_log("WebSocketConnection::failWS: " + reason, LOG_INFO);
+  // Send a Close frame if we haven't already, then close the socket without
+  // waiting for the client's reply. The rest of what it sends is ignored.
+  closeWS(code, reason);
+  disconnect();
+}
+
 void WebSocketConnection::read(const char* data, size_t len) {
   ASSERT_BACKGROUND_THREAD()
   if (_connState == WS_CLOSED) return;
@@ -332,6 +599,28 @@ void WebSocketConnection::markClosed() {
   _connState = WS_CLOSED;
 }
 
+void WebSocketConnection::markLeftChannels() {
+  ASSERT_BACKGROUND_THREAD()
+  _leftChannels = true;
+}
+
+bool WebSocketConnection::hasLeftChannels() const {
+  ASSERT_BACKGROUND_THREAD()
+  return _leftChannels;
+}
+
+// Data frames are received straight into the message they belong to, so a
+// fragmented message isn't copied again when its last fragment arrives.
+std::vector<char>& WebSocketConnection::frameBuffer() {
+  if (_header.opcode >= Close) {
+    return _control;
+  }
+  if (!_message) {
+    _message = std::make_shared<std::vector<char> >();
+  }
+  return *_message;
+}
+
 void WebSocketConnection::onHeaderComplete(const WSFrameHeaderInfo& header) {
   ASSERT_BACKGROUND_THREAD()
   if (_connState == WS_CLOSED) return;
@@ -339,85 +628,141 @@ void WebSocketConnection::onHeaderComplete(const WSFrameHeaderInfo& header) {
   _header = header;
   if (!header.fin && header.opcode != Continuation)
     _incompleteContentHeader = header;
+
+  // RSV1 marks a compressed message, so it's only allowed on the first frame
+  // of a data message, and only if compression was negotiated.
+  if (header.opcode == Text || header.opcode == Binary) {
+    _compressed = header.rsv1;
+  }
+  if (header.rsv1 &&
+      (!_pDeflate || !(header.opcode == Text || header.opcode == Binary)))
+  {
+    failWS(1002, "Unexpected RSV1 bit");
+    return;
+  }
+
+  std::vector<char>& buf = frameBuffer();
+  _frameStart = buf.size();
+
+  // The limit is on the size of the message, so for a compressed message it
+  // is checked again after decompression. The payload length comes from the
+  // client and can be anything up to 2^64-1, so it isn't added to
+  // _frameStart, which could wrap around.
+  if (header.opcode < Close && header.hasLength && _options.maxMessageSize >= 0 &&
+      header.payloadLength > _options.maxMessageSize - _frameStart)
+  {
+    failWS(1009, "Message too big");
+    return;
+  }
+
+  // Make room for the whole payload up front, rather than growing the vector
+  // as it arrives. The length comes from the client, so it's capped. Later
+  // fragments grow the message geometrically, so that many small fragments
+  // don't each reallocate it.
+  if (header.hasLength) {
+    size_t needed = _frameStart +
+      std::min(header.payloadLength, (uint64_t)MAX_PAYLOAD_RESERVE);
+    if (needed > buf.capacity()) {
+      buf.reserve(std::max(needed, buf.capacity() * 2));
+    }
+  }
 }
 void WebSocketConnection::onPayload(const char* data, size_t len) {
   ASSERT_BACKGROUND_THREAD()
   if (_connState == WS_CLOSED) return;
 
-  size_t origSize = _payload.size();
-  std::copy(data, data + len, std::back_inserter(_payload));
+  if (len == 0) return;
+
+  std::vector<char>& buf = frameBuffer();
+  size_t origSize = buf.size();
+  buf.insert(buf.end(), data, data + len);
 
   if (_header.masked != 0) {
-    for (size_t i = origSize; i < _payload.size(); i++) {
-      size_t j = i % 4;
-      _payload[i] = _payload[i] ^ _header.maskingKey[j];
-    }
+    // The masking key restarts with each frame.
+    ws_unmask(&buf[origSize], len, &_header.maskingKey[0], origSize - _frameStart);
   }
 }
 void WebSocketConnection::onFrameComplete() {
   ASSERT_BACKGROUND_THREAD()
   debug_log("WebSocketConnection::onFrameComplete", LOG_DEBUG);
   if (_connState == WS_CLOSED) return;
+  HTTPUV_PROBE3(ws__frame__receive, _connId, (int)_header.opcode,
+                frameBuffer().size() - _frameStart);
 
   if (!_header.fin) {
-    std::copy(_payload.begin(), _payload.end(),
-      std::back_inserter(_incompleteContentPayload));
-  } else {
-    switch (_header.opcode) {
-      case Continuation: {
-        std::copy(_payload.begin(), _payload.end(),
-          std::back_inserter(_incompleteContentPayload));
-        _pCallbacks->onWSMessage(_incompleteContentHeader.opcode == Binary,
-          safe_vec_addr(_incompleteContentPayload), _incompleteContentPayload.size());
-
-        _incompleteContentPayload.clear();
-        break;
+    // A data fragment is already in _message; wait for the rest. Control
+    // frames can't be fragmented, so a fragment of one is dropped.
+    _control.clear();
+    return;
+  }
+
+  switch (_header.opcode) {
+    case Continuation:
+    case Text:
+    case Binary: {
+      Opcode opcode = (_header.opcode == Continuation) ?
+        _incompleteContentHeader.opcode : _header.opcode;
+      std::shared_ptr<std::vector<char> > message;
+      message.swap(_message);
+      if (!message) {
+        message = std::make_shared<std::vector<char> >();
       }
-      case Text:
-      case Binary: {
-        _pCallbacks->onWSMessage(_header.opcode == Binary, safe_vec_addr(_payload), _payload.size());
-        break;
+      if (_compressed) {
+        std::shared_ptr<std::vector<char> > inflated =
+          std::make_shared<std::vector<char> >();
+        WSDeflate::InflateResult res = _pDeflate->decompress(
+          message.get(), inflated.get(), _options.maxMessageSize);
+        if (res == WSDeflate::INFLATE_TOO_BIG) {
+          failWS(1009, "Message too big");
+          return;
+        } else if (res != WSDeflate::INFLATE_OK) {
+          failWS(1007, "Invalid compressed data");
+          return;
+        }
+        message = inflated;
       }
-      case Close: {
+      _pCallbacks->onWSMessage(opcode == Binary, message);
+      break;
+    }
+    case Close: {
 
-        if (_connState == WS_OPEN) {
-          _connState = WS_CLOSE_RECEIVED;
-        } else if (_connState == WS_CLOSE_SENT) {
-          _connState = WS_CLOSED;
-        }
+      if (_connState == WS_OPEN) {
+        _connState = WS_CLOSE_RECEIVED;
+      } else if (_connState == WS_CLOSE_SENT) {
+        _connState = WS_CLOSED;
+      }
 
-        // If we haven't sent a Close frame before, send one now, echoing
-        // the callback
-        if (_connState != WS_CLOSE_SENT && _connState != WS_CLOSED) {
-          _connState = WS_CLOSED;
-          sendWSMessage(Close, safe_vec_addr(_payload), _payload.size());
-        }
+      // If we haven't sent a Close frame before, send one now, echoing
+      // the callback
+      if (_connState != WS_CLOSE_SENT && _connState != WS_CLOSED) {
+        _connState = WS_CLOSED;
+        sendWSMessage(Close, safe_vec_addr(_control), _control.size());
+      }
 
-        // TODO: Delay closeWSSocket call until close message is actually sent
-        _pCallbacks->closeWSSocket();
+      // TODO: Delay closeWSSocket call until close message is actually sent
+      _pCallbacks->closeWSSocket();
 
-        // TODO: Use code and status
-        _pCallbacks->onWSClose(0);
+      // TODO: Use code and status
+      _pCallbacks->onWSClose(0);
 
-        break;
-      }
-      case Ping: {
-        // Send back a pong
-        sendWSMessage(Pong, safe_vec_addr(_payload), _payload.size());
-        break;
-      }
-      case Pong: {
-        // No action needed
-        break;
-      }
-      case Reserved: {
-        // TODO: Warn and close connection?
-        break;
-      }
+      break;
+    }
+    case Ping: {
+      // Send back a pong
+      sendWSMessage(Pong, safe_vec_addr(_control), _control.size());
+      break;
+    }
+    case Pong: {
+      // No action needed
+      break;
+    }
+    case Reserved: {
+      // TODO: Warn and close connection?
+      break;
     }
   }
 
-  _payload.clear();
+  _control.clear();
 }
 
 void pingTimerCallback(uv_timer_t* pHandle) {
@@ -4,6 +4,8 @@
 #include <string.h>
 #include <stdint.h>
 
+#include <atomic>
+#include <deque>
 #include <memory>
 #include <string>
 #include <vector>
@@ -12,11 +14,15 @@
 #include "thread.h"
 #include "constants.h"
 #include "websockets-base.h"
+#include "wsdeflate.h"
 #include "uvutil.h"
 
 class WSFrameHeaderInfo {
 public:
   bool fin;
+  // Set on the first frame of a message that was compressed with the
+  // permessage-deflate extension.
+  bool rsv1;
   Opcode opcode;
   bool masked;
   std::vector<uint8_t> maskingKey;
@@ -56,6 +62,7 @@ public:
 private:
 
   bool fin() const;
+  bool rsv1() const;
   Opcode opcode() const;
   bool masked() const;
   void maskingKey(uint8_t key[4]) const;
@@ -149,17 +156,94 @@ enum WSConnState {
   WS_CLOSED
 };
 
+// An outgoing frame, in a single allocation that is handed straight to
+// uv_write(). The payload is copied in once, after room for the largest
+// possible header; the header and footer are filled in on the background
+// thread, directly in front of and after the payload, once the protocol is
+// known. The write callback frees the whole thing.
+typedef struct {
+  uv_write_t writeReq;
+  size_t headerLength;
+  size_t payloadLength;
+  size_t footerLength;
+  char data[1];
+} ws_frame_t;
+
+// Allocates a frame with room for `payloadLength` bytes of payload, which the
+// caller copies to ws_frame_payload().
+ws_frame_t* ws_frame_alloc(size_t payloadLength);
+char* ws_frame_payload(ws_frame_t* pFrame);
+// The buffer to write: header, payload and footer.
+uv_buf_t ws_frame_buf(ws_frame_t* pFrame);
+void ws_frame_free(ws_frame_t* pFrame);
+
 class WebSocketConnectionCallbacks {
 public:
-  virtual void onWSMessage(bool binary, const char* data, size_t len) = 0;
+  // The message buffer is handed over; the connection doesn't touch it
+  // afterward.
+  virtual void onWSMessage(bool binary, std::shared_ptr<std::vector<char> > data) = 0;
   virtual void onWSClose(int code) = 0;
-  // Implementers MUST copy data
-  virtual void sendWSFrame(const char* headerData, size_t headerLength,
-                           const char* pData, size_t dataLength,
-                           const char* footerData, size_t footerLength) = 0;
+  // Takes ownership of the frame, and must free it with ws_frame_free() once
+  // it has been written.
+  virtual void sendWSFrame(ws_frame_t* pFrame) = 0;
+  // Sends a frame whose payload is shared with other connections. The header
+  // and footer are copied; the payload is kept alive until it's written.
+  virtual void sendWSSharedFrame(const char* headerData, size_t headerLength,
+                                 std::shared_ptr<const std::vector<char> > payload,
+                                 const char* footerData, size_t footerLength) = 0;
+  // The number of bytes that have been queued for writing but not yet sent.
+  virtual size_t wsBufferedAmount() = 0;
+  // Called when the data waiting to be sent, after going over the
+  // high-water mark, is down to half of it.
+  virtual void onWSDrain() = 0;
   virtual void closeWSSocket() = 0;
 };
 
+// What to do with a new outgoing data message when more than the high-water
+// mark is already waiting to be sent.
+enum WSBackpressurePolicy {
+  // Send it anyway.
+  WS_BACKPRESSURE_QUEUE,
+  // Discard it.
+  WS_BACKPRESSURE_DROP_NEWEST,
+  // Hold it back until the client catches up, discarding the oldest held
+  // messages when they add up to more than the high-water mark.
+  WS_BACKPRESSURE_DROP_OLDEST,
+  // Close the connection with 1008.
+  WS_BACKPRESSURE_CLOSE
+};
+
+// Per-connection settings, from the server's options.
+struct WSConnectionOptions {
+  // The largest message that will be accepted from the client, in bytes
+  // (after decompression), or negative for no limit.
+  double maxMessageSize;
+  WSDeflateOptions deflate;
+  // Bytes waiting to be sent above which the backpressure policy applies, or
+  // negative for no limit.
+  double highWaterMark;
+  WSBackpressurePolicy backpressure;
+
+  WSConnectionOptions() :
+    maxMessageSize(-1), highWaterMark(-1), backpressure(WS_BACKPRESSURE_QUEUE) {}
+};
+
+// An outgoing data message held back by WS_BACKPRESSURE_DROP_OLDEST. It isn't
+// compressed or framed until it's written, so that dropping it doesn't
+// affect the compression state. Either the frame or the shared payload is
+// set.
+struct WSHeldMessage {
+  Opcode opcode;
+  ws_frame_t* pFrame;
+  std::shared_ptr<const std::vector<char> > payload;
+  size_t length;
+
+  WSHeldMessage(Opcode opcode, ws_frame_t* pFrame)
+    : opcode(opcode), pFrame(pFrame), length(pFrame->payloadLength) {}
+  WSHeldMessage(Opcode opcode, std::shared_ptr<const std::vector<char> > payload)
+    : opcode(opcode), pFrame(NULL), payload(payload), length(payload->size()) {}
+};
+
 void pingTimerCallback(uv_timer_t *handle);
 
 class WebSocketConnection : WSParserCallbacks, NoCopy {
@@ -167,20 +251,60 @@ class WebSocketConnection : WSParserCallbacks, NoCopy {
   WSConnState _connState;
   std::shared_ptr<WebSocketConnectionCallbacks> _pCallbacks;
   WSParser* _pParser;
+  // True if the client speaks RFC 6455, which supports extensions.
+  bool _ietf;
+  WSConnectionOptions _options;
+  // Set if permessage-deflate was negotiated in the handshake.
+  WSDeflate* _pDeflate;
+  // Whether the data message being received is compressed.
+  bool _compressed;
   WSFrameHeaderInfo _incompleteContentHeader;
   WSFrameHeaderInfo _header;
-  std::vector<char> _incompleteContentPayload;
-  std::vector<char> _payload;
+  // The data message being received. Fragments are appended to it as they
+  // arrive, and it is passed to the callbacks once the message is complete.
+  std::shared_ptr<std::vector<char> > _message;
+  // The payload of the control frame being received. Control frames may
+  // arrive between the fragments of a data message, so they're kept apart.
+  std::vector<char> _control;
+  // Where the current frame's payload starts in _message or _control.
+  size_t _frameStart;
   uv_timer_t* _pPingTimer;
+  // The ID of the underlying connection, for trace probes.
+  uint64_t _connId;
+  // Messages held back by the drop_oldest policy, and their total size.
+  std::deque<WSHeldMessage> _held;
+  size_t _heldBytes;
+  // Set when more than the high-water mark is waiting to be sent, and
+  // cleared when onWSDrain() is called.
+  bool _overHighWaterMark;
+  // For the main thread: bufferedAmount() as of the last time it changed on
+  // the background thread, and the size of messages from R that the
+  // background thread hasn't picked up yet.
+  std::atomic<size_t> _bufferedSnapshot;
+  std::atomic<size_t> _queuedBytes;
+  // Set when the connection has been removed from its channels as it
+  // closed, so that a subscribe() queued before then doesn't add it again.
+  bool _leftChannels;
 
 public:
   WebSocketConnection(
     uv_loop_t* pLoop,
-    std::shared_ptr<WebSocketConnectionCallbacks> callbacks)
+    std::shared_ptr<WebSocketConnectionCallbacks> callbacks,
+    uint64_t connId)
       : _pLoop(pLoop),
         _connState(WS_OPEN),
         _pCallbacks(callbacks),
-        _pParser(NULL) {
+        _pParser(NULL),
+        _ietf(false),
+        _pDeflate(NULL),
+        _compressed(false),
+        _frameStart(0),
+        _connId(connId),
+        _heldBytes(0),
+        _overHighWaterMark(false),
+        _bufferedSnapshot(0),
+        _queuedBytes(0),
+        _leftChannels(false) {
     ASSERT_BACKGROUND_THREAD()
     debug_log("WebSocketConnection::WebSocketConnection", LOG_DEBUG);
 
@@ -197,8 +321,16 @@ public:
     try {
       delete _pParser;
     } catch(...) {}
+    delete _pDeflate;
+    for (size_t i = 0; i < _held.size(); i++) {
+      if (_held[i].pFrame) {
+        ws_frame_free(_held[i].pFrame);
+      }
+    }
   }
 
+  // Must be called before handshake().
+  void setOptions(const WSConnectionOptions& options);
   bool accept(const RequestHeaders& requestHeaders, const char* pData, size_t len);
   void handshake(const std::string& url,
                  const RequestHeaders& requestHeaders,
@@ -207,13 +339,53 @@ public:
                  std::vector<uint8_t>* pResponse);
 
   void sendWSMessage(Opcode opcode, const char* pData, size_t length);
+  // Sends a frame whose payload has already been filled in, taking ownership
+  // of it.
+  void sendWSFrame(Opcode opcode, ws_frame_t* pFrame);
+  // Sends a payload that is also being sent to other connections, as with
+  // broadcast_ws_message().
+  void sendWSSharedMessage(Opcode opcode,
+                           std::shared_ptr<const std::vector<char> > payload);
+  // For messages from R: messageQueued() is called on the main thread when
+  // a message is passed to sendQueuedWSFrame() on the background thread, so
+  // that bufferedAmountSnapshot() counts it straight away.
+  void messageQueued(size_t length);
+  void sendQueuedWSFrame(Opcode opcode, ws_frame_t* pFrame);
+  // Bytes of data messages waiting to be sent, including held messages.
+  size_t bufferedAmount();
+  // An estimate of bufferedAmount() which can be read on the main thread.
+  size_t bufferedAmountSnapshot() const;
+  // Called after each write to the socket finishes.
+  void onWritten();
+  // Closes the socket without a closing handshake, for a client that has
+  // stopped reading.
+  void disconnect();
   void sendPing();
   void closeWS(uint16_t code = 1000, std::string reason = "");
   void read(const char* data, size_t len);
   void markClosed();
   void startPingTimer();
+  void markLeftChannels();
+  bool hasLeftChannels() const;
 
 protected:
+  std::vector<char>& frameBuffer();
+  // Compress, frame, and write a message, without applying the backpressure
+  // policy.
+  void writeWSFrame(Opcode opcode, ws_frame_t* pFrame);
+  void writeWSSharedMessage(Opcode opcode,
+                            std::shared_ptr<const std::vector<char> > payload);
+  // Applies the backpressure policy to an outgoing data message. Returns
+  // true if it should be written now; otherwise it has been held, or
+  // discarded.
+  bool admitMessage(const WSHeldMessage& message);
+  // Writes held messages while there's room under the high-water mark, or
+  // all of them.
+  void releaseHeld(bool all);
+  void updateBufferedAmount();
+  // Closes the connection because of a problem with what the client sent.
+  void failWS(uint16_t code, const std::string& reason);
+
   void onHeaderComplete(const WSFrameHeaderInfo& header);
   void onPayload(const char* data, size_t len);
   void onFrameComplete();
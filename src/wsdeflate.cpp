@@ -0,0 +1,324 @@
+#include "wsdeflate.h"
+#include "utils.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+
+// A sync flush ends with these four bytes. They're left off the end of each
+// compressed message, and put back before it is decompressed.
+static const char DEFLATE_TAIL[4] = { 0x00, 0x00, (char)0xFF, (char)0xFF };
+
+// How much room to make in the output buffer, at least, each time it grows
+// while decompressing.
+static const size_t INFLATE_CHUNK = 16 * 1024;
+
+// The parameters of one permessage-deflate offer from a client.
+struct DeflateOffer {
+  bool serverNoContextTakeover;
+  bool clientNoContextTakeover;
+  // 0 if the parameter wasn't given.
+  int serverMaxWindowBits;
+  // 0 if the parameter wasn't given, -1 if it was given without a value.
+  int clientMaxWindowBits;
+};
+
+static std::vector<std::string> split_on(const std::string& value, char sep) {
+  std::vector<std::string> result;
+  size_t start = 0;
+  while (start <= value.length()) {
+    size_t end = value.find(sep, start);
+    if (end == std::string::npos) {
+      end = value.length();
+    }
+    result.push_back(trim(value.substr(start, end - start)));
+    start = end + 1;
+  }
+  return result;
+}
+
+// Window bits are a number from 8 to 15, which may be quoted. Returns 0 if
+// the value isn't valid.
+static int parse_window_bits(std::string value) {
+  if (value.length() >= 2 && value[0] == '"' && value[value.length() - 1] == '"') {
+    value = value.substr(1, value.length() - 2);
+  }
+  if (value.empty() || value.length() > 2 ||
+      value.find_first_not_of("0123456789") != std::string::npos) {
+    return 0;
+  }
+  int bits = atoi(value.c_str());
+  return (bits >= 8 && bits <= 15) ? bits : 0;
+}
+
+// Parses an offer like "permessage-deflate; client_max_window_bits". Returns
+// false if it's for another extension, or if any of its parameters are
+// unknown, repeated, or have an invalid value; RFC 7692 says that such an
+// offer must be declined.
+static bool parse_offer(const std::string& offer, DeflateOffer* pOffer) {
+  std::vector<std::string> parts = split_on(offer, ';');
+  if (to_lower(parts[0]) != "permessage-deflate") {
+    return false;
+  }
+
+  pOffer->serverNoContextTakeover = false;
+  pOffer->clientNoContextTakeover = false;
+  pOffer->serverMaxWindowBits = 0;
+  pOffer->clientMaxWindowBits = 0;
+
+  std::vector<std::string> seen;
+  for (size_t i = 1; i < parts.size(); i++) {
+    std::string name = parts[i];
+    std::string value;
+    bool hasValue = false;
+    size_t eq = parts[i].find('=');
+    if (eq != std::string::npos) {
+      name = trim(parts[i].substr(0, eq));
+      value = trim(parts[i].substr(eq + 1));
+      hasValue = true;
+    }
+    name = to_lower(name);
+
+    if (std::find(seen.begin(), seen.end(), name) != seen.end()) {
+      return false;
+    }
+    seen.push_back(name);
+
+    if (name == "server_no_context_takeover" && !hasValue) {
+      pOffer->serverNoContextTakeover = true;
+    } else if (name == "client_no_context_takeover" && !hasValue) {
+      pOffer->clientNoContextTakeover = true;
+    } else if (name == "server_max_window_bits" && hasValue) {
+      pOffer->serverMaxWindowBits = parse_window_bits(value);
+      if (pOffer->serverMaxWindowBits == 0) {
+        return false;
+      }
+    } else if (name == "client_max_window_bits") {
+      if (hasValue) {
+        pOffer->clientMaxWindowBits = parse_window_bits(value);
+        if (pOffer->clientMaxWindowBits == 0) {
+          return false;
+        }
+      } else {
+        pOffer->clientMaxWindowBits = -1;
+      }
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+WSDeflate* WSDeflate::negotiate(const std::string& offers,
+                                const WSDeflateOptions& options,
+                                std::string* pResponse) {
+  if (!options.enabled) {
+    return NULL;
+  }
+
+  // The client lists its offers in order of preference; accept the first
+  // one that works.
+  std::vector<std::string> offerList = split_on(offers, ',');
+  for (size_t i = 0; i < offerList.size(); i++) {
+    DeflateOffer offer;
+    if (!parse_offer(offerList[i], &offer)) {
+      continue;
+    }
+
+    int serverWindowBits = options.windowBits;
+    if (offer.serverMaxWindowBits > 0) {
+      serverWindowBits = std::min(serverWindowBits, offer.serverMaxWindowBits);
+    }
+    // zlib can't compress with a 256-byte window.
+    if (serverWindowBits < 9) {
+      continue;
+    }
+
+    int clientWindowBits = 15;
+    if (offer.clientMaxWindowBits != 0) {
+      clientWindowBits = options.windowBits;
+      if (offer.clientMaxWindowBits > 0) {
+        clientWindowBits = std::min(clientWindowBits, offer.clientMaxWindowBits);
+      }
+    } else if (options.windowBits < 15) {
+      // This client can't be asked to use a smaller window, so its messages
+      // could take more memory to decompress than the options allow.
+      continue;
+    }
+
+    bool serverContextTakeover =
+      options.contextTakeover && !offer.serverNoContextTakeover;
+    bool clientContextTakeover =
+      options.contextTakeover && !offer.clientNoContextTakeover;
+
+    std::string response = "permessage-deflate";
+    if (!serverContextTakeover) {
+      response += "; server_no_context_takeover";
+    }
+    if (!clientContextTakeover) {
+      response += "; client_no_context_takeover";
+    }
+    if (offer.serverMaxWindowBits > 0 || serverWindowBits < 15) {
+      response += "; server_max_window_bits=" + toString(serverWindowBits);
+    }
+    if (offer.clientMaxWindowBits != 0 && clientWindowBits < 15) {
+      response += "; client_max_window_bits=" + toString(clientWindowBits);
+    }
+
+    try {
+      // Data compressed with a window of 256 bytes can be decompressed with
+      // a bigger one. zlib also compresses with 512 bytes when asked for 256.
+      WSDeflate* pDeflate = new WSDeflate(
+        std::min(std::max(options.level, 0), 9),
+        serverWindowBits, serverContextTakeover,
+        std::max(clientWindowBits, 9), clientContextTakeover
+      );
+      *pResponse = response;
+      return pDeflate;
+    } catch (const std::exception& e) {
+      debug_log(std::string("permessage-deflate error: ") + e.what(), LOG_INFO);
+      return NULL;
+    }
+  }
+
+  return NULL;
+}
+
+WSDeflate::WSDeflate(int level, int serverWindowBits, bool serverContextTakeover,
+                     int clientWindowBits, bool clientContextTakeover) :
+  _serverContextTakeover(serverContextTakeover),
+  _clientContextTakeover(clientContextTakeover)
+{
+  memset(&_deflate, 0, sizeof(z_stream));
+  memset(&_inflate, 0, sizeof(z_stream));
+
+  // Negative window bits mean a raw deflate stream, with no zlib header. The
+  // compressor's hash table is scaled down along with the window, so that
+  // windowBits bounds the memory used for both.
+  int memLevel = std::min(8, serverWindowBits - 6);
+  if (deflateInit2(&_deflate, level, Z_DEFLATED, -serverWindowBits, memLevel,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    throw std::runtime_error("zlib initialization failed");
+  }
+  if (inflateInit2(&_inflate, -clientWindowBits) != Z_OK) {
+    deflateEnd(&_deflate);
+    throw std::runtime_error("zlib initialization failed");
+  }
+}
+
+WSDeflate::~WSDeflate() {
+  // ignore errors on destruction
+  deflateEnd(&_deflate);
+  inflateEnd(&_inflate);
+}
+
+size_t WSDeflate::compressBound(size_t len) {
+  // deflateBound() assumes a single Z_FINISH; a sync flush can add up to
+  // another empty stored block.
+  return deflateBound(&_deflate, len) + 16;
+}
+
+bool WSDeflate::compress(const char* data, size_t len, char* out, size_t* pOutLen) {
+  size_t bound = compressBound(len);
+  if (bound > UINT_MAX) {
+    return false;
+  }
+
+  _deflate.next_in = (Bytef*)data;
+  _deflate.avail_in = (uInt)len;
+  _deflate.next_out = (Bytef*)out;
+  _deflate.avail_out = (uInt)bound;
+
+  int res = deflate(&_deflate, Z_SYNC_FLUSH);
+  size_t outLen = bound - _deflate.avail_out;
+
+  if (res != Z_OK || _deflate.avail_in != 0 || _deflate.avail_out == 0 ||
+      outLen < sizeof(DEFLATE_TAIL) ||
+      memcmp(out + outLen - sizeof(DEFLATE_TAIL), DEFLATE_TAIL, sizeof(DEFLATE_TAIL)) != 0)
+  {
+    // The client won't see this output, so later messages mustn't refer
+    // back to it.
+    deflateReset(&_deflate);
+    return false;
+  }
+
+  *pOutLen = outLen - sizeof(DEFLATE_TAIL);
+
+  if (!_serverContextTakeover) {
+    deflateReset(&_deflate);
+  }
+  return true;
+}
+
+WSDeflate::InflateResult WSDeflate::decompress(std::vector<char>* pData,
+                                               std::vector<char>* pOut,
+                                               double maxSize) {
+  pData->insert(pData->end(), DEFLATE_TAIL, DEFLATE_TAIL + sizeof(DEFLATE_TAIL));
+  if (pData->size() > UINT_MAX) {
+    return INFLATE_TOO_BIG;
+  }
+
+  _inflate.next_in = (Bytef*)safe_vec_addr(*pData);
+  _inflate.avail_in = (uInt)pData->size();
+
+  pOut->clear();
+  size_t outLen = 0;
+  InflateResult result = INFLATE_OK;
+
+  while (true) {
+    if (pOut->size() - outLen < INFLATE_CHUNK) {
+      // Text usually compresses by a factor of a few, so start there.
+      size_t newSize = std::max(std::max(pOut->size() * 2, pData->size() * 4),
+                                INFLATE_CHUNK);
+      // One byte over the limit is enough to know it has been exceeded.
+      if (maxSize >= 0 && newSize > maxSize + 1) {
+        newSize = (size_t)maxSize + 1;
+      }
+      pOut->resize(newSize);
+    }
+
+    size_t avail = std::min(pOut->size() - outLen, (size_t)UINT_MAX);
+    _inflate.next_out = (Bytef*)&(*pOut)[outLen];
+    _inflate.avail_out = (uInt)avail;
+
+    int res = inflate(&_inflate, Z_SYNC_FLUSH);
+    outLen += avail - _inflate.avail_out;
+
+    if (res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR) {
+      result = INFLATE_ERROR;
+      break;
+    }
+    if (maxSize >= 0 && outLen > maxSize) {
+      result = INFLATE_TOO_BIG;
+      break;
+    }
+    if (res == Z_STREAM_END) {
+      // The client ended the stream with a final block; the next message
+      // starts a new one.
+      inflateReset(&_inflate);
+      break;
+    }
+    if (_inflate.avail_in == 0 && _inflate.avail_out > 0) {
+      break;
+    }
+    if (res == Z_BUF_ERROR && _inflate.avail_out > 0) {
+      // No progress was possible even with room for output.
+      result = INFLATE_ERROR;
+      break;
+    }
+  }
+
+  pOut->resize(outLen);
+  // The output was grown ahead of the data, so it can have far more room
+  // than the message needs. It's handed to R, which may keep it for a while,
+  // so give the rest back.
+  if (pOut->capacity() - outLen >= INFLATE_CHUNK) {
+    pOut->shrink_to_fit();
+  }
+
+  if (result != INFLATE_OK || !_clientContextTakeover) {
+    inflateReset(&_inflate);
+  }
+  return result;
+}
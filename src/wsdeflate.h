@@ -0,0 +1,69 @@
+#ifndef WSDEFLATE_HPP
+#define WSDEFLATE_HPP
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include "constants.h"
+
+// Server settings for the permessage-deflate WebSocket extension (RFC 7692).
+struct WSDeflateOptions {
+  bool enabled;
+  // zlib compression level, 0-9.
+  int level;
+  // The largest LZ77 window (as a power of 2, 9-15) used in either direction.
+  // This is what bounds the memory each connection uses for compression.
+  int windowBits;
+  // If false, each message is compressed on its own, and clients are asked
+  // to do the same.
+  bool contextTakeover;
+
+  WSDeflateOptions() :
+    enabled(false), level(6), windowBits(15), contextTakeover(true) {}
+};
+
+// Compresses outgoing messages and decompresses incoming ones for a single
+// connection, with the parameters that were agreed in the handshake. Used
+// only on the background thread.
+class WSDeflate : NoCopy {
+public:
+  enum InflateResult {
+    INFLATE_OK,
+    INFLATE_TOO_BIG,
+    INFLATE_ERROR
+  };
+
+  // Looks through the extensions offered in a Sec-WebSocket-Extensions
+  // request header for a permessage-deflate offer that fits the options.
+  // Returns NULL if there isn't one. Otherwise the caller owns the returned
+  // object, and *pResponse is set to the value of the Sec-WebSocket-Extensions
+  // response header.
+  static WSDeflate* negotiate(const std::string& offers,
+                              const WSDeflateOptions& options,
+                              std::string* pResponse);
+
+  ~WSDeflate();
+
+  // The most space that compress() can need for `len` bytes.
+  size_t compressBound(size_t len);
+  // Compresses a message payload into `out`, which must have room for
+  // compressBound(len) bytes. Returns false if zlib fails, in which case the
+  // message should be sent uncompressed.
+  bool compress(const char* data, size_t len, char* out, size_t* pOutLen);
+  // Decompresses a message payload. The input vector is modified. If
+  // maxSize is not negative, the output may not be larger than that.
+  InflateResult decompress(std::vector<char>* pData, std::vector<char>* pOut,
+                           double maxSize);
+
+private:
+  WSDeflate(int level, int serverWindowBits, bool serverContextTakeover,
+            int clientWindowBits, bool clientContextTakeover);
+
+  z_stream _deflate;
+  z_stream _inflate;
+  bool _serverContextTakeover;
+  bool _clientContextTakeover;
+};
+
+#endif
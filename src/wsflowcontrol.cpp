@@ -0,0 +1,106 @@
+#include "wsflowcontrol.h"
+#include "httprequest.h"
+#include <algorithm>
+
+WSFlowControl::WSFlowControl() :
+  _maxPendingMessages(-1), _maxPendingBytes(-1),
+  _pendingMessages(0), _pendingBytes(0), _pausedConnections(0), _pauses(0)
+{
+}
+
+void WSFlowControl::setLimits(double maxPendingMessages, double maxPendingBytes) {
+  ASSERT_BACKGROUND_THREAD()
+  _maxPendingMessages = maxPendingMessages;
+  _maxPendingBytes = maxPendingBytes;
+}
+
+bool WSFlowControl::overLimit(bool paused) const {
+  ASSERT_BACKGROUND_THREAD()
+  return
+    ws_pending_over_limit(_pendingMessages, _maxPendingMessages, paused) ||
+    ws_pending_over_limit(_pendingBytes, _maxPendingBytes, paused);
+}
+
+void WSFlowControl::messageQueued(size_t bytes) {
+  ASSERT_BACKGROUND_THREAD()
+  _pendingMessages++;
+  _pendingBytes += bytes;
+}
+
+bool WSFlowControl::messageDelivered(size_t bytes) {
+  ASSERT_BACKGROUND_THREAD()
+  uint64_t messages = _pendingMessages--;
+  uint64_t pendingBytes = _pendingBytes.fetch_sub(bytes);
+
+  return
+    ws_pending_resumed(messages, messages - 1, _maxPendingMessages) ||
+    ws_pending_resumed(pendingBytes, pendingBytes - bytes, _maxPendingBytes);
+}
+
+uint64_t WSFlowControl::pendingMessages() const {
+  return _pendingMessages;
+}
+
+uint64_t WSFlowControl::pendingBytes() const {
+  return _pendingBytes;
+}
+
+void WSFlowControl::addPaused(std::shared_ptr<HttpRequest> pRequest) {
+  ASSERT_BACKGROUND_THREAD()
+  _paused.push_back(pRequest);
+  _pausedConnections = _paused.size();
+  _pauses++;
+}
+
+void WSFlowControl::removePaused(HttpRequest* pRequest) {
+  ASSERT_BACKGROUND_THREAD()
+  for (std::vector<std::shared_ptr<HttpRequest> >::iterator it = _paused.begin();
+       it != _paused.end();
+       ++it)
+  {
+    if (it->get() == pRequest) {
+      _paused.erase(it);
+      break;
+    }
+  }
+  _pausedConnections = _paused.size();
+}
+
+void WSFlowControl::resumePaused() {
+  ASSERT_BACKGROUND_THREAD()
+  // Connections remove themselves from _paused when they resume, so iterate
+  // over a copy.
+  std::vector<std::shared_ptr<HttpRequest> > paused = _paused;
+  for (std::vector<std::shared_ptr<HttpRequest> >::iterator it = paused.begin();
+       it != paused.end();
+       ++it)
+  {
+    (*it)->resumeWSRead();
+  }
+}
+
+void WSFlowControl::writePrometheus(std::ostream& os) const {
+  os << "# HELP httpuv_ws_pending_messages WebSocket messages waiting for the R main thread.\n"
+     << "# TYPE httpuv_ws_pending_messages gauge\n"
+     << "httpuv_ws_pending_messages " << _pendingMessages.load() << "\n";
+  os << "# HELP httpuv_ws_pending_bytes Size of WebSocket messages waiting for the R main thread.\n"
+     << "# TYPE httpuv_ws_pending_bytes gauge\n"
+     << "httpuv_ws_pending_bytes " << _pendingBytes.load() << "\n";
+  os << "# HELP httpuv_ws_paused_connections WebSocket connections not reading because R is behind.\n"
+     << "# TYPE httpuv_ws_paused_connections gauge\n"
+     << "httpuv_ws_paused_connections " << _pausedConnections.load() << "\n";
+  os << "# HELP httpuv_ws_pauses_total Times a WebSocket connection stopped reading because R was behind.\n"
+     << "# TYPE httpuv_ws_pauses_total counter\n"
+     << "httpuv_ws_pauses_total " << _pauses.load() << "\n";
+}
+
+Rcpp::List WSFlowControl::metricsAsRObject() const {
+  ASSERT_MAIN_THREAD()
+  using namespace Rcpp;
+  return List::create(
+    _["pendingMessages"]   = (double)_pendingMessages,
+    _["pendingBytes"]      = (double)_pendingBytes,
+    _["pausedConnections"] = (double)_pausedConnections,
+    _["pauses"]            = (double)_pauses
+  );
+}
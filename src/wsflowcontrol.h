@@ -0,0 +1,80 @@
+#ifndef WSFLOWCONTROL_HPP
+#define WSFLOWCONTROL_HPP
+
+#include <atomic>
+#include <memory>
+#include <ostream>
+#include <vector>
+#include <stdint.h>
+#include <Rcpp.h>
+#include "thread.h"
+
+class HttpRequest;
+
+// Keeps track of a server's incoming WebSocket messages which have been
+// passed to R but not yet handled, and the connections which have stopped
+// reading because too many of them are waiting (see the wsMaxPending*
+// server options). When a connection stops reading, the client is held back
+// by TCP flow control instead of the messages piling up in memory.
+//
+// Everything except metricsAsRObject() is called on the background thread.
+// The counters are atomic so that the metrics can be read on the main thread.
+class WSFlowControl {
+  std::vector<std::shared_ptr<HttpRequest> > _paused;
+
+  // The wsMaxPendingMessagesTotal and wsMaxPendingBytesTotal options.
+  // Negative for no limit.
+  double _maxPendingMessages;
+  double _maxPendingBytes;
+
+  std::atomic<uint64_t> _pendingMessages;
+  std::atomic<uint64_t> _pendingBytes;
+  std::atomic<uint64_t> _pausedConnections;
+  // Number of times that a connection has stopped reading.
+  std::atomic<uint64_t> _pauses;
+
+public:
+  WSFlowControl();
+
+  void setLimits(double maxPendingMessages, double maxPendingBytes);
+  // Whether the server's totals are over their limits (see
+  // ws_pending_over_limit()).
+  bool overLimit(bool paused) const;
+
+  void messageQueued(size_t bytes);
+  // Returns true if this brought one of the totals down to the point where
+  // paused connections can start reading again.
+  bool messageDelivered(size_t bytes);
+  uint64_t pendingMessages() const;
+  uint64_t pendingBytes() const;
+
+  void addPaused(std::shared_ptr<HttpRequest> pRequest);
+  void removePaused(HttpRequest* pRequest);
+  // Lets each paused connection start reading again, if it's now within the
+  // limits.
+  void resumePaused();
+
+  Rcpp::List metricsAsRObject() const;
+  // For the metricsPath endpoint; safe to call on the background thread.
+  void writePrometheus(std::ostream& os) const;
+};
+
+// Whether a queue of `pending` items is over a limit of `max` (negative for
+// no limit). A connection stops reading when a limit is reached, but only
+// starts again once the queue is down to half of it, so that a busy
+// connection doesn't stop and start on every message.
+inline bool ws_pending_over_limit(double pending, double max, bool paused) {
+  if (max < 0) {
+    return false;
+  }
+  return paused ? pending > max / 2 : pending >= max;
+}
+
+// Whether a queue going from `before` to `after` items has just come down
+// to the point where connections paused by a limit of `max` can resume.
+inline bool ws_pending_resumed(double before, double after, double max) {
+  return ws_pending_over_limit(before, max, true) &&
+    !ws_pending_over_limit(after, max, true);
+}
+
+#endif
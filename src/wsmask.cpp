@@ -0,0 +1,157 @@
+#include "wsmask.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+#define WSMASK_SSE2
+#include <emmintrin.h>
+#endif
+
+// AVX2 is used only if the CPU has it, so it's compiled with a target
+// attribute rather than -mavx2.
+#if defined(WSMASK_SSE2) && defined(__GNUC__) && \
+  (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define WSMASK_AVX2
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#define WSMASK_NEON
+#include <arm_neon.h>
+#endif
+
+// Buffers shorter than this aren't worth the vector setup.
+static const size_t MIN_VECTOR_LEN = 64;
+
+// Fills `pattern` (whose length is a multiple of four) with the key,
+// rotated so that pattern[0] applies to the byte at `offset`.
+static void fill_pattern(uint8_t* pattern, size_t n, const uint8_t key[4],
+                         uint64_t offset)
+{
+  for (size_t i = 0; i < n; i++) {
+    pattern[i] = key[(offset + i) & 3];
+  }
+}
+
+void ws_unmask_scalar(char* data, size_t len, const uint8_t key[4], uint64_t offset) {
+  uint8_t pattern[8];
+  fill_pattern(pattern, sizeof(pattern), key, offset);
+  uint64_t k;
+  memcpy(&k, pattern, sizeof(k));
+
+  size_t i = 0;
+  // memcpy() is used for unaligned loads and stores; compilers turn it into
+  // a single instruction.
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, data + i, sizeof(w));
+    w ^= k;
+    memcpy(data + i, &w, sizeof(w));
+  }
+  for (; i < len; i++) {
+    data[i] ^= pattern[i & 3];
+  }
+}
+
+#ifdef WSMASK_SSE2
+static void ws_unmask_sse2(char* data, size_t len, const uint8_t key[4], uint64_t offset) {
+  uint8_t pattern[16];
+  fill_pattern(pattern, sizeof(pattern), key, offset);
+  __m128i k = _mm_loadu_si128((const __m128i*)pattern);
+
+  size_t i = 0;
+  for (; i + 64 <= len; i += 64) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(data + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(data + i + 16));
+    __m128i c = _mm_loadu_si128((const __m128i*)(data + i + 32));
+    __m128i d = _mm_loadu_si128((const __m128i*)(data + i + 48));
+    _mm_storeu_si128((__m128i*)(data + i),      _mm_xor_si128(a, k));
+    _mm_storeu_si128((__m128i*)(data + i + 16), _mm_xor_si128(b, k));
+    _mm_storeu_si128((__m128i*)(data + i + 32), _mm_xor_si128(c, k));
+    _mm_storeu_si128((__m128i*)(data + i + 48), _mm_xor_si128(d, k));
+  }
+  for (; i + 16 <= len; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(data + i));
+    _mm_storeu_si128((__m128i*)(data + i), _mm_xor_si128(a, k));
+  }
+  ws_unmask_scalar(data + i, len - i, key, offset + i);
+}
+#endif
+
+#ifdef WSMASK_AVX2
+__attribute__((target("avx2")))
+static void ws_unmask_avx2(char* data, size_t len, const uint8_t key[4], uint64_t offset) {
+  uint8_t pattern[32];
+  fill_pattern(pattern, sizeof(pattern), key, offset);
+  __m256i k = _mm256_loadu_si256((const __m256i*)pattern);
+
+  size_t i = 0;
+  for (; i + 128 <= len; i += 128) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(data + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(data + i + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i*)(data + i + 64));
+    __m256i d = _mm256_loadu_si256((const __m256i*)(data + i + 96));
+    _mm256_storeu_si256((__m256i*)(data + i),      _mm256_xor_si256(a, k));
+    _mm256_storeu_si256((__m256i*)(data + i + 32), _mm256_xor_si256(b, k));
+    _mm256_storeu_si256((__m256i*)(data + i + 64), _mm256_xor_si256(c, k));
+    _mm256_storeu_si256((__m256i*)(data + i + 96), _mm256_xor_si256(d, k));
+  }
+  for (; i + 32 <= len; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(data + i));
+    _mm256_storeu_si256((__m256i*)(data + i), _mm256_xor_si256(a, k));
+  }
+  ws_unmask_scalar(data + i, len - i, key, offset + i);
+}
+#endif
+
+#ifdef WSMASK_NEON
+static void ws_unmask_neon(char* data, size_t len, const uint8_t key[4], uint64_t offset) {
+  uint8_t pattern[16];
+  fill_pattern(pattern, sizeof(pattern), key, offset);
+  uint8x16_t k = vld1q_u8(pattern);
+
+  size_t i = 0;
+  for (; i + 64 <= len; i += 64) {
+    uint8_t* p = (uint8_t*)(data + i);
+    uint8x16_t a = vld1q_u8(p);
+    uint8x16_t b = vld1q_u8(p + 16);
+    uint8x16_t c = vld1q_u8(p + 32);
+    uint8x16_t d = vld1q_u8(p + 48);
+    vst1q_u8(p,      veorq_u8(a, k));
+    vst1q_u8(p + 16, veorq_u8(b, k));
+    vst1q_u8(p + 32, veorq_u8(c, k));
+    vst1q_u8(p + 48, veorq_u8(d, k));
+  }
+  for (; i + 16 <= len; i += 16) {
+    uint8_t* p = (uint8_t*)(data + i);
+    vst1q_u8(p, veorq_u8(vld1q_u8(p), k));
+  }
+  ws_unmask_scalar(data + i, len - i, key, offset + i);
+}
+#endif
+
+typedef void (*unmask_fn)(char*, size_t, const uint8_t*, uint64_t);
+
+static unmask_fn select_unmask() {
+#ifdef WSMASK_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    return ws_unmask_avx2;
+  }
+#endif
+#if defined(WSMASK_SSE2)
+  return ws_unmask_sse2;
+#elif defined(WSMASK_NEON)
+  return ws_unmask_neon;
+#else
+  return ws_unmask_scalar;
+#endif
+}
+
+void ws_unmask(char* data, size_t len, const uint8_t key[4], uint64_t offset) {
+  if (len < MIN_VECTOR_LEN) {
+    ws_unmask_scalar(data, len, key, offset);
+    return;
+  }
+  // Chosen once, on first use.
+  static const unmask_fn fn = select_unmask();
+  fn(data, len, key, offset);
+}
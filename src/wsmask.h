@@ -0,0 +1,17 @@
+#ifndef WSMASK_HPP
+#define WSMASK_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+// XORs `len` bytes of a WebSocket payload with a masking key, in place.
+// `offset` is the position of data[0] within the frame's payload, since the
+// key repeats every four bytes from the start of the payload. Large buffers
+// are done with the widest vector instructions the CPU supports.
+void ws_unmask(char* data, size_t len, const uint8_t key[4], uint64_t offset);
+
+// The portable version, eight bytes at a time. ws_unmask() uses it for short
+// buffers and the ends of long ones.
+void ws_unmask_scalar(char* data, size_t len, const uint8_t key[4], uint64_t offset);
+
+#endif
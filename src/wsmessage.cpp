@@ -0,0 +1,120 @@
+#include "wsmessage.h"
+#include "thread.h"
+#include "utils.h"
+#include <Rversion.h>
+#include <limits.h>
+#include <string.h>
+#include <stdexcept>
+
+#if defined(R_VERSION) && R_VERSION >= R_Version(3, 6, 0)
+#define WSMESSAGE_ALTREP
+#include <R_ext/Altrep.h>
+#endif
+
+#ifdef WSMESSAGE_ALTREP
+
+// An ALTREP raw vector whose data is a WebSocket message buffer. data1 is an
+// external pointer to a heap-allocated shared_ptr holding the buffer, which
+// is released when R garbage collects the vector.
+//
+// Only the methods that need the buffer are implemented. Serializing or
+// duplicating the vector falls back to R's defaults, which copy the data
+// into an ordinary raw vector. R code that modifies the vector in place
+// writes to the buffer, which is fine since nothing else refers to it.
+static R_altrep_class_t ws_message_class;
+static bool ws_message_class_registered = false;
+
+static std::vector<char>* ws_message_buffer(SEXP x) {
+  SEXP xp = R_altrep_data1(x);
+  std::shared_ptr<std::vector<char> >* p =
+    static_cast<std::shared_ptr<std::vector<char> >*>(R_ExternalPtrAddr(xp));
+  return p->get();
+}
+
+static void ws_message_finalize(SEXP xp) {
+  std::shared_ptr<std::vector<char> >* p =
+    static_cast<std::shared_ptr<std::vector<char> >*>(R_ExternalPtrAddr(xp));
+  if (p) {
+    delete p;
+    R_ClearExternalPtr(xp);
+  }
+}
+
+static R_xlen_t ws_message_length(SEXP x) {
+  return ws_message_buffer(x)->size();
+}
+
+static void* ws_message_dataptr(SEXP x, Rboolean writeable) {
+  return safe_vec_addr(*ws_message_buffer(x));
+}
+
+static const void* ws_message_dataptr_or_null(SEXP x) {
+  return safe_vec_addr(*ws_message_buffer(x));
+}
+
+static Rboolean ws_message_inspect(SEXP x, int pre, int deep, int pvec,
+                                   void (*inspect_subtree)(SEXP, int, int, int)) {
+  Rprintf("httpuv WebSocket message (len=%lu)\n",
+          (unsigned long)ws_message_buffer(x)->size());
+  return TRUE;
+}
+
+#endif // WSMESSAGE_ALTREP
+
+// [[Rcpp::init]]
+void registerWSMessageClass(DllInfo* dll) {
+#ifdef WSMESSAGE_ALTREP
+  ws_message_class = R_make_altraw_class("ws_message", "httpuv", dll);
+  R_set_altrep_Length_method(ws_message_class, ws_message_length);
+  R_set_altrep_Inspect_method(ws_message_class, ws_message_inspect);
+  R_set_altvec_Dataptr_method(ws_message_class, ws_message_dataptr);
+  R_set_altvec_Dataptr_or_null_method(ws_message_class, ws_message_dataptr_or_null);
+  ws_message_class_registered = true;
+#endif
+}
+
+SEXP ws_message_to_r(bool binary, std::shared_ptr<std::vector<char> > data) {
+  ASSERT_MAIN_THREAD()
+
+  if (!binary) {
+    // R strings can't contain nul, and Rf_mkCharLenCE() would raise an R
+    // error, which skips the caller's C++ cleanup. Cut the message off at the
+    // first nul instead, as httpuv always has.
+    const char* str_data = safe_vec_addr(*data);
+    size_t len = data->size();
+    const char* nul = NULL;
+    if (len > 0) {
+      nul = static_cast<const char*>(memchr(str_data, '\0', len));
+    }
+    if (nul) {
+      len = nul - str_data;
+    }
+    // Rf_mkCharLenCE() takes an int, and raises an R error for a longer
+    // string. Throwing lets the caller close the connection instead.
+    if (len > INT_MAX) {
+      throw std::runtime_error("WebSocket text message is too long for an R string.");
+    }
+    Rcpp::CharacterVector str(1);
+    str[0] = Rf_mkCharLenCE(str_data, (int)len, CE_NATIVE);
+    return str;
+  }
+
+#ifdef WSMESSAGE_ALTREP
+  // An empty vector has no data pointer to hand out.
+  if (ws_message_class_registered && !data->empty()) {
+    SEXP xp = PROTECT(R_MakeExternalPtr(
+      new std::shared_ptr<std::vector<char> >(data), R_NilValue, R_NilValue
+    ));
+    R_RegisterCFinalizerEx(xp, ws_message_finalize, TRUE);
+    SEXP result = R_new_altrep(ws_message_class, xp, R_NilValue);
+    UNPROTECT(1);
+    return result;
+  }
+#endif
+
+  Rcpp::RawVector raw(data->size());
+  if (!data->empty()) {
+    memcpy(RAW(raw), safe_vec_addr(*data), data->size());
+  }
+  return raw;
+}
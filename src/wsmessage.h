@@ -0,0 +1,18 @@
+#ifndef WSMESSAGE_HPP
+#define WSMESSAGE_HPP
+
+#include <memory>
+#include <vector>
+#include <Rcpp.h>
+
+// Converts a received WebSocket message to the R object that is passed to
+// the application's onMessage callbacks. Must be called on the main thread.
+//
+// Binary messages become raw vectors. Where R supports ALTREP (R >= 3.6),
+// the raw vector is backed by the message buffer itself, which it keeps
+// alive, so the payload isn't copied at all; otherwise it is copied once.
+// Text messages are copied once, into a string; a text message of 2^31 bytes
+// or more, which R can't hold in a string, throws std::runtime_error.
+SEXP ws_message_to_r(bool binary, std::shared_ptr<std::vector<char> > data);
+
+#endif
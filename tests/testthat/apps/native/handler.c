@@ -0,0 +1,33 @@
+// A native handler for the tests, built against inst/include/httpuv_api.h
+// the way another package would build one. It answers with the method, path
+// and query of the request, and declines requests with a "decline" header.
+// The status can be set with a "status" header; the body is set regardless.
+
+#include <stdlib.h>
+#include <string.h>
+#include <httpuv_api.h>
+
+static int echo_handler(const httpuv_request* req, httpuv_response* res,
+                        void* data)
+{
+  const char* body;
+  const char* status;
+
+  if (httpuv_request_header(req, "decline") != NULL) {
+    return 0;
+  }
+
+  body = (const char*)data;
+  status = httpuv_request_header(req, "status");
+  httpuv_response_set_status(res, status != NULL ? atoi(status) : 201);
+  httpuv_response_add_header(res, "Content-Type", "text/plain");
+  httpuv_response_add_header(res, "X-Method", httpuv_request_method(req));
+  httpuv_response_add_header(res, "X-Path", httpuv_request_path(req));
+  httpuv_response_add_header(res, "X-Query", httpuv_request_query(req));
+  httpuv_response_set_body(res, body, strlen(body));
+  return 1;
+}
+
+SEXP make_echo_handler(void) {
+  return httpuv_make_handler(echo_handler, (void*)"from C");
+}
@@ -0,0 +1,19 @@
+#ifndef MICROBENCH_LATER_API_H
+#define MICROBENCH_LATER_API_H
+
+// Stands in for the later package's header in the microbenchmarks. The real
+// header looks up later's C functions from a static initializer, which needs
+// a running R session. None of the benchmarked code schedules callbacks on
+// the main thread, so later() is never called.
+
+#include <stdlib.h>
+
+namespace later {
+
+inline void later(void (*func)(void*), void* data, double secs) {
+  abort();
+}
+
+} // namespace later
+
+#endif
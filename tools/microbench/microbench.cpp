@@ -0,0 +1,547 @@
+// Microbenchmarks for httpuv's parsing, framing and encoding code.
+//
+// These call the package's C++ code directly, with a fake WebApplication and
+// unconnected sockets, so they measure the CPU cost of each kernel without a
+// network or an R session. Each benchmark prints one line of JSON:
+//
+//   {"benchmark":"ws_read_unmask_64k","iterations":4096,"ns_per_op":...,
+//    "bytes_per_op":65546,"mb_per_sec":...}
+//
+// Usage: microbench [filter] [min_seconds]
+//   Only benchmarks whose names contain `filter` are run.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <uv.h>
+
+#include "httprequest.h"
+#include "httpresponse.h"
+#include "webapplication.h"
+#include "websockets.h"
+#include "websockets-ietf.h"
+#include "wsmask.h"
+#include "broadcast.h"
+#include "gzipdatasource.h"
+#include "staticpath.h"
+#include "httpuv.h"
+#include "mime.h"
+#include "utils.h"
+
+
+// Results are written here so the compiler can't optimize the work away.
+static volatile uint64_t sink;
+
+static std::string filter;
+static double min_seconds = 0.5;
+
+// Runs `fn` with an increasing number of iterations until a run takes at
+// least `min_seconds`, then reports that run.
+template <typename F>
+static void run_benchmark(const std::string& name, size_t bytes_per_op, F fn) {
+  if (!filter.empty() && name.find(filter) == std::string::npos) {
+    return;
+  }
+
+  // Warm up caches and any lazily-initialized state.
+  fn(1);
+
+  uint64_t iterations = 1;
+  uint64_t elapsed;
+  for (;;) {
+    uint64_t start = uv_hrtime();
+    fn(iterations);
+    elapsed = uv_hrtime() - start;
+    if (elapsed >= min_seconds * 1e9 || iterations >= (1ULL << 40)) {
+      break;
+    }
+    // Aim for the target time, but don't grow by more than 10x at a time.
+    uint64_t next = elapsed > 0 ?
+      (uint64_t)(iterations * (min_seconds * 1.2e9 / elapsed)) :
+      iterations * 10;
+    if (next > iterations * 10) next = iterations * 10;
+    if (next <= iterations) next = iterations + 1;
+    iterations = next;
+  }
+
+  double ns_per_op = (double)elapsed / iterations;
+  printf("{\"benchmark\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.2f",
+         name.c_str(), (unsigned long long)iterations, ns_per_op);
+  if (bytes_per_op > 0) {
+    printf(",\"bytes_per_op\":%llu,\"mb_per_sec\":%.2f",
+           (unsigned long long)bytes_per_op,
+           bytes_per_op / ns_per_op * 1e9 / 1e6);
+  }
+  printf("}\n");
+  fflush(stdout);
+}
+
+
+// A WebApplication that doesn't call into R. The benchmarks only exercise
+// code that reads headers and options from it.
+class FakeWebApplication : public WebApplication {
+  StaticPathManager _staticPathManager;
+  RouteManager _routeManager;
+  NativeHandlerManager _nativeHandlerManager;
+  RequestCoalescer _requestCoalescer;
+  RequestMetrics _requestMetrics;
+  AccessLog _accessLog;
+  std::shared_ptr<TrafficCapture> _pTrafficCapture;
+  WSFlowControl _wsFlowControl;
+  std::shared_ptr<const ServerOptions> _pServerOptions;
+
+public:
+  FakeWebApplication() :
+    _pTrafficCapture(std::make_shared<TrafficCapture>()),
+    _pServerOptions(std::make_shared<const ServerOptions>()) {}
+
+  void onHeaders(std::shared_ptr<HttpRequest> pRequest,
+                 std::function<void(std::shared_ptr<HttpResponse>)> callback) {
+    callback(std::shared_ptr<HttpResponse>());
+  }
+  void onBodyData(std::shared_ptr<HttpRequest> pRequest,
+                  std::shared_ptr<std::vector<char> > data,
+                  std::function<void(std::shared_ptr<HttpResponse>)> errorCallback) {
+  }
+  void getResponse(std::shared_ptr<HttpRequest> request,
+                   std::function<void(std::shared_ptr<HttpResponse>)> callback) {
+  }
+  void onWSOpen(std::shared_ptr<HttpRequest> pRequest,
+                std::function<void(void)> error_callback) {
+  }
+  void onWSMessage(std::shared_ptr<WebSocketConnection>,
+                   bool binary,
+                   std::shared_ptr<std::vector<char> > data,
+                   std::function<void(void)> error_callback) {
+  }
+  void onWSClose(std::shared_ptr<WebSocketConnection>) {}
+  void onWSDrain(std::shared_ptr<WebSocketConnection>) {}
+  void onResponseTimeout(std::shared_ptr<HttpRequest> pRequest) {}
+
+  std::shared_ptr<HttpResponse> staticFileResponse(
+    std::shared_ptr<HttpRequest> pRequest) {
+    return std::shared_ptr<HttpResponse>();
+  }
+  StaticPathManager& getStaticPathManager() { return _staticPathManager; }
+  RouteManager& getRouteManager() { return _routeManager; }
+
+  std::shared_ptr<HttpResponse> nativeHandlerResponse(
+    std::shared_ptr<HttpRequest> pRequest) {
+    return std::shared_ptr<HttpResponse>();
+  }
+  NativeHandlerManager& getNativeHandlerManager() { return _nativeHandlerManager; }
+
+  std::shared_ptr<HttpResponse> cachedResponse(
+    std::shared_ptr<HttpRequest> pRequest) {
+    return std::shared_ptr<HttpResponse>();
+  }
+  void cacheResponse(std::shared_ptr<HttpRequest> pRequest,
+                     std::shared_ptr<HttpResponse> pResponse) {
+  }
+  void clearResponseCache() {}
+
+  RequestCoalescer& getRequestCoalescer() { return _requestCoalescer; }
+  RequestMetrics& getRequestMetrics() { return _requestMetrics; }
+  AccessLog& getAccessLog() { return _accessLog; }
+  TrafficCapture& getTrafficCapture() { return *_pTrafficCapture; }
+  WSFlowControl& getWSFlowControl() { return _wsFlowControl; }
+
+  std::shared_ptr<const ServerOptions> getServerOptions() { return _pServerOptions; }
+  void setServerOptions(const Rcpp::List& options) {}
+
+  Rcpp::List getMetrics() { return Rcpp::List(); }
+};
+
+// Counts the messages that a WebSocketConnection delivers, and discards
+// anything it tries to send.
+class FakeWSCallbacks : public WebSocketConnectionCallbacks {
+public:
+  uint64_t messages;
+  uint64_t bytes;
+
+  FakeWSCallbacks() : messages(0), bytes(0) {}
+
+  void onWSMessage(bool binary, std::shared_ptr<std::vector<char> > data) {
+    messages++;
+    bytes += data->size();
+  }
+  void onWSClose(int code) {}
+  void sendWSFrame(ws_frame_t* pFrame) {
+    ws_frame_free(pFrame);
+  }
+  void sendWSSharedFrame(const char* headerData, size_t headerLength,
+                         std::shared_ptr<const std::vector<char> > payload,
+                         const char* footerData, size_t footerLength) {
+    bytes += headerLength + payload->size() + footerLength;
+  }
+  size_t wsBufferedAmount() { return 0; }
+  void onWSDrain() {}
+  void closeWSSocket() {}
+};
+
+
+static const char request_text[] =
+  "GET /static/js/app.min.js?v=1.6.16&session=abcdef0123456789 HTTP/1.1\r\n"
+  "Host: 127.0.0.1:8080\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+  "Accept-Language: en-US,en;q=0.5\r\n"
+  "Accept-Encoding: gzip, deflate, br\r\n"
+  "Connection: keep-alive\r\n"
+  "Cookie: session=abcdef0123456789; theme=dark; _ga=GA1.1.123456789.1700000000\r\n"
+  "Cache-Control: max-age=0\r\n"
+  "If-None-Match: \"5f3b2a1c-1a2b\"\r\n"
+  "\r\n";
+
+// Parses the request line and headers through HttpRequest's parser
+// callbacks. on_headers_complete is left out, since it dispatches the
+// request to the application.
+static void bench_http_request_headers(std::shared_ptr<HttpRequest> req) {
+  http_parser_settings settings;
+  memset(&settings, 0, sizeof(settings));
+  settings.on_message_begin = HttpRequest_on_message_begin;
+  settings.on_url = HttpRequest_on_url;
+  settings.on_header_field = HttpRequest_on_header_field;
+  settings.on_header_value = HttpRequest_on_header_value;
+
+  size_t len = sizeof(request_text) - 1;
+  run_benchmark("http_request_headers", len, [&](uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+      http_parser parser;
+      http_parser_init(&parser, HTTP_REQUEST);
+      parser.data = req.get();
+      sink += http_parser_execute(&parser, &settings, request_text, len);
+      req->requestCompleted();
+    }
+  });
+  sink += req->headers().size();
+}
+
+// Serializes the status line and headers of a response. The request's
+// socket isn't connected, so uv_write() fails immediately and nothing is
+// sent.
+static void bench_http_response_serialize(std::shared_ptr<HttpRequest> req) {
+  std::vector<uint8_t> body(1024, 'x');
+
+  run_benchmark("http_response_serialize", 0, [&](uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+      std::shared_ptr<HttpResponse> resp = std::make_shared<HttpResponse>(
+        req, 200, "OK", std::make_shared<InMemoryDataSource>(body));
+      resp->addHeader("Content-Type", "application/json; charset=UTF-8");
+      resp->addHeader("Cache-Control", "no-cache, no-store, must-revalidate");
+      resp->addHeader("X-Request-Id", "0123456789abcdef");
+      resp->addHeader("Vary", "Accept-Encoding");
+      resp->writeResponse();
+    }
+  });
+}
+
+// Builds a masked client-to-server frame, like a browser sends.
+static std::vector<char> masked_frame(Opcode opcode, size_t len) {
+  std::vector<char> frame;
+  frame.push_back((char)(0x80 | opcode));
+  if (len < 126) {
+    frame.push_back((char)(0x80 | len));
+  } else if (len <= 0xFFFF) {
+    frame.push_back((char)(0x80 | 126));
+    frame.push_back((char)((len >> 8) & 0xFF));
+    frame.push_back((char)(len & 0xFF));
+  } else {
+    frame.push_back((char)(0x80 | 127));
+    for (int i = 7; i >= 0; i--) {
+      frame.push_back((char)((len >> (i * 8)) & 0xFF));
+    }
+  }
+  const unsigned char key[4] = { 0x37, 0xfa, 0x21, 0x3d };
+  frame.insert(frame.end(), key, key + 4);
+  for (size_t i = 0; i < len; i++) {
+    frame.push_back((char)(('a' + i % 26) ^ key[i % 4]));
+  }
+  return frame;
+}
+
+// Parses and unmasks complete frames with WSHyBiParser.
+static void bench_ws_read(uv_loop_t* loop, const std::string& name,
+                          size_t payload) {
+  std::shared_ptr<FakeWSCallbacks> callbacks = std::make_shared<FakeWSCallbacks>();
+  std::shared_ptr<WebSocketConnection> conn = std::make_shared<WebSocketConnection>(
+    loop, callbacks, 0);
+
+  RequestHeaders headers;
+  headers["Upgrade"] = "websocket";
+  headers["Connection"] = "Upgrade";
+  headers["Sec-WebSocket-Key"] = "dGhlIHNhbXBsZSBub25jZQ==";
+  headers["Sec-WebSocket-Version"] = "13";
+  if (!conn->accept(headers, NULL, 0)) {
+    fprintf(stderr, "WebSocketConnection::accept() failed\n");
+    exit(1);
+  }
+
+  std::vector<char> frame = masked_frame(Binary, payload);
+  run_benchmark(name, frame.size(), [&](uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+      conn->read(&frame[0], frame.size());
+    }
+  });
+  sink += callbacks->bytes;
+}
+
+// Frames an outgoing message: one allocation and copy of the payload, plus
+// the header. With `deflate`, the connection negotiates permessage-deflate
+// and the message is JSON-like text, which is compressed before framing.
+static void bench_ws_send(uv_loop_t* loop, const std::string& name,
+                          size_t payload, bool deflate = false) {
+  std::shared_ptr<FakeWSCallbacks> callbacks = std::make_shared<FakeWSCallbacks>();
+  std::shared_ptr<WebSocketConnection> conn = std::make_shared<WebSocketConnection>(
+    loop, callbacks, 0);
+
+  RequestHeaders headers;
+  headers["Upgrade"] = "websocket";
+  headers["Connection"] = "Upgrade";
+  headers["Sec-WebSocket-Key"] = "dGhlIHNhbXBsZSBub25jZQ==";
+  headers["Sec-WebSocket-Version"] = "13";
+  if (deflate) {
+    headers["Sec-WebSocket-Extensions"] = "permessage-deflate";
+  }
+  if (!conn->accept(headers, NULL, 0)) {
+    fprintf(stderr, "WebSocketConnection::accept() failed\n");
+    exit(1);
+  }
+
+  std::vector<char> message(payload, 'x');
+  if (deflate) {
+    WSConnectionOptions options;
+    options.deflate.enabled = true;
+    conn->setOptions(options);
+
+    char* pData = NULL;
+    size_t len = 0;
+    ResponseHeaders responseHeaders;
+    std::vector<uint8_t> body;
+    conn->handshake("/", headers, &pData, &len, &responseHeaders, &body);
+
+    message.clear();
+    for (size_t i = 0; message.size() < payload; i++) {
+      std::string record = "{\"id\": " + toString(i * 7919 % 100000) +
+        ", \"name\": \"sensor\", \"value\": " + toString(i % 97) + "}, ";
+      message.insert(message.end(), record.begin(), record.end());
+    }
+    message.resize(payload);
+  }
+
+  run_benchmark(name, payload, [&](uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+      conn->sendWSMessage(deflate ? Text : Binary, &message[0], message.size());
+    }
+  });
+}
+
+// Fans one message out to many connections, sharing the payload.
+static void bench_ws_broadcast(uv_loop_t* loop, const std::string& name,
+                               size_t nconns, size_t payload) {
+  std::shared_ptr<FakeWSCallbacks> callbacks = std::make_shared<FakeWSCallbacks>();
+  std::vector<std::shared_ptr<WebSocketConnection> > conns;
+
+  RequestHeaders headers;
+  headers["Upgrade"] = "websocket";
+  headers["Connection"] = "Upgrade";
+  headers["Sec-WebSocket-Key"] = "dGhlIHNhbXBsZSBub25jZQ==";
+  headers["Sec-WebSocket-Version"] = "13";
+  for (size_t i = 0; i < nconns; i++) {
+    conns.push_back(std::make_shared<WebSocketConnection>(loop, callbacks, i));
+    if (!conns.back()->accept(headers, NULL, 0)) {
+      fprintf(stderr, "WebSocketConnection::accept() failed\n");
+      exit(1);
+    }
+  }
+
+  BroadcastOptions options;
+  run_benchmark(name, payload, [&](uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+      std::shared_ptr<const std::vector<char> > message =
+        std::make_shared<std::vector<char> >(payload, 'x');
+      broadcast_ws_message(conns, Text, message, options);
+    }
+  });
+  sink += callbacks->bytes;
+}
+
+// The unmasking kernel on its own, with the CPU's best kernel and with the
+// portable one.
+static void bench_ws_unmask() {
+  std::vector<char> payload(65536, 'x');
+  const uint8_t key[4] = { 0x37, 0xfa, 0x21, 0x3d };
+
+  run_benchmark("ws_unmask_64k", payload.size(), [&](uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+      ws_unmask(&payload[0], payload.size(), key, i);
+    }
+  });
+  run_benchmark("ws_unmask_scalar_64k", payload.size(), [&](uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+      ws_unmask_scalar(&payload[0], payload.size(), key, i);
+    }
+  });
+  sink += payload[0];
+}
+
+static void bench_ws_frame_header() {
+  WebSocketProto_IETF proto;
+  const size_t sizes[] = { 5, 125, 126, 65535, 65536, 1 << 20 };
+
+  run_benchmark("ws_frame_header", 0, [&](uint64_t n) {
+    char header[MAX_HEADER_BYTES];
+    size_t len;
+    for (uint64_t i = 0; i < n; i++) {
+      proto.createFrameHeader(Binary, false, sizes[i % 6], 0, header, &len);
+      sink += len;
+    }
+  });
+}
+
+static void bench_gzip() {
+  // Repetitive text, which compresses roughly like HTML or JSON.
+  std::vector<uint8_t> body;
+  const char* words[] = { "<div class=\"row\">", "<span>", "value", "</span>",
+                          "</div>\n", "{\"id\": ", "12345", ", \"name\": " };
+  for (size_t i = 0; body.size() < 65536; i++) {
+    const char* w = words[(i * 7 + i / 3) % 8];
+    body.insert(body.end(), w, w + strlen(w));
+  }
+  body.resize(65536);
+
+  run_benchmark("gzip_64k", body.size(), [&](uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+      GZipDataSource gz(std::make_shared<InMemoryDataSource>(body));
+      for (;;) {
+        uv_buf_t buf = gz.getData(65536);
+        if (buf.len == 0) {
+          gz.freeData(buf);
+          break;
+        }
+        sink += buf.len;
+        gz.freeData(buf);
+      }
+      gz.close();
+    }
+  });
+}
+
+static void bench_uri() {
+  std::string plain = "/api/v1/search?q=r packages&sort=downloads&page=2#results";
+  std::string unicode = "/files/r\xC3\xA9sum\xC3\xA9 (final) \xE2\x9C\x93.pdf";
+  std::string value = plain + unicode;
+
+  run_benchmark("encode_uri", value.size(), [&](uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+      sink += doEncodeURI(value, true).size();
+    }
+  });
+
+  std::string encoded = doEncodeURI(value, true);
+  run_benchmark("decode_uri", encoded.size(), [&](uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+      sink += doDecodeURI(encoded, true).size();
+    }
+  });
+}
+
+static void bench_http_date() {
+  const std::string dates[] = {
+    "Sun, 06 Nov 1994 08:49:37 GMT",
+    "Sunday, 06-Nov-94 08:49:37 GMT",
+    "Sun Nov  6 08:49:37 1994"
+  };
+
+  run_benchmark("parse_http_date", 0, [&](uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+      sink += parse_http_date_string(dates[i % 3]);
+    }
+  });
+}
+
+static void bench_mime_type() {
+  const std::string exts[] = { "html", "js", "css", "png", "json", "svg",
+                               "woff2", "unknownext" };
+
+  run_benchmark("find_mime_type", 0, [&](uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+      sink += find_mime_type(exts[i % 8]).size();
+    }
+  });
+}
+
+static void bench_static_path() {
+  StaticPathManager manager;
+  const char* prefixes[] = { "/static", "/assets", "/css", "/js", "/img",
+                             "/fonts", "/docs", "/lib", "/vendor", "/public" };
+  for (int i = 0; i < 10; i++) {
+    manager.set(prefixes[i], StaticPath("/tmp", StaticPathOptions()));
+    manager.set(std::string("/app") + prefixes[i],
+                StaticPath("/tmp", StaticPathOptions()));
+  }
+
+  const std::string urls[] = {
+    "/static/js/app.min.js",
+    "/app/vendor/lib/deep/nested/path/file.css",
+    "/api/v1/users/42",
+    "/"
+  };
+
+  run_benchmark("match_static_path", 0, [&](uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+      sink += manager.matchStaticPath(urls[i % 4]) ? 1 : 0;
+    }
+  });
+}
+
+
+int main(int argc, char** argv) {
+  if (argc > 1) {
+    filter = argv[1];
+  }
+  if (argc > 2) {
+    min_seconds = atof(argv[2]);
+  }
+
+  // The package's code asserts that it runs on the background thread when
+  // built with DEBUG_THREAD; this thread plays that role.
+  register_background_thread();
+
+  uv_loop_t loop;
+  uv_loop_init(&loop);
+  {
+    std::shared_ptr<FakeWebApplication> app = std::make_shared<FakeWebApplication>();
+    std::shared_ptr<Socket> socket = std::make_shared<Socket>(app, (CallbackQueue*)NULL);
+    std::shared_ptr<HttpRequest> req = std::make_shared<HttpRequest>(
+      &loop, app, socket, (CallbackQueue*)NULL);
+
+    bench_http_request_headers(req);
+    bench_http_response_serialize(req);
+    bench_ws_read(&loop, "ws_read_unmask_125", 125);
+    bench_ws_read(&loop, "ws_read_unmask_64k", 65536);
+    bench_ws_unmask();
+    bench_ws_send(&loop, "ws_send_125", 125);
+    bench_ws_send(&loop, "ws_send_64k", 65536);
+    bench_ws_send(&loop, "ws_send_deflate_4k", 4096, true);
+    bench_ws_send(&loop, "ws_send_deflate_64k", 65536, true);
+    bench_ws_broadcast(&loop, "ws_broadcast_1000x4k", 1000, 4096);
+    bench_ws_frame_header();
+    bench_gzip();
+    bench_uri();
+    bench_http_date();
+    bench_mime_type();
+    bench_static_path();
+    // The request must outlive its handle, so it's closed here and released
+    // after the loop has run the close callbacks.
+    req->close();
+    uv_run(&loop, UV_RUN_DEFAULT);
+  }
+
+  uv_run(&loop, UV_RUN_DEFAULT);
+  uv_loop_close(&loop);
+  return 0;
+}